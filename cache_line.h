@@ -0,0 +1,21 @@
+#ifndef CACHE_LINE_H
+# define CACHE_LINE_H
+
+/*
+ * cache line layout. a CPU writing a cache line takes it away from the
+ * caches of all the other CPUs - even if they only use other variables
+ * in it ('false sharing'). so data written often by one thread (a lock
+ * word, a queue's tail, a thread's counters) should not share its cache
+ * line with data other threads use. CACHE_ALIGNED starts a variable (or
+ * a struct's field) on a new cache line - the data before it ends where
+ * its line ends. a type aligned this way also gets its size rounded up
+ * to whole lines, so array elements don't share lines either.
+ */
+
+/* size of a cache line, in bytes (64 on x86-64 and most ARMs). */
+#define CACHE_LINE_SIZE 64
+
+/* start a variable, a field or a type on a cache line of its own. */
+#define CACHE_ALIGNED __attribute__ ((aligned(CACHE_LINE_SIZE)))
+
+#endif /* CACHE_LINE_H */
@@ -0,0 +1,550 @@
+#include <stdio.h>       /* standard I/O routines                 */
+#include <stdlib.h>      /* malloc(), posix_memalign(), exit()    */
+#include <string.h>      /* memset(), strcmp(), strtok()          */
+#include <math.h>        /* sqrt()                                */
+#include <time.h>        /* clock_gettime()                       */
+#include <unistd.h>      /* getopt(), usleep()                    */
+#include <pthread.h>     /* pthread functions and data structures */
+#include <sched.h>       /* sched_yield()                         */
+
+#include "cache_line.h"  /* CACHE_LINE_SIZE, CACHE_ALIGNED        */
+#include "seqlock.h"     /* sequence counters                     */
+#include "epoch.h"       /* epoch based reclamation               */
+
+/*
+ * a contention benchmark, derived from 'employee-with-mutex.c' and
+ * 'employee-without-mutex.c': reader threads read a shared record over
+ * and over, while writer threads replace it - under each of a few ways
+ * to synchronize them. each write stamps all the words of the record
+ * with a new version number, so a read that sees different numbers in
+ * different words saw a torn record. for each method, it reports the
+ * reads and writes per second, how evenly the threads got to make
+ * their operations (fairness), and how many reads were torn.
+ */
+
+/* defaults of the command line options. */
+#define DEFAULT_READERS 4
+#define DEFAULT_WRITERS 2
+#define DEFAULT_RECORD_SIZE 128
+#define DEFAULT_WRITE_PERCENT 100
+#define DEFAULT_SECONDS 1.0
+
+/* ways to synchronize readers and writers. */
+enum method {
+    METHOD_NONE,		/* no synchronization at all.              */
+    METHOD_MUTEX,		/* a pthread mutex.                        */
+    METHOD_RWLOCK,		/* a pthread read-write lock.              */
+    METHOD_SPINLOCK,		/* a pthread spinlock.                     */
+    METHOD_SEQLOCK,		/* a sequence counter, optimistic readers. */
+    METHOD_RCU,			/* pointer swap, epoch based reclamation.  */
+    NUM_METHODS
+};
+
+static const char* method_names[] = {
+    "none", "mutex", "rwlock", "spinlock", "seqlock", "rcu"
+};
+
+/* a record - 'num_words' words, all holding the version that wrote it. */
+struct record {
+    size_t num_words;		/* number of words - set once, when made. */
+    unsigned long words[];	/* the words.                             */
+};
+
+/* the benchmark's settings. */
+struct settings {
+    int num_readers;		/* threads that only read.              */
+    int num_writers;		/* threads that write (and may read).   */
+    size_t num_words;		/* size of the record, in words.        */
+    int write_percent;		/* percent of writers' ops that write.  */
+    double seconds;		/* how long each method runs.           */
+};
+
+/* a thread's share of the run. each on its own cache line, as are the */
+/* shared variables - false sharing would distort what the methods cost. */
+struct worker {
+    pthread_t thread;		/* the thread.                          */
+    int is_writer;		/* does it write?                       */
+    unsigned long seed;		/* its random numbers' state.           */
+    unsigned long reads;	/* reads it made.                       */
+    unsigned long writes;	/* writes it made.                      */
+    unsigned long torn;		/* reads that saw a torn record.        */
+    unsigned long retries;	/* seqlock reads it had to retry.       */
+} CACHE_ALIGNED;
+
+/* the settings, and the method currently measured. */
+struct settings settings;
+enum method method;
+
+/* the shared record, and the locks protecting it. */
+struct record* shared_record CACHE_ALIGNED;
+pthread_mutex_t a_mutex CACHE_ALIGNED = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t a_rwlock CACHE_ALIGNED = PTHREAD_RWLOCK_INITIALIZER;
+pthread_spinlock_t a_spinlock CACHE_ALIGNED;
+unsigned int seq_counter CACHE_ALIGNED = 0;
+
+/* the next version a writer stamps. */
+unsigned long next_version CACHE_ALIGNED = 1;
+
+/* flags starting and stopping the threads. */
+int start_threads CACHE_ALIGNED = 0;
+int stop_threads = 0;
+
+/* get the current time, in seconds. */
+double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* get a pseudo random number (xorshift). */
+unsigned long
+next_random(unsigned long* seed)
+{
+    unsigned long x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *seed = x;
+
+    return x;
+}
+
+/* allocate a record. */
+struct record*
+new_record(void)
+{
+    struct record* record = (struct record*)
+			    malloc(sizeof(struct record) +
+				   settings.num_words * sizeof(unsigned long));
+
+    if (!record) {
+	fprintf(stderr, "new_record: out of memory. exiting\n");
+	exit(1);
+    }
+    record->num_words = settings.num_words;
+
+    return record;
+}
+
+/*
+ * the words of the shared record are read and written with relaxed
+ * atomics - without a lock (method 'none', the seqlock's optimistic
+ * reads) they are accessed concurrently, and must not be torn by the
+ * compiler. under a lock, relaxed atomics cost the same as plain ones.
+ */
+
+/* stamp all the words of a record with a version. */
+void
+stamp_record(struct record* record, unsigned long version)
+{
+    size_t i;
+
+    for (i = 0; i < record->num_words; i++)
+	__atomic_store_n(&record->words[i], version, __ATOMIC_RELAXED);
+}
+
+/* check all the words of a record hold the same version. */
+int
+record_torn(const struct record* record)
+{
+    unsigned long version = __atomic_load_n(&record->words[0],
+					    __ATOMIC_RELAXED);
+    int torn = 0;
+    size_t i;
+
+    for (i = 1; i < record->num_words; i++)
+	torn |= __atomic_load_n(&record->words[i], __ATOMIC_RELAXED) != version;
+
+    return torn;
+}
+
+/* copy a record, word by word. */
+void
+copy_record(const struct record* from, struct record* to)
+{
+    size_t i;
+
+    for (i = 0; i < to->num_words; i++)
+	to->words[i] = __atomic_load_n(&from->words[i], __ATOMIC_RELAXED);
+}
+
+/* replace the shared record, retiring the old one (see 'epoch.h'). */
+void
+rcu_publish(struct record* record)
+{
+    epoch_retire(__atomic_exchange_n(&shared_record, record,
+				     __ATOMIC_SEQ_CST));
+}
+
+/*
+ * function read_shared(): read the shared record once, with the current
+ *                         method.
+ * algorithm: under a lock, check the record in place. the seqlock
+ *            copies it optimistically, and retries if a writer got in,
+ *            then checks the copy. RCU checks the current record in
+ *            place, inside a read section.
+ * input:     the reading thread, a buffer to copy records to.
+ * output:    none. the read (and if it was torn) is counted.
+ */
+void
+read_shared(struct worker* me, struct record* copy)
+{
+    struct epoch_thread* self;
+    unsigned int seq;
+    int torn = 0;
+
+    switch (method) {
+	case METHOD_NONE:
+	    torn = record_torn(shared_record);
+	    break;
+	case METHOD_MUTEX:
+	    pthread_mutex_lock(&a_mutex);
+	    torn = record_torn(shared_record);
+	    pthread_mutex_unlock(&a_mutex);
+	    break;
+	case METHOD_RWLOCK:
+	    pthread_rwlock_rdlock(&a_rwlock);
+	    torn = record_torn(shared_record);
+	    pthread_rwlock_unlock(&a_rwlock);
+	    break;
+	case METHOD_SPINLOCK:
+	    pthread_spin_lock(&a_spinlock);
+	    torn = record_torn(shared_record);
+	    pthread_spin_unlock(&a_spinlock);
+	    break;
+	case METHOD_SEQLOCK:
+	    for (;; me->retries++) {
+		seq = seqlock_read_begin(&seq_counter, &me->retries);
+		copy_record(shared_record, copy);
+		if (!seqlock_read_retry(&seq_counter, seq))
+		    break;
+	    }
+	    torn = record_torn(copy);
+	    break;
+	case METHOD_RCU:
+	    self = epoch_read_lock();
+	    torn = record_torn(__atomic_load_n(&shared_record,
+					       __ATOMIC_ACQUIRE));
+	    epoch_read_unlock(self);
+	    break;
+	default:
+	    break;
+    }
+    me->reads++;
+    me->torn += torn;
+}
+
+/*
+ * function write_shared(): write a new version of the shared record,
+ *                          with the current method.
+ * algorithm: under a lock, stamp the record in place. seqlock writers
+ *            lock each other out with the mutex, and make the counter
+ *            odd while stamping. RCU writers stamp a new record, and
+ *            swap it in.
+ * input:     the writing thread.
+ * output:    none. the write is counted.
+ */
+void
+write_shared(struct worker* me)
+{
+    unsigned long version = __atomic_fetch_add(&next_version, 1,
+					       __ATOMIC_RELAXED);
+    struct record* record;
+
+    switch (method) {
+	case METHOD_NONE:
+	    stamp_record(shared_record, version);
+	    break;
+	case METHOD_MUTEX:
+	    pthread_mutex_lock(&a_mutex);
+	    stamp_record(shared_record, version);
+	    pthread_mutex_unlock(&a_mutex);
+	    break;
+	case METHOD_RWLOCK:
+	    pthread_rwlock_wrlock(&a_rwlock);
+	    stamp_record(shared_record, version);
+	    pthread_rwlock_unlock(&a_rwlock);
+	    break;
+	case METHOD_SPINLOCK:
+	    pthread_spin_lock(&a_spinlock);
+	    stamp_record(shared_record, version);
+	    pthread_spin_unlock(&a_spinlock);
+	    break;
+	case METHOD_SEQLOCK:
+	    pthread_mutex_lock(&a_mutex);
+	    seqlock_write_begin(&seq_counter);
+	    stamp_record(shared_record, version);
+	    seqlock_write_end(&seq_counter);
+	    pthread_mutex_unlock(&a_mutex);
+	    break;
+	case METHOD_RCU:
+	    record = new_record();
+	    stamp_record(record, version);
+	    rcu_publish(record);
+	    break;
+	default:
+	    break;
+    }
+    me->writes++;
+}
+
+/* function to be executed by the reader and writer threads. */
+void*
+do_loop(void* data)
+{
+    struct worker* me = (struct worker*)data;
+    struct record* copy = new_record();
+
+    /* wait for all the threads to be created, so they start together. */
+    while (!__atomic_load_n(&start_threads, __ATOMIC_ACQUIRE))
+	sched_yield();
+
+    while (!__atomic_load_n(&stop_threads, __ATOMIC_RELAXED)) {
+	if (me->is_writer &&
+	    (int)(next_random(&me->seed) % 100) < settings.write_percent)
+	    write_shared(me);
+	else
+	    read_shared(me, copy);
+    }
+    free(copy);
+
+    return NULL;
+}
+
+/* statistics of the operations of a group of threads. */
+struct spread {
+    double total;		/* operations of all the threads.        */
+    double min;			/* fewest operations of a thread.        */
+    double max;			/* most operations of a thread.          */
+    double cv;			/* their standard deviation / mean.      */
+};
+
+/* get the spread of the reads (or writes) of a group of threads. */
+struct spread
+get_spread(struct worker* workers, int num_workers, int writes)
+{
+    struct spread spread = { 0, 0, 0, 0 };
+    double sum_squares = 0;
+    double mean, variance;
+    int i;
+
+    for (i = 0; i < num_workers; i++) {
+	double ops = writes ? workers[i].writes : workers[i].reads;
+
+	spread.total += ops;
+	sum_squares += ops * ops;
+	if (i == 0 || ops < spread.min)
+	    spread.min = ops;
+	if (i == 0 || ops > spread.max)
+	    spread.max = ops;
+    }
+    if (num_workers > 0 && spread.total > 0) {
+	mean = spread.total / num_workers;
+	/* rounding may take an all but zero variance below zero. */
+	variance = sum_squares / num_workers - mean * mean;
+	spread.cv = sqrt(variance > 0 ? variance : 0) / mean;
+    }
+
+    return spread;
+}
+
+/* format a spread's max/min ratio into 'buf' - "inf" if some thread made */
+/* no progress while others did, "-" if none did (or there are none).    */
+const char*
+format_ratio(char* buf, size_t size, struct spread* spread)
+{
+    if (spread->max == 0)
+	snprintf(buf, size, "-");
+    else if (spread->min == 0)
+	snprintf(buf, size, "inf");
+    else
+	snprintf(buf, size, "%.2f", spread->max / spread->min);
+
+    return buf;
+}
+
+/*
+ * function run_method(): run the workload with one method, and report.
+ * algorithm: create the readers and the writers, let them go together,
+ *            stop them after the given time, and print the reads and
+ *            writes per second, the spread of the readers' reads and of
+ *            the writers' writes (max/min ratio, and coefficient of
+ *            variation - 0% is perfectly fair), and the torn reads.
+ * input:     method to run.
+ * output:    number of torn reads.
+ */
+unsigned long
+run_method(enum method m)
+{
+    int num_workers = settings.num_readers + settings.num_writers;
+    struct worker* workers;
+    struct spread readers, writers;
+    char readers_ratio[16], writers_ratio[16];
+    unsigned long torn = 0, retries = 0;
+    double start, elapsed;
+    int i;
+
+    if (posix_memalign((void**)&workers, CACHE_LINE_SIZE,
+		       num_workers * sizeof(struct worker)) != 0) {
+	fprintf(stderr, "run_method: out of memory. exiting\n");
+	exit(1);
+    }
+    memset(workers, 0, num_workers * sizeof(struct worker));
+    method = m;
+    stamp_record(shared_record, 0);
+    start_threads = 0;
+    stop_threads = 0;
+    for (i = 0; i < num_workers; i++) {
+	workers[i].is_writer = i >= settings.num_readers;
+	workers[i].seed = 0x9e3779b97f4a7c15UL * (i + 1);
+	pthread_create(&workers[i].thread, NULL, do_loop, (void*)&workers[i]);
+    }
+
+    start = now_sec();
+    __atomic_store_n(&start_threads, 1, __ATOMIC_RELEASE);
+    usleep((useconds_t)(settings.seconds * 1e6));
+    __atomic_store_n(&stop_threads, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < num_workers; i++) {
+	pthread_join(workers[i].thread, NULL);
+	torn += workers[i].torn;
+	retries += workers[i].retries;
+    }
+    elapsed = now_sec() - start;
+
+    /* writers' reads count as reads, but only readers' for fairness. */
+    readers = get_spread(workers, settings.num_readers, 0);
+    writers = get_spread(workers + settings.num_readers,
+			 settings.num_writers, 1);
+    for (i = settings.num_readers; i < num_workers; i++)
+	readers.total += workers[i].reads;
+
+    printf("%-9s %12.0f %12.0f %8s %6.1f%% %8s %6.1f%% %10lu",
+	   method_names[m], readers.total / elapsed, writers.total / elapsed,
+	   format_ratio(readers_ratio, sizeof(readers_ratio), &readers),
+	   readers.cv * 100,
+	   format_ratio(writers_ratio, sizeof(writers_ratio), &writers),
+	   writers.cv * 100, torn);
+    if (m == METHOD_SEQLOCK)
+	printf("  (%lu retries)", retries);
+    printf("\n");
+    free(workers);
+
+    return torn;
+}
+
+/* print a usage message, and exit. */
+void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-r readers] [-w writers] [-s record size] "
+		    "[-p write percent]\n"
+		    "       [-t seconds] [-m method,...]\n", prog);
+    fprintf(stderr, "  -r  threads that only read (default %d)\n"
+		    "  -w  threads that write (default %d)\n"
+		    "  -s  size of the shared record, in bytes (default %d)\n"
+		    "  -p  percent of the writers' operations that write - "
+		    "the rest read (default %d)\n"
+		    "  -t  seconds to run each method (default %.1f)\n"
+		    "  -m  methods to run: none, mutex, rwlock, spinlock, "
+		    "seqlock, rcu (default all)\n",
+	    DEFAULT_READERS, DEFAULT_WRITERS, DEFAULT_RECORD_SIZE,
+	    DEFAULT_WRITE_PERCENT, DEFAULT_SECONDS);
+    exit(1);
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    int run[NUM_METHODS];	/* methods to run.                  */
+    unsigned long torn = 0;	/* torn reads of the safe methods.  */
+    size_t record_size = DEFAULT_RECORD_SIZE;
+    char* name;
+    int opt;
+    int m;
+
+    settings.num_readers = DEFAULT_READERS;
+    settings.num_writers = DEFAULT_WRITERS;
+    settings.write_percent = DEFAULT_WRITE_PERCENT;
+    settings.seconds = DEFAULT_SECONDS;
+    for (m = 0; m < NUM_METHODS; m++)
+	run[m] = 1;
+
+    while ((opt = getopt(argc, argv, "r:w:s:p:t:m:")) != -1) {
+	switch (opt) {
+	    case 'r':
+		settings.num_readers = atoi(optarg);
+		break;
+	    case 'w':
+		settings.num_writers = atoi(optarg);
+		break;
+	    case 's':
+		record_size = atol(optarg);
+		break;
+	    case 'p':
+		settings.write_percent = atoi(optarg);
+		break;
+	    case 't':
+		settings.seconds = atof(optarg);
+		break;
+	    case 'm':
+		for (m = 0; m < NUM_METHODS; m++)
+		    run[m] = 0;
+		for (name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+		    for (m = 0; m < NUM_METHODS; m++) {
+			if (strcmp(name, method_names[m]) == 0)
+			    break;
+		    }
+		    if (m == NUM_METHODS)
+			usage(argv[0]);
+		    run[m] = 1;
+		}
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    if (settings.num_readers < 0 || settings.num_writers < 0 ||
+	settings.num_readers + settings.num_writers < 1 ||
+	settings.write_percent < 0 || settings.write_percent > 100 ||
+	settings.seconds <= 0)
+	usage(argv[0]);
+    settings.num_words = record_size / sizeof(unsigned long);
+    if (settings.num_words < 2)
+	settings.num_words = 2;
+
+    pthread_spin_init(&a_spinlock, PTHREAD_PROCESS_PRIVATE);
+    shared_record = new_record();
+
+    printf("%d readers, %d writers (%d%% writes), %zu byte record, "
+	   "%.1f sec per method\n", settings.num_readers,
+	   settings.num_writers, settings.write_percent,
+	   settings.num_words * sizeof(unsigned long), settings.seconds);
+    printf("%-9s %12s %12s %8s %7s %8s %7s %10s\n", "method", "reads/s",
+	   "writes/s", "rd max/", "rd cv", "wr max/", "wr cv", "torn");
+    printf("%-9s %12s %12s %8s %7s %8s %7s %10s\n", "", "", "", "min", "",
+	   "min", "", "reads");
+    for (m = 0; m < NUM_METHODS; m++) {
+	if (!run[m])
+	    continue;
+	if (m == METHOD_NONE)
+	    run_method(m);
+	else
+	    torn += run_method(m);
+    }
+
+    /* all threads are gone - free the records still retired. */
+    epoch_reclaim_all();
+    free(shared_record);
+
+    if (torn) {
+	printf("%lu torn reads with synchronization!\n", torn);
+	return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,774 @@
+#include <stdio.h>       /* standard I/O routines                 */
+#include <stdlib.h>      /* malloc(), free(), exit(), atol()      */
+#include <string.h>      /* memset(), memcmp(), memcpy()          */
+#include <errno.h>       /* errno and error codes                 */
+#include <fcntl.h>       /* open()                                */
+#include <time.h>        /* clock_gettime()                       */
+#include <unistd.h>      /* fork(), ftruncate(), getopt()         */
+#include <pthread.h>     /* pthread functions and data structures */
+#include <sched.h>       /* sched_yield()                         */
+#include <sys/mman.h>    /* mmap(), munmap()                      */
+#include <sys/stat.h>    /* fstat()                               */
+#include <sys/wait.h>    /* waitpid()                             */
+
+#include "cache_line.h"  /* CACHE_ALIGNED                         */
+#include "seqlock.h"     /* sequence counters                     */
+
+/*
+ * a table of employees, keyed by their id, shared by processes through
+ * a memory mapped file. the file is the table - fixed layout records,
+ * no parsing - so a process attaches to it by mapping it, and all the
+ * processes share the same pages.
+ *
+ * the file starts with a header page, followed by an open addressing
+ * (linear probing) array of slots. as in 'employee-table.c', each slot
+ * has a sequence counter, and lookups copy employees optimistically,
+ * without locking - or writing - anything. writers lock a process
+ * shared mutex, in the header. it is robust: if a writer dies holding
+ * it, the next process to lock it is told so. before changing a slot,
+ * a writer saves its old contents in the header's undo record - so the
+ * next one can roll back the half done change. a reader finding a
+ * slot changing for long checks if its writer died, and rolls it back
+ * itself. the table has a fixed capacity, set when it is created, and
+ * employees are never removed. an id of 0 marks an empty slot.
+ *
+ * the program creates a table, fills it, crashes a writer in the middle
+ * of an update (to check it is rolled back), and then runs processes
+ * looking employees up, and updating them, at once.
+ */
+
+/* defaults of the command line options. */
+#define DEFAULT_FILE "/tmp/employees.tab"
+#define DEFAULT_RECORDS 1000000
+#define DEFAULT_READERS 4
+#define DEFAULT_WRITERS 1
+#define DEFAULT_SECONDS 1.0
+
+/* most processes the benchmark runs. */
+#define MAX_PROCESSES 64
+
+/* magic string at the start of a table file, and its layout version. */
+#define TABLE_MAGIC "EMPTABLE"
+#define TABLE_VERSION 2
+
+/* size of the header, at the start of the file - the slots start on */
+/* the page after it.                                                 */
+#define TABLE_HEADER_SIZE 4096
+
+/* the table may be up to 3/4 full. */
+#define MAX_LOAD_NUMERATOR 3
+#define MAX_LOAD_DENOMINATOR 4
+
+/* a reader finding a slot being written for long (see 'seqlock.h')   */
+/* checks if the writer died, every this many yields.                 */
+#define YIELDS_BEFORE_CHECK 100
+
+struct employee {
+    int number;
+    int id;
+    char first_name[20];
+    char last_name[30];
+    char department[30];
+    int room_number;
+};
+
+/* the words an employee struct is copied in. 'may_alias' lets us     */
+/* access the struct through them.                                     */
+typedef unsigned int __attribute__ ((may_alias)) employee_word;
+#define EMPLOYEE_WORDS (sizeof(struct employee) / sizeof(employee_word))
+
+/* a slot of the table - an employee, protected by a sequence counter. */
+/* the counter is odd while a writer is changing the employee.         */
+struct table_slot {
+    unsigned int seq;
+    struct employee employee;
+};
+
+/* the change a writer is making - enough to roll it back. */
+struct undo_record {
+    int valid;			/* is a change in progress?              */
+    unsigned long slot;		/* slot being changed.                   */
+    unsigned int seq;		/* slot's counter before the change.     */
+    unsigned long count;	/* number of employees before the change. */
+    struct employee employee;	/* slot's employee before the change.    */
+};
+
+/* the header of a table file. */
+struct table_header {
+    char magic[8];		/* TABLE_MAGIC.                          */
+    unsigned int version;	/* TABLE_VERSION.                        */
+    unsigned int slot_size;	/* sizeof(struct table_slot) - the       */
+				/* processes must agree on the layout.   */
+    unsigned long capacity;	/* number of slots (a power of 2).       */
+    unsigned long count;	/* number of employees.                  */
+    pthread_mutex_t write_mutex; /* taken by writers. process shared,    */
+				/* and robust.                           */
+    struct undo_record undo;	/* change in progress, if any.           */
+};
+
+/* a process's view of a table. */
+struct shared_table {
+    struct table_header* header; /* the mapped file.                     */
+    struct table_slot* slots;	/* its slots.                            */
+    size_t size;		/* size of the mapping.                  */
+};
+
+/* get the current time, in seconds. */
+double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* get the hash of an id (the finalizer of MurmurHash3). */
+unsigned long
+hash_id(int id)
+{
+    unsigned long hash = (unsigned int)id;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53UL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/* get the size of a table file with the given number of slots. */
+size_t
+table_file_size(unsigned long capacity)
+{
+    return TABLE_HEADER_SIZE + capacity * sizeof(struct table_slot);
+}
+
+/* map a table file, of the given size. returns 0, or -1 (errno set). */
+int
+map_table(int fd, size_t size, struct shared_table* table)
+{
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED)
+	return -1;
+    table->header = (struct table_header*)addr;
+    table->slots = (struct table_slot*)((char*)addr + TABLE_HEADER_SIZE);
+    table->size = size;
+
+    return 0;
+}
+
+/*
+ * function table_create(): create a table file.
+ * algorithm: create it under a temporary name - as an empty (sparse)
+ *            file, of its full size - write its header, with a mutex
+ *            that is process shared and robust, and rename it to its
+ *            name. a process attaching to it never sees it half made.
+ * input:     file name, number of employees it should hold, the table.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+int
+table_create(const char* file_name, unsigned long num_employees,
+	     struct shared_table* table)
+{
+    unsigned long capacity = 16;
+    pthread_mutexattr_t attr;
+    char* temp_name;
+    int fd;
+    int error = 0;
+
+    while (capacity * MAX_LOAD_NUMERATOR < num_employees * MAX_LOAD_DENOMINATOR)
+	capacity *= 2;
+
+    temp_name = (char*)malloc(strlen(file_name) + 8);
+    if (!temp_name) {
+	fprintf(stderr, "table_create: out of memory. exiting\n");
+	exit(1);
+    }
+    sprintf(temp_name, "%s.XXXXXX", file_name);
+    fd = mkstemp(temp_name);
+    if (fd < 0) {
+	free(temp_name);
+	return -1;
+    }
+    if (ftruncate(fd, table_file_size(capacity)) < 0 ||
+	map_table(fd, table_file_size(capacity), table) < 0) {
+	error = errno;
+    }
+    else {
+	memcpy(table->header->magic, TABLE_MAGIC, 8);
+	table->header->version = TABLE_VERSION;
+	table->header->slot_size = sizeof(struct table_slot);
+	table->header->capacity = capacity;
+	table->header->count = 0;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&table->header->write_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (rename(temp_name, file_name) < 0) {
+	    error = errno;
+	    munmap(table->header, table->size);
+	}
+    }
+    close(fd);
+    if (error)
+	unlink(temp_name);
+    free(temp_name);
+    errno = error;
+
+    return error ? -1 : 0;
+}
+
+/*
+ * function table_attach(): attach to an existing table file.
+ * algorithm: map it, and check it is a table, of the layout we use -
+ *            nothing else needs to be read.
+ * input:     file name, the table.
+ * output:    0 on success, -1 on error (errno is set - EINVAL if the
+ *            file is not a table we can use).
+ */
+int
+table_attach(const char* file_name, struct shared_table* table)
+{
+    struct table_header header;
+    struct stat st;
+    int fd = open(file_name, O_RDWR);
+    int error = 0;
+
+    if (fd < 0)
+	return -1;
+    if (fstat(fd, &st) < 0 || pread(fd, &header, sizeof(header), 0) < 0)
+	error = errno;
+    else if ((size_t)st.st_size < sizeof(header) ||
+	     memcmp(header.magic, TABLE_MAGIC, 8) != 0 ||
+	     header.version != TABLE_VERSION ||
+	     header.slot_size != sizeof(struct table_slot) ||
+	     (header.capacity & (header.capacity - 1)) != 0 ||
+	     (size_t)st.st_size != table_file_size(header.capacity))
+	error = EINVAL;
+    else if (map_table(fd, st.st_size, table) < 0)
+	error = errno;
+    close(fd);
+    errno = error;
+
+    return error ? -1 : 0;
+}
+
+/* detach from a table. */
+void
+table_detach(struct shared_table* table)
+{
+    munmap(table->header, table->size);
+}
+
+/* find the slot of an id - or the empty slot where it would go. the */
+/* table is never full, so there always is one.                      */
+struct table_slot*
+find_slot(struct shared_table* table, int id)
+{
+    unsigned long mask = table->header->capacity - 1;
+    unsigned long i;
+
+    for (i = hash_id(id) & mask;; i = (i + 1) & mask) {
+	struct table_slot* slot = &table->slots[i];
+	int slot_id = __atomic_load_n(&slot->employee.id, __ATOMIC_ACQUIRE);
+
+	if (slot_id == id || slot_id == 0)
+	    return slot;
+    }
+}
+
+/* write words of a slot's employee, with the write mutex locked. */
+void
+write_words(struct table_slot* slot, const struct employee* from,
+	    unsigned int first, unsigned int last)
+{
+    const employee_word* src = (const employee_word*)from;
+    employee_word* dst = (employee_word*)&slot->employee;
+    unsigned int i;
+
+    for (i = first; i < last; i++)
+	__atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+}
+
+/* start changing a slot - save it in the undo record, and make its */
+/* counter odd. with the write mutex locked.                        */
+void
+begin_write(struct shared_table* table, struct table_slot* slot)
+{
+    struct undo_record* undo = &table->header->undo;
+
+    undo->slot = slot - table->slots;
+    undo->seq = slot->seq;
+    undo->count = table->header->count;
+    undo->employee = slot->employee;
+    __atomic_store_n(&undo->valid, 1, __ATOMIC_RELEASE);
+
+    seqlock_write_begin(&slot->seq);
+}
+
+/* finish changing a slot - make its counter even, and drop the undo */
+/* record. with the write mutex locked.                              */
+void
+end_write(struct shared_table* table, struct table_slot* slot)
+{
+    seqlock_write_end(&slot->seq);
+    __atomic_store_n(&table->header->undo.valid, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * function roll_back(): undo the change of a writer that died.
+ * algorithm: if the undo record is valid, the writer died in the middle
+ *            of a change. if the slot's counter moved on by two, the
+ *            change was complete - the writer died before dropping the
+ *            record - so just drop it. otherwise put the slot's old
+ *            employee back (the counter may be odd or even - make sure
+ *            it is odd while doing it), and the old number of employees.
+ * input:     the table, with the write mutex locked.
+ * output:    1 if a change was rolled back, 0 if there was none.
+ */
+int
+roll_back(struct shared_table* table)
+{
+    struct undo_record* undo = &table->header->undo;
+    struct table_slot* slot;
+
+    if (!__atomic_load_n(&undo->valid, __ATOMIC_ACQUIRE))
+	return 0;
+
+    slot = &table->slots[undo->slot];
+    if (slot->seq == undo->seq + 2) {
+	__atomic_store_n(&undo->valid, 0, __ATOMIC_RELEASE);
+	return 0;
+    }
+    if (!(slot->seq & 1))
+	seqlock_write_begin(&slot->seq);
+    write_words(slot, &undo->employee, 0, EMPLOYEE_WORDS);
+    table->header->count = undo->count;
+    end_write(table, slot);
+
+    return 1;
+}
+
+/* number of changes rolled back by this process. */
+unsigned long num_rolled_back = 0;
+
+/*
+ * function lock_writers(): lock the table's write mutex.
+ * algorithm: if the previous owner died holding it, roll back its
+ *            change, and mark the mutex consistent again.
+ * input:     the table, 1 to only try locking.
+ * output:    0 when locked, or the error of locking (EBUSY if trying,
+ *            and it is taken).
+ */
+int
+lock_writers(struct shared_table* table, int try)
+{
+    pthread_mutex_t* mutex = &table->header->write_mutex;
+    int rc = try ? pthread_mutex_trylock(mutex) : pthread_mutex_lock(mutex);
+
+    if (rc == EOWNERDEAD) {
+	num_rolled_back += roll_back(table);
+	pthread_mutex_consistent(mutex);
+	rc = 0;
+    }
+
+    return rc;
+}
+
+/* unlock the table's write mutex. */
+void
+unlock_writers(struct shared_table* table)
+{
+    pthread_mutex_unlock(&table->header->write_mutex);
+}
+
+/*
+ * function table_lookup(): look an employee up, by id.
+ * algorithm: find its slot, and copy it as a seqlock reader does - read
+ *            the counter (wait while odd), copy the employee, and read
+ *            the counter again, to check no writer got in - and check
+ *            the copy is still of that id, as a writer may have given
+ *            the slot to another employee meanwhile. a counter odd for
+ *            long may be of a writer that died - so try locking the
+ *            write mutex: if it was left by a dead owner, that rolls
+ *            its change back.
+ * input:     the table, the id, where to copy the employee to.
+ * output:    1 if the employee was found, 0 if not.
+ */
+int
+table_lookup(struct shared_table* table, int id, struct employee* to)
+{
+    struct table_slot* slot = find_slot(table, id);
+    employee_word* src = (employee_word*)&slot->employee;
+    employee_word* dst = (employee_word*)to;
+    unsigned long retries;
+    unsigned int seq;
+    unsigned int i;
+
+    if (slot->employee.id != id)
+	return 0;
+
+    for (retries = 1;; retries++) {
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1) {
+	    if (retries %
+		(SEQLOCK_SPINS_BEFORE_YIELD * YIELDS_BEFORE_CHECK) == 0 &&
+		lock_writers(table, 1) == 0)
+		unlock_writers(table);
+	    else if (retries % SEQLOCK_SPINS_BEFORE_YIELD == 0)
+		sched_yield();
+	    continue;
+	}
+
+	for (i = 0; i < EMPLOYEE_WORDS; i++)
+	    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+	if (!seqlock_read_retry(&slot->seq, seq))
+	    return to->id == id;
+    }
+}
+
+/*
+ * function table_put(): add an employee, or update it if its id is in
+ *                       the table already.
+ * algorithm: lock the writers out, find the id's slot, and change it
+ *            under the undo record and the slot's counter.
+ * input:     the table, the employee.
+ * output:    1 if the employee was added, 0 if updated, -1 on error
+ *            (errno is set - EINVAL for an id of 0, ENOSPC if the table
+ *            is full).
+ */
+int
+table_put(struct shared_table* table, const struct employee* employee)
+{
+    struct table_slot* slot;
+    int added;
+    int rc;
+
+    if (employee->id == 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    rc = lock_writers(table, 0);
+    if (rc != 0) {
+	errno = rc;
+	return -1;
+    }
+
+    slot = find_slot(table, employee->id);
+    added = slot->employee.id == 0;
+    if (added && (table->header->count + 1) * MAX_LOAD_DENOMINATOR >
+		 table->header->capacity * MAX_LOAD_NUMERATOR) {
+	unlock_writers(table);
+	errno = ENOSPC;
+	return -1;
+    }
+    begin_write(table, slot);
+    write_words(slot, employee, 0, EMPLOYEE_WORDS);
+    table->header->count += added;
+    end_write(table, slot);
+
+    unlock_writers(table);
+
+    return added;
+}
+
+/* the benchmark's settings. */
+const char* file_name = DEFAULT_FILE;
+long num_records = DEFAULT_RECORDS;
+int num_readers = DEFAULT_READERS;
+int num_writers = DEFAULT_WRITERS;
+double seconds = DEFAULT_SECONDS;
+
+/* a benchmark process's results - on cache lines of its own. */
+struct process_result {
+    double attach_time;		/* time attaching took, in seconds.      */
+    unsigned long lookups;	/* lookups it made.                      */
+    unsigned long updates;	/* updates it made.                      */
+    unsigned long bad;		/* lookups that missed, or found a torn  */
+				/* employee, and failed updates.         */
+} CACHE_ALIGNED;
+
+/* state shared with the benchmark processes (mapped before forking). */
+struct bench_state {
+    int start;			/* set when all should start.            */
+    int stop;			/* set when all should stop.             */
+    struct process_result results[MAX_PROCESSES];
+};
+
+struct bench_state* bench;
+
+/* get a pseudo random number (xorshift). */
+unsigned long
+next_random(unsigned long* seed)
+{
+    unsigned long x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *seed = x;
+
+    return x;
+}
+
+/* get the id of the i'th employee - never 0. */
+int
+id_of(long i)
+{
+    return (int)((unsigned int)(i + 1) * 2654435761u);
+}
+
+/* make the i'th employee. its department tells its room number - a */
+/* torn copy of it would likely tell another one.                   */
+void
+make_employee(long i, int room_number, struct employee* employee)
+{
+    memset(employee, 0, sizeof(struct employee));
+    employee->number = i + 1;
+    employee->id = id_of(i);
+    snprintf(employee->first_name, sizeof(employee->first_name),
+	     "first-%d", (int)(i + 1));
+    snprintf(employee->last_name, sizeof(employee->last_name),
+	     "last-%d", (int)(i + 1));
+    snprintf(employee->department, sizeof(employee->department),
+	     "room %d", room_number);
+    employee->room_number = room_number;
+}
+
+/* look the i'th employee up, and check it is all of one employee. */
+/* returns 1 if it was found and consistent, 0 if not.              */
+int
+check_lookup(struct shared_table* table, long i)
+{
+    struct employee employee;
+
+    if (!table_lookup(table, id_of(i), &employee))
+	return 0;
+
+    return employee.number == i + 1 && employee.id == id_of(i) &&
+	   atoi(employee.department + 5) == employee.room_number;
+}
+
+/*
+ * function run_process(): the body of a benchmark process.
+ * algorithm: attach to the table by its name (timing it), wait for the
+ *            start, and look random employees up (a reader) or update
+ *            them (a writer), until told to stop.
+ * input:     process's index, is it a writer.
+ * output:    none - it exits.
+ */
+void
+run_process(int index, int is_writer)
+{
+    struct process_result* result = &bench->results[index];
+    struct shared_table table;
+    struct employee employee;
+    unsigned long seed = 0x9e3779b97f4a7c15UL * (index + 1);
+    double start = now_sec();
+
+    if (table_attach(file_name, &table) < 0) {
+	perror("table_attach");
+	_exit(1);
+    }
+    result->attach_time = now_sec() - start;
+
+    while (!__atomic_load_n(&bench->start, __ATOMIC_ACQUIRE))
+	sched_yield();
+
+    while (!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+	unsigned long r = next_random(&seed);
+	long i = (long)((r >> 8) % num_records);
+
+	if (is_writer) {
+	    make_employee(i, (int)(r >> 40), &employee);
+	    if (table_put(&table, &employee) != 0)
+		result->bad++;
+	    result->updates++;
+	}
+	else {
+	    if (!check_lookup(&table, i))
+		result->bad++;
+	    result->lookups++;
+	}
+    }
+    table_detach(&table);
+    _exit(0);
+}
+
+/*
+ * function crash_writer(): check a writer dying mid-update is rolled
+ *                          back.
+ * algorithm: fork a process that locks the writers out, starts updating
+ *            an employee, and dies half way. then look the employee up:
+ *            the lookup finds the slot still being written, and the
+ *            mutex left by a dead owner - and rolls the update back.
+ * input:     the table.
+ * output:    1 if the employee was rolled back intact, 0 if not.
+ */
+int
+crash_writer(struct shared_table* table)
+{
+    struct employee employee;
+    pid_t pid = fork();
+
+    if (pid < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (pid == 0) {
+	struct table_slot* slot;
+
+	make_employee(0, 999, &employee);
+	lock_writers(table, 0);
+	slot = find_slot(table, employee.id);
+	begin_write(table, slot);
+	write_words(slot, &employee, 0, EMPLOYEE_WORDS / 2);
+	_exit(1);	/* crash, holding the mutex, with a torn employee. */
+    }
+    waitpid(pid, NULL, 0);
+
+    return check_lookup(table, 0) && table_lookup(table, id_of(0), &employee)
+	   && employee.room_number == 0;
+}
+
+/* print a usage message, and exit. */
+void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-f file] [-n records] [-r readers] "
+		    "[-w writers] [-s seconds] [-k]\n", prog);
+    fprintf(stderr, "  -f  table file (default %s)\n"
+		    "  -n  number of employees (default %d)\n"
+		    "  -r  reader processes (default %d)\n"
+		    "  -w  writer processes (default %d)\n"
+		    "  -s  seconds to run (default %.1f)\n"
+		    "  -k  keep the table file\n",
+	    DEFAULT_FILE, DEFAULT_RECORDS, DEFAULT_READERS, DEFAULT_WRITERS,
+	    DEFAULT_SECONDS);
+    exit(1);
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    struct shared_table table;
+    struct employee employee;
+    unsigned long lookups = 0, updates = 0, bad = 0;
+    double max_attach = 0;
+    double start, elapsed;
+    int keep = 0;
+    int opt;
+    long i;
+
+    while ((opt = getopt(argc, argv, "f:n:r:w:s:k")) != -1) {
+	switch (opt) {
+	    case 'f':
+		file_name = optarg;
+		break;
+	    case 'n':
+		num_records = atol(optarg);
+		break;
+	    case 'r':
+		num_readers = atoi(optarg);
+		break;
+	    case 'w':
+		num_writers = atoi(optarg);
+		break;
+	    case 's':
+		seconds = atof(optarg);
+		break;
+	    case 'k':
+		keep = 1;
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    if (num_records < 1 || num_records > 0x7fffffffL || num_readers < 0 ||
+	num_writers < 0 || num_readers + num_writers < 1 ||
+	num_readers + num_writers > MAX_PROCESSES || seconds <= 0)
+	usage(argv[0]);
+
+    /* create the table, and fill it. */
+    start = now_sec();
+    if (table_create(file_name, num_records, &table) < 0) {
+	perror("table_create");
+	exit(1);
+    }
+    for (i = 0; i < num_records; i++) {
+	make_employee(i, 0, &employee);
+	if (table_put(&table, &employee) != 1) {
+	    perror("table_put");
+	    exit(1);
+	}
+    }
+    elapsed = now_sec() - start;
+    printf("created '%s': %ld employees, %lu slots, %.1f MB, in %.2f sec\n",
+	   file_name, num_records, table.header->capacity,
+	   table.size / (1024.0 * 1024.0), elapsed);
+
+    /* crash a writer in the middle of an update. */
+    if (!crash_writer(&table) || num_rolled_back != 1) {
+	printf("a writer crashed mid-update, and was not rolled back!\n");
+	exit(1);
+    }
+    printf("a writer crashed mid-update - its change was rolled back\n");
+
+    /* run the readers and the writers, each in a process of its own. */
+    bench = (struct bench_state*)mmap(NULL, sizeof(struct bench_state),
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (bench == MAP_FAILED) {
+	perror("mmap");
+	exit(1);
+    }
+    for (i = 0; i < num_readers + num_writers; i++) {
+	pid_t pid = fork();
+
+	if (pid < 0) {
+	    perror("fork");
+	    exit(1);
+	}
+	if (pid == 0)
+	    run_process(i, i >= num_readers);
+    }
+    start = now_sec();
+    __atomic_store_n(&bench->start, 1, __ATOMIC_RELEASE);
+    usleep((useconds_t)(seconds * 1e6));
+    __atomic_store_n(&bench->stop, 1, __ATOMIC_RELAXED);
+    while (wait(NULL) > 0)
+	;
+    elapsed = now_sec() - start;
+
+    for (i = 0; i < num_readers + num_writers; i++) {
+	struct process_result* result = &bench->results[i];
+
+	lookups += result->lookups;
+	updates += result->updates;
+	bad += result->bad;
+	if (result->attach_time > max_attach)
+	    max_attach = result->attach_time;
+    }
+    printf("%d readers, %d writers, %.1f sec: %.0f lookups/sec, "
+	   "%.0f updates/sec\n", num_readers, num_writers, seconds,
+	   lookups / elapsed, updates / elapsed);
+    printf("attaching took up to %.1f us\n", max_attach * 1e6);
+
+    table_detach(&table);
+    if (!keep)
+	unlink(file_name);
+
+    if (bad) {
+	printf("%lu lookups missed, found a torn employee, or updates "
+	       "failed!\n", bad);
+	return 1;
+    }
+
+    return 0;
+}
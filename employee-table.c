@@ -0,0 +1,659 @@
+#include <stdio.h>       /* standard I/O routines                 */
+#include <stdlib.h>      /* malloc(), calloc(), free(), exit()    */
+#include <string.h>      /* memcpy(), strtok()                    */
+#include <errno.h>       /* errno, EINVAL                         */
+#include <time.h>        /* clock_gettime()                       */
+#include <unistd.h>      /* getopt(), usleep()                    */
+#include <pthread.h>     /* pthread functions and data structures */
+#include <sched.h>       /* sched_yield()                         */
+
+#include "cache_line.h"  /* CACHE_LINE_SIZE, CACHE_ALIGNED        */
+#include "seqlock.h"     /* sequence counters                     */
+#include "epoch.h"       /* epoch based reclamation               */
+
+/*
+ * a concurrent table of employees, keyed by their id - for a directory
+ * of millions of employees, looked up by many threads at once.
+ *
+ * the table is split into shards, by the id's hash. each shard is an
+ * open addressing (linear probing) array of slots, with its own mutex
+ * (lock striping) - writers of different shards don't wait for each
+ * other. lookups take no lock at all: each slot has a sequence counter
+ * (see 'seqlock.h'), and a lookup copies the employee optimistically,
+ * and retries if a writer got in. a shard that gets too full is resized
+ * on its own, by the writer that filled it - only the writers of that
+ * shard wait for it, while lookups go on in the old slots. those are
+ * freed once no lookup may still be using them, with epoch based
+ * reclamation (see 'epoch.h'). employees are never removed, so an empty
+ * slot ends a probe. an id of 0 marks an empty slot, so it can't be used
+ * as a key.
+ *
+ * the program fills tables of a few sizes, from several threads at once,
+ * and runs a mixed lookup/update workload on them.
+ */
+
+/* defaults of the command line options. */
+#define DEFAULT_SIZES "1000000,10000000,50000000"
+#define DEFAULT_THREADS 4
+#define DEFAULT_UPDATE_PERCENT 10
+#define DEFAULT_SECONDS 1.0
+#define DEFAULT_SHARD_BITS 8
+
+/* slots of a shard when the table is created - it grows from there. */
+#define INITIAL_SLOTS 16
+
+/* a shard is resized once more than 3/4 of its slots are in use. */
+#define MAX_LOAD_NUMERATOR 3
+#define MAX_LOAD_DENOMINATOR 4
+
+struct employee {
+    int number;
+    int id;
+    char first_name[20];
+    char last_name[30];
+    char department[30];
+    int room_number;
+};
+
+/* the words an employee struct is copied in. 'may_alias' lets us     */
+/* access the struct through them.                                     */
+typedef unsigned int __attribute__ ((may_alias)) employee_word;
+#define EMPLOYEE_WORDS (sizeof(struct employee) / sizeof(employee_word))
+
+/* a slot of the table - an employee, protected by a sequence counter. */
+/* the counter is odd while a writer is changing the employee.         */
+struct table_slot {
+    unsigned int seq;
+    struct employee employee;
+};
+
+/* the slots of a shard. */
+struct slot_array {
+    size_t mask;		/* number of slots - 1 (a power of 2).   */
+    struct table_slot slots[];	/* the slots.                            */
+};
+
+/* a shard of the table. each one on its own cache line(s), so writers */
+/* locking different shards don't slow each other down.                 */
+struct table_shard {
+    pthread_mutex_t lock;	/* taken by the shard's writers.         */
+    struct slot_array* array;	/* current slots - replaced on resize.   */
+    size_t count;		/* employees in the shard.               */
+    unsigned long resizes;	/* times the shard was resized.          */
+    double longest_resize;	/* longest resize, in seconds.           */
+} CACHE_ALIGNED;
+
+/* the table. */
+struct employee_table {
+    int shard_bits;		/* log2 of the number of shards.         */
+    struct table_shard* shards;	/* the shards.                           */
+};
+
+/* get the current time, in seconds. */
+double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* get the hash of an id (the finalizer of MurmurHash3). its high bits */
+/* choose the shard, its low bits the first slot to probe.             */
+unsigned long
+hash_id(int id)
+{
+    unsigned long hash = (unsigned int)id;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53UL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/* get the shard an id belongs to. */
+struct table_shard*
+shard_of(struct employee_table* table, unsigned long hash)
+{
+    return &table->shards[hash >> (64 - table->shard_bits)];
+}
+
+/* allocate an array of empty slots (all zeros: id 0, even counter). */
+struct slot_array*
+new_slot_array(size_t num_slots)
+{
+    struct slot_array* array = (struct slot_array*)
+	calloc(1, sizeof(struct slot_array) +
+		  num_slots * sizeof(struct table_slot));
+
+    if (!array) {
+	fprintf(stderr, "new_slot_array: out of memory. exiting\n");
+	exit(1);
+    }
+    array->mask = num_slots - 1;
+
+    return array;
+}
+
+/* create a table, with 2^shard_bits shards. */
+struct employee_table*
+table_create(int shard_bits)
+{
+    struct employee_table* table;
+    size_t num_shards = (size_t)1 << shard_bits;
+    size_t i;
+
+    table = (struct employee_table*)malloc(sizeof(struct employee_table));
+    if (!table || posix_memalign((void**)&table->shards, CACHE_LINE_SIZE,
+				 num_shards * sizeof(struct table_shard))) {
+	fprintf(stderr, "table_create: out of memory. exiting\n");
+	exit(1);
+    }
+    table->shard_bits = shard_bits;
+    for (i = 0; i < num_shards; i++) {
+	struct table_shard* shard = &table->shards[i];
+
+	pthread_mutex_init(&shard->lock, NULL);
+	shard->array = new_slot_array(INITIAL_SLOTS);
+	shard->count = 0;
+	shard->resizes = 0;
+	shard->longest_resize = 0;
+    }
+
+    return table;
+}
+
+/* destroy a table. no thread may be using it. */
+void
+table_destroy(struct employee_table* table)
+{
+    size_t num_shards = (size_t)1 << table->shard_bits;
+    size_t i;
+
+    for (i = 0; i < num_shards; i++) {
+	pthread_mutex_destroy(&table->shards[i].lock);
+	free(table->shards[i].array);
+    }
+    free(table->shards);
+    free(table);
+
+    /* no lookups are going on, so two epochs pass right away. */
+    epoch_reclaim_all();
+}
+
+/*
+ * function read_slot(): copy the employee of a slot.
+ * algorithm: the seqlock read of 'seqlock.h' - read the counter
+ *            (wait while odd), copy the employee, and read the counter
+ *            again: if it changed, the copy may be torn - retry.
+ * input:     the slot, where to copy the employee to.
+ * output:    none.
+ */
+void
+read_slot(struct table_slot* slot, struct employee* to)
+{
+    employee_word* src = (employee_word*)&slot->employee;
+    employee_word* dst = (employee_word*)to;
+    unsigned long retries;
+    unsigned int seq;
+    unsigned int i;
+
+    for (retries = 0;; retries++) {
+	seq = seqlock_read_begin(&slot->seq, &retries);
+	for (i = 0; i < EMPLOYEE_WORDS; i++)
+	    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	if (!seqlock_read_retry(&slot->seq, seq))
+	    return;
+    }
+}
+
+/* write the employee of a slot - with its shard's lock held. */
+void
+write_slot(struct table_slot* slot, const struct employee* from)
+{
+    const employee_word* src = (const employee_word*)from;
+    employee_word* dst = (employee_word*)&slot->employee;
+    unsigned int i;
+
+    seqlock_write_begin(&slot->seq);
+    for (i = 0; i < EMPLOYEE_WORDS; i++)
+	__atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    seqlock_write_end(&slot->seq);
+}
+
+/* find the slot of an id in a slot array - or the empty slot where it */
+/* would go. the array is never full, so there always is one.          */
+struct table_slot*
+find_slot(struct slot_array* array, unsigned long hash, int id)
+{
+    size_t i;
+
+    for (i = hash & array->mask;; i = (i + 1) & array->mask) {
+	struct table_slot* slot = &array->slots[i];
+	int slot_id = __atomic_load_n(&slot->employee.id, __ATOMIC_ACQUIRE);
+
+	if (slot_id == id || slot_id == 0)
+	    return slot;
+    }
+}
+
+/*
+ * function resize_shard(): double the slots of a shard.
+ * algorithm: copy the employees to a new slot array, twice as large,
+ *            and publish it. lookups that got the old array go on
+ *            using it - nothing changes in it, as the shard's writers
+ *            wait for its lock - and it is freed once they are done.
+ *            the new array is not published yet while filling it, so
+ *            its slots are written without their counters.
+ * input:     the shard, with its lock held.
+ * output:    none.
+ */
+void
+resize_shard(struct table_shard* shard)
+{
+    struct slot_array* old_array = shard->array;
+    struct slot_array* new_array = new_slot_array((old_array->mask + 1) * 2);
+    double start = now_sec();
+    double elapsed;
+    size_t i;
+
+    for (i = 0; i <= old_array->mask; i++) {
+	struct table_slot* slot = &old_array->slots[i];
+
+	if (slot->employee.id != 0)
+	    find_slot(new_array, hash_id(slot->employee.id),
+		      slot->employee.id)->employee = slot->employee;
+    }
+    __atomic_store_n(&shard->array, new_array, __ATOMIC_RELEASE);
+    epoch_retire(old_array);
+
+    elapsed = now_sec() - start;
+    shard->resizes++;
+    if (elapsed > shard->longest_resize)
+	shard->longest_resize = elapsed;
+}
+
+/*
+ * function table_lookup(): look an employee up, by id.
+ * algorithm: hash the id, to find its shard, and probe the shard's
+ *            slots from the one the hash points to, until finding the
+ *            id (and copying its employee), or an empty slot. no lock
+ *            is taken, and no shared memory written - except for the
+ *            thread's own epoch record.
+ * input:     the table, the id, where to copy the employee to.
+ * output:    1 if the employee was found, 0 if not.
+ */
+int
+table_lookup(struct employee_table* table, int id, struct employee* to)
+{
+    unsigned long hash = hash_id(id);
+    struct table_shard* shard = shard_of(table, hash);
+    struct epoch_thread* self = epoch_read_lock();
+    struct slot_array* array = __atomic_load_n(&shard->array,
+					       __ATOMIC_ACQUIRE);
+    struct table_slot* slot = find_slot(array, hash, id);
+    int found = slot->employee.id == id;
+
+    if (found)
+	read_slot(slot, to);
+    epoch_read_unlock(self);
+
+    return found;
+}
+
+/*
+ * function table_put(): add an employee, or update it if its id is in
+ *                       the table already.
+ * algorithm: lock the id's shard, and find its slot. a new employee
+ *            that would fill the shard past the maximal load first
+ *            resizes it. then write the slot, under its counter.
+ * input:     the table, the employee.
+ * output:    1 if the employee was added, 0 if updated, -1 if its id is
+ *            0 (errno is set to EINVAL).
+ */
+int
+table_put(struct employee_table* table, const struct employee* employee)
+{
+    unsigned long hash = hash_id(employee->id);
+    struct table_shard* shard = shard_of(table, hash);
+    struct table_slot* slot;
+    int added;
+
+    if (employee->id == 0) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    slot = find_slot(shard->array, hash, employee->id);
+    added = slot->employee.id == 0;
+    if (added && (shard->count + 1) * MAX_LOAD_DENOMINATOR >
+		 (shard->array->mask + 1) * MAX_LOAD_NUMERATOR) {
+	resize_shard(shard);
+	slot = find_slot(shard->array, hash, employee->id);
+    }
+    write_slot(slot, employee);
+    shard->count += added;
+    pthread_mutex_unlock(&shard->lock);
+
+    epoch_try_reclaim();
+
+    return added;
+}
+
+/* the benchmark's settings. */
+int num_threads = DEFAULT_THREADS;
+int update_percent = DEFAULT_UPDATE_PERCENT;
+double seconds = DEFAULT_SECONDS;
+
+/* the table the threads work on, and the number of its employees. */
+struct employee_table* the_table;
+long num_records;
+
+/* flags starting and stopping the mixed workload's threads. */
+int start_threads = 0;
+int stop_threads = 0;
+
+/* a benchmark thread's share of the work - on cache lines of its own, */
+/* so threads counting their operations don't slow each other down.    */
+struct worker {
+    pthread_t thread;		/* the thread.                          */
+    int index;			/* its index, from 0.                   */
+    unsigned long seed;		/* its random numbers' state.           */
+    unsigned long lookups;	/* lookups it made.                     */
+    unsigned long updates;	/* updates it made.                     */
+    unsigned long bad;		/* lookups that missed, or found a torn */
+				/* (inconsistent) employee.             */
+} CACHE_ALIGNED;
+
+/* get a pseudo random number (xorshift). */
+unsigned long
+next_random(unsigned long* seed)
+{
+    unsigned long x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *seed = x;
+
+    return x;
+}
+
+/* get the id of the i'th employee - a multiplication by an odd number */
+/* spreads them around, and never gives 0.                              */
+int
+id_of(long i)
+{
+    return (int)((unsigned int)(i + 1) * 2654435761u);
+}
+
+/* make the i'th employee. its department tells its room number - a */
+/* torn copy of it would likely tell another one.                   */
+void
+make_employee(long i, int room_number, struct employee* employee)
+{
+    memset(employee, 0, sizeof(struct employee));
+    employee->number = i + 1;
+    employee->id = id_of(i);
+    snprintf(employee->first_name, sizeof(employee->first_name),
+	     "first-%d", (int)(i + 1));
+    snprintf(employee->last_name, sizeof(employee->last_name),
+	     "last-%d", (int)(i + 1));
+    snprintf(employee->department, sizeof(employee->department),
+	     "room %d", room_number);
+    employee->room_number = room_number;
+}
+
+/* look the i'th employee up, and check it is all of one employee. */
+/* returns 1 if it was found and consistent, 0 if not.              */
+int
+check_lookup(long i)
+{
+    struct employee employee;
+
+    if (!table_lookup(the_table, id_of(i), &employee))
+	return 0;
+
+    return employee.number == i + 1 && employee.id == id_of(i) &&
+	   atoi(employee.department + 5) == employee.room_number;
+}
+
+/* function to be executed by the threads filling the table - each */
+/* adds its share of the employees, and looks one it added up after */
+/* each one - while the shards get resized.                         */
+void*
+do_fill(void* data)
+{
+    struct worker* me = (struct worker*)data;
+    long first = num_records * me->index / num_threads;
+    long last = num_records * (me->index + 1) / num_threads;
+    struct employee employee;
+    long i;
+
+    for (i = first; i < last; i++) {
+	make_employee(i, 0, &employee);
+	table_put(the_table, &employee);
+	me->lookups++;
+	if (!check_lookup(first + next_random(&me->seed) % (i - first + 1)))
+	    me->bad++;
+    }
+
+    return NULL;
+}
+
+/* function to be executed by the threads of the mixed workload - each */
+/* looks random employees up, or updates them, until stopped.           */
+void*
+do_mix(void* data)
+{
+    struct worker* me = (struct worker*)data;
+    struct employee employee;
+
+    while (!__atomic_load_n(&start_threads, __ATOMIC_ACQUIRE))
+	sched_yield();
+
+    while (!__atomic_load_n(&stop_threads, __ATOMIC_RELAXED)) {
+	unsigned long r = next_random(&me->seed);
+	long i = (long)((r >> 8) % num_records);
+
+	if ((int)(r % 100) < update_percent) {
+	    make_employee(i, (int)(r >> 40), &employee);
+	    table_put(the_table, &employee);
+	    me->updates++;
+	}
+	else {
+	    me->lookups++;
+	    if (!check_lookup(i))
+		me->bad++;
+	}
+    }
+
+    return NULL;
+}
+
+/* run the threads of a phase, with the given function. for the mixed */
+/* workload, start them together, and stop them after 'seconds'.       */
+void
+run_workers(struct worker* workers, void* (*func)(void*))
+{
+    int i;
+
+    memset(workers, 0, num_threads * sizeof(struct worker));
+    start_threads = 0;
+    stop_threads = 0;
+    for (i = 0; i < num_threads; i++) {
+	workers[i].index = i;
+	workers[i].seed = 0x9e3779b97f4a7c15UL * (i + 1);
+	pthread_create(&workers[i].thread, NULL, func, (void*)&workers[i]);
+    }
+    if (func == do_mix) {
+	__atomic_store_n(&start_threads, 1, __ATOMIC_RELEASE);
+	usleep((useconds_t)(seconds * 1e6));
+	__atomic_store_n(&stop_threads, 1, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < num_threads; i++)
+	pthread_join(workers[i].thread, NULL);
+}
+
+/*
+ * function run_size(): benchmark a table of a given size.
+ * algorithm: fill a new table from all the threads, then run the
+ *            mixed workload on it, and print a line of results: the
+ *            fill's time and rate, the resizes it took, the longest of
+ *            them (only the writers of the resized shard wait for it),
+ *            the table's memory, the lookups and updates per second of
+ *            the mixed workload, and the lookups that missed or found
+ *            a torn employee (there should be none).
+ * input:     number of employees.
+ * output:    number of bad lookups.
+ */
+unsigned long
+run_size(long size, int shard_bits)
+{
+    struct worker* workers;
+    size_t num_shards = (size_t)1 << shard_bits;
+    unsigned long resizes = 0, bad = 0;
+    unsigned long lookups = 0, updates = 0;
+    double longest_resize = 0, fill_time, mix_time;
+    double memory = 0;
+    size_t count = 0;
+    double start;
+    size_t i;
+
+    if (posix_memalign((void**)&workers, CACHE_LINE_SIZE,
+		       num_threads * sizeof(struct worker)) != 0) {
+	fprintf(stderr, "run_size: out of memory. exiting\n");
+	exit(1);
+    }
+    num_records = size;
+    the_table = table_create(shard_bits);
+
+    start = now_sec();
+    run_workers(workers, do_fill);
+    fill_time = now_sec() - start;
+    for (i = 0; i < (size_t)num_threads; i++)
+	bad += workers[i].bad;
+    for (i = 0; i < num_shards; i++) {
+	struct table_shard* shard = &the_table->shards[i];
+
+	count += shard->count;
+	resizes += shard->resizes;
+	if (shard->longest_resize > longest_resize)
+	    longest_resize = shard->longest_resize;
+	memory += (shard->array->mask + 1) * sizeof(struct table_slot);
+    }
+    bad += (long)count != size;
+
+    start = now_sec();
+    run_workers(workers, do_mix);
+    mix_time = now_sec() - start;
+    for (i = 0; i < (size_t)num_threads; i++) {
+	lookups += workers[i].lookups;
+	updates += workers[i].updates;
+	bad += workers[i].bad;
+    }
+
+    printf("%10ld %8.2f %10.0f %8lu %8.2f %9.0f %12.0f %11.0f %6lu\n",
+	   size, fill_time, size / fill_time, resizes, longest_resize * 1000,
+	   memory / (1024 * 1024), lookups / mix_time, updates / mix_time, bad);
+    fflush(stdout);
+
+    table_destroy(the_table);
+    free(workers);
+
+    return bad;
+}
+
+/* print a usage message, and exit. */
+void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-n sizes] [-t threads] [-u update percent] "
+		    "[-s seconds] [-S shards]\n", prog);
+    fprintf(stderr, "  -n  numbers of employees, comma separated "
+		    "(default %s)\n"
+		    "  -t  threads (default %d)\n"
+		    "  -u  percent of the mixed workload's operations that "
+		    "update (default %d)\n"
+		    "  -s  seconds to run the mixed workload (default %.1f)\n"
+		    "  -S  shards, a power of 2 (default %d)\n",
+	    DEFAULT_SIZES, DEFAULT_THREADS, DEFAULT_UPDATE_PERCENT,
+	    DEFAULT_SECONDS, 1 << DEFAULT_SHARD_BITS);
+    exit(1);
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    char sizes_buf[256] = DEFAULT_SIZES;
+    char* sizes = sizes_buf;
+    int shard_bits = DEFAULT_SHARD_BITS;
+    unsigned long bad = 0;
+    long num_shards;
+    char* size;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:u:s:S:")) != -1) {
+	switch (opt) {
+	    case 'n':
+		sizes = optarg;
+		break;
+	    case 't':
+		num_threads = atoi(optarg);
+		break;
+	    case 'u':
+		update_percent = atoi(optarg);
+		break;
+	    case 's':
+		seconds = atof(optarg);
+		break;
+	    case 'S':
+		num_shards = atol(optarg);
+		if (num_shards < 1 || (num_shards & (num_shards - 1)) ||
+		    num_shards > 1L << 20)
+		    usage(argv[0]);
+		for (shard_bits = 0; (1L << shard_bits) < num_shards;
+		     shard_bits++)
+		    ;
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    if (num_threads < 1 || update_percent < 0 || update_percent > 100 ||
+	seconds <= 0)
+	usage(argv[0]);
+
+    /* with one shard, the shard index is the hash shifted right by 64 - */
+    /* which C leaves undefined - so keep at least two.                   */
+    if (shard_bits == 0)
+	shard_bits = 1;
+
+    printf("%d threads, %d shards, %d%% updates, %.1f sec mixed workload\n",
+	   num_threads, 1 << shard_bits, update_percent, seconds);
+    printf("%10s %8s %10s %8s %8s %9s %12s %11s %6s\n", "employees",
+	   "fill s", "adds/s", "resizes", "longest", "memory", "lookups/s",
+	   "updates/s", "bad");
+    printf("%10s %8s %10s %8s %8s %9s %12s %11s %6s\n", "", "", "", "",
+	   "ms", "MB", "", "", "");
+    for (size = strtok(sizes, ","); size; size = strtok(NULL, ",")) {
+	long n = atol(size);
+
+	if (n < 1 || n > 0x7fffffffL)
+	    usage(argv[0]);
+	bad += run_size(n, shard_bits);
+    }
+
+    if (bad) {
+	printf("%lu lookups missed, or found a torn employee!\n", bad);
+	return 1;
+    }
+
+    return 0;
+}
@@ -1,10 +1,16 @@
 #include <stdio.h>       /* standard I/O routines                 */
 #include <pthread.h>     /* pthread functions and data structures */
 
+#include "cache_line.h"  /* CACHE_ALIGNED                         */
+
 #define NUM_EMPLOYEES 2                   /* size of each array.    */
 
+/* the mutex (written on every lock), 'employee of the day' (written */
+/* by the setting threads) and the employees array (only read) each  */
+/* get cache lines of their own.                                     */
+
 /* global mutex for our program. assignment initializes it */
-pthread_mutex_t a_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t a_mutex CACHE_ALIGNED = PTHREAD_MUTEX_INITIALIZER;
 
 struct employee {
     int number;
@@ -16,13 +22,13 @@ struct employee {
 };
 
 /* global variable - our employees array, with 2 employees */
-struct employee employees[] = {
+struct employee employees[] CACHE_ALIGNED = {
     { 1, 12345678, "danny", "cohen", "Accounting", 101},
     { 2, 87654321, "moshe", "levy", "Programmers", 202}
 };
 
 /* global variable - employee of the day. */
-struct employee employee_of_the_day;
+struct employee employee_of_the_day CACHE_ALIGNED;
 
 /* function to copy one employee struct into another */
 void
@@ -0,0 +1,281 @@
+#include <stdio.h>       /* standard I/O routines                 */
+#include <stdlib.h>      /* malloc(), free(), exit(), atoi()      */
+#include <string.h>      /* strcpy(), strcmp()                    */
+#include <time.h>        /* clock_gettime()                       */
+#include <unistd.h>      /* usleep(), sysconf()                   */
+#include <pthread.h>     /* pthread functions and data structures */
+
+#include "epoch.h"       /* epoch based reclamation               */
+
+#define NUM_EMPLOYEES 2                   /* size of each array.    */
+
+/* how long each measurement runs, in seconds (by default). */
+#define RUN_SECONDS 1
+
+/* time a writer sleeps between updates, in microseconds - the record */
+/* is read-mostly.                                                     */
+#define WRITE_INTERVAL_US 100
+
+/* global mutex for our program. assignment initializes it. only the */
+/* mutex variant uses it.                                             */
+pthread_mutex_t a_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct employee {
+    int number;
+    int id;
+    char first_name[20];
+    char last_name[30];
+    char department[30];
+    int room_number;
+};
+
+/* global variable - our employees array, with 2 employees */
+struct employee employees[] = {
+    { 1, 12345678, "danny", "cohen", "Accounting", 101},
+    { 2, 87654321, "moshe", "levy", "Programmers", 202}
+};
+
+/* global variable - employee of the day, protected by 'a_mutex'. */
+struct employee employee_of_the_day;
+
+/* global variable - the current version of employee of the day, in */
+/* the RCU variant. a version never changes once published - writers */
+/* publish a new one instead.                                        */
+struct employee* rcu_employee_of_the_day = NULL;
+
+/* number of old versions freed - once no reader may hold them, with */
+/* epoch based reclamation (see 'epoch.h').                           */
+unsigned long rcu_freed = 0;
+
+/* flag telling the writer and reader threads to stop. */
+int stop_threads = 0;
+
+/* function to copy one employee struct into another */
+void
+copy_employee(struct employee* from, struct employee* to)
+{
+    int rc;	/* contain mutex lock/unlock results */
+
+    /* lock the mutex, to assure exclusive access to 'a' and 'b'. */
+    rc = pthread_mutex_lock(&a_mutex);
+
+    to->number = from->number;
+    to->id = from->id;
+    strcpy(to->first_name, from->first_name);
+    strcpy(to->last_name, from->last_name);
+    strcpy(to->department, from->department);
+    to->room_number = from->room_number;
+
+    /* unlock mutex */
+    rc = pthread_mutex_unlock(&a_mutex);
+}
+
+/*
+ * function publish_employee(): publish a new employee of the day.
+ * algorithm: build a new version, swap it with the current one (so
+ *            readers see either the old version, or the new one -
+ *            never part of each), and retire the old one, tagged with
+ *            the epoch it was replaced in.
+ * input:     employee to publish.
+ * output:    none.
+ */
+void
+publish_employee(struct employee* from)
+{
+    struct employee* version = (struct employee*)malloc(sizeof(*version));
+    struct employee* old;
+
+    if (!version) {
+	fprintf(stderr, "publish_employee: out of memory. exiting\n");
+	exit(1);
+    }
+    *version = *from;
+    old = __atomic_exchange_n(&rcu_employee_of_the_day, version,
+			      __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&rcu_freed, epoch_retire(old), __ATOMIC_RELAXED);
+}
+
+/* check a copy of 'employee of the day' is all of one employee. */
+void
+check_employee(const struct employee* eotd, long i)
+{
+    const struct employee* worker = &employees[eotd->number-1];
+
+    /* compare employees */
+    if (eotd->id != worker->id) {
+	printf("mismatching 'id' , %d != %d (loop '%ld')\n",
+	       eotd->id, worker->id, i);
+	exit(0);
+    }
+    if (strcmp(eotd->first_name, worker->first_name) != 0) {
+	printf("mismatching 'first_name' , %s != %s (loop '%ld')\n",
+	       eotd->first_name, worker->first_name, i);
+	exit(0);
+    }
+    if (strcmp(eotd->last_name, worker->last_name) != 0) {
+	printf("mismatching 'last_name' , %s != %s (loop '%ld')\n",
+	       eotd->last_name, worker->last_name, i);
+	exit(0);
+    }
+    if (strcmp(eotd->department, worker->department) != 0) {
+	printf("mismatching 'department' , %s != %s (loop '%ld')\n",
+	       eotd->department, worker->department, i);
+	exit(0);
+    }
+    if (eotd->room_number != worker->room_number) {
+	printf("mismatching 'room_number' , %d != %d (loop '%ld')\n",
+	       eotd->room_number, worker->room_number, i);
+	exit(0);
+    }
+}
+
+/* a reader thread's results. */
+struct reader {
+    pthread_t thread;		/* the thread.                  */
+    int use_rcu;		/* read with RCU, or the mutex? */
+    long reads;			/* reads it made.               */
+};
+
+/* function to be executed by the reader threads. */
+void*
+do_reads(void* data)
+{
+    struct reader* me = (struct reader*)data;
+    struct employee eotd;      /* local copy of 'employee of the day'.  */
+    long i;
+
+    for (i = 0; !__atomic_load_n(&stop_threads, __ATOMIC_RELAXED); i++) {
+	if (me->use_rcu) {
+	    /* no copy - check the version in place. */
+	    struct epoch_thread* self = epoch_read_lock();
+
+	    check_employee(__atomic_load_n(&rcu_employee_of_the_day,
+					   __ATOMIC_ACQUIRE), i);
+	    epoch_read_unlock(self);
+	}
+	else {
+	    copy_employee(&employee_of_the_day, &eotd);
+	    check_employee(&eotd, i);
+	}
+    }
+    me->reads = i;
+
+    return NULL;
+}
+
+/* function to be executed by the variable setting threads thread */
+void*
+do_loop(void* data)
+{
+    int my_num = ((int*)data)[0];   /* thread identifying number       */
+    int use_rcu = ((int*)data)[1];  /* publish with RCU?               */
+
+    while (!__atomic_load_n(&stop_threads, __ATOMIC_RELAXED)) {
+        /* set employee of the day to be the one with number 'my_num'. */
+	if (use_rcu)
+	    publish_employee(&employees[my_num-1]);
+	else
+	    copy_employee(&employees[my_num-1], &employee_of_the_day);
+	usleep(WRITE_INTERVAL_US);
+    }
+
+    return NULL;
+}
+
+/* get the current time, in seconds. */
+double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * function measure_reads(): measure the read rate of some readers.
+ * algorithm: run two writers and the readers for a while, then stop
+ *            them all, and sum up the readers' reads.
+ * input:     number of readers, use RCU (1) or the mutex (0), seconds.
+ * output:    reads per second, of all readers together.
+ */
+double
+measure_reads(int num_readers, int use_rcu, double seconds)
+{
+    struct reader* readers;
+    pthread_t writers[2];
+    int writer_args[2][2] = { { 1, use_rcu }, { 2, use_rcu } };
+    long reads = 0;
+    double start;
+    int i;
+
+    readers = (struct reader*)calloc(num_readers, sizeof(struct reader));
+    if (!readers) {
+	fprintf(stderr, "measure_reads: out of memory. exiting\n");
+	exit(1);
+    }
+    stop_threads = 0;
+    for (i = 0; i < 2; i++)
+	pthread_create(&writers[i], NULL, do_loop, (void*)writer_args[i]);
+    start = now_sec();
+    for (i = 0; i < num_readers; i++) {
+	readers[i].use_rcu = use_rcu;
+	pthread_create(&readers[i].thread, NULL, do_reads, (void*)&readers[i]);
+    }
+
+    usleep((useconds_t)(seconds * 1e6));
+    __atomic_store_n(&stop_threads, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < num_readers; i++) {
+	pthread_join(readers[i].thread, NULL);
+	reads += readers[i].reads;
+    }
+    seconds = now_sec() - start;
+    for (i = 0; i < 2; i++)
+	pthread_join(writers[i], NULL);
+    free(readers);
+
+    return reads / seconds;
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_readers = num_cpus > 0 ? (int)num_cpus : 1;
+    double seconds = RUN_SECONDS;
+    int n;
+
+    if (argc > 1)
+	max_readers = atoi(argv[1]);
+    if (argc > 2)
+	seconds = atof(argv[2]);
+    if (max_readers < 1 || seconds <= 0) {
+	fprintf(stderr, "usage: %s [max readers] [seconds]\n", argv[0]);
+	exit(1);
+    }
+
+    /* initialize employee of the day to first 1. */
+    copy_employee(&employees[0], &employee_of_the_day);
+    publish_employee(&employees[0]);
+
+    printf("%8s %16s %16s %8s\n", "readers", "mutex reads/s", "rcu reads/s",
+	   "speedup");
+    /* 1, 2, 4, ... readers, and finally 'max_readers'. */
+    for (n = 1; ; n = n * 2 < max_readers ? n * 2 : max_readers) {
+	double mutex_rate = measure_reads(n, 0, seconds);
+	double rcu_rate = measure_reads(n, 1, seconds);
+
+	printf("%8d %16.0f %16.0f %7.2fx\n", n, mutex_rate, rcu_rate,
+	       rcu_rate / mutex_rate);
+	if (n == max_readers)
+	    break;
+    }
+
+    /* all threads are gone - free the versions still waiting. */
+    rcu_freed += epoch_reclaim_all();
+    printf("%lu old versions freed, epoch %lu\n", rcu_freed, epoch_global);
+    printf("Glory, employees contents was always consistent\n");
+
+    return 0;
+}
@@ -0,0 +1,287 @@
+#include <stdio.h>       /* standard I/O routines                 */
+#include <stdlib.h>      /* exit(), atol()                        */
+#include <string.h>      /* strcpy(), strcmp()                    */
+#include <time.h>        /* clock_gettime()                       */
+#include <pthread.h>     /* pthread functions and data structures */
+
+#include "seqlock.h"     /* sequence counters                     */
+
+#define NUM_EMPLOYEES 2                   /* size of each array.    */
+
+/* default number of verification loops, for each of the two variants. */
+#define NUM_LOOPS 2000000
+
+/* global mutex for our program. assignment initializes it. in the mutex */
+/* variant, readers and writers take it. in the seqlock variant, only    */
+/* writers do - to keep out of each other's way, not out of the readers'. */
+pthread_mutex_t a_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct employee {
+    int number;
+    int id;
+    char first_name[20];
+    char last_name[30];
+    char department[30];
+    int room_number;
+};
+
+/* the words an employee struct is copied in, by the seqlock variant. */
+/* 'may_alias' lets us access the struct through them.                */
+typedef unsigned int __attribute__ ((may_alias)) employee_word;
+#define EMPLOYEE_WORDS (sizeof(struct employee) / sizeof(employee_word))
+
+/* an employee record, protected by a sequence counter. the counter is */
+/* odd while a writer is changing the record.                          */
+struct seqlock_employee {
+    unsigned int seq;
+    struct employee employee;
+};
+
+/* global variable - our employees array, with 2 employees */
+struct employee employees[] = {
+    { 1, 12345678, "danny", "cohen", "Accounting", 101},
+    { 2, 87654321, "moshe", "levy", "Programmers", 202}
+};
+
+/* global variable - employee of the day, protected by 'a_mutex'. */
+struct employee employee_of_the_day;
+
+/* global variable - employee of the day, protected by a seqlock. */
+struct seqlock_employee seq_employee_of_the_day;
+
+/* flag telling the writer threads to stop. */
+int stop_writers = 0;
+
+/* function to copy one employee struct into another */
+void
+copy_employee(struct employee* from, struct employee* to)
+{
+    int rc;	/* contain mutex lock/unlock results */
+
+    /* lock the mutex, to assure exclusive access to 'a' and 'b'. */
+    rc = pthread_mutex_lock(&a_mutex);
+
+    to->number = from->number;
+    to->id = from->id;
+    strcpy(to->first_name, from->first_name);
+    strcpy(to->last_name, from->last_name);
+    strcpy(to->department, from->department);
+    to->room_number = from->room_number;
+
+    /* unlock mutex */
+    rc = pthread_mutex_unlock(&a_mutex);
+}
+
+/*
+ * function publish_employee(): set the seqlock protected employee.
+ * algorithm: lock out the other writers, make the counter odd, copy the
+ *            employee, and make the counter even again. the release
+ *            fence keeps the copy from being seen before the counter
+ *            turned odd; the release store keeps it from being seen
+ *            after it turned even. the words are stored atomically
+ *            (relaxed) as readers may read them at the same time.
+ * input:     employee to publish, seqlock protected record.
+ * output:    none.
+ */
+void
+publish_employee(struct employee* from, struct seqlock_employee* to)
+{
+    employee_word* src = (employee_word*)from;
+    employee_word* dst = (employee_word*)&to->employee;
+    unsigned int i;
+
+    pthread_mutex_lock(&a_mutex);
+
+    seqlock_write_begin(&to->seq);
+    for (i = 0; i < EMPLOYEE_WORDS; i++)
+	__atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    seqlock_write_end(&to->seq);
+
+    pthread_mutex_unlock(&a_mutex);
+}
+
+/*
+ * function read_employee(): copy the seqlock protected employee.
+ * algorithm: read the counter - if it is odd, a writer is busy, so wait
+ *            (see 'seqlock.h'). copy the employee optimistically, and
+ *            read the counter again: if it changed, a writer got in
+ *            during the copy, and it may be torn - so try again. the
+ *            reader never writes shared memory, so readers don't slow
+ *            each other (or the writers) down.
+ * input:     seqlock protected record, where to copy the employee to.
+ * output:    number of retries it took.
+ */
+unsigned long
+read_employee(struct seqlock_employee* from, struct employee* to)
+{
+    employee_word* src = (employee_word*)&from->employee;
+    employee_word* dst = (employee_word*)to;
+    unsigned long retries = 0;
+    unsigned int seq;
+    unsigned int i;
+
+    for (;; retries++) {
+	seq = seqlock_read_begin(&from->seq, &retries);
+	for (i = 0; i < EMPLOYEE_WORDS; i++)
+	    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	if (!seqlock_read_retry(&from->seq, seq))
+	    return retries;
+    }
+}
+
+/* function to be executed by the variable setting threads thread, */
+/* in the mutex variant.                                           */
+void*
+do_loop(void* data)
+{
+    int my_num = *((int*)data);   /* thread identifying number         */
+
+    while (!__atomic_load_n(&stop_writers, __ATOMIC_RELAXED)) {
+        /* set employee of the day to be the one with number 'my_num'. */
+	copy_employee(&employees[my_num-1], &employee_of_the_day);
+    }
+
+    return NULL;
+}
+
+/* function to be executed by the variable setting threads thread, */
+/* in the seqlock variant.                                         */
+void*
+do_seq_loop(void* data)
+{
+    int my_num = *((int*)data);   /* thread identifying number         */
+
+    while (!__atomic_load_n(&stop_writers, __ATOMIC_RELAXED)) {
+        /* set employee of the day to be the one with number 'my_num'. */
+	publish_employee(&employees[my_num-1], &seq_employee_of_the_day);
+    }
+
+    return NULL;
+}
+
+/* get the current time, in seconds. */
+double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * function verify_employees(): run the writers, and check 'employee of
+ *                              the day' many many times.
+ * algorithm: start two writer threads, each setting 'employee of the
+ *            day' to another employee, and copy it over and over,
+ *            checking each copy is all of one employee. stop and join
+ *            the writers at the end.
+ * input:     1 for the seqlock variant, 0 for the mutex one, number of
+ *            loops.
+ * output:    reads per second. exits if a copy was inconsistent.
+ */
+double
+verify_employees(int use_seqlock, long num_loops)
+{
+    long       i;              /* loop counter                          */
+    pthread_t  p_thread1;      /* first thread's structure              */
+    pthread_t  p_thread2;      /* second thread's structure             */
+    int        num1      = 1;  /* thread 1 employee number              */
+    int        num2      = 2;  /* thread 2 employee number              */
+    struct employee eotd;      /* local copy of 'employee of the day'.  */
+    struct employee* worker;   /* pointer to currently checked employee */
+    unsigned long retries = 0; /* seqlock reads that had to be retried. */
+    double start;              /* time the checks started.              */
+    double elapsed;            /* time they took.                       */
+
+    /* initialize employee of the day to first 1. */
+    copy_employee(&employees[0], &employee_of_the_day);
+    publish_employee(&employees[0], &seq_employee_of_the_day);
+
+    /* create the two threads that will set 'employee of the day'.      */
+    stop_writers = 0;
+    pthread_create(&p_thread1, NULL, use_seqlock ? do_seq_loop : do_loop,
+		   (void*)&num1);
+    pthread_create(&p_thread2, NULL, use_seqlock ? do_seq_loop : do_loop,
+		   (void*)&num2);
+
+    /* run a loop that verifies integrity of 'employee of the day' many */
+    /* many many times.....                                             */
+    start = now_sec();
+    for (i=0; i<num_loops; i++) {
+        /* save contents of 'employee of the day' to local 'worker'.    */
+	if (use_seqlock)
+	    retries += read_employee(&seq_employee_of_the_day, &eotd);
+	else
+	    copy_employee(&employee_of_the_day, &eotd);
+	worker = &employees[eotd.number-1];
+
+        /* compare employees */
+	if (eotd.id != worker->id) {
+	    printf("mismatching 'id' , %d != %d (loop '%ld')\n",
+		   eotd.id, worker->id, i);
+	    exit(0);
+	}
+	if (strcmp(eotd.first_name, worker->first_name) != 0) {
+	    printf("mismatching 'first_name' , %s != %s (loop '%ld')\n",
+		   eotd.first_name, worker->first_name, i);
+	    exit(0);
+	}
+	if (strcmp(eotd.last_name, worker->last_name) != 0) {
+	    printf("mismatching 'last_name' , %s != %s (loop '%ld')\n",
+		   eotd.last_name, worker->last_name, i);
+	    exit(0);
+	}
+	if (strcmp(eotd.department, worker->department) != 0) {
+	    printf("mismatching 'department' , %s != %s (loop '%ld')\n",
+		   eotd.department, worker->department, i);
+	    exit(0);
+	}
+	if (eotd.room_number != worker->room_number) {
+	    printf("mismatching 'room_number' , %d != %d (loop '%ld')\n",
+		   eotd.room_number, worker->room_number, i);
+	    exit(0);
+	}
+    }
+    elapsed = now_sec() - start;
+
+    /* stop the writers, and wait for them to exit. */
+    __atomic_store_n(&stop_writers, 1, __ATOMIC_RELAXED);
+    pthread_join(p_thread1, NULL);
+    pthread_join(p_thread2, NULL);
+
+    printf("%-8s %ld reads in %.3f sec - %.0f reads/sec",
+	   use_seqlock ? "seqlock" : "mutex", num_loops, elapsed,
+	   num_loops / elapsed);
+    if (use_seqlock)
+	printf(", %lu retries", retries);
+    printf("\n");
+
+    return num_loops / elapsed;
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    long num_loops = NUM_LOOPS;  /* verification loops of each variant. */
+    double mutex_rate;           /* reads per second, with the mutex.   */
+    double seqlock_rate;         /* reads per second, with the seqlock. */
+
+    if (argc > 1)
+	num_loops = atol(argv[1]);
+    if (num_loops < 1) {
+	fprintf(stderr, "usage: %s [loops]\n", argv[0]);
+	exit(1);
+    }
+
+    /* the same checks, first with the mutex, then with the seqlock. */
+    mutex_rate = verify_employees(0, num_loops);
+    seqlock_rate = verify_employees(1, num_loops);
+
+    printf("Glory, employees contents was always consistent\n");
+    printf("seqlock reads are %.2f times as fast as mutex reads\n",
+	   seqlock_rate / mutex_rate);
+
+    return 0;
+}
@@ -0,0 +1,271 @@
+#ifndef EPOCH_H
+# define EPOCH_H
+
+#include <stdio.h>       /* standard I/O routines                 */
+#include <stdlib.h>      /* malloc(), free(), exit()              */
+#include <pthread.h>     /* pthread functions and data structures */
+
+/*
+ * epoch based reclamation, shared by the employee programs. readers
+ * take no lock: a reader announces the global epoch in its thread's
+ * record (found through TSD) while it reads. a writer replacing a block
+ * of memory readers may hold retires the old one, tagged with the
+ * global epoch. the global epoch advances only when all the readers
+ * inside a read section announce it - so once it advanced twice past a
+ * block's tag, no reader can still hold that block, and it is freed:
+ *
+ *     self = epoch_read_lock();
+ *     read through the shared pointer;
+ *     epoch_read_unlock(self);
+ *
+ *     old = __atomic_exchange_n(&shared, new, __ATOMIC_SEQ_CST);
+ *     epoch_retire(old);
+ *
+ * everything is static, as each program is a single file.
+ */
+
+/* a reading thread's record. registered on the thread's first read, */
+/* and released by the thread's TSD destructor when it exits.        */
+struct epoch_thread {
+    unsigned long state;	/* epoch << 1 | 1 while reading, else 0. */
+    int in_use;			/* does a live thread own the record?     */
+    struct epoch_thread* next;	/* next record - records are never freed. */
+};
+
+/* a block waiting until no reader may hold it. */
+struct epoch_retired {
+    void* block;		/* the old block, freed with free().      */
+    unsigned long epoch;	/* global epoch when it was replaced.     */
+    struct epoch_retired* next;	/* next one, retired earlier.             */
+};
+
+/* the global epoch. */
+static unsigned long epoch_global = 1;
+
+/* list of all threads' records, and a mutex for adding records. */
+static struct epoch_thread* epoch_threads = NULL;
+static pthread_mutex_t epoch_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* key of the records in the threads' TSD. */
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+
+/* blocks waiting to be freed, the epoch they were last looked at in, */
+/* and the mutex writers take to retire blocks and advance the epoch. */
+/* readers never take it.                                             */
+static struct epoch_retired* epoch_retired_list = NULL;
+static unsigned long epoch_reclaimed = 0;
+static pthread_mutex_t epoch_reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* TSD destructor - a thread exits: release its record for reuse. */
+static void
+epoch_unregister(void* data)
+{
+    struct epoch_thread* self = (struct epoch_thread*)data;
+
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&self->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* create the TSD key of the records. */
+static void
+epoch_create_key(void)
+{
+    pthread_key_create(&epoch_key, epoch_unregister);
+}
+
+/*
+ * function epoch_register(): get the calling thread's record.
+ * algorithm: look the record up in the thread's TSD. on the thread's
+ *            first read, take a record a thread that exited released,
+ *            or add a new one to the list - records are never unlinked
+ *            nor freed, so writers walk the list without locking.
+ * input:     none.
+ * output:    the thread's record.
+ */
+static inline struct epoch_thread*
+epoch_register(void)
+{
+    struct epoch_thread* self;
+
+    pthread_once(&epoch_key_once, epoch_create_key);
+    self = (struct epoch_thread*)pthread_getspecific(epoch_key);
+    if (self)
+	return self;
+
+    pthread_mutex_lock(&epoch_threads_mutex);
+    for (self = epoch_threads; self; self = self->next) {
+	if (!__atomic_load_n(&self->in_use, __ATOMIC_ACQUIRE))
+	    break;
+    }
+    if (self) {
+	__atomic_store_n(&self->in_use, 1, __ATOMIC_RELAXED);
+    }
+    else {
+	self = (struct epoch_thread*)malloc(sizeof(struct epoch_thread));
+	if (!self) {
+	    fprintf(stderr, "epoch_register: out of memory. exiting\n");
+	    exit(1);
+	}
+	self->state = 0;
+	self->in_use = 1;
+	self->next = epoch_threads;
+	/* publish the record only once it is initialized. */
+	__atomic_store_n(&epoch_threads, self, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&epoch_threads_mutex);
+    pthread_setspecific(epoch_key, self);
+
+    return self;
+}
+
+/*
+ * function epoch_read_lock(): enter a read section.
+ * algorithm: announce the global epoch in the thread's record. the full
+ *            fence orders the announcement before the reads of the
+ *            section - a writer either sees it, or the reader sees the
+ *            writer's new block.
+ * input:     none.
+ * output:    the thread's record, for epoch_read_unlock().
+ */
+static inline struct epoch_thread*
+epoch_read_lock(void)
+{
+    struct epoch_thread* self = epoch_register();
+    unsigned long epoch = __atomic_load_n(&epoch_global, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&self->state, epoch << 1 | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return self;
+}
+
+/* leave a read section - the reads are done before the record says so. */
+static inline void
+epoch_read_unlock(struct epoch_thread* self)
+{
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * function epoch_reclaim(): advance the epoch, and free old blocks.
+ * algorithm: if every reader inside a read section announced the
+ *            current epoch, advance it. then free the blocks retired
+ *            two epochs ago, or before. the full fence pairs with the
+ *            one in epoch_read_lock() - it orders the swap of the block
+ *            before the look at the readers' records. a reader
+ *            preempted inside a read section holds the epoch back, and
+ *            the list grows - so it is only walked once the epoch moved.
+ *            must be called with 'epoch_reclaim_mutex' locked.
+ * input:     none.
+ * output:    number of blocks freed.
+ */
+static inline unsigned long
+epoch_reclaim(void)
+{
+    struct epoch_thread* thread;
+    struct epoch_retired** link;
+    unsigned long epoch;
+    unsigned long freed = 0;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    epoch = __atomic_load_n(&epoch_global, __ATOMIC_RELAXED);
+    for (thread = __atomic_load_n(&epoch_threads, __ATOMIC_ACQUIRE); thread;
+	 thread = thread->next) {
+	unsigned long state = __atomic_load_n(&thread->state,
+					      __ATOMIC_ACQUIRE);
+
+	if ((state & 1) && (state >> 1) != epoch)
+	    break;
+    }
+    if (!thread) {
+	epoch++;
+	__atomic_store_n(&epoch_global, epoch, __ATOMIC_SEQ_CST);
+    }
+    if (epoch == epoch_reclaimed)
+	return 0;
+    epoch_reclaimed = epoch;
+
+    /* the list is newest first - so everything after the first old */
+    /* enough block is old enough too.                              */
+    for (link = &epoch_retired_list; *link; link = &(*link)->next) {
+	if ((*link)->epoch + 2 <= epoch)
+	    break;
+    }
+    while (*link) {
+	struct epoch_retired* retired = *link;
+
+	*link = retired->next;
+	free(retired->block);
+	free(retired);
+	freed++;
+    }
+
+    return freed;
+}
+
+/*
+ * function epoch_retire(): retire a block replaced by a writer.
+ * algorithm: tag it with the global epoch, add it to the list, and
+ *            free whatever became old enough.
+ * input:     the old block (NULL is ignored).
+ * output:    number of blocks freed.
+ */
+static inline unsigned long
+epoch_retire(void* block)
+{
+    struct epoch_retired* retired;
+    unsigned long freed;
+
+    if (!block)
+	return 0;
+    retired = (struct epoch_retired*)malloc(sizeof(struct epoch_retired));
+    if (!retired) {
+	fprintf(stderr, "epoch_retire: out of memory. exiting\n");
+	exit(1);
+    }
+    retired->block = block;
+    pthread_mutex_lock(&epoch_reclaim_mutex);
+    retired->epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+    retired->next = epoch_retired_list;
+    __atomic_store_n(&epoch_retired_list, retired, __ATOMIC_RELAXED);
+    freed = epoch_reclaim();
+    pthread_mutex_unlock(&epoch_reclaim_mutex);
+
+    return freed;
+}
+
+/* try freeing retired blocks - if there are any, and no other thread */
+/* is at it already. returns the number freed.                        */
+static inline unsigned long
+epoch_try_reclaim(void)
+{
+    unsigned long freed;
+
+    if (!__atomic_load_n(&epoch_retired_list, __ATOMIC_RELAXED))
+	return 0;
+    if (pthread_mutex_trylock(&epoch_reclaim_mutex) != 0)
+	return 0;
+    freed = epoch_reclaim();
+    pthread_mutex_unlock(&epoch_reclaim_mutex);
+
+    return freed;
+}
+
+/* free all the retired blocks - once no reader is left, so the epoch */
+/* advances on each pass. returns the number freed.                   */
+static inline unsigned long
+epoch_reclaim_all(void)
+{
+    unsigned long freed = 0;
+    int pass;
+
+    pthread_mutex_lock(&epoch_reclaim_mutex);
+    for (pass = 0; pass < 3; pass++)
+	freed += epoch_reclaim();
+    pthread_mutex_unlock(&epoch_reclaim_mutex);
+
+    return freed;
+}
+
+#endif /* EPOCH_H */
@@ -0,0 +1,309 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <errno.h>       /* errno and error codes                     */
+#include <fcntl.h>       /* open()                                    */
+#include <unistd.h>      /* close()                                   */
+
+#include "line_scan.h"         /* newline counting kernels            */
+#include "lzw.h"               /* .Z decoder                          */
+#include "compressed_count.h"  /* compressed line counting functions  */
+
+/* the ring of buffers, shared by the decoder and the counting threads. */
+/* buffers move from the 'free' queue to the 'full' queue (decoder)     */
+/* and back (counters). both queues are circular arrays of indices.     */
+struct pipeline {
+    pthread_mutex_t mutex;		   /* protects everything below.  */
+    pthread_cond_t  got_full;		   /* a buffer was filled.        */
+    pthread_cond_t  got_free;		   /* a buffer was freed.         */
+    char* buffers[PIPELINE_NUM_BUFFERS];   /* the buffers themselves.     */
+    size_t lengths[PIPELINE_NUM_BUFFERS];  /* bytes of data in each.      */
+    int free_queue[PIPELINE_NUM_BUFFERS];  /* indices of free buffers.    */
+    int free_head, num_free;
+    int full_queue[PIPELINE_NUM_BUFFERS];  /* indices of filled buffers.  */
+    int full_head, num_full;
+    int eof;				   /* decoder reached the end?    */
+    int aborted;			   /* stop everything?            */
+    int error;				   /* errno of a failure, or 0.   */
+    unsigned long long lines;		   /* lines counted so far.       */
+    struct scan_progress* progress;	   /* progress of the scan.       */
+    struct lzw_decoder* decoder;	   /* the .Z decoder.             */
+    pthread_t decoder_thread;		   /* thread running the decoder. */
+    pthread_t* counter_threads;		   /* the counting threads.       */
+    int num_counters;			   /* number of counting threads. */
+    int fd;				   /* the compressed file.        */
+};
+
+/*
+ * function decode_loop(): the decoder thread's function.
+ * algorithm: take a free buffer (waiting if there is none), fill it with
+ *            decompressed data, and pass it to the counters. at the end
+ *            of the data (or on an error) mark the pipeline so. the
+ *            buffer is filled in small steps, checking between them if
+ *            the scan was cancelled.
+ * input:     pointer to pipeline.
+ * output:    none.
+ */
+static void*
+decode_loop(void* data)
+{
+    struct pipeline* pipe = (struct pipeline*)data;
+
+    while (1) {
+	int index;
+	size_t len = 0;
+	ssize_t n = 1;
+
+	pthread_mutex_lock(&pipe->mutex);
+	while (pipe->num_free == 0 && !pipe->aborted)
+	    pthread_cond_wait(&pipe->got_free, &pipe->mutex);
+	if (pipe->aborted) {
+	    pthread_mutex_unlock(&pipe->mutex);
+	    break;
+	}
+	index = pipe->free_queue[pipe->free_head];
+	pipe->free_head = (pipe->free_head + 1) % PIPELINE_NUM_BUFFERS;
+	pipe->num_free--;
+	pthread_mutex_unlock(&pipe->mutex);
+
+	/* fill the buffer, without holding the mutex. */
+	while (len < PIPELINE_BUFFER_SIZE && n > 0) {
+	    size_t step = PIPELINE_BUFFER_SIZE - len < PIPELINE_DECODE_STEP ?
+			  PIPELINE_BUFFER_SIZE - len : PIPELINE_DECODE_STEP;
+
+	    if (scan_cancelled(pipe->progress)) {
+		errno = ECANCELED;
+		n = -1;
+		break;
+	    }
+	    n = lzw_read(pipe->decoder, pipe->buffers[index] + len, step);
+	    if (n > 0)
+		len += n;
+	}
+
+	pthread_mutex_lock(&pipe->mutex);
+	pipe->lengths[index] = len;
+	pipe->full_queue[(pipe->full_head + pipe->num_full)
+			 % PIPELINE_NUM_BUFFERS] = index;
+	pipe->num_full++;
+	if (n < 0) {
+	    if (!pipe->error)
+		pipe->error = errno ? errno : EIO;
+	    pipe->aborted = 1;
+	}
+	if (n <= 0)
+	    pipe->eof = 1;
+	pthread_cond_broadcast(&pipe->got_full);
+	pthread_cond_broadcast(&pipe->got_free);
+	pthread_mutex_unlock(&pipe->mutex);
+	if (n <= 0)
+	    break;
+    }
+
+    return NULL;
+}
+
+/*
+ * function count_loop(): a counting thread's function.
+ * algorithm: take a filled buffer (waiting if there is none), count its
+ *            lines a block at a time, and give it back to the decoder.
+ *            exit when the decoder is done and no filled buffer is
+ *            left, or when the scan is cancelled.
+ * input:     pointer to pipeline.
+ * output:    none.
+ */
+static void*
+count_loop(void* data)
+{
+    struct pipeline* pipe = (struct pipeline*)data;
+
+    while (1) {
+	int index;
+	unsigned long long lines = 0;
+	int rc;
+
+	pthread_mutex_lock(&pipe->mutex);
+	while (pipe->num_full == 0 && !pipe->eof && !pipe->aborted)
+	    pthread_cond_wait(&pipe->got_full, &pipe->mutex);
+	if (pipe->num_full == 0 || pipe->aborted) {
+	    pthread_mutex_unlock(&pipe->mutex);
+	    break;
+	}
+	index = pipe->full_queue[pipe->full_head];
+	pipe->full_head = (pipe->full_head + 1) % PIPELINE_NUM_BUFFERS;
+	pipe->num_full--;
+	pthread_mutex_unlock(&pipe->mutex);
+
+	rc = count_newlines_blocks(pipe->buffers[index], pipe->lengths[index],
+				   pipe->progress, &lines);
+
+	pthread_mutex_lock(&pipe->mutex);
+	pipe->lines += lines;
+	if (rc < 0) {
+	    if (!pipe->error)
+		pipe->error = ECANCELED;
+	    pipe->aborted = 1;
+	    pthread_cond_broadcast(&pipe->got_full);
+	}
+	pipe->free_queue[(pipe->free_head + pipe->num_free)
+			 % PIPELINE_NUM_BUFFERS] = index;
+	pipe->num_free++;
+	/* both the decoder and compressed_count_lines() wait for this. */
+	pthread_cond_broadcast(&pipe->got_free);
+	pthread_mutex_unlock(&pipe->mutex);
+    }
+
+    return NULL;
+}
+
+/* cleanup handler - unlock the mutex held when cancelled in a wait. */
+static void
+cleanup_unlock_mutex(void* a_mutex)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)a_mutex);
+}
+
+/*
+ * function stop_pipeline(): cleanup handler of compressed_count_lines().
+ * algorithm: if the calling thread is cancelled while waiting for the
+ *            pipeline, tell its threads to stop, by cancelling the scan.
+ *            they check this between blocks, so they stop quickly. in
+ *            any case, join the threads and free the pipeline.
+ * input:     pointer to pipeline.
+ * output:    none.
+ */
+static void
+stop_pipeline(void* data)
+{
+    struct pipeline* pipe = (struct pipeline*)data;
+    int i;
+
+    pthread_mutex_lock(&pipe->mutex);
+    if (!pipe->eof) {
+	pipe->aborted = 1;
+	cancel_scan(pipe->progress);
+    }
+    pthread_cond_broadcast(&pipe->got_full);
+    pthread_cond_broadcast(&pipe->got_free);
+    pthread_mutex_unlock(&pipe->mutex);
+
+    pthread_join(pipe->decoder_thread, NULL);
+    for (i = 0; i < pipe->num_counters; i++)
+	pthread_join(pipe->counter_threads[i], NULL);
+
+    for (i = 0; i < PIPELINE_NUM_BUFFERS; i++)
+	free(pipe->buffers[i]);
+    free(pipe->counter_threads);
+    free(pipe->decoder);
+    close(pipe->fd);
+    pthread_cond_destroy(&pipe->got_full);
+    pthread_cond_destroy(&pipe->got_free);
+    pthread_mutex_destroy(&pipe->mutex);
+}
+
+/*
+ * function compressed_count_lines(): count the lines of a .Z file.
+ * algorithm: set up the ring of buffers, start the decoder thread and
+ *            the counting threads, and wait for them to finish. the
+ *            threads report to 'progress' (the decompressed bytes are
+ *            counted), and stop once it is cancelled. with no
+ *            'progress', a private one is used.
+ * input:     file name, number of counting threads, progress of the
+ *            scan (or NULL), where to place the count.
+ * output:    0 on success, -1 on error (errno is set; ECANCELED if the
+ *            scan was cancelled).
+ */
+int
+compressed_count_lines(const char* file_name, int num_counters,
+		       struct scan_progress* progress,
+		       unsigned long long* lines)
+{
+    struct pipeline pipe;
+    struct scan_progress own_progress;
+    int error;
+    int i;
+
+    if (num_counters < 1)
+	num_counters = 1;
+
+    pipe.fd = open(file_name, O_RDONLY);
+    if (pipe.fd < 0)
+	return -1;
+    pipe.decoder = (struct lzw_decoder*)malloc(sizeof(struct lzw_decoder));
+    pipe.counter_threads = (pthread_t*)malloc(num_counters * sizeof(pthread_t));
+    if (!pipe.decoder || !pipe.counter_threads) {
+	fprintf(stderr, "compressed_count_lines: out of memory. exiting\n");
+	exit(1);
+    }
+    if (lzw_decoder_init(pipe.decoder, pipe.fd) < 0) {
+	error = errno;
+	free(pipe.decoder);
+	free(pipe.counter_threads);
+	close(pipe.fd);
+	errno = error;
+	return -1;
+    }
+
+    for (i = 0; i < PIPELINE_NUM_BUFFERS; i++) {
+	pipe.buffers[i] = (char*)malloc(PIPELINE_BUFFER_SIZE);
+	if (!pipe.buffers[i]) {
+	    fprintf(stderr, "compressed_count_lines: out of memory. exiting\n");
+	    exit(1);
+	}
+	pipe.free_queue[i] = i;
+    }
+    pipe.free_head = 0;
+    pipe.num_free = PIPELINE_NUM_BUFFERS;
+    pipe.full_head = 0;
+    pipe.num_full = 0;
+    pipe.eof = 0;
+    pipe.aborted = 0;
+    pipe.error = 0;
+    pipe.lines = 0;
+    if (!progress) {
+	init_scan_progress(&own_progress);
+	progress = &own_progress;
+    }
+    pipe.progress = progress;
+    pipe.num_counters = num_counters;
+    pthread_mutex_init(&pipe.mutex, NULL);
+    pthread_cond_init(&pipe.got_full, NULL);
+    pthread_cond_init(&pipe.got_free, NULL);
+
+    if (pthread_create(&pipe.decoder_thread, NULL, decode_loop,
+		       (void*)&pipe) != 0) {
+	fprintf(stderr, "compressed_count_lines: cannot create thread. "
+			"exiting\n");
+	exit(1);
+    }
+    for (i = 0; i < num_counters; i++) {
+	if (pthread_create(&pipe.counter_threads[i], NULL, count_loop,
+			   (void*)&pipe) != 0) {
+	    fprintf(stderr, "compressed_count_lines: cannot create thread. "
+			    "exiting\n");
+	    exit(1);
+	}
+    }
+
+    /* wait for the pipeline to drain. the cleanup handler joins the  */
+    /* threads - also if we get cancelled while waiting for them.     */
+    pthread_cleanup_push(stop_pipeline, (void*)&pipe);
+    pthread_mutex_lock(&pipe.mutex);
+    pthread_cleanup_push(cleanup_unlock_mutex, (void*)&pipe.mutex);
+    while (!pipe.aborted &&
+	   !(pipe.eof && pipe.num_free == PIPELINE_NUM_BUFFERS))
+	pthread_cond_wait(&pipe.got_free, &pipe.mutex);
+    pthread_cleanup_pop(1);
+    pthread_cleanup_pop(0);
+
+    error = pipe.error;
+    *lines = pipe.lines;
+    stop_pipeline((void*)&pipe);
+
+    if (error) {
+	errno = error;
+	return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef COMPRESSED_COUNT_H
+# define COMPRESSED_COUNT_H
+
+#include "line_scan.h"   /* struct scan_progress                      */
+
+/*
+ * line counting of .Z compressed files, with no temporary file. a
+ * decoder thread decompresses into a ring of fixed-size buffers, while
+ * counting threads count the lines of the buffers already filled. so
+ * decompression overlaps counting, and memory use is bounded by the
+ * ring's size.
+ */
+
+/* size of a single buffer of the ring, and number of buffers in it. */
+#define PIPELINE_BUFFER_SIZE (1024 * 1024)
+#define PIPELINE_NUM_BUFFERS 8
+
+/* the decoder fills a buffer in steps of this size, checking between */
+/* them if the scan was cancelled.                                    */
+#define PIPELINE_DECODE_STEP (64 * 1024)
+
+/*
+ * count the lines of the given .Z file, using 'num_counters' counting
+ * threads, reporting to 'progress' (may be NULL). returns 0 on success,
+ * -1 on error (with errno set - ECANCELED if the scan was cancelled).
+ */
+extern int
+compressed_count_lines(const char* file_name, int num_counters,
+		       struct scan_progress* progress,
+		       unsigned long long* lines);
+
+#endif /* COMPRESSED_COUNT_H */
@@ -0,0 +1,260 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* free()                                    */
+#include <string.h>      /* memset(), strdup()                        */
+#include <errno.h>       /* errno and error codes                     */
+#include <fcntl.h>       /* open()                                    */
+#include <unistd.h>      /* read(), close()                           */
+#include <libgen.h>      /* dirname()                                 */
+#include <poll.h>        /* poll()                                    */
+#include <sys/stat.h>    /* stat(), fstat()                           */
+#include <sys/inotify.h> /* inotify functions and events              */
+
+#include "line_scan.h"       /* struct scan_progress                  */
+#include "parallel_count.h"  /* parallel line counting                */
+#include "follow_count.h"    /* line counting of growing files        */
+
+/* events that may mean the followed file changed. */
+#define FOLLOW_FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | \
+			    IN_DELETE_SELF)
+
+/* events that may mean a new file took the followed one's name. */
+#define FOLLOW_DIR_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+/* inotify state of a followed file. */
+struct follow_watch {
+    int fd;			/* the inotify instance, -1 if none.     */
+    int file_wd;		/* watch of the file, -1 if none.        */
+    int dir_wd;			/* watch of its directory, -1 if none.   */
+};
+
+/*
+ * function open_followed(): start following the file the name refers to.
+ * algorithm: open the file, and remember its identity. nothing of it was
+ *            counted yet. the previously followed file (if any) is
+ *            only closed if the new one could be opened.
+ * input:     state of the followed file.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+static int
+open_followed(struct follow_state* state)
+{
+    struct stat st;
+    int fd = open(state->file_name, O_RDONLY);
+
+    if (fd < 0)
+	return -1;
+    if (fstat(fd, &st) < 0) {
+	int error = errno;
+
+	close(fd);
+	errno = error;
+	return -1;
+    }
+    if (state->fd >= 0)
+	close(state->fd);
+    state->fd = fd;
+    state->dev = st.st_dev;
+    state->ino = st.st_ino;
+    state->offset = 0;
+    state->lines = 0;
+    state->new_lines = 0;
+
+    return 0;
+}
+
+/*
+ * function watch_followed(): (re)start watching the followed file.
+ * algorithm: a watch is on an inode, not a name - so after a rotation,
+ *            drop the old file's watch, and watch the file the name now
+ *            refers to. the directory is watched once, to notice a new
+ *            file being created (or moved) under the name.
+ * input:     state of the followed file, its inotify state.
+ * output:    none. without inotify, does nothing.
+ */
+static void
+watch_followed(struct follow_state* state, struct follow_watch* watch)
+{
+    if (watch->fd < 0)
+	return;
+
+    if (watch->file_wd >= 0)
+	inotify_rm_watch(watch->fd, watch->file_wd);
+    watch->file_wd = inotify_add_watch(watch->fd, state->file_name,
+				       FOLLOW_FILE_EVENTS);
+    if (watch->dir_wd < 0) {
+	char* name = strdup(state->file_name);
+
+	if (name) {
+	    watch->dir_wd = inotify_add_watch(watch->fd, dirname(name),
+					      FOLLOW_DIR_EVENTS);
+	    free(name);
+	}
+    }
+    state->use_inotify = watch->file_wd >= 0;
+}
+
+/*
+ * function wait_for_change(): wait until the followed file may have
+ *                             changed.
+ * algorithm: wait for inotify events, up to FOLLOW_POLL_MS. once they
+ *            come, give the writer FOLLOW_COALESCE_MS more, and read all
+ *            the events queued - however many writes they stand for,
+ *            the caller checks the file once. without inotify, just
+ *            sleep FOLLOW_POLL_MS.
+ * input:     inotify state.
+ * output:    none.
+ */
+static void
+wait_for_change(struct follow_watch* watch)
+{
+    char events[4096]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
+
+    if (watch->fd < 0) {
+	poll(NULL, 0, FOLLOW_POLL_MS);
+	return;
+    }
+
+    pfd.fd = watch->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, FOLLOW_POLL_MS) > 0) {
+	poll(NULL, 0, FOLLOW_COALESCE_MS);
+	while (read(watch->fd, events, sizeof(events)) > 0)
+	    ;
+    }
+}
+
+/*
+ * function count_appended(): count the bytes appended to the file.
+ * input:     state of the followed file, the file's size, number of
+ *            threads, progress of the scan.
+ * output:    0 on success, -1 on error (errno is set - ENODATA if the
+ *            file was truncated while counted).
+ */
+static int
+count_appended(struct follow_state* state, off_t size, int num_threads,
+	       struct scan_progress* progress)
+{
+    unsigned long long lines = 0;
+
+    if (parallel_count_range(state->fd, state->offset, size, num_threads,
+			     progress, &lines) < 0)
+	return -1;
+    state->bytes_scanned += size - state->offset;
+    state->offset = size;
+    state->lines += lines;
+    state->new_lines = lines;
+
+    return 0;
+}
+
+/*
+ * function follow_count_lines(): count the lines of a growing file.
+ * algorithm: loop - check the size of the file we have open. if it
+ *            got smaller, it was truncated: count it from its start.
+ *            if it grew, count just the new bytes, and tell 'func'.
+ *            then check the name still refers to the same file - if
+ *            not, the file was rotated, and its last appends were just
+ *            counted: switch to the new file, and count it from its
+ *            start right away. otherwise wait for the next change. a
+ *            file truncated while its new bytes are counted is counted
+ *            again from its start, too.
+ *            note that a file truncated and then grown past the
+ *            offset we reached, between two checks, looks like a file
+ *            that only grew.
+ * input:     file name, number of threads, progress of the scan (or
+ *            NULL), function to tell about updates, and its data.
+ * output:    -1, with errno set (ECANCELED if the scan was cancelled).
+ */
+int
+follow_count_lines(const char* file_name, int num_threads,
+		   struct scan_progress* progress,
+		   follow_func_t func, void* data)
+{
+    struct follow_state state;
+    struct follow_watch watch;
+    struct scan_progress own_progress;
+    enum follow_event event = FOLLOW_STARTED;
+    int changed = 1;
+    int error = 0;
+
+    if (!progress) {
+	init_scan_progress(&own_progress);
+	progress = &own_progress;
+    }
+    memset(&state, 0, sizeof(state));
+    state.file_name = file_name;
+    state.fd = -1;
+    if (open_followed(&state) < 0)
+	return -1;
+
+    watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    watch.file_wd = -1;
+    watch.dir_wd = -1;
+    watch_followed(&state, &watch);
+
+    while (!error) {
+	struct stat st;
+
+	/* count what was appended to the file we have open. */
+	if (fstat(state.fd, &st) < 0) {
+	    error = errno;
+	    break;
+	}
+	if (st.st_size < state.offset) {
+	    state.offset = 0;
+	    state.lines = 0;
+	    state.new_lines = 0;
+	    event = FOLLOW_TRUNCATED;
+	    changed = 1;
+	}
+	if (st.st_size > state.offset) {
+	    if (count_appended(&state, st.st_size, num_threads,
+			       progress) < 0) {
+		if (errno != ENODATA) {
+		    error = errno;
+		    break;
+		}
+		/* truncated while counted - count it from its start. */
+		state.offset = 0;
+		state.lines = 0;
+		state.new_lines = 0;
+		event = FOLLOW_TRUNCATED;
+		changed = 1;
+		continue;
+	    }
+	    changed = 1;
+	}
+	if (changed) {
+	    func(data, event, &state);
+	    event = FOLLOW_GREW;
+	    changed = 0;
+	}
+
+	/* was the file replaced by a new one? follow it, from its start. */
+	if (stat(file_name, &st) == 0 &&
+	    (st.st_dev != state.dev || st.st_ino != state.ino) &&
+	    open_followed(&state) == 0) {
+	    watch_followed(&state, &watch);
+	    event = FOLLOW_ROTATED;
+	    changed = 1;
+	    continue;
+	}
+
+	if (scan_cancelled(progress)) {
+	    error = ECANCELED;
+	    break;
+	}
+	wait_for_change(&watch);
+	if (scan_cancelled(progress))
+	    error = ECANCELED;
+    }
+
+    if (watch.fd >= 0)
+	close(watch.fd);
+    close(state.fd);
+    errno = error;
+
+    return -1;
+}
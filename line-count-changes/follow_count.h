@@ -0,0 +1,62 @@
+#ifndef FOLLOW_COUNT_H
+# define FOLLOW_COUNT_H
+
+#include <sys/types.h>   /* off_t, dev_t, ino_t                       */
+
+#include "line_scan.h"   /* struct scan_progress                      */
+
+/*
+ * counting the lines of a growing (append-only) file, like a log. the
+ * file is counted once, and then only the bytes appended to it since -
+ * so the cost is proportional to the new data, not to the file's size.
+ * appends are waited for with inotify, or by polling, if inotify is not
+ * available. a file that got shorter (truncated) is counted again from
+ * its start, and a file replaced by a new one (rotated) - once the rest
+ * of the old one is counted - is followed from the new one's start.
+ */
+
+/* longest wait for an event, in milliseconds - the polling interval    */
+/* without inotify, and the most a cancel request takes to be noticed. */
+#define FOLLOW_POLL_MS 200
+
+/* once a change is noticed, changes coming within this many milliseconds */
+/* are counted with it - so a burst of writes makes a single update.       */
+#define FOLLOW_COALESCE_MS 20
+
+/* what happened to a followed file. */
+enum follow_event {
+    FOLLOW_STARTED,		/* the file was counted for the first time. */
+    FOLLOW_GREW,		/* bytes were appended, and counted.        */
+    FOLLOW_TRUNCATED,		/* it got shorter - counted from its start. */
+    FOLLOW_ROTATED		/* it was replaced - the new one counted.   */
+};
+
+/* the state of a followed file. */
+struct follow_state {
+    const char* file_name;	/* name of the followed file.            */
+    int fd;			/* the file currently followed.          */
+    dev_t dev;			/* its device and inode, to notice when  */
+    ino_t ino;			/* the name refers to another file.      */
+    off_t offset;		/* bytes counted so far.                 */
+    unsigned long long lines;	/* lines counted so far.                 */
+    unsigned long long new_lines; /* lines the last update added.        */
+    unsigned long long bytes_scanned; /* bytes scanned since started.    */
+    int use_inotify;		/* waiting with inotify, not polling?    */
+};
+
+/* a function told about each update - called on the following thread. */
+typedef void (*follow_func_t)(void* data, enum follow_event event,
+			      const struct follow_state* state);
+
+/*
+ * follow the given file, counting its lines with (up to) 'num_threads'
+ * threads, and calling 'func' (with 'data') on each update, until the
+ * scan gets cancelled through 'progress'. returns -1, with errno set to
+ * ECANCELED when cancelled, or to the error that stopped it.
+ */
+extern int
+follow_count_lines(const char* file_name, int num_threads,
+		   struct scan_progress* progress,
+		   follow_func_t func, void* data);
+
+#endif /* FOLLOW_COUNT_H */
@@ -0,0 +1,238 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* exit(), atoi()                            */
+#include <string.h>      /* strlen()                                  */
+#include <time.h>        /* clock_gettime()                           */
+
+#include "line_scan.h"       /* line scanning functions and structs   */
+#include "parallel_count.h"  /* parallel line counting                */
+#include "pattern_scan.h"    /* delimiter, substring and 'wc' counting */
+
+/* default number of timed runs of each kernel - the best one is shown. */
+#define NUM_RUNS 5
+
+/* get the current time, in seconds. */
+static double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* count lines the way line-count.c originally did, one getc() at a time. */
+static unsigned long long
+count_lines_getc(const char* file_name)
+{
+    FILE* f = fopen(file_name, "r");
+    unsigned long long wc = 0;
+    int c;
+
+    if (!f) {
+	perror("fopen");
+	exit(1);
+    }
+    while ((c = getc(f)) != EOF) {
+	if (c == '\n')
+	    wc++;
+    }
+    fclose(f);
+
+    return wc;
+}
+
+/* print one result line. */
+static void
+report(const char* name, unsigned long long lines, unsigned long long expected,
+       size_t size, double elapsed)
+{
+    printf("%-18s %12llu lines  %8.3f sec  %8.2f GB/s%s\n",
+	   name, lines, elapsed, size / elapsed / 1e9,
+	   lines == expected ? "" : "  MISMATCH");
+}
+
+/*
+ * function count_pattern_once(): count a pattern in a whole buffer.
+ * input:     pattern, buffer, its length.
+ * output:    matches found - for PATTERN_WC, lines plus words.
+ */
+static unsigned long long
+count_pattern_once(const struct pattern* pattern, const char* buf, size_t len)
+{
+    struct pattern_counts counts = { 0, 0, 0, 0 };
+    size_t skip = 0;
+    int after_space = 1;
+
+    switch (pattern->mode) {
+	case PATTERN_SET:
+	    return count_byte_set(pattern, buf, len);
+	case PATTERN_STRING:
+	    return count_string(pattern, buf, len, len, &skip);
+	default:
+	    count_words(buf, len, &after_space, &counts);
+	    return counts.lines + counts.words;
+    }
+}
+
+/*
+ * function bench_patterns(): time the pattern kernels.
+ * algorithm: count each pattern with the portable kernels (the
+ *            reference), then with the best kernels, and compare both
+ *            the results and the speed with plain newline counting.
+ * input:     mapped file, number of runs.
+ * output:    1 if a kernel's result differs from the reference, 0 if not.
+ */
+static int
+bench_patterns(struct mapped_file* map, int num_runs)
+{
+    static const struct {
+	enum pattern_mode mode;
+	const char* bytes;
+	const char* name;
+    } patterns[] = {
+	{ PATTERN_SET,    "\n",     "set \\n" },
+	{ PATTERN_SET,    ",",      "set ," },
+	{ PATTERN_SET,    " \t,;",  "set 4" },
+	{ PATTERN_SET,    "\t,;|:!?", "set 8" },
+	{ PATTERN_STRING, "\r\n",   "str \\r\\n" },
+	{ PATTERN_STRING, "ab",     "str ab" },
+	{ PATTERN_STRING, "the end", "str 'the end'" },
+	{ PATTERN_WC,     "",       "wc" }
+    };
+    int mismatch = 0;
+    unsigned int p;
+
+    for (p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+	struct pattern pattern;
+	unsigned long long expected, found = 0;
+	double best = 0, start;
+	char name[32];
+	int run;
+
+	init_pattern(&pattern, patterns[p].mode, patterns[p].bytes,
+		     strlen(patterns[p].bytes));
+	set_scan_kernel(SCAN_KERNEL_SCALAR);
+	start = now_sec();
+	expected = count_pattern_once(&pattern, map->data, map->size);
+	snprintf(name, sizeof(name), "%s scalar", patterns[p].name);
+	report(name, expected, expected, map->size, now_sec() - start);
+
+	set_scan_kernel(SCAN_KERNEL_AUTO);
+	for (run = 0; run < num_runs; run++) {
+	    double elapsed;
+
+	    start = now_sec();
+	    found = count_pattern_once(&pattern, map->data, map->size);
+	    elapsed = now_sec() - start;
+	    if (run == 0 || elapsed < best)
+		best = elapsed;
+	}
+	snprintf(name, sizeof(name), "%s %s", patterns[p].name,
+		 scan_kernel_name());
+	report(name, found, expected, map->size, best);
+	if (found != expected)
+	    mismatch = 1;
+    }
+
+    return mismatch;
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    static const struct {
+	enum scan_kernel kernel;
+	const char* name;
+    } kernels[] = {
+	{ SCAN_KERNEL_SCALAR, "scalar" },
+	{ SCAN_KERNEL_SSE2,   "sse2" },
+	{ SCAN_KERNEL_AVX2,   "avx2" }
+    };
+    struct mapped_file map;
+    unsigned long long expected;
+    double start;
+    int num_runs;
+    int mismatch = 0;
+    unsigned int k;
+
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s file [num_runs]\n", argv[0]);
+	exit(1);
+    }
+    num_runs = argc > 2 ? atoi(argv[2]) : NUM_RUNS;
+    if (num_runs < 1)
+	num_runs = 1;
+
+    if (map_file(argv[1], &map) < 0) {
+	perror("map_file");
+	exit(1);
+    }
+    printf("file '%s', %zu bytes\n", argv[1], map.size);
+
+    /* the byte-wise path - also the reference for the kernels' results. */
+    start = now_sec();
+    expected = count_lines_getc(argv[1]);
+    report("getc", expected, expected, map.size, now_sec() - start);
+
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+	unsigned long long lines = 0;
+	double best = 0;
+	int run;
+
+	if (set_scan_kernel(kernels[k].kernel) < 0) {
+	    printf("%-8s not supported by this CPU\n", kernels[k].name);
+	    continue;
+	}
+	for (run = 0; run < num_runs; run++) {
+	    double elapsed;
+
+	    start = now_sec();
+	    lines = count_newlines(map.data, map.size);
+	    elapsed = now_sec() - start;
+	    if (run == 0 || elapsed < best)
+		best = elapsed;
+	}
+	report(kernels[k].name, lines, expected, map.size, best);
+	if (lines != expected)
+	    mismatch = 1;
+    }
+
+    /* the pattern kernels - scalar first (the reference), then the best. */
+    if (bench_patterns(&map, num_runs))
+	mismatch = 1;
+
+    unmap_file(&map);
+
+    /* parallel scaling, from one thread up to the number of CPUs. */
+    set_scan_kernel(SCAN_KERNEL_AUTO);
+    for (k = 1; ; k *= 2) {
+	unsigned long long lines = 0;
+	double best = 0;
+	char name[16];
+	int run;
+
+	if ((int)k > default_num_threads())
+	    k = default_num_threads();
+	for (run = 0; run < num_runs; run++) {
+	    double elapsed;
+
+	    start = now_sec();
+	    if (parallel_count_lines(argv[1], k, NULL, &lines) < 0) {
+		perror("parallel_count_lines");
+		exit(1);
+	    }
+	    elapsed = now_sec() - start;
+	    if (run == 0 || elapsed < best)
+		best = elapsed;
+	}
+	snprintf(name, sizeof(name), "%ut", k);
+	report(name, lines, expected, map.size, best);
+	if (lines != expected)
+	    mismatch = 1;
+	if ((int)k >= default_num_threads())
+	    break;
+    }
+
+    return mismatch;
+}
@@ -0,0 +1,444 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <string.h>      /* memcmp(), memchr(), strlen()              */
+#include <errno.h>       /* errno and error codes                     */
+#include <fcntl.h>       /* open()                                    */
+#include <unistd.h>      /* pread(), write(), close()                 */
+#include <sys/stat.h>    /* stat(), fstat()                           */
+#include <sys/mman.h>    /* mmap(), munmap()                          */
+
+#include "line_scan.h"       /* newline counting kernels              */
+#include "parallel_count.h"  /* parallel line counting and sampling   */
+#include "line_index.h"      /* line offset index functions           */
+
+/* size of the reads that scan from a sample to the line looked up. */
+#define LINE_INDEX_SCAN_SIZE (64 * 1024)
+
+/* get the name of a file's index file, in a malloc()ed string. */
+static char*
+index_file_name(const char* file_name)
+{
+    size_t len = strlen(file_name);
+    char* name = (char*)malloc(len + sizeof(LINE_INDEX_SUFFIX));
+
+    if (!name) {
+	fprintf(stderr, "index_file_name: out of memory. exiting\n");
+	exit(1);
+    }
+    memcpy(name, file_name, len);
+    memcpy(name + len, LINE_INDEX_SUFFIX, sizeof(LINE_INDEX_SUFFIX));
+
+    return name;
+}
+
+/* get the size of an index file with the given number of samples. */
+static size_t
+index_file_size(unsigned int group_size, unsigned long long num_samples)
+{
+    unsigned long long num_groups = (num_samples + group_size - 1) / group_size;
+
+    return sizeof(struct line_index_header) + num_groups * sizeof(uint64_t) +
+	   num_samples * (sizeof(uint32_t) + sizeof(uint16_t));
+}
+
+/* check if a file is the one an index was made for. */
+static int
+index_matches(const struct line_index_header* header, const struct stat* st)
+{
+    return header->file_size == (uint64_t)st->st_size &&
+	   header->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+	   header->mtime_nsec == (int64_t)st->st_mtim.tv_nsec;
+}
+
+/*
+ * function choose_group_size(): choose how many samples share a base.
+ * algorithm: start with the largest groups, and halve them until the
+ *            samples of each group are within 4GB of its first one, so
+ *            every delta fits in 32 bits. groups of one sample always
+ *            do. offsets only grow, so a group's span is its last
+ *            offset minus its first.
+ * input:     offsets of the samples, their number.
+ * output:    the group size.
+ */
+static unsigned int
+choose_group_size(const off_t* offsets, size_t num_samples)
+{
+    unsigned int group_size = LINE_INDEX_MAX_GROUP;
+
+    while (group_size > 1) {
+	size_t i;
+
+	for (i = 0; i < num_samples; i += group_size) {
+	    size_t last = (num_samples - i < group_size ?
+			   num_samples : i + group_size) - 1;
+
+	    if (offsets[last] - offsets[i] > (off_t)UINT32_MAX)
+		break;
+	}
+	if (i >= num_samples)
+	    break;
+	group_size /= 2;
+    }
+
+    return group_size;
+}
+
+/*
+ * function write_line_index(): write a file's index file.
+ * algorithm: for every multiple of K, take the last line start sampled
+ *            at or before it, and its distance (the shift). encode the
+ *            offsets as bases and deltas, and write it all to a
+ *            temporary file that is then renamed over the index file -
+ *            so readers see either the old index, or the whole new one.
+ * input:     file name, its status when counted, K, its newlines count,
+ *            the line starts sampled, their number.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+static int
+write_line_index(const char* file_name, const struct stat* st,
+		 unsigned int sample_every, unsigned long long lines,
+		 const struct line_sample* samples, size_t num_samples)
+{
+    struct line_index_header* header;
+    size_t num_entries = lines / sample_every + 1;
+    off_t* offsets;
+    unsigned int group_size;
+    size_t num_groups;
+    uint64_t* bases;
+    uint32_t* deltas;
+    uint16_t* shifts;
+    char* buf;
+    size_t size, done;
+    char* name;
+    char* temp_name;
+    size_t i, j;
+    int fd;
+    int error = 0;
+
+    /* the sample each entry starts from. */
+    offsets = (off_t*)malloc(num_entries * sizeof(off_t));
+    shifts = (uint16_t*)malloc(num_entries * sizeof(uint16_t));
+    if (!offsets || !shifts) {
+	fprintf(stderr, "write_line_index: out of memory. exiting\n");
+	exit(1);
+    }
+    for (i = 0, j = 0; i < num_entries; i++) {
+	unsigned long long line = (unsigned long long)i * sample_every;
+
+	while (j + 1 < num_samples && samples[j + 1].line <= line)
+	    j++;
+	offsets[i] = samples[j].offset;
+	shifts[i] = (uint16_t)(line - samples[j].line);
+    }
+
+    /* lay the index file out in memory. */
+    group_size = choose_group_size(offsets, num_entries);
+    num_groups = (num_entries + group_size - 1) / group_size;
+    size = index_file_size(group_size, num_entries);
+    buf = (char*)calloc(1, size);
+    if (!buf) {
+	fprintf(stderr, "write_line_index: out of memory. exiting\n");
+	exit(1);
+    }
+    header = (struct line_index_header*)buf;
+    memcpy(header->magic, LINE_INDEX_MAGIC, sizeof(header->magic));
+    header->sample_every = sample_every;
+    header->group_size = group_size;
+    header->file_size = st->st_size;
+    header->mtime_sec = st->st_mtim.tv_sec;
+    header->mtime_nsec = st->st_mtim.tv_nsec;
+    header->lines = lines;
+    header->num_samples = num_entries;
+    bases = (uint64_t*)(header + 1);
+    deltas = (uint32_t*)(bases + num_groups);
+    for (i = 0; i < num_entries; i++) {
+	if (i % group_size == 0)
+	    bases[i / group_size] = offsets[i];
+	deltas[i] = (uint32_t)(offsets[i] - offsets[i - i % group_size]);
+    }
+    memcpy(deltas + num_entries, shifts, num_entries * sizeof(uint16_t));
+    free(offsets);
+    free(shifts);
+
+    /* and write it out. */
+    name = index_file_name(file_name);
+    temp_name = (char*)malloc(strlen(name) + sizeof(".XXXXXX"));
+    if (!temp_name) {
+	fprintf(stderr, "write_line_index: out of memory. exiting\n");
+	exit(1);
+    }
+    sprintf(temp_name, "%s.XXXXXX", name);
+    fd = mkstemp(temp_name);
+    if (fd < 0) {
+	error = errno;
+	goto out;
+    }
+    fchmod(fd, 0644);
+    for (done = 0; done < size; ) {
+	ssize_t res = write(fd, buf + done, size - done);
+
+	if (res < 0) {
+	    if (errno == EINTR)
+		continue;
+	    error = errno;
+	    break;
+	}
+	done += res;
+    }
+    if (close(fd) < 0 && !error)
+	error = errno;
+    if (!error && rename(temp_name, name) < 0)
+	error = errno;
+    if (error)
+	unlink(temp_name);
+
+out:
+    free(temp_name);
+    free(name);
+    free(buf);
+    if (error) {
+	errno = error;
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * function build_line_index(): count a file's lines, and index them.
+ * algorithm: count the lines in parallel, sampling the line starts in
+ *            the same pass, and write the index. the file's status is
+ *            taken before and after counting - if it changed in
+ *            between, the samples may not match it, and no index is
+ *            written.
+ * input:     file name, number of threads, K, progress of the scan (or
+ *            NULL), where to place the count.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+int
+build_line_index(const char* file_name, int num_threads,
+		 unsigned int sample_every, struct scan_progress* progress,
+		 unsigned long long* lines)
+{
+    struct stat before, after;
+    struct line_sample* samples;
+    size_t num_samples;
+    int rc;
+
+    if (sample_every < 1 || sample_every > LINE_INDEX_MAX_SAMPLE) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (stat(file_name, &before) < 0)
+	return -1;
+    if (!S_ISREG(before.st_mode)) {
+	errno = ENODEV;
+	return -1;
+    }
+
+    if (parallel_sample_lines(file_name, num_threads, sample_every, progress,
+			      lines, &samples, &num_samples) < 0)
+	return -1;
+
+    if (stat(file_name, &after) < 0) {
+	rc = -1;
+    }
+    else if (before.st_size != after.st_size ||
+	     before.st_mtim.tv_sec != after.st_mtim.tv_sec ||
+	     before.st_mtim.tv_nsec != after.st_mtim.tv_nsec) {
+	errno = ESTALE;
+	rc = -1;
+    }
+    else {
+	rc = write_line_index(file_name, &after, sample_every, *lines,
+			      samples, num_samples);
+    }
+    free(samples);
+
+    return rc;
+}
+
+/*
+ * function index_count_lines(): count a file's lines, using its index.
+ * algorithm: if the file has an up to date index, its header holds the
+ *            count. otherwise (no index, a stale or a bad one), count
+ *            the lines and write a new index.
+ * input:     file name, number of threads, progress of the scan (or
+ *            NULL), where to place the count, and whether an index was
+ *            found.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+int
+index_count_lines(const char* file_name, int num_threads,
+		  struct scan_progress* progress, unsigned long long* lines,
+		  int* indexed)
+{
+    struct line_index index;
+
+    if (open_line_index(file_name, &index) == 0) {
+	*lines = index.lines;
+	*indexed = 1;
+	close_line_index(&index);
+	return 0;
+    }
+    if (errno != ENOENT && errno != ESTALE && errno != EINVAL)
+	return -1;
+
+    *indexed = 0;
+    return build_line_index(file_name, num_threads, LINE_INDEX_DEFAULT_SAMPLE,
+			    progress, lines);
+}
+
+/*
+ * function open_line_index(): open a file's index, for lookups.
+ * algorithm: map the index file, check its header is sane and its size
+ *            matches it, and that the file's size and modification time
+ *            are the ones it was indexed with. keep the file open, for
+ *            the scans from the samples.
+ * input:     file name, index structure to fill in.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+int
+open_line_index(const char* file_name, struct line_index* index)
+{
+    const struct line_index_header* header;
+    struct stat st, index_st;
+    char* name = index_file_name(file_name);
+    int index_fd = -1;
+    int error;
+
+    index->map = MAP_FAILED;
+    index->fd = open(file_name, O_RDONLY);
+    if (index->fd < 0 || fstat(index->fd, &st) < 0)
+	goto error;
+    index_fd = open(name, O_RDONLY);
+    if (index_fd < 0 || fstat(index_fd, &index_st) < 0)
+	goto error;
+    if (index_st.st_size < (off_t)sizeof(struct line_index_header)) {
+	errno = EINVAL;
+	goto error;
+    }
+    index->map_size = index_st.st_size;
+    index->map = mmap(NULL, index->map_size, PROT_READ, MAP_SHARED,
+		      index_fd, 0);
+    if (index->map == MAP_FAILED)
+	goto error;
+    close(index_fd);
+    index_fd = -1;
+
+    header = (const struct line_index_header*)index->map;
+    if (memcmp(header->magic, LINE_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+	header->sample_every < 1 ||
+	header->sample_every > LINE_INDEX_MAX_SAMPLE ||
+	header->group_size < 1 || header->group_size > LINE_INDEX_MAX_GROUP ||
+	header->num_samples != header->lines / header->sample_every + 1 ||
+	header->num_samples > index->map_size / sizeof(uint16_t) ||
+	index_file_size(header->group_size, header->num_samples) !=
+	index->map_size) {
+	errno = EINVAL;
+	goto error;
+    }
+    if (!index_matches(header, &st)) {
+	errno = ESTALE;
+	goto error;
+    }
+
+    index->lines = header->lines;
+    index->sample_every = header->sample_every;
+    index->group_size = header->group_size;
+    index->bases = (const uint64_t*)(header + 1);
+    index->deltas = (const uint32_t*)
+		    (index->bases + (header->num_samples + header->group_size - 1) /
+				    header->group_size);
+    index->shifts = (const uint16_t*)(index->deltas + header->num_samples);
+    free(name);
+
+    return 0;
+
+error:
+    error = errno;
+    if (index->map != MAP_FAILED)
+	munmap(index->map, index->map_size);
+    if (index_fd >= 0)
+	close(index_fd);
+    if (index->fd >= 0)
+	close(index->fd);
+    index->fd = -1;
+    index->map = NULL;
+    free(name);
+    errno = error;
+
+    return -1;
+}
+
+/*
+ * function line_index_offset(): find where a line starts.
+ * algorithm: the sample of line N is N / K - found at its group's base
+ *            plus its delta. it starts the line its shift lines before
+ *            (N / K) * K, so skip that many newlines plus N % K from it:
+ *            read the file from there, counting whole buffers of
+ *            newlines with the newline kernel, and walking the last one
+ *            with memchr().
+ * input:     the index, line number, where to place the line's offset.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+int
+line_index_offset(const struct line_index* index, unsigned long long line,
+		  off_t* offset)
+{
+    char buf[LINE_INDEX_SCAN_SIZE];
+    unsigned long long sample = line / index->sample_every;
+    unsigned long long skip;
+    off_t pos;
+
+    if (line > index->lines) {
+	errno = ERANGE;
+	return -1;
+    }
+
+    pos = index->bases[sample / index->group_size] + index->deltas[sample];
+    skip = line % index->sample_every + index->shifts[sample];
+    while (skip > 0) {
+	ssize_t len = pread(index->fd, buf, sizeof(buf), pos);
+	unsigned long long found;
+	const char* p = buf;
+
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (len == 0) {		/* the file got shorter since indexed. */
+	    errno = ESTALE;
+	    return -1;
+	}
+	found = count_newlines(buf, len);
+	if (found < skip) {
+	    skip -= found;
+	    pos += len;
+	    continue;
+	}
+	for (; skip > 0; skip--)
+	    p = (const char*)memchr(p, '\n', buf + len - p) + 1;
+	pos += p - buf;
+    }
+    *offset = pos;
+
+    return 0;
+}
+
+/*
+ * function close_line_index(): undo open_line_index().
+ * input:     the index.
+ * output:    none.
+ */
+void
+close_line_index(struct line_index* index)
+{
+    if (index->map)
+	munmap(index->map, index->map_size);
+    if (index->fd >= 0)
+	close(index->fd);
+    index->map = NULL;
+    index->fd = -1;
+}
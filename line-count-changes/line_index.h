@@ -0,0 +1,112 @@
+#ifndef LINE_INDEX_H
+# define LINE_INDEX_H
+
+#include <stdint.h>      /* fixed-size integer types                  */
+#include <sys/types.h>   /* off_t                                     */
+
+#include "line_scan.h"   /* struct scan_progress                      */
+
+/*
+ * a persistent index of line offsets, kept next to the file it indexes
+ * (in "<file>.lidx"), so jumping to a line does not need a full scan.
+ * the index samples the start of every K-th line - it is built in the
+ * same parallel pass that counts the lines - and finding line N takes
+ * one array lookup, plus a scan of less than 2K lines from the sample.
+ *
+ * the index file is mapped, and used as it is: a header, then the
+ * sample offsets, delta encoded - a 64 bit base for every group of
+ * samples, followed by a 32 bit delta (from its group's base) and a 16
+ * bit shift (see below) for every sample. all in the host's byte order.
+ */
+
+/* suffix of an index file's name. */
+#define LINE_INDEX_SUFFIX ".lidx"
+
+/* default, and largest, number of lines between samples. */
+#define LINE_INDEX_DEFAULT_SAMPLE 1024
+#define LINE_INDEX_MAX_SAMPLE 65536
+
+/* largest number of samples sharing a base - groups are made smaller */
+/* when their samples span more than 4GB.                            */
+#define LINE_INDEX_MAX_GROUP 1024
+
+/* "LINEIDX" and a version byte. */
+#define LINE_INDEX_MAGIC "LINEIDX1"
+
+/* the header of an index file. */
+struct line_index_header {
+    char magic[8];		/* LINE_INDEX_MAGIC.                      */
+    uint32_t sample_every;	/* K - lines between samples.             */
+    uint32_t group_size;	/* samples sharing a base.                */
+    uint64_t file_size;		/* size of the indexed file...            */
+    int64_t mtime_sec;		/* ...and its modification time, when it  */
+    int64_t mtime_nsec;		/* was indexed. the index is stale if     */
+				/* either changed.                        */
+    uint64_t lines;		/* newlines in the file.                  */
+    uint64_t num_samples;	/* lines / K + 1.                         */
+    uint64_t reserved;		/* pads the header to 64 bytes.           */
+};
+
+/*
+ * an index opened for lookups. sample 'i' is the start of line i * K -
+ * or, when the index was built in parallel chunks, of a line up to K
+ * lines before it. its shift tells how many lines before.
+ */
+struct line_index {
+    int fd;				/* the indexed file.              */
+    void* map;				/* the mapped index file.         */
+    size_t map_size;			/* its size.                      */
+    unsigned long long lines;		/* newlines in the indexed file.  */
+    unsigned int sample_every;		/* K.                             */
+    unsigned int group_size;		/* samples sharing a base.        */
+    const uint64_t* bases;		/* base offset of each group.     */
+    const uint32_t* deltas;		/* offset of each sample - base.  */
+    const uint16_t* shifts;		/* i * K - line of sample 'i'.    */
+};
+
+/*
+ * count the lines of the given file with (up to) 'num_threads' threads,
+ * and write its index, sampling every 'sample_every' lines. reports to
+ * 'progress' (may be NULL). returns 0 on success, -1 on error (with
+ * errno set - ECANCELED if the scan was cancelled, ESTALE if the file
+ * changed while being indexed).
+ */
+extern int
+build_line_index(const char* file_name, int num_threads,
+		 unsigned int sample_every, struct scan_progress* progress,
+		 unsigned long long* lines);
+
+/*
+ * count the lines of the given file - taking the count from its index,
+ * if it is up to date, or counting them and writing the index if not.
+ * '*indexed' is set to 1 if an up to date index was found. returns 0 on
+ * success, -1 on error (with errno set).
+ */
+extern int
+index_count_lines(const char* file_name, int num_threads,
+		  struct scan_progress* progress, unsigned long long* lines,
+		  int* indexed);
+
+/*
+ * open the index of the given file, for lookups. returns 0 on success,
+ * -1 on error (with errno set - ENOENT if there is no index, ESTALE if
+ * the file changed since it was indexed, EINVAL if the index is bad).
+ */
+extern int
+open_line_index(const char* file_name, struct line_index* index);
+
+/*
+ * find the offset of the given line (lines are numbered from 0). the
+ * line after the last newline starts at the file's size. returns 0 on
+ * success, -1 on error (with errno set - ERANGE if the file has no such
+ * line).
+ */
+extern int
+line_index_offset(const struct line_index* index, unsigned long long line,
+		  off_t* offset);
+
+/* close an index opened by open_line_index(). */
+extern void
+close_line_index(struct line_index* index);
+
+#endif /* LINE_INDEX_H */
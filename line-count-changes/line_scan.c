@@ -0,0 +1,372 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <pthread.h>     /* pthread_once()                            */
+#include <string.h>      /* memcpy()                                  */
+#include <stdint.h>      /* fixed-size integer types                  */
+#include <errno.h>       /* errno and error codes                     */
+#include <fcntl.h>       /* open()                                    */
+#include <unistd.h>      /* close()                                   */
+#include <sys/stat.h>    /* fstat()                                   */
+#include <sys/mman.h>    /* mmap(), madvise()                         */
+
+#if defined(__x86_64__)
+#include <immintrin.h>   /* SSE2 and AVX2 intrinsics                  */
+#endif /* __x86_64__ */
+
+#include "line_scan.h"   /* line scanning functions and structs       */
+
+/* a kernel counting newline characters in a buffer. */
+typedef unsigned long long (*scan_func_t)(const char* buf, size_t len);
+
+/*
+ * function count_newlines_scalar(): portable newline counting kernel.
+ * algorithm: XOR 8 bytes at a time with a word full of newlines, so
+ *            newline bytes become zero, then count the zero bytes using
+ *            bit tricks that are exact (no false positives from borrows).
+ * input:     buffer, its length.
+ * output:    number of newline characters in the buffer.
+ */
+static unsigned long long
+count_newlines_scalar(const char* buf, size_t len)
+{
+    const uint64_t newlines = 0x0a0a0a0a0a0a0a0aULL;
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+    unsigned long long count = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+	uint64_t word, t;
+
+	memcpy(&word, buf + i, 8);
+	word ^= newlines;
+	/* high bit of each byte of 't' is set iff that byte is zero. */
+	t = (word & low7) + low7;
+	t = ~(t | word | low7);
+	count += __builtin_popcountll(t);
+    }
+    for (; i < len; i++) {
+	if (buf[i] == '\n')
+	    count++;
+    }
+
+    return count;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * function count_newlines_sse2(): SSE2 newline counting kernel.
+ * algorithm: compare 16 bytes at a time with newlines. each match is
+ *            -1 in its byte, so subtracting the comparison result counts
+ *            matches per byte lane. every 255 rounds (before a lane may
+ *            overflow), sum the lanes with 'sad' into 64 bit totals.
+ * input:     buffer, its length.
+ * output:    number of newline characters in the buffer.
+ */
+static unsigned long long
+count_newlines_sse2(const char* buf, size_t len)
+{
+    const __m128i newlines = _mm_set1_epi8('\n');
+    unsigned long long count = 0;
+    size_t i = 0;
+
+    while (len - i >= 16) {
+	__m128i acc = _mm_setzero_si128();
+	__m128i sums;
+	size_t rounds = (len - i) / 16;
+
+	if (rounds > 255)
+	    rounds = 255;
+	for (; rounds > 0; rounds--, i += 16) {
+	    __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+
+	    acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, newlines));
+	}
+	sums = _mm_sad_epu8(acc, _mm_setzero_si128());
+	count += _mm_cvtsi128_si64(sums) +
+		 _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+
+    return count + count_newlines_scalar(buf + i, len - i);
+}
+
+/*
+ * function count_newlines_avx2(): AVX2 newline counting kernel.
+ * algorithm: same as the SSE2 kernel, 32 bytes at a time.
+ * input:     buffer, its length.
+ * output:    number of newline characters in the buffer.
+ */
+__attribute__ ((target ("avx2")))
+static unsigned long long
+count_newlines_avx2(const char* buf, size_t len)
+{
+    const __m256i newlines = _mm256_set1_epi8('\n');
+    unsigned long long count = 0;
+    size_t i = 0;
+
+    while (len - i >= 32) {
+	__m256i acc = _mm256_setzero_si256();
+	__m256i sums;
+	size_t rounds = (len - i) / 32;
+
+	if (rounds > 255)
+	    rounds = 255;
+	for (; rounds > 0; rounds--, i += 32) {
+	    __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+
+	    acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, newlines));
+	}
+	sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+	count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+		 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+
+    return count + count_newlines_scalar(buf + i, len - i);
+}
+
+#endif /* __x86_64__ */
+
+/* the kernel in use, and its name. chosen on first use. */
+static scan_func_t scan_func = NULL;
+static const char* scan_name = NULL;
+static enum scan_kernel scan_kernel = SCAN_KERNEL_AUTO;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+/* pick the best kernel the CPU supports. */
+static void
+choose_scan_kernel(void)
+{
+    if (set_scan_kernel(SCAN_KERNEL_AVX2) == 0)
+	return;
+    if (set_scan_kernel(SCAN_KERNEL_SSE2) == 0)
+	return;
+    set_scan_kernel(SCAN_KERNEL_SCALAR);
+}
+
+/*
+ * function set_scan_kernel(): choose the newline counting kernel.
+ * algorithm: checks the CPU supports the kernel, using the CPUID based
+ *            detection of the compiler's runtime.
+ * input:     kernel to use.
+ * output:    0 on success, -1 if the kernel is not supported.
+ */
+int
+set_scan_kernel(enum scan_kernel kernel)
+{
+    switch (kernel) {
+	case SCAN_KERNEL_AUTO:
+	    choose_scan_kernel();
+	    return 0;
+	case SCAN_KERNEL_SCALAR:
+	    scan_func = count_newlines_scalar;
+	    scan_name = "scalar";
+	    scan_kernel = kernel;
+	    return 0;
+#if defined(__x86_64__)
+	case SCAN_KERNEL_SSE2:
+	    __builtin_cpu_init();
+	    if (!__builtin_cpu_supports("sse2"))
+		return -1;
+	    scan_func = count_newlines_sse2;
+	    scan_name = "sse2";
+	    scan_kernel = kernel;
+	    return 0;
+	case SCAN_KERNEL_AVX2:
+	    __builtin_cpu_init();
+	    if (!__builtin_cpu_supports("avx2"))
+		return -1;
+	    scan_func = count_newlines_avx2;
+	    scan_name = "avx2";
+	    scan_kernel = kernel;
+	    return 0;
+#endif /* __x86_64__ */
+	default:
+	    return -1;
+    }
+}
+
+/* make sure a kernel was chosen. */
+static void
+init_scan_kernel(void)
+{
+    if (!scan_func)
+	choose_scan_kernel();
+}
+
+/*
+ * function count_newlines(): count newline characters in a buffer.
+ * input:     buffer, its length.
+ * output:    number of newline characters in the buffer.
+ */
+unsigned long long
+count_newlines(const char* buf, size_t len)
+{
+    pthread_once(&scan_once, init_scan_kernel);
+    return scan_func(buf, len);
+}
+
+/*
+ * function count_newlines_blocks(): count newlines, a block at a time.
+ * algorithm: before each block, check if the scan was cancelled. after
+ *            it, publish the block's bytes and lines, so watchers see
+ *            the scan advance. the kernel is chosen once, up front.
+ * input:     buffer, its length, progress of the scan, where to add the
+ *            count.
+ * output:    0 if the whole buffer was counted, -1 if cancelled.
+ */
+int
+count_newlines_blocks(const char* buf, size_t len,
+		      struct scan_progress* progress,
+		      unsigned long long* lines)
+{
+    size_t pos;
+
+    pthread_once(&scan_once, init_scan_kernel);
+    for (pos = 0; pos < len; pos += SCAN_BLOCK_SIZE) {
+	size_t block = len - pos < SCAN_BLOCK_SIZE ?
+		       len - pos : SCAN_BLOCK_SIZE;
+	unsigned long long block_lines;
+
+	if (scan_cancelled(progress))
+	    return -1;
+	block_lines = scan_func(buf + pos, block);
+	*lines += block_lines;
+	add_scan_progress(progress, block, block_lines);
+    }
+
+    return 0;
+}
+
+/* reset the progress of a scan, before starting it. */
+void
+init_scan_progress(struct scan_progress* progress)
+{
+    progress->cancelled = 0;
+    progress->bytes = 0;
+    progress->lines = 0;
+}
+
+/* ask a scan to stop. safe to call from any thread. */
+void
+cancel_scan(struct scan_progress* progress)
+{
+    __atomic_store_n(&progress->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+/* check if a scan was asked to stop. */
+int
+scan_cancelled(struct scan_progress* progress)
+{
+    return __atomic_load_n(&progress->cancelled, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * function add_scan_progress(): publish the progress of a scan.
+ * algorithm: the counters are only statistics - nothing else is ordered
+ *            by them - so relaxed atomic additions are enough.
+ * input:     progress of the scan, bytes and lines to add.
+ * output:    none.
+ */
+void
+add_scan_progress(struct scan_progress* progress,
+		  unsigned long long bytes, unsigned long long lines)
+{
+    __atomic_fetch_add(&progress->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&progress->lines, lines, __ATOMIC_RELAXED);
+}
+
+/* read the progress counters. */
+unsigned long long
+scan_progress_bytes(struct scan_progress* progress)
+{
+    return __atomic_load_n(&progress->bytes, __ATOMIC_RELAXED);
+}
+
+unsigned long long
+scan_progress_lines(struct scan_progress* progress)
+{
+    return __atomic_load_n(&progress->lines, __ATOMIC_RELAXED);
+}
+
+/* get the name of the kernel count_newlines() currently uses. */
+const char*
+scan_kernel_name(void)
+{
+    pthread_once(&scan_once, init_scan_kernel);
+    return scan_name;
+}
+
+/* get the kernel count_newlines() currently uses. */
+enum scan_kernel
+get_scan_kernel(void)
+{
+    pthread_once(&scan_once, init_scan_kernel);
+    return scan_kernel;
+}
+
+/*
+ * function map_file(): map a whole file into memory, read-only.
+ * algorithm: mmap() the file, and advise the kernel that it is read
+ *            sequentially (so it reads ahead aggressively), and that it
+ *            may back it with huge pages. advice failures are ignored.
+ *            an empty file is not mapped at all.
+ * input:     file name, mapped file structure to fill in.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+int
+map_file(const char* file_name, struct mapped_file* map)
+{
+    struct stat st;
+    void* data;
+
+    map->fd = open(file_name, O_RDONLY);
+    if (map->fd < 0)
+	return -1;
+    if (fstat(map->fd, &st) < 0)
+	goto error;
+    if (!S_ISREG(st.st_mode)) {
+	errno = ENODEV;
+	goto error;
+    }
+
+    map->size = st.st_size;
+    map->data = NULL;
+    if (map->size == 0)
+	return 0;
+
+    data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+    if (data == MAP_FAILED)
+	goto error;
+    madvise(data, map->size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(data, map->size, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+    map->data = (const char*)data;
+
+    return 0;
+
+error:
+    {
+	int saved_errno = errno;
+
+	close(map->fd);
+	map->fd = -1;
+	errno = saved_errno;
+    }
+    return -1;
+}
+
+/*
+ * function unmap_file(): undo map_file().
+ * input:     mapped file structure.
+ * output:    none.
+ */
+void
+unmap_file(struct mapped_file* map)
+{
+    if (map->data)
+	munmap((void*)map->data, map->size);
+    if (map->fd >= 0)
+	close(map->fd);
+    map->data = NULL;
+    map->fd = -1;
+}
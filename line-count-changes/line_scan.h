@@ -0,0 +1,103 @@
+#ifndef LINE_SCAN_H
+# define LINE_SCAN_H
+
+#include <stddef.h>      /* size_t                                    */
+
+/* kernels available for counting newline characters. */
+enum scan_kernel {
+    SCAN_KERNEL_AUTO,		/* best one the CPU supports.       */
+    SCAN_KERNEL_SCALAR,		/* portable, 8 bytes at a time.     */
+    SCAN_KERNEL_SSE2,		/* x86 SSE2, 16 bytes at a time.    */
+    SCAN_KERNEL_AVX2		/* x86 AVX2, 32 bytes at a time.    */
+};
+
+/* a file mapped into memory for scanning. */
+struct mapped_file {
+    int fd;			/* file descriptor of the file.     */
+    const char* data;		/* start of the file's contents.    */
+    size_t size;		/* size of the file, in bytes.      */
+};
+
+/*
+ * progress of a (possibly multi-threaded) scan, shared by the scanning
+ * threads and whoever watches them. all fields are accessed atomically,
+ * so the scan is watched - and cancelled - without taking any lock.
+ */
+struct scan_progress {
+    int cancelled;			/* set to ask the scan to stop.     */
+    unsigned long long bytes;		/* bytes scanned so far.            */
+    unsigned long long lines;		/* newlines found so far.           */
+};
+
+/*
+ * scans process their data in blocks of this size, checking for a
+ * cancel request between blocks. with kernels doing several GB/s, a
+ * block takes well below a millisecond even with the scalar kernel.
+ */
+#define SCAN_BLOCK_SIZE (256 * 1024)
+
+/* count the newline characters in the given buffer. */
+extern unsigned long long
+count_newlines(const char* buf, size_t len);
+
+/*
+ * count the newline characters in the given buffer a block at a time,
+ * adding each block to the progress counters. returns 0 when the whole
+ * buffer was counted, -1 if the scan was cancelled first. either way,
+ * the lines of the blocks counted are added to '*lines'.
+ */
+extern int
+count_newlines_blocks(const char* buf, size_t len,
+		      struct scan_progress* progress,
+		      unsigned long long* lines);
+
+/* reset the progress of a scan, before starting it. */
+extern void
+init_scan_progress(struct scan_progress* progress);
+
+/* ask a scan to stop. safe to call from any thread. */
+extern void
+cancel_scan(struct scan_progress* progress);
+
+/* check if a scan was asked to stop. */
+extern int
+scan_cancelled(struct scan_progress* progress);
+
+/* add the given bytes and lines to the progress counters. */
+extern void
+add_scan_progress(struct scan_progress* progress,
+		  unsigned long long bytes, unsigned long long lines);
+
+/* read the progress counters. */
+extern unsigned long long
+scan_progress_bytes(struct scan_progress* progress);
+extern unsigned long long
+scan_progress_lines(struct scan_progress* progress);
+
+/*
+ * choose the kernel count_newlines() uses. returns 0 on success, -1 if
+ * the CPU does not support it. by default the best kernel is used.
+ */
+extern int
+set_scan_kernel(enum scan_kernel kernel);
+
+/* get the name of the kernel count_newlines() currently uses. */
+extern const char*
+scan_kernel_name(void);
+
+/* get the kernel count_newlines() currently uses (never AUTO). */
+extern enum scan_kernel
+get_scan_kernel(void);
+
+/*
+ * map a file into memory, advising the kernel it is read sequentially.
+ * returns 0 on success, -1 on error (with errno set).
+ */
+extern int
+map_file(const char* file_name, struct mapped_file* map);
+
+/* unmap a file mapped by map_file(), and close it. */
+extern void
+unmap_file(struct mapped_file* map);
+
+#endif /* LINE_SCAN_H */
@@ -0,0 +1,278 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <string.h>      /* memset()                                  */
+#include <errno.h>       /* errno and error codes                     */
+#include <fcntl.h>       /* open()                                    */
+#include <unistd.h>      /* read(), close()                           */
+
+#include "lzw.h"         /* .Z decoder functions and structs          */
+
+/* codes of the format. */
+#define LZW_INIT_BITS 9		/* width of codes after a CLEAR.   */
+#define LZW_CLEAR 256		/* reset the table (block mode).   */
+#define LZW_BLOCK_FLAG 0x80	/* header flag - block mode.       */
+#define LZW_BITS_MASK 0x1f	/* header mask - max code width.   */
+
+/*
+ * function is_lzw_file(): check if a file is in .Z format.
+ * input:     file name.
+ * output:    1 if it starts with the .Z magic bytes, 0 otherwise.
+ */
+int
+is_lzw_file(const char* file_name)
+{
+    unsigned char magic[2];
+    int fd = open(file_name, O_RDONLY);
+    int is_lzw;
+
+    if (fd < 0)
+	return 0;
+    is_lzw = read(fd, magic, 2) == 2 &&
+	     magic[0] == LZW_MAGIC_1 && magic[1] == LZW_MAGIC_2;
+    close(fd);
+
+    return is_lzw;
+}
+
+/*
+ * function lzw_get_byte(): get the next byte of compressed data.
+ * input:     pointer to decoder.
+ * output:    the byte, -1 at end of file, -2 on read error.
+ */
+static int
+lzw_get_byte(struct lzw_decoder* decoder)
+{
+    if (decoder->in_pos == decoder->in_len) {
+	ssize_t n;
+
+	if (decoder->in_eof)
+	    return -1;
+	do {
+	    n = read(decoder->fd, decoder->input, LZW_INPUT_SIZE);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+	    return -2;
+	if (n == 0) {
+	    decoder->in_eof = 1;
+	    return -1;
+	}
+	decoder->in_pos = 0;
+	decoder->in_len = n;
+    }
+
+    return decoder->input[decoder->in_pos++];
+}
+
+/*
+ * function lzw_get_code(): read the next code, of the current width.
+ * algorithm: codes are packed least significant bit first. keep adding
+ *            bytes above the bits we have, till there are enough.
+ * input:     pointer to decoder.
+ * output:    the code, -1 at end of data, -2 on read error.
+ */
+static int
+lzw_get_code(struct lzw_decoder* decoder)
+{
+    int code;
+
+    while (decoder->bit_cnt < decoder->n_bits) {
+	int c = lzw_get_byte(decoder);
+
+	if (c < 0)	/* a partial code at the end is just padding. */
+	    return c;
+	decoder->bit_buf |= (unsigned long long)c << decoder->bit_cnt;
+	decoder->bit_cnt += 8;
+    }
+    code = decoder->bit_buf & ((1U << decoder->n_bits) - 1);
+    decoder->bit_buf >>= decoder->n_bits;
+    decoder->bit_cnt -= decoder->n_bits;
+    decoder->bit_pos += decoder->n_bits;
+
+    return code;
+}
+
+/*
+ * function lzw_skip_group(): skip to the end of the current code group.
+ * algorithm: 'compress' writes codes in groups of 8 - n_bits bytes. when
+ *            the code width changes, or the table is cleared, the rest
+ *            of the current group is padding. skip it, and start
+ *            counting a new group.
+ * input:     pointer to decoder.
+ * output:    0 on success, -2 on read error.
+ */
+static int
+lzw_skip_group(struct lzw_decoder* decoder)
+{
+    unsigned int group_bits = decoder->n_bits * 8;
+    unsigned int skip = (group_bits - decoder->bit_pos % group_bits)
+			% group_bits;
+
+    while (skip > 0) {
+	unsigned int n;
+
+	if (decoder->bit_cnt == 0) {
+	    int c = lzw_get_byte(decoder);
+
+	    if (c == -1)
+		break;
+	    if (c < 0)
+		return c;
+	    decoder->bit_buf = c;
+	    decoder->bit_cnt = 8;
+	}
+	n = skip < (unsigned int)decoder->bit_cnt ? skip : decoder->bit_cnt;
+	decoder->bit_buf >>= n;
+	decoder->bit_cnt -= n;
+	skip -= n;
+    }
+    decoder->bit_pos = 0;
+
+    return 0;
+}
+
+/*
+ * function lzw_decoder_init(): start decoding a .Z stream.
+ * algorithm: read and check the 3 bytes header - magic bytes, and a
+ *            flags byte holding the max code width and block mode.
+ * input:     pointer to decoder, file descriptor to read from.
+ * output:    0 on success, -1 on a bad header (errno EINVAL) or error.
+ */
+int
+lzw_decoder_init(struct lzw_decoder* decoder, int fd)
+{
+    int magic1, magic2, flags;
+
+    decoder->fd = fd;
+    decoder->in_pos = decoder->in_len = 0;
+    decoder->in_eof = 0;
+
+    magic1 = lzw_get_byte(decoder);
+    magic2 = lzw_get_byte(decoder);
+    flags = lzw_get_byte(decoder);
+    if (magic1 == -2 || magic2 == -2 || flags == -2)
+	return -1;
+    if (magic1 != LZW_MAGIC_1 || magic2 != LZW_MAGIC_2 || flags < 0)
+	goto bad_header;
+
+    decoder->max_bits = flags & LZW_BITS_MASK;
+    decoder->block_mode = (flags & LZW_BLOCK_FLAG) != 0;
+    if (decoder->max_bits < LZW_INIT_BITS || decoder->max_bits > LZW_MAX_BITS)
+	goto bad_header;
+
+    decoder->bit_buf = 0;
+    decoder->bit_cnt = 0;
+    decoder->bit_pos = 0;
+    decoder->n_bits = LZW_INIT_BITS;
+    decoder->max_code = (1U << LZW_INIT_BITS) - 1;
+    decoder->free_ent = decoder->block_mode ? LZW_CLEAR + 1 : LZW_CLEAR;
+    decoder->old_code = -1;
+    decoder->fin_char = 0;
+    decoder->stack_len = 0;
+    decoder->done = 0;
+    memset(decoder->prefix, 0, sizeof(decoder->prefix));
+    memset(decoder->suffix, 0, sizeof(decoder->suffix));
+
+    return 0;
+
+bad_header:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * function lzw_read(): decode data into a buffer.
+ * algorithm: first hand out what is left of the last decoded string.
+ *            then decode codes one at a time. each code stands for a
+ *            string - a shorter string (its 'prefix', itself a code) plus
+ *            one byte. following the prefixes gives the string's bytes
+ *            last to first, so they are pushed on a stack, and popped
+ *            into the buffer. each code also defines a new table entry -
+ *            the previous code's string, plus the first byte of this one.
+ * input:     pointer to decoder, buffer, its length.
+ * output:    number of bytes decoded, 0 at end of data, -1 on error.
+ */
+ssize_t
+lzw_read(struct lzw_decoder* decoder, char* buf, size_t len)
+{
+    unsigned int max_max_code = 1U << decoder->max_bits;
+    size_t out = 0;
+
+    while (out < len) {
+	int code, in_code;
+	int sp;
+
+	/* pop the rest of the previous string first. */
+	while (decoder->stack_len > 0 && out < len)
+	    buf[out++] = decoder->stack[--decoder->stack_len];
+	if (out == len || decoder->done)
+	    break;
+
+	/* table is full for this width - widen the codes. */
+	if (decoder->free_ent > decoder->max_code) {
+	    if (lzw_skip_group(decoder) < 0)
+		return -1;
+	    decoder->n_bits++;
+	    decoder->max_code = decoder->n_bits == decoder->max_bits ?
+				max_max_code : (1U << decoder->n_bits) - 1;
+	}
+
+	code = lzw_get_code(decoder);
+	if (code == -2)
+	    return -1;
+	if (code == -1) {
+	    decoder->done = 1;
+	    break;
+	}
+
+	if (decoder->old_code == -1) {	/* first code - a plain byte. */
+	    if (code >= LZW_CLEAR)
+		goto corrupt;
+	    decoder->old_code = code;
+	    decoder->fin_char = (unsigned char)code;
+	    buf[out++] = (char)code;
+	    continue;
+	}
+
+	if (code == LZW_CLEAR && decoder->block_mode) {
+	    memset(decoder->prefix, 0, sizeof(decoder->prefix));
+	    /* the next code defines entry 256, which is never used. */
+	    decoder->free_ent = LZW_CLEAR;
+	    if (lzw_skip_group(decoder) < 0)
+		return -1;
+	    decoder->n_bits = LZW_INIT_BITS;
+	    decoder->max_code = (1U << LZW_INIT_BITS) - 1;
+	    continue;
+	}
+
+	in_code = code;
+	sp = 0;
+	if ((unsigned int)code >= decoder->free_ent) {
+	    /* the special case of a code defined by this very step: */
+	    /* the previous string, plus its own first byte.         */
+	    if ((unsigned int)code > decoder->free_ent)
+		goto corrupt;
+	    decoder->stack[sp++] = decoder->fin_char;
+	    code = decoder->old_code;
+	}
+	while (code >= LZW_CLEAR) {
+	    decoder->stack[sp++] = decoder->suffix[code];
+	    code = decoder->prefix[code];
+	}
+	decoder->fin_char = (unsigned char)code;
+	decoder->stack[sp++] = decoder->fin_char;
+
+	/* define the new table entry. */
+	if (decoder->free_ent < max_max_code) {
+	    decoder->prefix[decoder->free_ent] = decoder->old_code;
+	    decoder->suffix[decoder->free_ent] = decoder->fin_char;
+	    decoder->free_ent++;
+	}
+	decoder->old_code = in_code;
+	decoder->stack_len = sp;
+    }
+
+    return out;
+
+corrupt:
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,69 @@
+#ifndef LZW_H
+# define LZW_H
+
+#include <sys/types.h>   /* ssize_t                                   */
+
+/*
+ * streaming decoder for files made by the Unix 'compress' program (.Z).
+ * the data is read from a file descriptor, and decoded on demand into
+ * the caller's buffers, using a fixed amount of memory.
+ */
+
+/* magic bytes that start a .Z file. */
+#define LZW_MAGIC_1 0x1f
+#define LZW_MAGIC_2 0x9d
+
+/* largest code width 'compress' uses, and the size of the tables. */
+#define LZW_MAX_BITS 16
+#define LZW_TABLE_SIZE (1 << LZW_MAX_BITS)
+
+/* size of the decoder's input buffer. */
+#define LZW_INPUT_SIZE 65536
+
+/* state of a decoder. */
+struct lzw_decoder {
+    int fd;				/* file descriptor to read from.   */
+    unsigned char input[LZW_INPUT_SIZE]; /* input buffer.              */
+    size_t in_pos;			/* next byte of 'input' to use.    */
+    size_t in_len;			/* number of bytes in 'input'.     */
+    int in_eof;				/* got end of file on 'fd'?        */
+
+    unsigned long long bit_buf;		/* bits read but not yet used.     */
+    int bit_cnt;			/* number of bits in 'bit_buf'.    */
+    unsigned long long bit_pos;		/* bits used since group start.    */
+
+    int max_bits;			/* largest code width of file.     */
+    int block_mode;			/* is the CLEAR code in use?       */
+    int n_bits;				/* current code width.             */
+    unsigned int max_code;		/* largest code of current width.  */
+    unsigned int free_ent;		/* next free table entry.          */
+    int old_code;			/* previous code, -1 for none.     */
+    unsigned char fin_char;		/* first byte of previous string.  */
+
+    unsigned short prefix[LZW_TABLE_SIZE]; /* code of string's prefix.  */
+    unsigned char suffix[LZW_TABLE_SIZE];  /* string's last byte.       */
+    unsigned char stack[LZW_TABLE_SIZE];   /* a string, last byte first. */
+    int stack_len;			/* bytes of a string not yet given. */
+    int done;				/* reached end of compressed data? */
+};
+
+/* check if the given file starts with the .Z magic bytes. */
+extern int
+is_lzw_file(const char* file_name);
+
+/*
+ * start decoding the .Z data read from 'fd'. returns 0 on success, -1 if
+ * the data does not start with a valid .Z header.
+ */
+extern int
+lzw_decoder_init(struct lzw_decoder* decoder, int fd);
+
+/*
+ * decode up to 'len' bytes into 'buf'. returns the number of bytes
+ * decoded, 0 at the end of the data, or -1 if the data is corrupt
+ * (errno EINVAL) or reading failed.
+ */
+extern ssize_t
+lzw_read(struct lzw_decoder* decoder, char* buf, size_t len);
+
+#endif /* LZW_H */
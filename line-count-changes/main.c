@@ -0,0 +1,629 @@
+#include <stdio.h>             /* standard I/O routines                      */
+#include <pthread.h>           /* pthread functions and data structures      */
+#include <stdlib.h>            /* exit(), system(), atoi(), strtol()         */
+#include <unistd.h>            /* getopt(), isatty()                         */
+#include <errno.h>             /* errno and error codes                      */
+#include <time.h>              /* clock_gettime()                            */
+#include <string.h>            /* strerror(), strcmp()                       */
+#include <sys/stat.h>          /* stat()                                     */
+
+#include "line_scan.h"         /* line scanning functions and structs        */
+#include "parallel_count.h"    /* parallel line counting                     */
+#include "lzw.h"               /* .Z format detection                        */
+#include "compressed_count.h"  /* line counting of .Z files                  */
+#include "multi_count.h"       /* line counting of many files                */
+#include "read_engine.h"       /* io_uring/pread read engine                 */
+#include "pattern_scan.h"      /* delimiter, substring and 'wc' counting     */
+#include "line_index.h"        /* persistent line offset index               */
+#include "follow_count.h"      /* line counting of growing files             */
+
+#define DATA_FILE "very_large_data_file"
+
+/* compressed version of the data file, used if the data file is missing. */
+#define COMPRESSED_DATA_FILE DATA_FILE ".Z"
+
+/* how often main shows the progress of the scan, in milliseconds. */
+#define PROGRESS_INTERVAL_MS 250
+
+/* global mutex for our program. assignment initializes it. */
+pthread_mutex_t action_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* global condition variable for our program. assignment initializes it. */
+pthread_cond_t  action_cond   = PTHREAD_COND_INITIALIZER;
+
+/* flag to denote if the user requested to cancel the operation in the middle */
+/* 0 means 'no'. */
+int cancel_operation = 0;
+
+/* flag to denote the line counting finished. 0 means 'no'. both flags  */
+/* are protected by 'action_mutex', so main can't miss the signal if it */
+/* comes before main starts waiting.                                    */
+int operation_done = 0;
+
+/* a line counting job - the file to scan, and the result. */
+struct line_count_job {
+    const char* file_name;	/* name of file to scan.          */
+    int num_threads;		/* number of threads to scan with. */
+    int use_reads;		/* read the file instead of mapping it? */
+    enum read_engine engine;	/* engine issuing the reads.      */
+    int depth;			/* number of reads in flight.     */
+    int read_flags;		/* flags of the reads (O_DIRECT). */
+    int use_pattern;		/* count a pattern, not lines?    */
+    struct pattern pattern;	/* the pattern to count.          */
+    struct pattern_counts counts; /* what the pattern count found. */
+    int use_index;		/* count through the file's index? */
+    int indexed;		/* was an up to date index found?  */
+    int follow;			/* keep counting as the file grows? */
+    unsigned long long lines;	/* number of lines found.         */
+    struct scan_progress progress; /* progress, and cancel flag.  */
+};
+
+/* get the current time of the given clock, in seconds. */
+static double
+now_sec(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * function: restore_coocked_mode - restore normal screen mode.
+ * algorithm: uses the 'stty' command to restore normal screen mode.
+ *            serves as a cleanup function for the user input thread.
+ * input: none.
+ * output: none.
+ */
+
+void
+restore_coocked_mode(void* dummy)
+{
+#ifdef DEBUG
+    printf("restore_coocked_mode: before 'stty -raw echo'\n\r");
+    fflush(stdout);
+#endif /* DEBUG */
+    system("stty -raw echo");
+#ifdef DEBUG
+    printf("restore_coocked_mode: after 'stty -raw echo'\n\r");
+    fflush(stdout);
+#endif /* DEBUG */
+}
+
+/*
+ * function: read_user_input - read user input while long operation in progress.
+ * algorithm: put screen in raw mode (without echo), to allow for unbuffered
+ *            input.
+ *            perform an endless loop of reading user input. If user
+ *            pressed 'e', ask the scan to stop, signal our condition
+ *            variable and end the thread. reading is a cancellation
+ *            point, so the default (deferred) cancel mode is enough to
+ *            cancel us while we are blocked on it.
+ * input: line counting job.
+ * output: none.
+ */
+void*
+read_user_input(void* data)
+{
+    struct line_count_job* job = (struct line_count_job*)data;
+    int c;
+
+    /* register cleanup handler */
+    pthread_cleanup_push(restore_coocked_mode, NULL);
+
+    /* put screen in raw data mode */
+    system("stty raw -echo");
+
+    /* "endless" loop - read data from the user.            */
+    /* terminate the loop if we got a 'e', or are canceled. */
+    while ((c = getchar()) != EOF) {
+	if (c == 'e') {
+#ifdef DEBUG
+	    printf("\n\ngot a 'e'\n\n\r");
+	    fflush(stdout);
+#endif /* DEBUG */
+	    /* the scanning threads stop within a block. */
+	    cancel_scan(&job->progress);
+	    /* mark that there was a cancel request by the user */
+	    pthread_mutex_lock(&action_mutex);
+	    cancel_operation = 1;
+	    /* signify that we are done */
+	    pthread_cond_signal(&action_cond);
+	    pthread_mutex_unlock(&action_mutex);
+	    pthread_exit(NULL);
+	}
+    }
+
+    /* pop cleanup handler, while executing it, to restore cooked mode. */
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+/*
+ * function: show_follow_update - print the count of a followed file.
+ * algorithm: called by the following thread on each update. the user
+ *            input thread puts the terminal in raw mode, so lines end
+ *            with an explicit carriage return there.
+ * input: line counting job, what happened, state of the followed file.
+ * output: none.
+ */
+static void
+show_follow_update(void* data, enum follow_event event,
+		   const struct follow_state* state)
+{
+    const char* eol = isatty(STDOUT_FILENO) ? "\r\n" : "\n";
+
+    switch (event) {
+	case FOLLOW_STARTED:
+	    printf("%s'%llu' lines. following %s (with %s)...%s", eol,
+		   state->lines, state->file_name,
+		   state->use_inotify ? "inotify" : "polling", eol);
+	    break;
+	case FOLLOW_GREW:
+	    printf("'%llu' lines (+%llu, %llu bytes scanned in all).%s",
+		   state->lines, state->new_lines, state->bytes_scanned, eol);
+	    break;
+	case FOLLOW_TRUNCATED:
+	    printf("file truncated - '%llu' lines.%s", state->lines, eol);
+	    break;
+	case FOLLOW_ROTATED:
+	    printf("file rotated - '%llu' lines.%s", state->lines, eol);
+	    break;
+    }
+    fflush(stdout);
+}
+
+/*
+ * function: file_line_count - counts the number of lines in the given file.
+ * algorithm: split the data file into chunks, and count the newline
+ *            characters of all chunks in parallel, with the fastest
+ *            kernel the CPU supports. a .Z file is decompressed on the
+ *            fly instead, and counted while being decompressed. if asked
+ *            to, the file is read with a queue of large reads (better
+ *            when it is not in the page cache) instead of mapped. a
+ *            pattern (delimiters, a string, or 'wc' counts) is counted
+ *            with the pattern kernels instead. if asked to, an up to
+ *            date index of the file gives the count without a scan -
+ *            or the count writes the index, sampling line starts in
+ *            the same parallel pass. when following the file, count it,
+ *            and then what is appended to it, until cancelled. the
+ *            scan reports its progress in the job, and stops early if
+ *            it gets cancelled there.
+ * input: line counting job.
+ * output: none. the number of lines is placed in the job.
+ */
+void*
+file_line_count(void* data)
+{
+    struct line_count_job* job = (struct line_count_job*)data;
+
+    int rc;
+
+    if (job->follow) {
+	rc = follow_count_lines(job->file_name, job->num_threads,
+				&job->progress, show_follow_update, job);
+    }
+    else if (job->use_pattern) {
+	rc = pattern_count_file(job->file_name, &job->pattern,
+				job->num_threads, &job->progress, &job->counts);
+    }
+    else if (is_lzw_file(job->file_name)) {
+	/* one thread decompresses, the rest count. */
+	rc = compressed_count_lines(job->file_name, job->num_threads - 1,
+				    &job->progress, &job->lines);
+    }
+    else if (job->use_index) {
+	rc = index_count_lines(job->file_name, job->num_threads,
+			       &job->progress, &job->lines, &job->indexed);
+    }
+    else if (job->use_reads) {
+	rc = read_count_lines(job->file_name, job->engine, job->depth,
+			      job->read_flags, &job->progress, &job->lines);
+    }
+    else {
+	rc = parallel_count_lines(job->file_name, job->num_threads,
+				  &job->progress, &job->lines);
+    }
+    if (rc < 0 && errno == ECANCELED)
+	return NULL;
+    if (rc < 0) {
+	perror(job->file_name);
+	exit(1);
+    }
+
+    /* signify that we are done. */
+    pthread_mutex_lock(&action_mutex);
+    operation_done = 1;
+    pthread_cond_signal(&action_cond);
+    pthread_mutex_unlock(&action_mutex);
+
+    return NULL;
+}
+
+/*
+ * function: show_progress - show how far the scan got.
+ * algorithm: read the progress counters of the job. they are atomics,
+ *            so this takes no lock, and never slows the scan down.
+ * input: line counting job, time the scan started.
+ * output: none.
+ */
+static void
+show_progress(struct line_count_job* job, double start)
+{
+    unsigned long long bytes = scan_progress_bytes(&job->progress);
+    unsigned long long lines = scan_progress_lines(&job->progress);
+    double elapsed = now_sec(CLOCK_MONOTONIC) - start;
+
+    printf("\rChecking file size (press 'e' to cancel operation)... "
+	   "%llu MB, %llu lines, %.1f MB/s ",
+	   bytes >> 20, lines, elapsed > 0 ? bytes / elapsed / 1e6 : 0.0);
+    fflush(stdout);
+}
+
+/*
+ * function: count_many - count the lines of several files, like 'wc -l'.
+ * algorithm: gather the files (walking directories recursively), count
+ *            them all on a pool of handler threads, and print the
+ *            count of each file - in the order the files were given and
+ *            found - and the total.
+ * input: number of paths, the paths, number of threads.
+ * output: exit status - 0 if all files were counted, 1 otherwise.
+ */
+static int
+count_many(int num_paths, char* paths[], int num_threads)
+{
+    struct multi_count count;
+    unsigned long long total = 0;
+    int status = 0;
+    int i;
+
+    init_multi_count(&count);
+    for (i = 0; i < num_paths; i++)
+	add_count_path(&count, paths[i]);
+
+    multi_count_lines(&count, num_threads, NULL);
+
+    for (i = 0; i < count.num_files; i++) {
+	struct count_file* file = &count.files[i];
+
+	if (file->error) {
+	    fprintf(stderr, "line-count: %s: %s\n", file->path,
+		    strerror(file->error));
+	    status = 1;
+	    continue;
+	}
+	printf("%8llu %s\n", file->lines, file->path);
+	total += file->lines;
+    }
+    if (count.num_files > 1)
+	printf("%8llu total\n", total);
+
+    free_multi_count(&count);
+
+    return status;
+}
+
+/*
+ * function: unescape - decode the escapes of a command line pattern.
+ * algorithm: replace \n, \t, \r, \0, \\ and \xHH by the bytes they
+ *            stand for, in place. other bytes are kept as they are.
+ * input: the pattern.
+ * output: its length after decoding (it may hold zero bytes).
+ */
+static size_t
+unescape(char* str)
+{
+    char* in = str;
+    char* out = str;
+
+    while (*in) {
+	if (in[0] != '\\' || !in[1]) {
+	    *out++ = *in++;
+	    continue;
+	}
+	in++;
+	switch (*in) {
+	    case 'n': *out++ = '\n'; in++; break;
+	    case 't': *out++ = '\t'; in++; break;
+	    case 'r': *out++ = '\r'; in++; break;
+	    case '0': *out++ = '\0'; in++; break;
+	    case 'x': {
+		char hex[3] = { 0, 0, 0 };
+		char* end;
+
+		strncpy(hex, in + 1, 2);
+		*out = (char)strtol(hex, &end, 16);
+		if (end == hex) {	/* not a hex escape - keep the 'x'. */
+		    *out++ = 'x';
+		    in++;
+		}
+		else {
+		    out++;
+		    in += 1 + (end - hex);
+		}
+		break;
+	    }
+	    default: *out++ = *in++; break;
+	}
+    }
+
+    return out - str;
+}
+
+/*
+ * function: show_line - find a line through the file's index, and print it.
+ * algorithm: open the index (just written or checked by the count), look
+ *            the line up, and print its offset, the time the lookup
+ *            took, and the line itself.
+ * input: file name, line number (counted from 1).
+ * output: 0 on success, 1 on error.
+ */
+static int
+show_line(const char* file_name, unsigned long long line_number)
+{
+    struct line_index index;
+    off_t offset;
+    double start;
+    FILE* f;
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    if (open_line_index(file_name, &index) < 0) {
+	perror(file_name);
+	return 1;
+    }
+    start = now_sec(CLOCK_MONOTONIC);
+    if (line_index_offset(&index, line_number - 1, &offset) < 0) {
+	fprintf(stderr, "line-count: %s: line %llu: %s\n", file_name,
+		line_number, strerror(errno));
+	close_line_index(&index);
+	return 1;
+    }
+    printf("line %llu starts at byte %lld (found in %.3f ms):\n",
+	   line_number, (long long)offset,
+	   (now_sec(CLOCK_MONOTONIC) - start) * 1e3);
+    close_line_index(&index);
+
+    f = fopen(file_name, "r");
+    if (!f || fseeko(f, offset, SEEK_SET) < 0) {
+	perror(file_name);
+	if (f)
+	    fclose(f);
+	return 1;
+    }
+    len = getline(&line, &size, f);
+    if (len > 0) {
+	fwrite(line, 1, len, stdout);
+	if (line[len - 1] != '\n')
+	    putchar('\n');
+    }
+    free(line);
+    fclose(f);
+
+    return 0;
+}
+
+/* check if the given path is a directory. */
+static int
+is_directory(const char* path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* print a usage message, and exit. */
+static void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-i uring|pread|auto] [-q depth] "
+		    "[-d] [-c set | -s string | -w]\n"
+		    "       [-x] [-l line] [-f]\n"
+		    "       [file | file... | directory...]\n", prog);
+    fprintf(stderr, "  -i  read the file with the given engine, "
+		    "instead of mapping it\n"
+		    "  -q  number of reads in flight (default %d)\n"
+		    "  -d  read with O_DIRECT, bypassing the page cache\n"
+		    "  -c  count the bytes of the given set (e.g. ',;\\t')\n"
+		    "  -s  count occurrences of the given string (e.g. '\\r\\n')\n"
+		    "  -w  count lines, words and bytes, like 'wc'\n"
+		    "  -x  count through the file's index (" LINE_INDEX_SUFFIX
+		    "), writing it if it is\n"
+		    "      missing or out of date\n"
+		    "  -l  print the given line (counted from 1), found with "
+		    "the index\n"
+		    "  -f  follow the file as it grows, counting only the "
+		    "appended lines\n",
+	    READ_DEFAULT_DEPTH);
+    exit(1);
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    pthread_t thread_line_count; /* 'handle' of line-counting thread.        */
+    pthread_t thread_user_input; /* 'handle' of user-input thread.           */
+    struct line_count_job job;	 /* file to scan, and lines found in it.     */
+    int opt;			 /* command line option.                     */
+    int show;			 /* show progress while waiting?             */
+    double start;		 /* time the scan started.                   */
+    unsigned long long find_line = 0; /* line to look up, 0 if none.         */
+
+    job.file_name = DATA_FILE;
+    job.num_threads = default_num_threads();
+    job.use_reads = 0;
+    job.engine = READ_ENGINE_AUTO;
+    job.depth = READ_DEFAULT_DEPTH;
+    job.read_flags = 0;
+    job.use_pattern = 0;
+    job.use_index = 0;
+    job.indexed = 0;
+    job.follow = 0;
+    job.lines = 0;
+    init_scan_progress(&job.progress);
+
+    while ((opt = getopt(argc, argv, "j:i:q:dc:s:wxl:f")) != -1) {
+	switch (opt) {
+	    case 'j':
+		job.num_threads = atoi(optarg);
+		if (job.num_threads < 1)
+		    usage(argv[0]);
+		break;
+	    case 'i':
+		job.use_reads = 1;
+		if (strcmp(optarg, "uring") == 0)
+		    job.engine = READ_ENGINE_URING;
+		else if (strcmp(optarg, "pread") == 0)
+		    job.engine = READ_ENGINE_PREAD;
+		else if (strcmp(optarg, "auto") == 0)
+		    job.engine = READ_ENGINE_AUTO;
+		else
+		    usage(argv[0]);
+		break;
+	    case 'q':
+		job.use_reads = 1;
+		job.depth = atoi(optarg);
+		if (job.depth < 1 || job.depth > READ_MAX_DEPTH)
+		    usage(argv[0]);
+		break;
+	    case 'c':
+	    case 's':
+		job.use_pattern = 1;
+		if (init_pattern(&job.pattern,
+				 opt == 'c' ? PATTERN_SET : PATTERN_STRING,
+				 optarg, unescape(optarg)) < 0)
+		    usage(argv[0]);
+		break;
+	    case 'w':
+		job.use_pattern = 1;
+		init_pattern(&job.pattern, PATTERN_WC, NULL, 0);
+		break;
+	    case 'd':
+		job.use_reads = 1;
+		job.read_flags |= READ_DIRECT;
+		break;
+	    case 'l':
+		find_line = strtoull(optarg, NULL, 10);
+		if (find_line < 1)
+		    usage(argv[0]);
+		/* fall through - lines are found through the index. */
+	    case 'x':
+		job.use_index = 1;
+		break;
+	    case 'f':
+		job.follow = 1;
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    /* several files, or directories - count them all, like 'wc -l'. */
+    if (argc - optind > 1 || (optind < argc && is_directory(argv[optind])))
+	return count_many(argc - optind, argv + optind, job.num_threads);
+    if (optind < argc)
+	job.file_name = argv[optind];
+    else if (access(DATA_FILE, F_OK) != 0 &&
+	     access(COMPRESSED_DATA_FILE, F_OK) == 0)
+	job.file_name = COMPRESSED_DATA_FILE;
+    if (job.use_index && (job.use_pattern || is_lzw_file(job.file_name))) {
+	fprintf(stderr, "line-count: %s: only plain line counts of "
+			"uncompressed files are indexed\n", job.file_name);
+	exit(1);
+    }
+    if (job.follow && (job.use_pattern || job.use_index || job.use_reads ||
+		       is_lzw_file(job.file_name))) {
+	fprintf(stderr, "line-count: %s: only plain line counts of "
+			"uncompressed files are followed\n", job.file_name);
+	exit(1);
+    }
+
+    printf("Checking file size (press 'e' to cancel operation)...");
+    fflush(stdout);
+    /* when following, the updates are shown instead. */
+    show = isatty(STDOUT_FILENO) && !job.follow;
+    start = now_sec(CLOCK_MONOTONIC);
+
+    /* spawn the line counting thread */
+    pthread_create(&thread_line_count,
+		   NULL,
+		   file_line_count,
+		   (void*)&job);
+    /* spawn the user-reading thread */
+    pthread_create(&thread_user_input,
+		   NULL,
+		   read_user_input,
+		   (void*)&job);
+
+    /* lock the mutex, and wait on the condition variable, till one of */
+    /* the threads finishes up and signals it. wake up periodically to */
+    /* show the progress - outside the mutex, which it does not need.  */
+    pthread_mutex_lock(&action_mutex);
+    while (!operation_done && !cancel_operation) {
+	double wake_up = now_sec(CLOCK_REALTIME) + PROGRESS_INTERVAL_MS / 1e3;
+	struct timespec deadline;
+
+	deadline.tv_sec = (time_t)wake_up;
+	deadline.tv_nsec = (long)((wake_up - deadline.tv_sec) * 1e9);
+	if (pthread_cond_timedwait(&action_cond, &action_mutex,
+				   &deadline) == ETIMEDOUT && show) {
+	    pthread_mutex_unlock(&action_mutex);
+	    show_progress(&job, start);
+	    pthread_mutex_lock(&action_mutex);
+	}
+    }
+    pthread_mutex_unlock(&action_mutex);
+
+#ifdef DEBUG
+    printf("\n\rmain: we got signaled\n\n\r");
+    fflush(stdout);
+#endif /* DEBUG */
+
+    /* check if we were signaled due to user operation        */
+    /* cancelling, or because the line-counting was finished. */
+    if (cancel_operation) {
+	double cancel_time = now_sec(CLOCK_MONOTONIC);
+
+	/* the user-input thread already asked the scan to stop. wait */
+	/* for the scanning threads to notice - this is quick, and    */
+	/* leaves no memory mapped and no file open behind.           */
+        pthread_join(thread_line_count, NULL);
+	cancel_time = now_sec(CLOCK_MONOTONIC) - cancel_time;
+	/* we join it to make sure it restores normal */
+	/* screen mode before we print out.           */
+        pthread_join(thread_user_input, NULL);
+	printf("\noperation canceled (scan stopped within %.3f ms)\n",
+	       cancel_time * 1e3);
+	fflush(stdout);
+    }
+    else {
+        /* join the file line-counting thread, to get its results */
+        pthread_join(thread_line_count, NULL);
+
+        /* cancel and join the user-input thread.     */
+	/* we join it to make sure it restores normal */
+	/* screen mode before we print out.           */
+        pthread_cancel(thread_user_input);
+        pthread_join(thread_user_input, NULL);
+
+	/* and print the result */
+	if (show)
+	    show_progress(&job, start);
+	if (!job.use_pattern)
+	    printf("%s'%llu' lines%s.\n", show ? "\n" : "", job.lines,
+		   job.indexed ? " (from the index)" : "");
+	else if (job.pattern.mode == PATTERN_WC)
+	    printf("%s'%llu' lines, '%llu' words, '%llu' bytes.\n",
+		   show ? "\n" : "", job.counts.lines, job.counts.words,
+		   job.counts.bytes);
+	else
+	    printf("%s'%llu' matches.\n", show ? "\n" : "",
+		   job.counts.matches);
+	if (find_line)
+	    return show_line(job.file_name, find_line);
+    }
+
+    return 0;
+}
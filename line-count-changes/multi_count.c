@@ -0,0 +1,401 @@
+#include <stdio.h>       /* standard I/O routines, asprintf()         */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdlib.h>      /* malloc(), realloc() and free()            */
+#include <string.h>      /* strcmp(), strlen(), strdup()              */
+#include <errno.h>       /* errno and error codes                     */
+#include <fcntl.h>       /* open()                                    */
+#include <unistd.h>      /* read(), close()                           */
+#include <dirent.h>      /* scandir()                                 */
+#include <sys/stat.h>    /* stat(), lstat()                           */
+#include <sys/mman.h>    /* mmap(), madvise()                         */
+
+#include "requests_queue.h"       /* requests queue routines/structs  */
+#include "handler_threads_pool.h" /* handler threads pool             */
+#include "line_scan.h"            /* newline counting kernels         */
+#include "multi_count.h"          /* multi-file line counting         */
+
+/* the handler threads exit once this is set and the queue is empty. */
+int done_creating_requests = 0;
+
+/* a work item - a chunk of a big file, or a batch of small files. */
+struct count_item {
+    struct multi_count* count;	    /* the files being counted.          */
+    struct scan_progress* progress; /* progress of the whole count.      */
+    int first_file;		    /* index of (first) file of item.    */
+    int num_files;		    /* number of files - 1 for a chunk.  */
+    off_t offset;		    /* offset of chunk, -1 for a batch.  */
+    size_t len;			    /* length of chunk.                  */
+};
+
+/* buffer small files are read into - one per handler thread. */
+static __thread char read_buffer[MULTI_READ_SIZE];
+
+/*
+ * function init_multi_count(): start an empty multi-file count.
+ * input:     pointer to count.
+ * output:    none.
+ */
+void
+init_multi_count(struct multi_count* count)
+{
+    count->files = NULL;
+    count->num_files = 0;
+    count->max_files = 0;
+}
+
+/*
+ * function add_file(): add a file to the count, growing the array of
+ *            files as needed.
+ * input:     pointer to count, path of file, its size, errno of a
+ *            failure to access it (or 0).
+ * output:    none.
+ */
+static void
+add_file(struct multi_count* count, const char* path, off_t size, int error)
+{
+    struct count_file* file;
+
+    if (count->num_files == count->max_files) {
+	count->max_files = count->max_files ? count->max_files * 2 : 64;
+	count->files = (struct count_file*)
+		       realloc(count->files,
+			       count->max_files * sizeof(struct count_file));
+	if (!count->files) {
+	    fprintf(stderr, "add_file: out of memory. exiting\n");
+	    exit(1);
+	}
+    }
+    file = &count->files[count->num_files++];
+    file->path = strdup(path);
+    if (!file->path) {
+	fprintf(stderr, "add_file: out of memory. exiting\n");
+	exit(1);
+    }
+    file->size = size;
+    file->lines = 0;
+    file->error = error;
+}
+
+/* scandir() filter - skip the '.' and '..' entries. */
+static int
+not_dot_entry(const struct dirent* entry)
+{
+    return strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0;
+}
+
+/* scandir() order - by name, regardless of the locale. */
+static int
+compare_names(const struct dirent** a, const struct dirent** b)
+{
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/*
+ * function walk_directory(): add the files of a directory tree.
+ * algorithm: read the directory's entries sorted by name, so the files
+ *            are always found in the same order. recurse into
+ *            sub-directories. symbolic links and special files found
+ *            while walking are skipped, as 'find' does by default.
+ * input:     pointer to count, path of directory.
+ * output:    none.
+ */
+static void
+walk_directory(struct multi_count* count, const char* dir_path)
+{
+    struct dirent** entries;
+    const char* separator;
+    int num_entries;
+    int i;
+
+    num_entries = scandir(dir_path, &entries, not_dot_entry, compare_names);
+    if (num_entries < 0) {
+	add_file(count, dir_path, 0, errno);
+	return;
+    }
+    separator = dir_path[0] && dir_path[strlen(dir_path) - 1] == '/' ? "" : "/";
+
+    for (i = 0; i < num_entries; i++) {
+	char* path;
+	struct stat st;
+
+	if (asprintf(&path, "%s%s%s", dir_path, separator,
+		     entries[i]->d_name) < 0) {
+	    fprintf(stderr, "walk_directory: out of memory. exiting\n");
+	    exit(1);
+	}
+
+	if (lstat(path, &st) < 0)
+	    add_file(count, path, 0, errno);
+	else if (S_ISDIR(st.st_mode))
+	    walk_directory(count, path);
+	else if (S_ISREG(st.st_mode))
+	    add_file(count, path, st.st_size, 0);
+
+	free(path);
+	free(entries[i]);
+    }
+    free(entries);
+}
+
+/*
+ * function add_count_path(): add a path to count.
+ * algorithm: a directory is walked recursively. anything else is added
+ *            as is - symbolic links given explicitly are followed, and
+ *            non-regular files (e.g. pipes) are read to their end.
+ * input:     pointer to count, path.
+ * output:    none.
+ */
+void
+add_count_path(struct multi_count* count, const char* path)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0)
+	add_file(count, path, 0, errno);
+    else if (S_ISDIR(st.st_mode))
+	walk_directory(count, path);
+    else
+	add_file(count, path, S_ISREG(st.st_mode) ? st.st_size : 0, 0);
+}
+
+/*
+ * function count_chunk(): count the lines of a chunk of a big file.
+ * algorithm: map the chunk, and count it a block at a time. chunks of
+ *            the same file are counted by different threads, so their
+ *            counts are added to the file's count atomically.
+ * input:     work item.
+ * output:    none. the count (or error) is placed in the file.
+ */
+static void
+count_chunk(struct count_item* item)
+{
+    struct count_file* file = &item->count->files[item->first_file];
+    unsigned long long lines = 0;
+    void* data;
+    int fd;
+
+    fd = open(file->path, O_RDONLY);
+    if (fd < 0) {
+	__atomic_store_n(&file->error, errno, __ATOMIC_RELAXED);
+	return;
+    }
+    data = mmap(NULL, item->len, PROT_READ, MAP_PRIVATE, fd, item->offset);
+    if (data == MAP_FAILED) {
+	__atomic_store_n(&file->error, errno, __ATOMIC_RELAXED);
+	close(fd);
+	return;
+    }
+    madvise(data, item->len, MADV_SEQUENTIAL);
+
+    count_newlines_blocks((const char*)data, item->len, item->progress,
+			  &lines);
+    __atomic_fetch_add(&file->lines, lines, __ATOMIC_RELAXED);
+
+    munmap(data, item->len);
+    close(fd);
+}
+
+/*
+ * function count_batch(): count the lines of a batch of small files.
+ * algorithm: read each file into the thread's buffer - for small files
+ *            this is cheaper than mapping them - and count it. each file
+ *            belongs to this batch alone, so no atomics are needed.
+ * input:     work item.
+ * output:    none. the counts (or errors) are placed in the files.
+ */
+static void
+count_batch(struct count_item* item)
+{
+    int i;
+
+    for (i = item->first_file; i < item->first_file + item->num_files; i++) {
+	struct count_file* file = &item->count->files[i];
+	ssize_t n;
+	int fd;
+
+	if (file->error)
+	    continue;
+	if (scan_cancelled(item->progress))
+	    return;
+	fd = open(file->path, O_RDONLY);
+	if (fd < 0) {
+	    file->error = errno;
+	    continue;
+	}
+	while ((n = read(fd, read_buffer, MULTI_READ_SIZE)) != 0) {
+	    if (n < 0) {
+		if (errno == EINTR)
+		    continue;
+		file->error = errno;
+		break;
+	    }
+	    if (count_newlines_blocks(read_buffer, n, item->progress,
+				      &file->lines) < 0)
+		break;
+	}
+	close(fd);
+    }
+}
+
+/*
+ * function handle_count_item(): count a work item - the requests'
+ *            handling function.
+ * input:     work item.
+ * output:    none.
+ */
+static void
+handle_count_item(void* data)
+{
+    struct count_item* item = (struct count_item*)data;
+
+    if (!scan_cancelled(item->progress)) {
+	if (item->offset >= 0)
+	    count_chunk(item);
+	else
+	    count_batch(item);
+    }
+    free(item);
+}
+
+/*
+ * function queue_item(): queue a work item.
+ * input:     requests queue, its number, pointer to count, progress,
+ *            first file, number of files, offset and length of chunk.
+ * output:    none.
+ */
+static void
+queue_item(struct requests_queue* requests, int number,
+	   struct multi_count* count, struct scan_progress* progress,
+	   int first_file, int num_files, off_t offset, size_t len)
+{
+    struct count_item* item =
+	(struct count_item*)malloc(sizeof(struct count_item));
+
+    if (!item) {
+	fprintf(stderr, "queue_item: out of memory. exiting\n");
+	exit(1);
+    }
+    item->count = count;
+    item->progress = progress;
+    item->first_file = first_file;
+    item->num_files = num_files;
+    item->offset = offset;
+    item->len = len;
+    add_request_func(requests, number, handle_count_item, (void*)item, 0);
+}
+
+/*
+ * function multi_count_lines(): count the lines of all files added.
+ * algorithm: start a handler threads pool over a requests queue. go over
+ *            the files in order - split each big file into chunks, and
+ *            gather runs of small files into batches - and queue them.
+ *            then tell the handler threads no more requests are coming,
+ *            and wait for them to drain the queue and exit.
+ * input:     pointer to count, number of threads, progress of the count
+ *            (or NULL).
+ * output:    0 on success, -1 if cancelled (errno is set to ECANCELED).
+ */
+int
+multi_count_lines(struct multi_count* count, int num_threads,
+		  struct scan_progress* progress)
+{
+    /* the queue's functions lock the mutex the handlers already hold, */
+    /* so it must be recursive - as in the thread pool server.          */
+    pthread_mutex_t request_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+    pthread_cond_t  got_request = PTHREAD_COND_INITIALIZER;
+    struct requests_queue* requests;
+    struct handler_threads_pool* pool;
+    struct scan_progress own_progress;
+    int num_items = 0;	    /* number of work items queued.          */
+    int batch_first = 0;    /* first file of the batch being built.  */
+    int batch_files = 0;    /* files in the batch being built.       */
+    off_t batch_size = 0;   /* bytes in the batch being built.       */
+    int i;
+
+    if (!progress) {
+	init_scan_progress(&own_progress);
+	progress = &own_progress;
+    }
+    if (num_threads < 1)
+	num_threads = 1;
+
+    /* the handler threads of a previous count left the flag set. */
+    done_creating_requests = 0;
+    requests = init_requests_queue(&request_mutex, &got_request);
+    pool = init_handler_threads_pool(&request_mutex, &got_request, requests);
+    if (!requests || !pool) {
+	fprintf(stderr, "multi_count_lines: out of memory. exiting\n");
+	exit(1);
+    }
+    for (i = 0; i < num_threads; i++)
+	add_handler_thread(pool);
+
+    for (i = 0; i < count->num_files; i++) {
+	struct count_file* file = &count->files[i];
+
+	if (file->size > MULTI_CHUNK_SIZE) {
+	    off_t offset;
+
+	    /* a big file ends the current batch. */
+	    if (batch_files > 0) {
+		queue_item(requests, num_items++, count, progress,
+			   batch_first, batch_files, -1, 0);
+		batch_files = 0;
+	    }
+	    for (offset = 0; offset < file->size; offset += MULTI_CHUNK_SIZE)
+		queue_item(requests, num_items++, count, progress, i, 1, offset,
+			   file->size - offset < MULTI_CHUNK_SIZE ?
+			   file->size - offset : MULTI_CHUNK_SIZE);
+	    continue;
+	}
+
+	if (batch_files == 0) {
+	    batch_first = i;
+	    batch_size = 0;
+	}
+	batch_files++;
+	batch_size += file->size;
+	if (batch_size >= MULTI_BATCH_SIZE || batch_files == MULTI_BATCH_FILES) {
+	    queue_item(requests, num_items++, count, progress,
+		       batch_first, batch_files, -1, 0);
+	    batch_files = 0;
+	}
+    }
+    if (batch_files > 0)
+	queue_item(requests, num_items++, count, progress,
+		   batch_first, batch_files, -1, 0);
+
+    /* tell the handler threads no new requests will be generated, */
+    /* and wait for them to handle what is left and exit.          */
+    pthread_mutex_lock(&request_mutex);
+    done_creating_requests = 1;
+    pthread_cond_broadcast(&got_request);
+    pthread_mutex_unlock(&request_mutex);
+
+    delete_handler_threads_pool(pool);
+    free(pool);
+    delete_requests_queue(requests);
+
+    if (scan_cancelled(progress)) {
+	errno = ECANCELED;
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * function free_multi_count(): free the files of a multi-file count.
+ * input:     pointer to count.
+ * output:    none.
+ */
+void
+free_multi_count(struct multi_count* count)
+{
+    int i;
+
+    for (i = 0; i < count->num_files; i++)
+	free(count->files[i].path);
+    free(count->files);
+    init_multi_count(count);
+}
@@ -0,0 +1,69 @@
+#ifndef MULTI_COUNT_H
+# define MULTI_COUNT_H
+
+#include <sys/types.h>   /* off_t                                     */
+
+#include "line_scan.h"   /* struct scan_progress                      */
+
+/*
+ * 'wc -l' style line counting of many files. directories are walked
+ * recursively, and the files found are cut into work items - big files
+ * into chunks, small files batched together - so all items are of about
+ * the same size. the items are queued on a requests queue, and counted
+ * by the threads of a handler threads pool. the files are kept in the
+ * order they were found, so the results print in a deterministic order.
+ */
+
+/* files bigger than this are split into chunks of this size. it must */
+/* be a multiple of the page size, as chunks are mapped into memory.  */
+#define MULTI_CHUNK_SIZE (8 * 1024 * 1024)
+
+/* small files are batched together, up to this many bytes or files. */
+#define MULTI_BATCH_SIZE MULTI_CHUNK_SIZE
+#define MULTI_BATCH_FILES 256
+
+/* size of the buffer small files are read into. */
+#define MULTI_READ_SIZE (64 * 1024)
+
+/* a file to count, and the result. */
+struct count_file {
+    char* path;			/* path of the file.                     */
+    off_t size;			/* size of the file, when it was found.  */
+    unsigned long long lines;	/* lines counted (summed up atomically). */
+    int error;			/* errno of a failure, 0 if none.        */
+};
+
+/* the files of a multi-file count, in the order they were found. */
+struct multi_count {
+    struct count_file* files;	/* array of files.                       */
+    int num_files;		/* number of files in the array.         */
+    int max_files;		/* size of the array.                    */
+};
+
+/* start an empty multi-file count. */
+extern void
+init_multi_count(struct multi_count* count);
+
+/*
+ * add a path to count - a file, or a directory which is walked
+ * recursively, its entries in name order. paths that cannot be counted
+ * are added too, with their error, so they are reported in order.
+ */
+extern void
+add_count_path(struct multi_count* count, const char* path);
+
+/*
+ * count the lines of all files added, with 'num_threads' handler
+ * threads, reporting to 'progress' (may be NULL). returns 0 on success,
+ * -1 if the count was cancelled (errno ECANCELED). errors of single
+ * files are placed in their 'error' field.
+ */
+extern int
+multi_count_lines(struct multi_count* count, int num_threads,
+		  struct scan_progress* progress);
+
+/* free the files of a multi-file count. */
+extern void
+free_multi_count(struct multi_count* count);
+
+#endif /* MULTI_COUNT_H */
@@ -0,0 +1,540 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <string.h>      /* memcpy(), memchr()                        */
+#include <stdint.h>      /* fixed-size integer types                  */
+#include <errno.h>       /* errno and error codes                     */
+#include <fcntl.h>       /* open()                                    */
+#include <unistd.h>      /* close(), sysconf(), pread()               */
+#include <sys/stat.h>    /* fstat()                                   */
+#include <sys/mman.h>    /* mmap(), madvise()                         */
+
+#include "line_scan.h"       /* newline counting kernels              */
+#include "parallel_count.h"  /* parallel line counting functions      */
+
+/* one thread's share of the file. */
+struct count_chunk {
+    int fd;			   /* file descriptor of the file.       */
+    off_t start;		   /* offset of chunk (page-aligned).    */
+    off_t end;			   /* offset just past the chunk.        */
+    unsigned long long lines;	   /* newlines found in the chunk.       */
+    int use_reads;		   /* read with pread(), not mmap()?     */
+    int error;			   /* errno of a failure, 0 if none.     */
+    struct scan_progress* progress; /* progress of the whole scan.       */
+    unsigned int sample_every;	   /* sample every N-th line, 0 - never. */
+    unsigned long long next_sample; /* newline the next sample follows.  */
+    off_t* samples;		   /* offsets of the sampled lines.      */
+    size_t num_samples;		   /* number of sampled lines.           */
+    size_t max_samples;		   /* size of the 'samples' array.       */
+    pthread_t thread;		   /* the thread counting the chunk.     */
+};
+
+/* state shared with the cleanup handler of count_file_chunks(). */
+struct count_workers {
+    int fd;			   /* file to close, -1 if the caller's. */
+    struct count_chunk* chunks;	   /* array of chunks.                   */
+    int num_started;		   /* number of threads started.         */
+    int num_joined;		   /* number of threads joined so far.   */
+    struct scan_progress* progress; /* progress of the whole scan.       */
+};
+
+/*
+ * function default_num_threads(): get the default number of threads.
+ * input:     none.
+ * output:    number of online CPUs, at least 1.
+ */
+int
+default_num_threads(void)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return num_cpus > 0 ? (int)num_cpus : 1;
+}
+
+/* record the start of a line, in a chunk's samples array. */
+static void
+add_chunk_sample(struct count_chunk* chunk, off_t offset)
+{
+    if (chunk->num_samples == chunk->max_samples) {
+	chunk->max_samples = chunk->max_samples ? chunk->max_samples * 2 : 64;
+	chunk->samples = (off_t*)realloc(chunk->samples,
+					 chunk->max_samples * sizeof(off_t));
+	if (!chunk->samples) {
+	    fprintf(stderr, "add_chunk_sample: out of memory. exiting\n");
+	    exit(1);
+	}
+    }
+    chunk->samples[chunk->num_samples++] = offset;
+}
+
+/*
+ * function skip_newlines(): find the end of the n-th newline of a buffer.
+ * algorithm: skip whole pieces holding fewer newlines than are left to
+ *            skip, counting them with the newline kernel. then, like
+ *            the scalar kernel, turn 8 bytes at a time into a word with
+ *            the high bit of each newline byte set, and skip whole
+ *            words the same way. in the word holding the last newline,
+ *            clear the lowest bits of the ones before it, and locate it
+ *            by its bit's position. the buffer must hold 'n' newlines.
+ * input:     buffer, its end, number of newlines to skip (at least 1).
+ * output:    pointer just past the n-th newline.
+ */
+static const char*
+skip_newlines(const char* p, const char* end, unsigned long long n)
+{
+    const uint64_t newlines = 0x0a0a0a0a0a0a0a0aULL;
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+
+    while (end - p >= PARALLEL_SKIP_PIECE) {
+	unsigned long long found = count_newlines(p, PARALLEL_SKIP_PIECE);
+
+	if (found >= n)
+	    break;
+	n -= found;
+	p += PARALLEL_SKIP_PIECE;
+    }
+    for (; end - p >= 8; p += 8) {
+	uint64_t word, t;
+	unsigned int found;
+
+	memcpy(&word, p, 8);
+	word ^= newlines;
+	t = (word & low7) + low7;
+	t = ~(t | word | low7);
+	found = __builtin_popcountll(t);
+	if (found < n) {
+	    n -= found;
+	    continue;
+	}
+	while (--n > 0)
+	    t &= t - 1;
+	/* bytes are loaded in little endian order. */
+	return p + __builtin_ctzll(t) / 8 + 1;
+    }
+    for (; n > 0; n--)
+	p = (const char*)memchr(p, '\n', end - p) + 1;
+
+    return p;
+}
+
+/*
+ * function sample_chunk_lines(): count a window's newlines, sampling.
+ * algorithm: count the window a step at a time, with the newline
+ *            kernel. only when a step holds the newline a sample follows
+ *            is it walked, up to that newline - so sampling costs little
+ *            more than counting. like count_newlines_blocks(), check for
+ *            a cancel request and publish the progress once per block.
+ * input:     pointer to the chunk, the window, its length, and offset
+ *            in the file.
+ * output:    0 if the whole window was counted, -1 if cancelled.
+ */
+static int
+sample_chunk_lines(struct count_chunk* chunk, const char* window, size_t len,
+		   off_t offset)
+{
+    size_t pos;
+
+    for (pos = 0; pos < len; pos += SCAN_BLOCK_SIZE) {
+	size_t block = len - pos < SCAN_BLOCK_SIZE ?
+		       len - pos : SCAN_BLOCK_SIZE;
+	unsigned long long lines_before = chunk->lines;
+	size_t step_pos;
+
+	if (scan_cancelled(chunk->progress))
+	    return -1;
+	for (step_pos = pos; step_pos < pos + block;
+	     step_pos += PARALLEL_SAMPLE_STEP) {
+	    size_t step = pos + block - step_pos < PARALLEL_SAMPLE_STEP ?
+			  pos + block - step_pos : PARALLEL_SAMPLE_STEP;
+	    const char* p = window + step_pos;
+	    const char* end = p + step;
+	    unsigned long long found = count_newlines(p, step);
+
+	    /* 'p' follows newline number 'chunk->lines' - or starts the step. */
+	    while (chunk->lines + found >= chunk->next_sample) {
+		unsigned long long skip = chunk->next_sample - chunk->lines;
+
+		found -= skip;
+		chunk->lines += skip;
+		p = skip_newlines(p, end, skip);
+		add_chunk_sample(chunk, offset + (p - window));
+		chunk->next_sample += chunk->sample_every;
+	    }
+	    chunk->lines += found;
+	}
+	add_scan_progress(chunk->progress, block, chunk->lines - lines_before);
+    }
+
+    return 0;
+}
+
+/*
+ * function read_chunk_lines(): count a chunk's newlines, reading it.
+ * algorithm: read the chunk into a buffer with pread(), a piece at a
+ *            time, and count each piece's newlines a block at a time.
+ *            unlike a mapping - touching a page past the end of a file
+ *            that shrank raises SIGBUS - a read past its end just
+ *            returns short: the chunk then fails with ENODATA.
+ * input:     pointer to the chunk.
+ * output:    none. the count (or error) is placed in the chunk.
+ */
+static void
+read_chunk_lines(struct count_chunk* chunk)
+{
+    char* buffer = (char*)malloc(PARALLEL_READ_SIZE);
+    off_t offset;
+    ssize_t len;
+
+    if (!buffer) {
+	fprintf(stderr, "read_chunk_lines: out of memory. exiting\n");
+	exit(1);
+    }
+    for (offset = chunk->start; offset < chunk->end; offset += len) {
+	size_t want = chunk->end - offset < PARALLEL_READ_SIZE ?
+		      chunk->end - offset : PARALLEL_READ_SIZE;
+
+	len = pread(chunk->fd, buffer, want, offset);
+	if (len <= 0) {
+	    if (len < 0 && errno == EINTR) {
+		len = 0;
+		continue;
+	    }
+	    chunk->error = len < 0 ? errno : ENODATA;
+	    break;
+	}
+	if (count_newlines_blocks(buffer, len, chunk->progress,
+				  &chunk->lines) < 0) {
+	    chunk->error = ECANCELED;
+	    break;
+	}
+    }
+    free(buffer);
+}
+
+/*
+ * function count_chunk_lines(): a counting thread's function.
+ * algorithm: map the chunk one window at a time, and count its
+ *            newlines a block at a time (sampling line starts, if
+ *            asked to). a window is mapped from the page its first byte
+ *            is in, as mmap offsets must be page-aligned - only the
+ *            first chunk of a range may start mid-page. between blocks,
+ *            check if the scan was cancelled, and if so - stop, with the
+ *            window unmapped (an asynchronously cancelled thread would
+ *            leak it). a chunk of a file that may shrink is read instead.
+ * input:     pointer to the thread's chunk.
+ * output:    none. the count (or error) is placed in the chunk.
+ */
+static void*
+count_chunk_lines(void* data)
+{
+    struct count_chunk* chunk = (struct count_chunk*)data;
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t offset;
+    size_t len;
+
+    if (chunk->use_reads) {
+	read_chunk_lines(chunk);
+	return NULL;
+    }
+
+    for (offset = chunk->start; offset < chunk->end; offset += len) {
+	size_t head = offset % page_size;
+	void* window;
+
+	len = chunk->end - offset < PARALLEL_WINDOW_SIZE - head ?
+	      chunk->end - offset : PARALLEL_WINDOW_SIZE - head;
+	window = mmap(NULL, head + len, PROT_READ, MAP_PRIVATE,
+		      chunk->fd, offset - head);
+	if (window == MAP_FAILED) {
+	    chunk->error = errno;
+	    return NULL;
+	}
+	madvise(window, head + len, MADV_SEQUENTIAL);
+
+	if ((chunk->sample_every ?
+	     sample_chunk_lines(chunk, (const char*)window + head, len,
+				offset) :
+	     count_newlines_blocks((const char*)window + head, len,
+				   chunk->progress, &chunk->lines)) < 0) {
+	    munmap(window, head + len);
+	    chunk->error = ECANCELED;
+	    return NULL;
+	}
+
+	munmap(window, head + len);
+    }
+
+    return NULL;
+}
+
+/*
+ * function cancel_workers(): cleanup handler of count_file_chunks().
+ * algorithm: if the calling thread is cancelled while waiting for the
+ *            counting threads, ask them to stop, and join them. in any
+ *            case, free the chunks, and close the file if we opened it.
+ * input:     pointer to the workers' state.
+ * output:    none.
+ */
+static void
+cancel_workers(void* data)
+{
+    struct count_workers* workers = (struct count_workers*)data;
+    int i;
+
+    if (workers->num_joined < workers->num_started)
+	cancel_scan(workers->progress);
+    for (i = workers->num_joined; i < workers->num_started; i++)
+	pthread_join(workers->chunks[i].thread, NULL);
+    for (i = 0; i < workers->num_started; i++)
+	free(workers->chunks[i].samples);
+    free(workers->chunks);
+    if (workers->fd >= 0)
+	close(workers->fd);
+}
+
+/*
+ * function merge_samples(): gather the chunks' samples into one array.
+ * algorithm: a chunk's samples follow its newlines number 1, 1 + N,
+ *            1 + 2N, ... so their line numbers are known once the lines
+ *            of the chunks before it are - which they are, after all
+ *            the threads are joined. line 0 starts the file.
+ * input:     the workers' state, sampling interval, where to place the
+ *            samples and their number.
+ * output:    none.
+ */
+static void
+merge_samples(struct count_workers* workers, unsigned int sample_every,
+	      struct line_sample** samples, size_t* num_samples)
+{
+    unsigned long long chunk_line = 0;
+    size_t total = 1;
+    size_t n = 0;
+    size_t j;
+    int i;
+
+    for (i = 0; i < workers->num_started; i++)
+	total += workers->chunks[i].num_samples;
+    *samples = (struct line_sample*)malloc(total * sizeof(struct line_sample));
+    if (!*samples) {
+	fprintf(stderr, "merge_samples: out of memory. exiting\n");
+	exit(1);
+    }
+
+    (*samples)[n].line = 0;
+    (*samples)[n++].offset = 0;
+    for (i = 0; i < workers->num_started; i++) {
+	struct count_chunk* chunk = &workers->chunks[i];
+
+	for (j = 0; j < chunk->num_samples; j++) {
+	    (*samples)[n].line = chunk_line + 1 + j * sample_every;
+	    (*samples)[n++].offset = chunk->samples[j];
+	}
+	chunk_line += chunk->lines;
+    }
+    *num_samples = n;
+}
+
+/*
+ * function count_file_chunks(): count the lines of a file's range in
+ *                              parallel.
+ * algorithm: split the range into equal chunks, rounded up to whole
+ *            pages and starting on page boundaries (but the first, if
+ *            the range does not), spawn a thread per chunk, and sum up
+ *            their counts. all sizes and counts are 64 bit, so files
+ *            over 4GB are counted correctly.
+ *            the threads report to 'progress', and stop once it is
+ *            cancelled. with no 'progress', a private one is used.
+ *            with a sampling interval, the threads also sample line
+ *            starts, and their samples are merged at the end.
+ * input:     file descriptor, start and end of the range, whether to
+ *            close the file when done, whether to read it rather than
+ *            map it, number of threads, sampling interval (0 - don't
+ *            sample), progress of the scan (or NULL), where to place
+ *            the count, the samples and their number.
+ * output:    0 on success, -1 on error (errno is set; ECANCELED if the
+ *            scan was cancelled, ENODATA if a read range got shorter).
+ */
+static int
+count_file_chunks(int fd, off_t start, off_t end, int close_fd,
+		  int use_reads, int num_threads, unsigned int sample_every,
+		  struct scan_progress* progress, unsigned long long* lines,
+		  struct line_sample** samples, size_t* num_samples)
+{
+    struct count_workers workers;
+    struct scan_progress own_progress;
+    off_t chunk_size;
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t base = start / page_size * page_size;
+    int num_chunks;
+    int error = 0;
+    int i;
+
+    /* decide on the chunks' size, and on how many of them we need. */
+    if (num_threads < 1)
+	num_threads = 1;
+    if (end < start)
+	end = start;
+    chunk_size = (end - start + num_threads - 1) / num_threads;
+    if (chunk_size < PARALLEL_MIN_CHUNK_SIZE)
+	chunk_size = PARALLEL_MIN_CHUNK_SIZE;
+    chunk_size = (chunk_size + page_size - 1) / page_size * page_size;
+    num_chunks = (end - base + chunk_size - 1) / chunk_size;
+
+    workers.chunks = (struct count_chunk*)
+		     calloc(num_chunks > 0 ? num_chunks : 1,
+			    sizeof(struct count_chunk));
+    if (!workers.chunks) {
+	fprintf(stderr, "parallel_count_lines: out of memory. exiting\n");
+	exit(1);
+    }
+    workers.num_started = 0;
+    workers.num_joined = 0;
+    workers.fd = close_fd ? fd : -1;
+    if (!progress) {
+	init_scan_progress(&own_progress);
+	progress = &own_progress;
+    }
+    workers.progress = progress;
+
+    /* if we are cancelled while waiting, take the workers down with us. */
+    pthread_cleanup_push(cancel_workers, (void*)&workers);
+
+    for (i = 0; i < num_chunks; i++) {
+	struct count_chunk* chunk = &workers.chunks[i];
+
+	chunk->fd = fd;
+	chunk->use_reads = use_reads;
+	chunk->progress = progress;
+	chunk->sample_every = sample_every;
+	chunk->next_sample = 1;
+	chunk->start = base + (off_t)i * chunk_size;
+	if (chunk->start < start)
+	    chunk->start = start;
+	chunk->end = base + (off_t)(i + 1) * chunk_size < end ?
+		     base + (off_t)(i + 1) * chunk_size : end;
+	if (pthread_create(&chunk->thread, NULL, count_chunk_lines,
+			   (void*)chunk) != 0) {
+	    fprintf(stderr, "parallel_count_lines: cannot create thread. "
+			    "exiting\n");
+	    exit(1);
+	}
+	workers.num_started++;
+    }
+
+    *lines = 0;
+    for (i = 0; i < workers.num_started; i++) {
+	pthread_join(workers.chunks[i].thread, NULL);
+	workers.num_joined++;
+	*lines += workers.chunks[i].lines;
+	if (workers.chunks[i].error &&
+	    (!error || error == ECANCELED))
+	    error = workers.chunks[i].error;
+    }
+    if (sample_every && !error)
+	merge_samples(&workers, sample_every, samples, num_samples);
+
+    /* pop the cleanup handler, while executing it, to free the chunks */
+    /* (and close the file).                                           */
+    pthread_cleanup_pop(1);
+
+    if (error) {
+	errno = error;
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * function count_whole_file(): open a file, and count all its lines in
+ *                              parallel.
+ * input:     file name, number of threads, sampling interval, progress
+ *            of the scan (or NULL), where to place the count, the
+ *            samples and their number.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+static int
+count_whole_file(const char* file_name, int num_threads,
+		 unsigned int sample_every, struct scan_progress* progress,
+		 unsigned long long* lines,
+		 struct line_sample** samples, size_t* num_samples)
+{
+    struct stat st;
+    int fd;
+    int error;
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+	return -1;
+    if (fstat(fd, &st) < 0) {
+	error = errno;
+	close(fd);
+	errno = error;
+	return -1;
+    }
+
+    return count_file_chunks(fd, 0, st.st_size, 1, 0, num_threads,
+			     sample_every, progress, lines, samples,
+			     num_samples);
+}
+
+/*
+ * function parallel_count_lines(): count a file's lines in parallel.
+ * input:     file name, number of threads, progress of the scan (or
+ *            NULL), where to place the count.
+ * output:    0 on success, -1 on error (errno is set; ECANCELED if the
+ *            scan was cancelled).
+ */
+int
+parallel_count_lines(const char* file_name, int num_threads,
+		     struct scan_progress* progress,
+		     unsigned long long* lines)
+{
+    return count_whole_file(file_name, num_threads, 0, progress, lines,
+			    NULL, NULL);
+}
+
+/*
+ * function parallel_sample_lines(): count a file's lines in parallel,
+ *                                   sampling line starts.
+ * input:     file name, number of threads, sampling interval, progress
+ *            of the scan (or NULL), where to place the count, the
+ *            samples and their number.
+ * output:    0 on success, -1 on error (errno is set; ECANCELED if the
+ *            scan was cancelled).
+ */
+int
+parallel_sample_lines(const char* file_name, int num_threads,
+		      unsigned int sample_every,
+		      struct scan_progress* progress,
+		      unsigned long long* lines,
+		      struct line_sample** samples, size_t* num_samples)
+{
+    if (sample_every < 1) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    return count_whole_file(file_name, num_threads, sample_every, progress,
+			    lines, samples, num_samples);
+}
+
+/*
+ * function parallel_count_range(): count the lines of a range of an
+ *                                  open file in parallel.
+ * algorithm: the file may shrink meanwhile, so read it, not map it.
+ * input:     file descriptor, start and end of the range, number of
+ *            threads, progress of the scan (or NULL), where to place
+ *            the count.
+ * output:    0 on success, -1 on error (errno is set; ECANCELED if the
+ *            scan was cancelled, ENODATA if the file got shorter than
+ *            the range).
+ */
+int
+parallel_count_range(int fd, off_t start, off_t end, int num_threads,
+		     struct scan_progress* progress,
+		     unsigned long long* lines)
+{
+    return count_file_chunks(fd, start, end, 0, 1, num_threads, 0, progress,
+			     lines, NULL, NULL);
+}
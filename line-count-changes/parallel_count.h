@@ -0,0 +1,81 @@
+#ifndef PARALLEL_COUNT_H
+# define PARALLEL_COUNT_H
+
+#include <sys/types.h>   /* off_t                                     */
+
+#include "line_scan.h"   /* struct scan_progress                      */
+
+/*
+ * parallel line counting. the file is split into page-aligned chunks,
+ * one per thread. each thread maps its chunk a window at a time, counts
+ * its newlines, and the partial counts are summed up.
+ */
+
+/* size of the window of a chunk that is mapped at once. */
+#define PARALLEL_WINDOW_SIZE (64 * 1024 * 1024)
+
+/* size of the pieces a range that may shrink is read in. */
+#define PARALLEL_READ_SIZE (1024 * 1024)
+
+/* chunks are never made smaller than this - tiny files use one thread. */
+#define PARALLEL_MIN_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * while sampling, a window is counted in steps of this size, and only a
+ * step holding a sampled line start is walked newline by newline.
+ */
+#define PARALLEL_SAMPLE_STEP 4096
+
+/* ... and walked over pieces of this size, again counted by the kernel. */
+#define PARALLEL_SKIP_PIECE 256
+
+/* a line start recorded while counting. lines are numbered from 0. */
+struct line_sample {
+    unsigned long long line;	/* number of the line.               */
+    off_t offset;		/* offset of its first byte.         */
+};
+
+/* get the default number of counting threads - the online CPUs count. */
+extern int
+default_num_threads(void);
+
+/*
+ * count the lines of the given file with (up to) 'num_threads' threads,
+ * reporting to 'progress' (may be NULL). returns 0 on success, -1 on
+ * error (with errno set - ECANCELED if the scan was cancelled).
+ */
+extern int
+parallel_count_lines(const char* file_name, int num_threads,
+		     struct scan_progress* progress,
+		     unsigned long long* lines);
+
+/*
+ * count the lines of the given file like parallel_count_lines(), and
+ * also record where lines start - line 0, and in each chunk, the lines
+ * following its newlines number 1, 1 + 'sample_every', 1 + 2 *
+ * 'sample_every', ... so no line is more than 'sample_every' lines past
+ * the last line start recorded before it. the samples are placed, in
+ * order of their lines, in a malloc()ed array in '*samples'.
+ * returns 0 on success, -1 on error (with errno set - ECANCELED if the
+ * scan was cancelled).
+ */
+extern int
+parallel_sample_lines(const char* file_name, int num_threads,
+		      unsigned int sample_every,
+		      struct scan_progress* progress,
+		      unsigned long long* lines,
+		      struct line_sample** samples, size_t* num_samples);
+
+/*
+ * count the lines of bytes 'start' to 'end' of an open file, like
+ * parallel_count_lines() - e.g. the bytes appended to a file since it
+ * was last counted. the file is left open. the range is read with
+ * pread(), not mapped, so a file truncated meanwhile makes it fail with
+ * ENODATA, rather than kill the process with SIGBUS.
+ */
+extern int
+parallel_count_range(int fd, off_t start, off_t end, int num_threads,
+		     struct scan_progress* progress,
+		     unsigned long long* lines);
+
+#endif /* PARALLEL_COUNT_H */
@@ -0,0 +1,552 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdlib.h>      /* calloc() and free()                       */
+#include <string.h>      /* memset(), memcpy(), memcmp(), memchr()    */
+#include <stdint.h>      /* fixed-size integer types                  */
+#include <errno.h>       /* errno and error codes                     */
+
+#if defined(__x86_64__)
+#include <immintrin.h>   /* AVX2 intrinsics                           */
+#endif /* __x86_64__ */
+
+#include "line_scan.h"       /* kernel choice, mapped files, progress */
+#include "parallel_count.h"  /* chunk sizes                           */
+#include "pattern_scan.h"    /* pattern counting functions and structs */
+
+/* one thread's share of the file. */
+struct pattern_chunk {
+    const struct pattern* pattern;  /* what to count.                    */
+    const char* data;		    /* the whole file, mapped.           */
+    size_t file_size;		    /* size of the file.                 */
+    size_t start;		    /* offset of the chunk.              */
+    size_t end;			    /* offset just past the chunk.       */
+    struct scan_progress* progress; /* progress of the whole scan.       */
+    struct pattern_counts counts;   /* what was found in the chunk.      */
+    int cancelled;		    /* did the chunk stop early?         */
+    pthread_t thread;		    /* the thread counting the chunk.    */
+};
+
+/* is a byte white space - a word separator, as 'wc' sees it in the C */
+/* locale: space, \t, \n, \v, \f and \r.                              */
+static int
+is_space(unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* is a byte printable (and not a space) - a byte that starts a word.  */
+/* other bytes (control bytes, bytes over 127) neither start nor end a */
+/* word, as in 'wc'.                                                   */
+static int
+is_printable(unsigned char c)
+{
+    return c > ' ' && c < 127;
+}
+
+/* should the AVX2 kernels be used? follow the newline kernels' choice. */
+static int
+use_avx2(void)
+{
+#if defined(__x86_64__)
+    return get_scan_kernel() == SCAN_KERNEL_AVX2;
+#else
+    return 0;
+#endif /* __x86_64__ */
+}
+
+/*
+ * function init_pattern(): set up a pattern.
+ * algorithm: copy the bytes, and build the set's membership table. a
+ *            string of one byte is counted as a set - that is faster.
+ *            also find if the string can overlap itself (some proper
+ *            prefix of it is also a suffix); if it can't, every
+ *            occurrence is a non-overlapping one, so the file can be
+ *            split between threads anywhere.
+ * input:     pattern to set up, mode, bytes, their number.
+ * output:    0 on success, -1 on bad bytes (errno EINVAL).
+ */
+int
+init_pattern(struct pattern* pattern, enum pattern_mode mode,
+	     const char* bytes, size_t len)
+{
+    size_t i;
+
+    memset(pattern, 0, sizeof(*pattern));
+    pattern->mode = mode;
+    if (mode == PATTERN_WC)
+	return 0;
+    if (len == 0 || len > PATTERN_MAX_LEN) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (mode == PATTERN_STRING && len == 1)
+	pattern->mode = mode = PATTERN_SET;
+
+    if (mode == PATTERN_SET) {
+	/* keep each byte of the set once. */
+	for (i = 0; i < len; i++) {
+	    unsigned char c = (unsigned char)bytes[i];
+
+	    if (!pattern->in_set[c]) {
+		pattern->in_set[c] = 1;
+		pattern->bytes[pattern->len++] = c;
+	    }
+	}
+	return 0;
+    }
+
+    memcpy(pattern->bytes, bytes, len);
+    pattern->len = len;
+    for (i = 1; i < len; i++) {
+	if (memcmp(pattern->bytes + i, pattern->bytes, len - i) == 0) {
+	    pattern->self_overlapping = 1;
+	    break;
+	}
+    }
+
+    return 0;
+}
+
+/* portable set kernel - a table lookup per byte. */
+static unsigned long long
+count_byte_set_scalar(const struct pattern* pattern, const unsigned char* buf,
+		      size_t len)
+{
+    unsigned long long count = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	count += pattern->in_set[buf[i]];
+
+    return count;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * function count_byte_set_avx2(): AVX2 set kernel.
+ * algorithm: as the newline kernel, but a byte matches if it equals any
+ *            of the set's bytes - OR the compares with each of them.
+ * input:     pattern, buffer, its length.
+ * output:    number of bytes of the buffer in the set.
+ */
+__attribute__ ((target ("avx2")))
+static unsigned long long
+count_byte_set_avx2(const struct pattern* pattern, const unsigned char* buf,
+		    size_t len)
+{
+    __m256i delims[PATTERN_SIMD_SET];
+    int num_delims = pattern->len;
+    unsigned long long count = 0;
+    size_t i = 0;
+    int k;
+
+    for (k = 0; k < num_delims; k++)
+	delims[k] = _mm256_set1_epi8(pattern->bytes[k]);
+
+    while (len - i >= 32) {
+	__m256i acc = _mm256_setzero_si256();
+	__m256i sums;
+	size_t rounds = (len - i) / 32;
+
+	if (rounds > 255)
+	    rounds = 255;
+	for (; rounds > 0; rounds--, i += 32) {
+	    __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+	    __m256i match = _mm256_cmpeq_epi8(v, delims[0]);
+
+	    for (k = 1; k < num_delims; k++)
+		match = _mm256_or_si256(match, _mm256_cmpeq_epi8(v, delims[k]));
+	    acc = _mm256_sub_epi8(acc, match);
+	}
+	sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+	count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+		 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+
+    return count + count_byte_set_scalar(pattern, buf + i, len - i);
+}
+
+#endif /* __x86_64__ */
+
+/*
+ * function count_byte_set(): count the bytes of a buffer in a set.
+ * input:     pattern, buffer, its length.
+ * output:    number of bytes of the buffer in the pattern's set.
+ */
+unsigned long long
+count_byte_set(const struct pattern* pattern, const char* buf, size_t len)
+{
+    if (pattern->len == 1 && pattern->bytes[0] == '\n')
+	return count_newlines(buf, len);
+#if defined(__x86_64__)
+    if (pattern->len <= PATTERN_SIMD_SET && use_avx2())
+	return count_byte_set_avx2(pattern, (const unsigned char*)buf, len);
+#endif /* __x86_64__ */
+    return count_byte_set_scalar(pattern, (const unsigned char*)buf, len);
+}
+
+/*
+ * function count_string_scalar(): portable string kernel.
+ * algorithm: find candidates by their first byte with memchr() (itself
+ *            vectorized by the C library), and verify them.
+ * input:     pattern, buffer, positions to check (from 'start' up to
+ *            'len'), readable bytes, where the next match may start.
+ * output:    number of occurrences found.
+ */
+static unsigned long long
+count_string_scalar(const struct pattern* pattern, const unsigned char* buf,
+		    size_t start, size_t len, size_t avail, size_t* next)
+{
+    size_t m = pattern->len;
+    unsigned long long count = 0;
+    size_t i = start > *next ? start : *next;
+
+    while (i < len && i + m <= avail) {
+	const unsigned char* hit = (const unsigned char*)
+				   memchr(buf + i, pattern->bytes[0], len - i);
+
+	if (!hit)
+	    break;
+	i = hit - buf;
+	if (i + m > avail)
+	    break;
+	if (memcmp(hit + 1, pattern->bytes + 1, m - 1) == 0) {
+	    count++;
+	    i += m;
+	    *next = i;
+	}
+	else
+	    i++;
+    }
+
+    return count;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * function count_string_avx2(): AVX2 string kernel.
+ * algorithm: for 32 positions at once, compare the byte at each position
+ *            with the string's first byte, and the byte m-1 further with
+ *            its last byte. only positions matching both (rare, for
+ *            most strings) are verified with memcmp(). matches are
+ *            taken greedily left to right, skipping positions inside
+ *            the previous match.
+ * input:     pattern, buffer, positions to check (up to 'len'), readable
+ *            bytes, where the next match may start.
+ * output:    number of occurrences found.
+ */
+__attribute__ ((target ("avx2")))
+static unsigned long long
+count_string_avx2(const struct pattern* pattern, const unsigned char* buf,
+		  size_t len, size_t avail, size_t* next)
+{
+    size_t m = pattern->len;
+    const __m256i first = _mm256_set1_epi8(pattern->bytes[0]);
+    const __m256i last = _mm256_set1_epi8(pattern->bytes[m - 1]);
+    unsigned long long count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len && i + 32 + m - 1 <= avail; i += 32) {
+	__m256i a = _mm256_loadu_si256((const __m256i*)(buf + i));
+	__m256i b = _mm256_loadu_si256((const __m256i*)(buf + i + m - 1));
+	uint32_t candidates = _mm256_movemask_epi8(
+	    _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+			     _mm256_cmpeq_epi8(b, last)));
+
+	while (candidates) {
+	    size_t pos = i + __builtin_ctz(candidates);
+
+	    candidates &= candidates - 1;
+	    if (pos < *next)
+		continue;
+	    if (m <= 2 ||
+		memcmp(buf + pos + 1, pattern->bytes + 1, m - 2) == 0) {
+		count++;
+		*next = pos + m;
+	    }
+	}
+    }
+
+    return count + count_string_scalar(pattern, buf, i, len, avail, next);
+}
+
+#endif /* __x86_64__ */
+
+/*
+ * function count_string(): count occurrences of a string in a buffer.
+ * input:     pattern, buffer, its length, readable bytes, bytes to skip
+ *            (updated for the next buffer).
+ * output:    number of occurrences starting in the buffer.
+ */
+unsigned long long
+count_string(const struct pattern* pattern, const char* buf, size_t len,
+	     size_t avail, size_t* skip)
+{
+    size_t next = *skip;
+    unsigned long long count;
+
+#if defined(__x86_64__)
+    if (use_avx2())
+	count = count_string_avx2(pattern, (const unsigned char*)buf, len,
+				  avail, &next);
+    else
+#endif /* __x86_64__ */
+	count = count_string_scalar(pattern, (const unsigned char*)buf, 0, len,
+				    avail, &next);
+    *skip = next > len ? next - len : 0;
+
+    return count;
+}
+
+/* portable words kernel - a byte at a time. */
+static void
+count_words_scalar(const unsigned char* buf, size_t len, int* after_space,
+		   struct pattern_counts* counts)
+{
+    int space = *after_space;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	if (is_space(buf[i])) {
+	    space = 1;
+	    counts->lines += buf[i] == '\n';
+	}
+	else if (is_printable(buf[i])) {
+	    counts->words += space;
+	    space = 0;
+	}
+    }
+    *after_space = space;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * function count_words_avx2(): AVX2 words kernel.
+ * algorithm: classify 32 bytes at once - white space is a space, or a
+ *            byte in \t..\r (unsigned b - \t <= 4), printable is a byte
+ *            in '!'..'~'. as bit masks, a word starts at each printable
+ *            bit whose previous bit (carried over from the previous 32
+ *            bytes) is a space bit. bytes of neither kind carry the state
+ *            of the byte before them along - rare in text, so 32 bytes
+ *            holding any of them are counted by the portable kernel.
+ * input:     buffer, its length, was the previous byte a space, counts.
+ * output:    none. lines and words are added to the counts.
+ */
+__attribute__ ((target ("avx2")))
+static void
+count_words_avx2(const unsigned char* buf, size_t len, int* after_space,
+		 struct pattern_counts* counts)
+{
+    const __m256i newlines = _mm256_set1_epi8('\n');
+    const __m256i spaces = _mm256_set1_epi8(' ');
+    const __m256i tabs = _mm256_set1_epi8('\t');
+    const __m256i fours = _mm256_set1_epi8(4);
+    const __m256i bangs = _mm256_set1_epi8('!');
+    const __m256i printables = _mm256_set1_epi8('~' - '!');
+    uint32_t prev = *after_space ? 1 : 0;
+    unsigned long long lines = 0;
+    unsigned long long words = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+	__m256i t = _mm256_sub_epi8(v, tabs);
+	__m256i ws = _mm256_or_si256(
+	    _mm256_cmpeq_epi8(v, spaces),
+	    _mm256_cmpeq_epi8(_mm256_min_epu8(t, fours), t));
+	__m256i p = _mm256_sub_epi8(v, bangs);
+	__m256i pr = _mm256_cmpeq_epi8(_mm256_min_epu8(p, printables), p);
+	uint32_t space_bits = _mm256_movemask_epi8(ws);
+	uint32_t print_bits = _mm256_movemask_epi8(pr);
+	uint32_t newline_bits =
+	    _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newlines));
+
+	if ((space_bits | print_bits) != 0xffffffffU) {
+	    struct pattern_counts block_counts = { 0, 0, 0, 0 };
+	    int space = prev;
+
+	    count_words_scalar(buf + i, 32, &space, &block_counts);
+	    lines += block_counts.lines;
+	    words += block_counts.words;
+	    prev = space;
+	    continue;
+	}
+	lines += __builtin_popcount(newline_bits);
+	words += __builtin_popcount(print_bits & ((space_bits << 1) | prev));
+	prev = space_bits >> 31;
+    }
+    counts->lines += lines;
+    counts->words += words;
+    *after_space = prev;
+
+    count_words_scalar(buf + i, len - i, after_space, counts);
+}
+
+#endif /* __x86_64__ */
+
+/*
+ * function count_words(): count lines and words of a buffer.
+ * input:     buffer, its length, was the previous byte a space, counts.
+ * output:    none. lines and words are added to the counts.
+ */
+void
+count_words(const char* buf, size_t len, int* after_space,
+	    struct pattern_counts* counts)
+{
+#if defined(__x86_64__)
+    if (use_avx2()) {
+	count_words_avx2((const unsigned char*)buf, len, after_space, counts);
+	return;
+    }
+#endif /* __x86_64__ */
+    count_words_scalar((const unsigned char*)buf, len, after_space, counts);
+}
+
+/*
+ * function count_pattern_chunk(): a counting thread's function.
+ * algorithm: count the chunk a block at a time, publishing progress and
+ *            checking for a cancel between blocks. the state crossing
+ *            a chunk's start is known up front - a word continues iff
+ *            the last space or printable byte before the chunk is a
+ *            printable one, and strings are only split between threads
+ *            when they can't overlap.
+ * input:     pointer to the thread's chunk.
+ * output:    none. the counts are placed in the chunk.
+ */
+static void*
+count_pattern_chunk(void* data)
+{
+    struct pattern_chunk* chunk = (struct pattern_chunk*)data;
+    const struct pattern* pattern = chunk->pattern;
+    int after_space = 1;
+    size_t skip = 0;
+    size_t pos;
+
+    for (pos = chunk->start; pos > 0; pos--) {
+	unsigned char c = (unsigned char)chunk->data[pos - 1];
+
+	if (is_space(c) || is_printable(c)) {
+	    after_space = is_space(c);
+	    break;
+	}
+    }
+
+    for (pos = chunk->start; pos < chunk->end; pos += SCAN_BLOCK_SIZE) {
+	size_t block = chunk->end - pos < SCAN_BLOCK_SIZE ?
+		       chunk->end - pos : SCAN_BLOCK_SIZE;
+	unsigned long long found = 0;
+
+	if (scan_cancelled(chunk->progress)) {
+	    chunk->cancelled = 1;
+	    return NULL;
+	}
+	switch (pattern->mode) {
+	    case PATTERN_SET:
+		found = count_byte_set(pattern, chunk->data + pos, block);
+		chunk->counts.matches += found;
+		break;
+	    case PATTERN_STRING:
+		found = count_string(pattern, chunk->data + pos, block,
+				     chunk->file_size - pos, &skip);
+		chunk->counts.matches += found;
+		break;
+	    case PATTERN_WC:
+		found = chunk->counts.lines;
+		count_words(chunk->data + pos, block, &after_space,
+			    &chunk->counts);
+		found = chunk->counts.lines - found;
+		break;
+	}
+	chunk->counts.bytes += block;
+	add_scan_progress(chunk->progress, block, found);
+    }
+
+    return NULL;
+}
+
+/*
+ * function pattern_count_file(): count a pattern in a file.
+ * algorithm: map the file, split it into chunks - one per thread, or a
+ *            single one for a string that may overlap itself, as where
+ *            its matches are depends on all matches before them - and
+ *            sum up the chunks' counts.
+ * input:     file name, pattern, number of threads, progress of the
+ *            scan (or NULL), where to place the counts.
+ * output:    0 on success, -1 on error (errno is set; ECANCELED if the
+ *            scan was cancelled).
+ */
+int
+pattern_count_file(const char* file_name, const struct pattern* pattern,
+		   int num_threads, struct scan_progress* progress,
+		   struct pattern_counts* counts)
+{
+    struct mapped_file map;
+    struct pattern_chunk* chunks;
+    struct scan_progress own_progress;
+    size_t chunk_size;
+    int num_chunks;
+    int cancelled = 0;
+    int i;
+
+    if (map_file(file_name, &map) < 0)
+	return -1;
+    if (!progress) {
+	init_scan_progress(&own_progress);
+	progress = &own_progress;
+    }
+
+    if (num_threads < 1 ||
+	(pattern->mode == PATTERN_STRING && pattern->self_overlapping))
+	num_threads = 1;
+    chunk_size = (map.size + num_threads - 1) / num_threads;
+    if (chunk_size < PARALLEL_MIN_CHUNK_SIZE)
+	chunk_size = PARALLEL_MIN_CHUNK_SIZE;
+    num_chunks = (map.size + chunk_size - 1) / chunk_size;
+
+    chunks = (struct pattern_chunk*)
+	     calloc(num_chunks > 0 ? num_chunks : 1,
+		    sizeof(struct pattern_chunk));
+    if (!chunks) {
+	fprintf(stderr, "pattern_count_file: out of memory. exiting\n");
+	exit(1);
+    }
+    for (i = 0; i < num_chunks; i++) {
+	struct pattern_chunk* chunk = &chunks[i];
+
+	chunk->pattern = pattern;
+	chunk->data = map.data;
+	chunk->file_size = map.size;
+	chunk->start = (size_t)i * chunk_size;
+	chunk->end = chunk->start + chunk_size < map.size ?
+		     chunk->start + chunk_size : map.size;
+	chunk->progress = progress;
+	if (pthread_create(&chunk->thread, NULL, count_pattern_chunk,
+			   (void*)chunk) != 0) {
+	    fprintf(stderr, "pattern_count_file: cannot create thread. "
+			    "exiting\n");
+	    exit(1);
+	}
+    }
+
+    memset(counts, 0, sizeof(*counts));
+    for (i = 0; i < num_chunks; i++) {
+	pthread_join(chunks[i].thread, NULL);
+	counts->matches += chunks[i].counts.matches;
+	counts->lines += chunks[i].counts.lines;
+	counts->words += chunks[i].counts.words;
+	counts->bytes += chunks[i].counts.bytes;
+	cancelled |= chunks[i].cancelled;
+    }
+    free(chunks);
+    unmap_file(&map);
+
+    if (cancelled) {
+	errno = ECANCELED;
+	return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef PATTERN_SCAN_H
+# define PATTERN_SCAN_H
+
+#include <stddef.h>      /* size_t                                    */
+
+#include "line_scan.h"   /* struct scan_progress                      */
+
+/*
+ * counting more than newlines - bytes of a delimiter set, occurrences of
+ * a (multi-byte) delimiter or substring, and 'wc' style lines, words and
+ * bytes in a single pass. like the newline kernels, each has a portable
+ * kernel and an AVX2 one, used when count_newlines() uses AVX2.
+ */
+
+/* what a pattern counts. */
+enum pattern_mode {
+    PATTERN_SET,		/* bytes that are in a set.              */
+    PATTERN_STRING,		/* non-overlapping occurrences of bytes. */
+    PATTERN_WC			/* lines, words and bytes, like 'wc'.    */
+};
+
+/* longest string (and largest set) a pattern may have. */
+#define PATTERN_MAX_LEN 256
+
+/* sets up to this size are matched with SIMD compares, larger sets byte */
+/* by byte, through a table.                                            */
+#define PATTERN_SIMD_SET 8
+
+/* a pattern to count. */
+struct pattern {
+    enum pattern_mode mode;		  /* what to count.              */
+    unsigned char bytes[PATTERN_MAX_LEN]; /* the set's bytes, or string. */
+    size_t len;				  /* number of bytes.            */
+    unsigned char in_set[256];		  /* is a byte in the set?       */
+    int self_overlapping;		  /* may a string overlap itself? */
+};
+
+/* results of counting a pattern. */
+struct pattern_counts {
+    unsigned long long matches;		/* set bytes, or strings, found. */
+    unsigned long long lines;		/* newlines (PATTERN_WC).        */
+    unsigned long long words;		/* words (PATTERN_WC).           */
+    unsigned long long bytes;		/* bytes scanned.                */
+};
+
+/*
+ * set up a pattern. for PATTERN_SET, 'bytes' are the set's bytes; for
+ * PATTERN_STRING, the string (a string of one byte becomes a set). for
+ * PATTERN_WC, 'bytes' is ignored. returns 0 on success, -1 if the
+ * pattern is empty or too long (errno EINVAL).
+ */
+extern int
+init_pattern(struct pattern* pattern, enum pattern_mode mode,
+	     const char* bytes, size_t len);
+
+/* count the bytes of a buffer that are in the pattern's set. */
+extern unsigned long long
+count_byte_set(const struct pattern* pattern, const char* buf, size_t len);
+
+/*
+ * count the occurrences of the pattern's string that start in the first
+ * 'len' bytes of the buffer, and after its first '*skip' bytes. 'avail'
+ * bytes (at least 'len') may be read, so occurrences crossing 'len' are
+ * found. '*skip' is set to the number of bytes the next buffer must skip,
+ * as they are covered by an occurrence found here.
+ */
+extern unsigned long long
+count_string(const struct pattern* pattern, const char* buf, size_t len,
+	     size_t avail, size_t* skip);
+
+/*
+ * count the lines and words of a buffer, adding them to 'counts'.
+ * '*after_space' tells if the byte before the buffer was white space
+ * (1 at the start of a file), and is updated for the next buffer.
+ */
+extern void
+count_words(const char* buf, size_t len, int* after_space,
+	    struct pattern_counts* counts);
+
+/*
+ * count the pattern in the given file with (up to) 'num_threads'
+ * threads, reporting to 'progress' (may be NULL). returns 0 on success,
+ * -1 on error (with errno set - ECANCELED if the scan was cancelled).
+ */
+extern int
+pattern_count_file(const char* file_name, const struct pattern* pattern,
+		   int num_threads, struct scan_progress* progress,
+		   struct pattern_counts* counts);
+
+#endif /* PATTERN_SCAN_H */
@@ -0,0 +1,661 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdlib.h>      /* posix_memalign() and free()               */
+#include <string.h>      /* memset()                                  */
+#include <errno.h>       /* errno and error codes                     */
+#include <fcntl.h>       /* open(), O_DIRECT, posix_fadvise()         */
+#include <unistd.h>      /* pread(), close()                          */
+#include <sys/stat.h>    /* fstat()                                   */
+#include <sys/mman.h>    /* mmap() of the io_uring rings              */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h> /* syscall(), __NR_io_uring_*                */
+#include <linux/io_uring.h> /* io_uring structures and constants      */
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif /* __NR_io_uring_setup && __NR_io_uring_enter */
+#endif /* __has_include(<linux/io_uring.h>) */
+#endif /* __linux__ && __has_include */
+
+#include "line_scan.h"   /* newline counting kernels                  */
+#include "read_engine.h" /* read engine functions and structs         */
+
+/* a buffer, and the read that fills it. */
+struct read_buffer {
+    char* data;			/* the buffer (aligned).              */
+    off_t offset;		/* offset in file of the read.        */
+    size_t len;			/* length of the read.                */
+    size_t skip;		/* bytes at its start already counted. */
+    ssize_t result;		/* bytes read.                        */
+    int free;			/* counted, and may be read into?     */
+};
+
+/* the file being read, and the buffers it is read into. */
+struct read_job {
+    int fd;			    /* the file.                        */
+    off_t size;			    /* its size.                        */
+    off_t next_offset;		    /* offset of the next read.         */
+    struct read_buffer* buffers;    /* the buffers, one per read.       */
+    int depth;			    /* number of buffers.               */
+    struct scan_progress* progress; /* progress of the scan.            */
+    unsigned long long lines;	    /* lines counted so far.            */
+};
+
+/*
+ * function claim_read(): choose the part of the file a buffer gets next.
+ * algorithm: O_DIRECT reads must have an aligned length too, so the last
+ *            read is rounded up - it just comes back short.
+ * input:     job, buffer.
+ * output:    1 if there was a part left to read, 0 at the end.
+ */
+static int
+claim_read(struct read_job* job, struct read_buffer* buffer)
+{
+    if (job->next_offset >= job->size)
+	return 0;
+    buffer->offset = job->next_offset;
+    buffer->len = job->size - job->next_offset < READ_BLOCK_SIZE ?
+		  job->size - job->next_offset : READ_BLOCK_SIZE;
+    buffer->len = (buffer->len + READ_ALIGNMENT - 1) / READ_ALIGNMENT
+		  * READ_ALIGNMENT;
+    job->next_offset += buffer->len;
+    buffer->skip = 0;
+    buffer->free = 0;
+
+    return 1;
+}
+
+#ifdef HAVE_IO_URING
+
+/* an io_uring instance - the submission and completion rings. */
+struct uring {
+    int fd;				/* the ring's file descriptor.   */
+    unsigned* sq_tail;			/* submission ring's tail.       */
+    unsigned* sq_mask;			/* mask of submission indices.   */
+    unsigned* sq_array;			/* submission ring's entries.    */
+    struct io_uring_sqe* sqes;		/* submission queue entries.     */
+    unsigned* cq_head;			/* completion ring's head.       */
+    unsigned* cq_tail;			/* completion ring's tail.       */
+    unsigned* cq_mask;			/* mask of completion indices.   */
+    struct io_uring_cqe* cqes;		/* completion queue entries.     */
+    void* sq_ring;			/* mapping of submission ring.   */
+    size_t sq_ring_size;
+    void* cq_ring;			/* mapping of completion ring.   */
+    size_t cq_ring_size;
+    size_t sqes_size;			/* size of the sqes mapping.     */
+};
+
+/*
+ * function uring_init(): set up an io_uring instance.
+ * algorithm: there is no liburing here, so use the system calls
+ *            directly - create the ring, and map its submission ring,
+ *            its completion ring (one mapping, if the kernel shares
+ *            them) and its submission entries.
+ * input:     ring to set up, number of entries.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+static int
+uring_init(struct uring* ring, unsigned entries)
+{
+    struct io_uring_params params;
+    unsigned char* sq;
+    unsigned char* cq;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+	return -1;
+
+    ring->sq_ring_size = params.sq_off.array +
+			 params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+			 params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ring->cq_ring_size > ring->sq_ring_size)
+	    ring->sq_ring_size = ring->cq_ring_size;
+	ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+	goto error_close;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+	ring->cq_ring = ring->sq_ring;
+    else {
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+	    goto error_unmap_sq;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)
+		 mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+	goto error_unmap_cq;
+
+    sq = (unsigned char*)ring->sq_ring;
+    cq = (unsigned char*)ring->cq_ring;
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return 0;
+
+error_unmap_cq:
+    if (ring->cq_ring != ring->sq_ring)
+	munmap(ring->cq_ring, ring->cq_ring_size);
+error_unmap_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+error_close:
+    {
+	int saved_errno = errno;
+
+	close(ring->fd);
+	errno = saved_errno;
+    }
+    return -1;
+}
+
+/* tear down an io_uring instance. */
+static void
+uring_exit(struct uring* ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+	munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/* enter the kernel - submit entries, and/or wait for completions. */
+static int
+uring_enter(struct uring* ring, unsigned to_submit, unsigned min_complete)
+{
+    int rc;
+
+    do {
+	rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+		     min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc;
+}
+
+/*
+ * function uring_submit_read(): submit a read into a buffer.
+ * algorithm: fill the submission entry at the ring's tail, and publish
+ *            it by moving the tail (a release store - the kernel must
+ *            see the entry before the new tail). we never have more
+ *            reads in flight than entries, so the ring is never full.
+ * input:     ring, file descriptor, buffer, index of buffer.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+static int
+uring_submit_read(struct uring* ring, int fd, struct read_buffer* buffer,
+		  int index)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buffer->data;
+    sqe->len = buffer->len;
+    sqe->off = buffer->offset;
+    sqe->user_data = index;
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return uring_enter(ring, 1, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * function uring_wait(): wait for a read to complete.
+ * algorithm: if the completion ring is empty, wait in the kernel for an
+ *            entry. copy the entry at the ring's head, and consume it by
+ *            moving the head.
+ * input:     ring, where to copy the completion entry.
+ * output:    0 on success, -1 on error (errno is set).
+ */
+static int
+uring_wait(struct uring* ring, struct io_uring_cqe* cqe)
+{
+    unsigned head = *ring->cq_head;
+
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+	if (uring_enter(ring, 0, 1) < 0)
+	    return -1;
+    }
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * function continue_read(): continue a read that came back short.
+ * algorithm: O_DIRECT reads must start at an aligned offset, into an
+ *            aligned address - so read again from the start of the
+ *            aligned block the short read ended in, into the start of
+ *            the buffer, and skip the bytes of that block already
+ *            counted. the read's end is aligned already.
+ * input:     buffer, bytes the short read got.
+ * output:    none.
+ */
+static void
+continue_read(struct read_buffer* buffer, size_t got)
+{
+    off_t reached = buffer->offset + got;
+    off_t aligned = reached / READ_ALIGNMENT * READ_ALIGNMENT;
+
+    buffer->len -= aligned - buffer->offset;
+    buffer->skip = reached - aligned;
+    buffer->offset = aligned;
+}
+
+/*
+ * function uring_count(): count the lines of a file read with io_uring.
+ * algorithm: submit a read into every buffer. as each read completes,
+ *            count its buffer (but for the bytes counted already), and
+ *            submit the next read into it - the other reads go on while
+ *            we count. a short read (in the middle of the file) is
+ *            continued with the read of its rest. on an error, stop
+ *            submitting, and wait for the reads in flight - the kernel
+ *            still writes into their buffers.
+ * input:     read job.
+ * output:    0 on success, errno of the failure otherwise.
+ */
+static int
+uring_count(struct read_job* job)
+{
+    struct uring ring;
+    int in_flight = 0;
+    int error = 0;
+    int i;
+
+    if (uring_init(&ring, job->depth) < 0)
+	return errno;
+
+    for (i = 0; i < job->depth && claim_read(job, &job->buffers[i]); i++) {
+	if (uring_submit_read(&ring, job->fd, &job->buffers[i], i) < 0) {
+	    error = errno;
+	    break;
+	}
+	in_flight++;
+    }
+
+    while (in_flight > 0) {
+	struct io_uring_cqe cqe;
+	struct read_buffer* buffer;
+
+	if (uring_wait(&ring, &cqe) < 0) {
+	    /* can't reap the reads - the buffers are still in use. */
+	    fprintf(stderr, "uring_count: io_uring_enter failed. exiting\n");
+	    exit(1);
+	}
+	in_flight--;
+	buffer = &job->buffers[cqe.user_data];
+	if (error)
+	    continue;
+	if (cqe.res < 0) {
+	    error = -cqe.res;
+	    continue;
+	}
+
+	buffer->result = cqe.res;
+	if ((size_t)buffer->result > buffer->skip &&
+	    count_newlines_blocks(buffer->data + buffer->skip,
+				  buffer->result - buffer->skip,
+				  job->progress, &job->lines) < 0) {
+	    error = ECANCELED;
+	    continue;
+	}
+	if ((size_t)cqe.res > buffer->skip && (size_t)cqe.res < buffer->len &&
+	    buffer->offset + cqe.res < job->size) {
+	    /* a short read - the file may not end here. read the rest. */
+	    continue_read(buffer, cqe.res);
+	}
+	else if (!claim_read(job, buffer))
+	    continue;
+	if (uring_submit_read(&ring, job->fd, buffer, cqe.user_data) < 0) {
+	    error = errno;
+	    continue;
+	}
+	in_flight++;
+    }
+
+    uring_exit(&ring);
+
+    return error;
+}
+
+#endif /* HAVE_IO_URING */
+
+/* state of the pread() threads pool. */
+struct pread_pool {
+    pthread_mutex_t mutex;		   /* protects everything below.  */
+    pthread_cond_t  got_full;		   /* a buffer was read into.     */
+    pthread_cond_t  got_free;		   /* a buffer was counted.       */
+    struct read_job* job;		   /* the file being read.        */
+    int full_queue[READ_MAX_DEPTH];	   /* buffers waiting to be       */
+    int full_head, num_full;		   /* counted, in order of reads. */
+    int num_running;			   /* readers not yet done.       */
+    int aborted;			   /* stop everything?            */
+    int error;				   /* errno of a failure, or 0.   */
+};
+
+/* a reader thread's parameters - the pool, and the buffer it owns. */
+struct pread_reader {
+    struct pread_pool* pool;
+    int index;
+    pthread_t thread;
+};
+
+/*
+ * function pread_full(): read a whole part of a file.
+ * algorithm: continue a short read from the start of the aligned block
+ *            it ended in - O_DIRECT reads must be aligned, as must the
+ *            buffer, the offset and the length given. a read that gets
+ *            no further than the last one is the end of the file.
+ * input:     file descriptor, buffer, length, offset.
+ * output:    bytes read - less than asked only at the end of the file,
+ *            or -1 on error (errno is set).
+ */
+static ssize_t
+pread_full(int fd, char* buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < len) {
+	size_t start = done / READ_ALIGNMENT * READ_ALIGNMENT;
+	ssize_t n = pread(fd, buf + start, len - start, offset + start);
+
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	    return -1;
+	if (start + n <= done)
+	    break;
+	done = start + n;
+    }
+
+    return done;
+}
+
+/*
+ * function pread_loop(): a reader thread's function.
+ * algorithm: wait for the thread's buffer to be counted, claim the next
+ *            part of the file, read it (without holding the mutex), and
+ *            queue the buffer for counting. stop at the end of the file,
+ *            on an error, or when the pool is aborted.
+ * input:     pointer to reader.
+ * output:    none.
+ */
+static void*
+pread_loop(void* data)
+{
+    struct pread_reader* reader = (struct pread_reader*)data;
+    struct pread_pool* pool = reader->pool;
+    struct read_buffer* buffer = &pool->job->buffers[reader->index];
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+	ssize_t n;
+
+	while (!buffer->free && !pool->aborted)
+	    pthread_cond_wait(&pool->got_free, &pool->mutex);
+	if (pool->aborted || !claim_read(pool->job, buffer))
+	    break;
+	pthread_mutex_unlock(&pool->mutex);
+
+	n = pread_full(pool->job->fd, buffer->data, buffer->len,
+		       buffer->offset);
+
+	pthread_mutex_lock(&pool->mutex);
+	if (n < 0) {
+	    if (!pool->error)
+		pool->error = errno;
+	    pool->aborted = 1;
+	    pthread_cond_broadcast(&pool->got_free);
+	    break;
+	}
+	buffer->result = n;
+	pool->full_queue[(pool->full_head + pool->num_full) % READ_MAX_DEPTH] =
+	    reader->index;
+	pool->num_full++;
+	pthread_cond_signal(&pool->got_full);
+    }
+    pool->num_running--;
+    pthread_cond_signal(&pool->got_full);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/*
+ * function pread_count(): count the lines of a file read by a pool of
+ *            pread() threads.
+ * algorithm: each reader thread owns a buffer, and reads into it. the
+ *            calling thread counts the buffers as they get filled, and
+ *            hands them back to their readers.
+ * input:     read job.
+ * output:    0 on success, errno of the failure otherwise.
+ */
+static int
+pread_count(struct read_job* job)
+{
+    struct pread_pool pool;
+    struct pread_reader readers[READ_MAX_DEPTH];
+    int error;
+    int i;
+
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.got_full, NULL);
+    pthread_cond_init(&pool.got_free, NULL);
+    pool.job = job;
+    pool.full_head = 0;
+    pool.num_full = 0;
+    pool.num_running = job->depth;
+    pool.aborted = 0;
+    pool.error = 0;
+
+    for (i = 0; i < job->depth; i++) {
+	readers[i].pool = &pool;
+	readers[i].index = i;
+	if (pthread_create(&readers[i].thread, NULL, pread_loop,
+			   (void*)&readers[i]) != 0) {
+	    fprintf(stderr, "pread_count: cannot create thread. exiting\n");
+	    exit(1);
+	}
+    }
+
+    pthread_mutex_lock(&pool.mutex);
+    while (1) {
+	struct read_buffer* buffer;
+	int rc;
+
+	while (pool.num_full == 0 && pool.num_running > 0 && !pool.aborted)
+	    pthread_cond_wait(&pool.got_full, &pool.mutex);
+	if (pool.num_full == 0 || pool.aborted)
+	    break;
+	buffer = &job->buffers[pool.full_queue[pool.full_head]];
+	pool.full_head = (pool.full_head + 1) % READ_MAX_DEPTH;
+	pool.num_full--;
+	pthread_mutex_unlock(&pool.mutex);
+
+	rc = count_newlines_blocks(buffer->data, buffer->result, job->progress,
+				   &job->lines);
+
+	pthread_mutex_lock(&pool.mutex);
+	if (rc < 0) {
+	    pool.error = ECANCELED;
+	    break;
+	}
+	buffer->free = 1;
+	/* each reader waits for its own buffer - wake them all. */
+	pthread_cond_broadcast(&pool.got_free);
+    }
+    /* on an error, or a cancel, the readers still need to be stopped. */
+    pool.aborted = 1;
+    pthread_cond_broadcast(&pool.got_free);
+    error = pool.error;
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (i = 0; i < job->depth; i++)
+	pthread_join(readers[i].thread, NULL);
+    pthread_cond_destroy(&pool.got_full);
+    pthread_cond_destroy(&pool.got_free);
+    pthread_mutex_destroy(&pool.mutex);
+
+    return error;
+}
+
+/* result of probing for io_uring. */
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+static enum read_engine available_engine = READ_ENGINE_PREAD;
+
+/* check if the kernel lets us create an io_uring instance. */
+static void
+probe_engines(void)
+{
+#ifdef HAVE_IO_URING
+    struct uring ring;
+
+    if (uring_init(&ring, 1) == 0) {
+	uring_exit(&ring);
+	available_engine = READ_ENGINE_URING;
+    }
+#endif /* HAVE_IO_URING */
+}
+
+/*
+ * function read_engine_available(): get the best engine available.
+ * algorithm: io_uring may be missing (old kernel, or headers), or be
+ *            disabled (kernel.io_uring_disabled, seccomp). probe it
+ *            once, by creating a small ring.
+ * input:     none.
+ * output:    READ_ENGINE_URING or READ_ENGINE_PREAD.
+ */
+enum read_engine
+read_engine_available(void)
+{
+    pthread_once(&probe_once, probe_engines);
+    return available_engine;
+}
+
+/* get the name of an engine. */
+const char*
+read_engine_name(enum read_engine engine)
+{
+    switch (engine) {
+	case READ_ENGINE_URING:
+	    return "io_uring";
+	case READ_ENGINE_PREAD:
+	    return "pread";
+	default:
+	    return "auto";
+    }
+}
+
+/*
+ * function read_count_lines(): count a file's lines with explicit reads.
+ * algorithm: open the file - with O_DIRECT if asked for, and if the file
+ *            system supports it (else through the page cache, hinting
+ *            sequential access). allocate a buffer per read in flight,
+ *            aligned as O_DIRECT requires, and run the chosen engine -
+ *            falling back to the pread() pool if io_uring is missing.
+ * input:     file name, engine, queue depth, flags, progress of the scan
+ *            (or NULL), where to place the count.
+ * output:    0 on success, -1 on error (errno is set; ECANCELED if the
+ *            scan was cancelled).
+ */
+int
+read_count_lines(const char* file_name, enum read_engine engine, int depth,
+		 int flags, struct scan_progress* progress,
+		 unsigned long long* lines)
+{
+    struct read_job job;
+    struct scan_progress own_progress;
+    struct stat st;
+    int error = 0;
+    int i;
+
+    if (depth < 1)
+	depth = READ_DEFAULT_DEPTH;
+    if (depth > READ_MAX_DEPTH)
+	depth = READ_MAX_DEPTH;
+    if (engine == READ_ENGINE_AUTO || engine == READ_ENGINE_URING)
+	engine = read_engine_available();
+    if (!progress) {
+	init_scan_progress(&own_progress);
+	progress = &own_progress;
+    }
+
+    job.fd = -1;
+    if (flags & READ_DIRECT) {
+	job.fd = open(file_name, O_RDONLY | O_DIRECT);
+	if (job.fd < 0 && errno != EINVAL)
+	    return -1;
+    }
+    if (job.fd < 0) {
+	job.fd = open(file_name, O_RDONLY);
+	if (job.fd < 0)
+	    return -1;
+	posix_fadvise(job.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (fstat(job.fd, &st) < 0) {
+	error = errno;
+	close(job.fd);
+	errno = error;
+	return -1;
+    }
+
+    job.size = st.st_size;
+    job.next_offset = 0;
+    job.depth = depth;
+    job.progress = progress;
+    job.lines = 0;
+    job.buffers = (struct read_buffer*)
+		  calloc(depth, sizeof(struct read_buffer));
+    if (!job.buffers) {
+	fprintf(stderr, "read_count_lines: out of memory. exiting\n");
+	exit(1);
+    }
+    for (i = 0; i < depth; i++) {
+	if (posix_memalign((void**)&job.buffers[i].data, READ_ALIGNMENT,
+			   READ_BLOCK_SIZE) != 0) {
+	    fprintf(stderr, "read_count_lines: out of memory. exiting\n");
+	    exit(1);
+	}
+	job.buffers[i].free = 1;
+    }
+
+#ifdef HAVE_IO_URING
+    if (engine == READ_ENGINE_URING)
+	error = uring_count(&job);
+    else
+#endif /* HAVE_IO_URING */
+	error = pread_count(&job);
+
+    for (i = 0; i < depth; i++)
+	free(job.buffers[i].data);
+    free(job.buffers);
+    close(job.fd);
+
+    *lines = job.lines;
+    if (error) {
+	errno = error;
+	return -1;
+    }
+
+    return 0;
+}
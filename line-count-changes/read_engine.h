@@ -0,0 +1,56 @@
+#ifndef READ_ENGINE_H
+# define READ_ENGINE_H
+
+#include "line_scan.h"   /* struct scan_progress                      */
+
+/*
+ * line counting with explicit reads, for files that are not in the page
+ * cache. mapping such a file makes each page fault a small synchronous
+ * read; instead, a number of large aligned reads (the 'queue depth') are
+ * kept in flight, each into its own buffer, and buffers are counted as
+ * their reads complete - so counting overlaps the I/O of the other
+ * buffers (double buffering with a depth of 2, triple with 3, ...).
+ */
+
+/* ways to issue the reads. */
+enum read_engine {
+    READ_ENGINE_AUTO,		/* io_uring if the kernel allows it.   */
+    READ_ENGINE_URING,		/* io_uring, on the calling thread.    */
+    READ_ENGINE_PREAD		/* a pool of threads doing pread().    */
+};
+
+/* size of each read, and alignment of buffers and offsets (O_DIRECT). */
+#define READ_BLOCK_SIZE (1024 * 1024)
+#define READ_ALIGNMENT 4096
+
+/* default and maximal number of reads in flight. */
+#define READ_DEFAULT_DEPTH 4
+#define READ_MAX_DEPTH 64
+
+/* flags of read_count_lines(). */
+#define READ_DIRECT 1		/* bypass the page cache (O_DIRECT).   */
+
+/*
+ * count the lines of the given file, keeping 'depth' reads in flight,
+ * issued by the given engine, reporting to 'progress' (may be NULL).
+ * with READ_DIRECT, the file is opened with O_DIRECT, if its file system
+ * supports it. returns 0 on success, -1 on error (with errno set -
+ * ECANCELED if the scan was cancelled).
+ */
+extern int
+read_count_lines(const char* file_name, enum read_engine engine, int depth,
+		 int flags, struct scan_progress* progress,
+		 unsigned long long* lines);
+
+/*
+ * get the engine READ_ENGINE_AUTO stands for - io_uring if the kernel
+ * supports it (and allows it), otherwise the pread() pool.
+ */
+extern enum read_engine
+read_engine_available(void);
+
+/* get the name of an engine. */
+extern const char*
+read_engine_name(enum read_engine engine);
+
+#endif /* READ_ENGINE_H */
@@ -0,0 +1,176 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* exit(), atoi()                            */
+#include <string.h>      /* strcmp()                                  */
+#include <time.h>        /* clock_gettime()                           */
+#include <fcntl.h>       /* open(), posix_fadvise()                   */
+#include <unistd.h>      /* sync(), sysconf()                         */
+#include <sys/stat.h>    /* stat()                                    */
+
+#include "line_scan.h"       /* line scanning functions and structs   */
+#include "parallel_count.h"  /* parallel line counting                */
+#include "read_engine.h"     /* io_uring/pread read engine            */
+
+/* queue depths to try, for each engine. */
+static const int depths[] = { 1, 2, 3, 4, 8, 16, 32 };
+
+/* how the page cache is emptied before each run. */
+enum drop_method {
+    DROP_ALL,			/* /proc/sys/vm/drop_caches (root).      */
+    DROP_FILE,			/* posix_fadvise(POSIX_FADV_DONTNEED).   */
+    DROP_NONE			/* can't - rely on the file being big.   */
+};
+
+/* get the current time, in seconds. */
+static double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * function drop_caches(): take the file out of the page cache.
+ * algorithm: if we may, drop the whole page cache. otherwise ask the
+ *            kernel to drop the file's pages - it does this for clean
+ *            pages even when we are not root. flush dirty pages first.
+ * input:     file name, method to use.
+ * output:    none.
+ */
+static void
+drop_caches(const char* file_name, enum drop_method method)
+{
+    sync();
+    if (method == DROP_ALL) {
+	FILE* f = fopen("/proc/sys/vm/drop_caches", "w");
+
+	if (f) {
+	    fputs("3\n", f);
+	    fclose(f);
+	}
+    }
+    else if (method == DROP_FILE) {
+	int fd = open(file_name, O_RDONLY);
+
+	if (fd >= 0) {
+	    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	    close(fd);
+	}
+    }
+}
+
+/* find out how we can empty the page cache. */
+static enum drop_method
+choose_drop_method(const char* file_name)
+{
+    FILE* f = fopen("/proc/sys/vm/drop_caches", "w");
+    int fd;
+
+    if (f) {
+	fclose(f);
+	return DROP_ALL;
+    }
+    fd = open(file_name, O_RDONLY);
+    if (fd >= 0 && posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0) {
+	close(fd);
+	return DROP_FILE;
+    }
+    if (fd >= 0)
+	close(fd);
+
+    return DROP_NONE;
+}
+
+/* print one result line. */
+static void
+report(const char* name, unsigned long long lines, unsigned long long expected,
+       off_t size, double elapsed)
+{
+    printf("%-22s %12llu lines  %8.3f sec  %8.1f MB/s%s\n",
+	   name, lines, elapsed, size / elapsed / 1e6,
+	   lines == expected ? "" : "  MISMATCH");
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    static const enum read_engine engines[] = {
+	READ_ENGINE_URING, READ_ENGINE_PREAD
+    };
+    const char* file_name;
+    enum drop_method method;
+    struct stat st;
+    unsigned long long expected = 0;
+    double start;
+    int mismatch = 0;
+    unsigned int e, d;
+    int direct;
+
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s file\n", argv[0]);
+	exit(1);
+    }
+    file_name = argv[1];
+    if (stat(file_name, &st) < 0) {
+	perror(file_name);
+	exit(1);
+    }
+
+    method = choose_drop_method(file_name);
+    printf("file '%s', %lld bytes\n", file_name, (long long)st.st_size);
+    switch (method) {
+	case DROP_ALL:
+	    printf("page cache dropped before each run\n");
+	    break;
+	case DROP_FILE:
+	    printf("file's pages dropped before each run (not root)\n");
+	    break;
+	default:
+	    printf("can't drop the page cache - ");
+	    if ((double)st.st_size >
+		(double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE))
+		printf("file is larger than RAM, so it stays cold\n");
+	    else
+		printf("use a file larger than RAM for cold-cache numbers\n");
+    }
+    if (read_engine_available() != READ_ENGINE_URING)
+	printf("io_uring not available - it falls back to pread\n");
+
+    /* the baseline - mapping the file, as the default mode does. */
+    drop_caches(file_name, method);
+    start = now_sec();
+    if (parallel_count_lines(file_name, default_num_threads(), NULL,
+			     &expected) < 0) {
+	perror("parallel_count_lines");
+	exit(1);
+    }
+    report("mmap", expected, expected, st.st_size, now_sec() - start);
+
+    for (direct = 0; direct <= 1; direct++) {
+	for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+	    for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		unsigned long long lines = 0;
+		char name[32];
+
+		drop_caches(file_name, method);
+		start = now_sec();
+		if (read_count_lines(file_name, engines[e], depths[d],
+				     direct ? READ_DIRECT : 0, NULL,
+				     &lines) < 0) {
+		    perror("read_count_lines");
+		    exit(1);
+		}
+		snprintf(name, sizeof(name), "%s%s q%d",
+			 read_engine_name(engines[e]),
+			 direct ? " direct" : "", depths[d]);
+		report(name, lines, expected, st.st_size, now_sec() - start);
+		if (lines != expected)
+		    mismatch = 1;
+	    }
+	}
+    }
+
+    return mismatch;
+}
@@ -0,0 +1,78 @@
+#ifndef SEQLOCK_H
+# define SEQLOCK_H
+
+#include <sched.h>       /* sched_yield()                         */
+
+/*
+ * sequence counters (seqlocks), shared by the employee programs. data
+ * protected by a counter is written by one writer at a time (writers
+ * lock each other out by other means - a mutex, say). the writer makes
+ * the counter odd while it writes, and even again when done. a reader
+ * takes no lock, and never writes shared memory: it reads the counter
+ * (waiting while it is odd), copies the data optimistically, and reads
+ * the counter again - if it changed, a writer got in during the copy,
+ * which may be torn, so the reader tries again:
+ *
+ *     for (;; retries++) {
+ *         seq = seqlock_read_begin(&record->seq, &retries);
+ *         copy the record, with relaxed atomic loads;
+ *         if (!seqlock_read_retry(&record->seq, seq))
+ *             break;
+ *     }
+ *
+ * everything is static (and inline), as each program is a single file.
+ */
+
+/* a reader finding a writer busy this many times in a row yields the */
+/* CPU - the writer may have been preempted in the middle of a write.  */
+#define SEQLOCK_SPINS_BEFORE_YIELD 100
+
+/*
+ * function seqlock_read_begin(): start reading seqlock protected data.
+ * algorithm: read the counter until it is even - no writer is busy -
+ *            yielding the CPU every SEQLOCK_SPINS_BEFORE_YIELD tries.
+ * input:     pointer to the counter, retries counter to add the tries
+ *            that found a writer busy to.
+ * output:    the (even) counter, for seqlock_read_retry().
+ */
+static inline unsigned int
+seqlock_read_begin(const unsigned int* seq, unsigned long* retries)
+{
+    unsigned int start;
+
+    while ((start = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {
+	if (*retries % SEQLOCK_SPINS_BEFORE_YIELD ==
+	    SEQLOCK_SPINS_BEFORE_YIELD - 1)
+	    sched_yield();
+	(*retries)++;
+    }
+
+    return start;
+}
+
+/* done reading - returns non-zero if a writer got in since 'start', so */
+/* the copy may be torn, and must be read again. the fence keeps the    */
+/* copy from being done after the second counter read.                  */
+static inline int
+seqlock_read_retry(const unsigned int* seq, unsigned int start)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+/* start writing - make the counter odd, before any of the writes. */
+static inline void
+seqlock_write_begin(unsigned int* seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* done writing - make the counter even again, after all the writes. */
+static inline void
+seqlock_write_end(unsigned int* seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* SEQLOCK_H */
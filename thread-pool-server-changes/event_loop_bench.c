@@ -0,0 +1,270 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* atoi(), exit(), free()                    */
+#include <string.h>      /* memset()                                  */
+#include <time.h>        /* clock_gettime()                           */
+#include <unistd.h>      /* read(), write(), usleep()                 */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <sys/epoll.h>   /* epoll_create1(), epoll_ctl(), epoll_wait() */
+#include <sys/socket.h>  /* socketpair()                              */
+#include <sys/timerfd.h> /* timerfd_create(), timerfd_settime()       */
+
+#include "cache_line.h"      /* CACHE_ALIGNED                         */
+#include "requests_queue.h"  /* requests queue routines/structs       */
+
+/*
+ * event loop benchmark: an I/O thread waits in a single epoll_wait()
+ * call for new requests (on the requests queue's eventfd), for data on
+ * a socket, and for the ticks of a timer (a timerfd). producer threads
+ * add requests to the queue in bursts, and write a byte to the socket
+ * after each burst. the benchmark reports how many requests each
+ * wakeup on the eventfd found - since wakeups are coalesced, a burst
+ * costs about one - and checks every request added was handled.
+ */
+
+/* default number of producers, bursts each adds, requests per burst, */
+/* and pause between bursts (in microseconds).                        */
+#define NUM_PRODUCERS 2
+#define NUM_BURSTS 2000
+#define BURST_SIZE 32
+#define BURST_PAUSE_US 50
+
+/* interval of the timer, in microseconds. */
+#define TIMER_INTERVAL_US 1000
+
+/* most events epoll_wait() returns at once. */
+#define MAX_EVENTS 8
+
+/* the queue's mutex and condition variable (no thread waits on it). */
+static pthread_mutex_t request_mutex CACHE_ALIGNED = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  got_request CACHE_ALIGNED = PTHREAD_COND_INITIALIZER;
+
+/* the queue, the producers, and their end of the socket pair. */
+static struct requests_queue* requests;
+static pthread_t* producers;
+static int num_producers = NUM_PRODUCERS;
+static int producer_socket;
+
+/* the benchmark's settings. */
+static int num_bursts = NUM_BURSTS;
+static int burst_size = BURST_SIZE;
+
+/* what the event loop saw. */
+struct loop_counts {
+    unsigned long queue_wakeups;    /* times the eventfd was readable.  */
+    unsigned long empty_wakeups;    /* of them, finding no request.     */
+    unsigned long handled;	    /* requests taken off the queue.    */
+    unsigned long socket_bytes;	    /* bytes read from the socket.      */
+    unsigned long timer_ticks;	    /* timer expirations.               */
+};
+
+/* get the current time, in seconds. */
+static double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* function of the producer threads - add bursts of requests, and */
+/* write a byte to the socket after each.                         */
+static void*
+produce(void* data)
+{
+    int producer = (int)(long)data;
+    char byte = 'r';
+    int burst, i;
+
+    for (burst = 0; burst < num_bursts; burst++) {
+	for (i = 0; i < burst_size; i++)
+	    add_request(requests, -1 - producer);
+	if (write(producer_socket, &byte, 1) != 1)
+	    perror("write");
+	usleep(BURST_PAUSE_US);
+    }
+
+    return NULL;
+}
+
+/* function of the joiner thread - wait for the producers to finish, */
+/* and tell the event loop to quit.                                   */
+static void*
+join_producers(void* data)
+{
+    char quit = 'q';
+    int i;
+
+    for (i = 0; i < num_producers; i++)
+	pthread_join(producers[i], NULL);
+    if (write(producer_socket, &quit, 1) != 1)
+	perror("write");
+
+    return NULL;
+}
+
+/* take all the requests off the queue - acknowledging the eventfd */
+/* first, so requests added meanwhile signal it again.             */
+static void
+drain_requests(struct loop_counts* counts)
+{
+    struct request* a_request;
+    unsigned long handled = counts->handled;
+
+    ack_requests_queue_event(requests);
+    while ((a_request = get_request(requests)) != NULL) {
+	counts->handled++;
+	free(a_request);
+    }
+    if (counts->handled == handled)
+	counts->empty_wakeups++;
+}
+
+/* add a file descriptor to an epoll set, waiting for input. */
+static void
+watch_fd(int epoll_fd, int fd)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+	perror("epoll_ctl");
+	exit(1);
+    }
+}
+
+/*
+ * function run_event_loop(): the I/O thread's loop.
+ * algorithm: wait in epoll_wait() on the queue's eventfd, the socket and
+ *            the timerfd, and handle whichever is ready, until a 'q'
+ *            arrives on the socket. then drain the queue one last time.
+ * input:     the queue's eventfd, the socket, the timerfd, the counts.
+ * output:    none.
+ */
+static void
+run_event_loop(int queue_fd, int socket_fd, int timer_fd,
+	       struct loop_counts* counts)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int done = 0;
+    int num_events, i;
+
+    if (epoll_fd < 0) {
+	perror("epoll_create1");
+	exit(1);
+    }
+    watch_fd(epoll_fd, queue_fd);
+    watch_fd(epoll_fd, socket_fd);
+    watch_fd(epoll_fd, timer_fd);
+
+    while (!done) {
+	num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+	for (i = 0; i < num_events; i++) {
+	    int fd = events[i].data.fd;
+
+	    if (fd == queue_fd) {
+		counts->queue_wakeups++;
+		drain_requests(counts);
+	    }
+	    else if (fd == socket_fd) {
+		char buf[256];
+		ssize_t n = read(socket_fd, buf, sizeof(buf));
+
+		if (n > 0) {
+		    counts->socket_bytes += n;
+		    done = done || memchr(buf, 'q', n) != NULL;
+		}
+	    }
+	    else if (fd == timer_fd) {
+		unsigned long long ticks;
+
+		if (read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+		    counts->timer_ticks += ticks;
+	    }
+	}
+    }
+    drain_requests(counts);
+    close(epoll_fd);
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    struct requests_queue_stats stats;
+    struct loop_counts counts;
+    struct itimerspec interval;
+    pthread_t joiner;
+    int sockets[2];
+    int queue_fd, timer_fd;
+    unsigned long total;
+    double start, elapsed;
+    int i;
+
+    if (argc > 1)
+	num_producers = atoi(argv[1]);
+    if (argc > 2)
+	num_bursts = atoi(argv[2]);
+    if (argc > 3)
+	burst_size = atoi(argv[3]);
+    if (num_producers < 1 || num_bursts < 1 || burst_size < 1) {
+	fprintf(stderr, "usage: %s [producers] [bursts] [burst_size]\n",
+		argv[0]);
+	exit(1);
+    }
+    total = (unsigned long)num_producers * num_bursts * burst_size;
+
+    requests = init_requests_queue(&request_mutex, &got_request);
+    queue_fd = enable_requests_queue_eventfd(requests);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (queue_fd < 0 || timer_fd < 0 ||
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+	perror("main");
+	exit(1);
+    }
+    producer_socket = sockets[0];
+    interval.it_interval.tv_sec = 0;
+    interval.it_interval.tv_nsec = TIMER_INTERVAL_US * 1000L;
+    interval.it_value = interval.it_interval;
+    timerfd_settime(timer_fd, 0, &interval, NULL);
+
+    producers = (pthread_t*)malloc(num_producers * sizeof(pthread_t));
+    if (!producers) {
+	fprintf(stderr, "main: out of memory. exiting\n");
+	exit(1);
+    }
+    memset(&counts, 0, sizeof(counts));
+    start = now_sec();
+    for (i = 0; i < num_producers; i++)
+	pthread_create(&producers[i], NULL, produce, (void*)(long)i);
+    pthread_create(&joiner, NULL, join_producers, NULL);
+
+    run_event_loop(queue_fd, sockets[1], timer_fd, &counts);
+    elapsed = now_sec() - start;
+    pthread_join(joiner, NULL);
+
+    get_requests_queue_stats(requests, &stats);
+    printf("%d producers, %d bursts of %d requests each, in %.3f sec\n",
+	   num_producers, num_bursts, burst_size, elapsed);
+    printf("%lu requests handled, %lu eventfd signals, %lu wakeups "
+	   "(%lu found nothing): %.1f requests per wakeup\n",
+	   counts.handled, stats.num_events, counts.queue_wakeups,
+	   counts.empty_wakeups,
+	   counts.queue_wakeups ? (double)counts.handled / counts.queue_wakeups
+				: 0.0);
+    printf("%lu socket bytes, %lu timer ticks, on the same epoll set\n",
+	   counts.socket_bytes, counts.timer_ticks);
+
+    free(producers);
+    delete_requests_queue(requests);
+
+    if (counts.handled != total) {
+	printf("%lu requests were lost!\n", total - counts.handled);
+	return 1;
+    }
+
+    return 0;
+}
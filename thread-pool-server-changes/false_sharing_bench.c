@@ -0,0 +1,407 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* posix_memalign(), atol(), exit()          */
+#include <string.h>      /* memset(), strerror()                      */
+#include <errno.h>       /* errno                                     */
+#include <time.h>        /* clock_gettime()                           */
+#include <unistd.h>      /* syscall(), read(), close()                */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <sched.h>       /* sched_yield()                             */
+#include <sys/ioctl.h>   /* ioctl()                                   */
+#include <sys/syscall.h> /* SYS_perf_event_open                       */
+#include <linux/perf_event.h> /* perf_event_open() attributes         */
+
+#include "cache_line.h"  /* CACHE_LINE_SIZE, CACHE_ALIGNED            */
+
+/*
+ * false sharing microbenchmark: the cost of keeping data written by
+ * different threads on the same cache line. each test runs twice - with
+ * the data packed, as plain adjacent globals are, and padded to cache
+ * lines of their own (CACHE_ALIGNED) - and reports the time per
+ * operation, and the CPU cycles and L1 data cache misses per operation,
+ * if the kernel lets us read the CPU's counters (with perf_event_open).
+ * if it doesn't (no PMU in a VM, perf_event_paranoid, seccomp), only
+ * the wall-clock time is reported. the tests are:
+ *
+ * - counters: each thread increments a counter of its own, like the
+ *   per-thread statistics of a pool.
+ * - head/tail: a producer and a consumer pass items through a ring,
+ *   each moving its own index - like a queue's tail and head.
+ * - lock+flag: threads lock a mutex to update a counter, while another
+ *   thread polls a flag next to it - like 'request_mutex' and
+ *   'done_creating_requests' in main.c.
+ *
+ * on a single CPU, threads take turns instead of running together, and
+ * there is no false sharing to see.
+ */
+
+/* default number of threads, and of operations each makes. */
+#define NUM_THREADS 4
+#define NUM_OPS 10000000
+
+/* most threads a test may use. */
+#define MAX_THREADS 64
+
+/* slots of the head/tail test's ring (a power of 2). */
+#define RING_SIZE 1024
+
+/* spins on a full or empty ring before yielding the CPU. */
+#define SPINS_BEFORE_YIELD 100
+
+/* the CPU's counters we read. */
+enum perf_counter {
+    PERF_CYCLES,		/* CPU cycles.                           */
+    PERF_L1D_MISSES,		/* L1 data cache read misses.            */
+    NUM_PERF_COUNTERS
+};
+
+/* file descriptors of the counters, -1 where not available. */
+static int perf_fds[NUM_PERF_COUNTERS];
+
+/* the tests' settings. */
+static int num_threads = NUM_THREADS;
+static long num_ops = NUM_OPS;
+
+/* counters test: packed, and padded layouts. */
+struct packed_counters {
+    unsigned long count[MAX_THREADS];
+};
+
+struct padded_counter {
+    unsigned long count;
+} CACHE_ALIGNED;
+
+static struct packed_counters packed_counters CACHE_ALIGNED;
+static struct padded_counter padded_counters[MAX_THREADS];
+
+/* head/tail test: packed, and padded layouts of a ring's indexes. */
+struct packed_ring {
+    unsigned long head;		/* next item to take - the consumer's.   */
+    unsigned long tail;		/* next slot to fill - the producer's.   */
+};
+
+struct padded_ring {
+    unsigned long head CACHE_ALIGNED;
+    unsigned long tail CACHE_ALIGNED;
+};
+
+static struct packed_ring packed_ring CACHE_ALIGNED;
+static struct padded_ring padded_ring;
+static unsigned long ring_items[RING_SIZE] CACHE_ALIGNED;
+
+/* lock+flag test: packed, and padded layouts of a lock, its counter */
+/* and a flag polled by another thread.                               */
+struct packed_lock {
+    pthread_mutex_t mutex;
+    unsigned long count;	/* protected by the mutex.               */
+    int done;			/* polled without the mutex.             */
+};
+
+struct padded_lock {
+    pthread_mutex_t mutex CACHE_ALIGNED;
+    unsigned long count;
+    int done CACHE_ALIGNED;
+};
+
+static struct packed_lock packed_lock CACHE_ALIGNED =
+	{ PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+static struct padded_lock padded_lock =
+	{ PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+
+/* get the current time, in seconds. */
+static double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * function perf_open(): open the CPU's counters.
+ * algorithm: open each counter for the calling thread, disabled, and
+ *            inherited by the threads it creates later - so enabling it
+ *            before creating a test's threads counts them all. user
+ *            space only, which perf_event_paranoid 2 still allows.
+ * input:     none.
+ * output:    number of counters opened. the first error is printed.
+ */
+static int
+perf_open(void)
+{
+    static const struct {
+	unsigned int type;
+	unsigned long long config;
+    } events[NUM_PERF_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+			      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) }
+    };
+    struct perf_event_attr attr;
+    int num_opened = 0;
+    int i;
+
+    for (i = 0; i < NUM_PERF_COUNTERS; i++) {
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (perf_fds[i] >= 0)
+	    num_opened++;
+	else if (num_opened == 0 && i == 0)
+	    printf("perf_event_open: %s - ", strerror(errno));
+    }
+
+    return num_opened;
+}
+
+/* reset and enable the counters opened. */
+static void
+perf_start(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_PERF_COUNTERS; i++) {
+	if (perf_fds[i] >= 0) {
+	    ioctl(perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+    }
+}
+
+/* disable the counters opened, and read them (-1 where unavailable). */
+/* the threads counted must have exited, for their counts to be added. */
+static void
+perf_stop(double values[NUM_PERF_COUNTERS])
+{
+    unsigned long long value;
+    int i;
+
+    for (i = 0; i < NUM_PERF_COUNTERS; i++) {
+	values[i] = -1;
+	if (perf_fds[i] < 0)
+	    continue;
+	ioctl(perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	if (read(perf_fds[i], &value, sizeof(value)) == sizeof(value))
+	    values[i] = value;
+    }
+}
+
+/* function of the counters test's threads, packed layout. */
+static void*
+count_packed(void* data)
+{
+    unsigned long* count = &packed_counters.count[(long)data];
+    long i;
+
+    for (i = 0; i < num_ops; i++)
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+/* function of the counters test's threads, padded layout. */
+static void*
+count_padded(void* data)
+{
+    unsigned long* count = &padded_counters[(long)data].count;
+    long i;
+
+    for (i = 0; i < num_ops; i++)
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+/* wait while '*index' equals 'value' - the ring is full, or empty. */
+static void
+wait_ring(unsigned long* index, unsigned long value)
+{
+    unsigned long spins = 0;
+
+    while (__atomic_load_n(index, __ATOMIC_ACQUIRE) == value) {
+	if (++spins % SPINS_BEFORE_YIELD == 0)
+	    sched_yield();
+    }
+}
+
+/*
+ * function pass_items(): one side of the head/tail test.
+ * algorithm: the producer (thread 0) fills slots at the tail, waiting
+ *            while the ring is full; the consumer (thread 1) takes them
+ *            at the head, waiting while it is empty. each reads the
+ *            other's index, but only writes its own.
+ * input:     the ring's indexes, thread number.
+ * output:    none.
+ */
+static void
+pass_items(unsigned long* head, unsigned long* tail, long thread)
+{
+    unsigned long sum = 0;
+    long i;
+
+    for (i = 0; i < num_ops; i++) {
+	if (thread == 0) {
+	    wait_ring(head, i - RING_SIZE);
+	    ring_items[i % RING_SIZE] = i;
+	    __atomic_store_n(tail, i + 1, __ATOMIC_RELEASE);
+	}
+	else {
+	    wait_ring(tail, i);
+	    sum += ring_items[i % RING_SIZE];
+	    __atomic_store_n(head, i + 1, __ATOMIC_RELEASE);
+	}
+    }
+    if (thread == 1 && sum != (unsigned long)num_ops * (num_ops - 1) / 2) {
+	fprintf(stderr, "pass_items: wrong items passed. exiting\n");
+	exit(1);
+    }
+}
+
+/* functions of the head/tail test's threads, both layouts. */
+static void*
+pass_packed(void* data)
+{
+    pass_items(&packed_ring.head, &packed_ring.tail, (long)data);
+    return NULL;
+}
+
+static void*
+pass_padded(void* data)
+{
+    pass_items(&padded_ring.head, &padded_ring.tail, (long)data);
+    return NULL;
+}
+
+/* one side of the lock+flag test: thread 0 polls the flag until the   */
+/* others are done, they lock the mutex and update the counter.        */
+static void
+lock_and_poll(pthread_mutex_t* mutex, unsigned long* count, int* done,
+	      long thread)
+{
+    unsigned long polls = 0;
+    long i;
+
+    if (thread == 0) {
+	while (!__atomic_load_n(done, __ATOMIC_ACQUIRE)) {
+	    if (++polls % SPINS_BEFORE_YIELD == 0)
+		sched_yield();
+	}
+	return;
+    }
+    for (i = 0; i < num_ops; i++) {
+	pthread_mutex_lock(mutex);
+	if (++*count == (unsigned long)num_ops * (num_threads - 1))
+	    __atomic_store_n(done, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(mutex);
+    }
+}
+
+/* functions of the lock+flag test's threads, both layouts. */
+static void*
+lock_packed(void* data)
+{
+    lock_and_poll(&packed_lock.mutex, &packed_lock.count, &packed_lock.done,
+		  (long)data);
+    return NULL;
+}
+
+static void*
+lock_padded(void* data)
+{
+    lock_and_poll(&padded_lock.mutex, &padded_lock.count, &padded_lock.done,
+		  (long)data);
+    return NULL;
+}
+
+/*
+ * function run_test(): run a test's threads, and report.
+ * algorithm: enable the counters, run the threads - each given its
+ *            number - wait for them, and read the counters. print the
+ *            time, cycles and misses per operation (of the threads
+ *            making operations - 'num_working' of them).
+ * input:     test's and layout's names, thread function, number of
+ *            threads, number of them making operations.
+ * output:    time the test took, in seconds.
+ */
+static double
+run_test(const char* test, const char* layout, void* (*func)(void*),
+	 int threads, int num_working)
+{
+    pthread_t thread[MAX_THREADS];
+    double counters[NUM_PERF_COUNTERS];
+    double ops = (double)num_ops * num_working;
+    double start, elapsed;
+    long i;
+
+    perf_start();
+    start = now_sec();
+    for (i = 0; i < threads; i++)
+	pthread_create(&thread[i], NULL, func, (void*)i);
+    for (i = 0; i < threads; i++)
+	pthread_join(thread[i], NULL);
+    elapsed = now_sec() - start;
+    perf_stop(counters);
+
+    printf("%-10s %-7s %8.3f %10.2f", test, layout, elapsed,
+	   elapsed * 1e9 / ops);
+    for (i = 0; i < NUM_PERF_COUNTERS; i++) {
+	if (counters[i] >= 0)
+	    printf(" %12.2f", counters[i] / ops);
+	else
+	    printf(" %12s", "-");
+    }
+    printf("\n");
+
+    return elapsed;
+}
+
+/* run a test with both layouts, and report how much packing costs. */
+static void
+compare_layouts(const char* test, void* (*packed)(void*),
+		void* (*padded)(void*), int threads, int num_working)
+{
+    double packed_time = run_test(test, "packed", packed, threads,
+				  num_working);
+    double padded_time = run_test(test, "padded", padded, threads,
+				  num_working);
+
+    printf("%-10s packed takes %.2f times as long as padded\n", test,
+	   packed_time / padded_time);
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    if (argc > 1)
+	num_threads = atoi(argv[1]);
+    if (argc > 2)
+	num_ops = atol(argv[2]);
+    if (num_threads < 2 || num_threads > MAX_THREADS || num_ops < 1) {
+	fprintf(stderr, "usage: %s [num_threads (2-%d)] [num_ops]\n",
+		argv[0], MAX_THREADS);
+	exit(1);
+    }
+
+    if (perf_open() == 0)
+	printf("wall-clock time only\n");
+    printf("%d threads, %ld operations each, on %ld CPUs\n", num_threads,
+	   num_ops, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-10s %-7s %8s %10s %12s %12s\n", "test", "layout", "seconds",
+	   "ns/op", "cycles/op", "L1D miss/op");
+
+    compare_layouts("counters", count_packed, count_padded, num_threads,
+		    num_threads);
+    compare_layouts("head/tail", pass_packed, pass_padded, 2, 1);
+    compare_layouts("lock+flag", lock_packed, lock_padded, num_threads,
+		    num_threads - 1);
+
+    return 0;
+}
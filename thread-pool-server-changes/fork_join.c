@@ -0,0 +1,342 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* exit()                                    */
+#include <assert.h>      /* assert()                                  */
+#include <sched.h>       /* sched_yield()                             */
+
+#include "fork_join.h"   /* fork-join functions and structs           */
+
+/* rounds a thread syncing spins, finding nothing to run, before it */
+/* yields the CPU.                                                  */
+#define FJ_SPINS 100
+
+/* tell the CPU we are spinning - so it saves power, and leaves the */
+/* core to its other hyper-thread.                                  */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __asm__ __volatile__ ("pause" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+/* the threads' deques. they are never freed - a thread exiting gives */
+/* its deque back, and the next thread needing one takes it - so a    */
+/* thread stealing never finds one gone.                              */
+static struct fj_deque deques[FJ_MAX_THREADS];
+static int num_deques = 0;	/* deques handed out so far.             */
+static pthread_mutex_t deques_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* key giving a thread's deque back when it exits, and the thread's   */
+/* deque.                                                             */
+static pthread_key_t deque_key;
+static pthread_once_t deque_key_once = PTHREAD_ONCE_INIT;
+static __thread struct fj_deque* my_deque = NULL;
+
+/* where steal() starts looking, so thieves spread over the deques. */
+static __thread unsigned int steal_start = 0;
+
+/* the requests queue helpers are queued on, NULL if none, and how many */
+/* helpers may be queued or running at once, and are.                  */
+static struct requests_queue* helper_requests = NULL;
+static int max_helpers = 0;
+static int num_helpers CACHE_ALIGNED = 0;
+
+/* give a thread's deque back - called when the thread exits. */
+static void
+release_deque(void* data)
+{
+    struct fj_deque* deque = (struct fj_deque*)data;
+
+    pthread_mutex_lock(&deques_mutex);
+    deque->owned = 0;
+    pthread_mutex_unlock(&deques_mutex);
+}
+
+/* create the key giving deques back. */
+static void
+create_deque_key(void)
+{
+    pthread_key_create(&deque_key, release_deque);
+}
+
+/*
+ * function get_deque(): get the calling thread's deque.
+ * algorithm: on the thread's first call, take a deque no thread owns,
+ *            or a new one - initializing it before counting it, so
+ *            thieves only see initialized deques.
+ * input:     none.
+ * output:    the thread's deque.
+ */
+static struct fj_deque*
+get_deque(void)
+{
+    struct fj_deque* deque = my_deque;
+    int i;
+
+    if (deque)
+	return deque;
+
+    pthread_once(&deque_key_once, create_deque_key);
+    pthread_mutex_lock(&deques_mutex);
+    for (i = 0; i < num_deques; i++) {
+	if (!deques[i].owned)
+	    break;
+    }
+    if (i == FJ_MAX_THREADS) {
+	fprintf(stderr, "get_deque: more than %d threads. exiting\n",
+		FJ_MAX_THREADS);
+	exit(1);
+    }
+    deque = &deques[i];
+    if (i == num_deques) {
+	pthread_mutex_init(&deque->mutex, NULL);
+	deque->top = 0;
+	deque->bottom = 0;
+	__atomic_store_n(&num_deques, num_deques + 1, __ATOMIC_RELEASE);
+    }
+    deque->owned = 1;
+    pthread_mutex_unlock(&deques_mutex);
+
+    pthread_setspecific(deque_key, deque);
+    my_deque = deque;
+
+    return deque;
+}
+
+/* does a deque seem to hold subtasks? read without locking - a hint. */
+static int
+deque_has_tasks(struct fj_deque* deque)
+{
+    return __atomic_load_n(&deque->top, __ATOMIC_RELAXED) !=
+	   __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+}
+
+/* add a subtask at a deque's bottom. returns 0 if the deque is full. */
+static int
+push_bottom(struct fj_deque* deque, struct fj_task* task)
+{
+    int pushed = 0;
+
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom - deque->top < FJ_DEQUE_SIZE) {
+	deque->tasks[deque->bottom % FJ_DEQUE_SIZE] = *task;
+	__atomic_store_n(&deque->bottom, deque->bottom + 1, __ATOMIC_RELAXED);
+	pushed = 1;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+
+    return pushed;
+}
+
+/* take the subtask at a deque's bottom - the last spawned. returns 0 */
+/* if the deque is empty.                                             */
+static int
+pop_bottom(struct fj_deque* deque, struct fj_task* task)
+{
+    int popped = 0;
+
+    if (!deque_has_tasks(deque))
+	return 0;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom != deque->top) {
+	__atomic_store_n(&deque->bottom, deque->bottom - 1, __ATOMIC_RELAXED);
+	*task = deque->tasks[deque->bottom % FJ_DEQUE_SIZE];
+	popped = 1;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+
+    return popped;
+}
+
+/* take the subtask at a deque's top - the first spawned. returns 0 if */
+/* the deque is empty.                                                 */
+static int
+pop_top(struct fj_deque* deque, struct fj_task* task)
+{
+    int popped = 0;
+
+    if (!deque_has_tasks(deque))
+	return 0;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom != deque->top) {
+	*task = deque->tasks[deque->top % FJ_DEQUE_SIZE];
+	__atomic_store_n(&deque->top, deque->top + 1, __ATOMIC_RELAXED);
+	popped = 1;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+
+    return popped;
+}
+
+/*
+ * function steal(): steal a subtask from another thread.
+ * algorithm: go over the other threads' deques, starting after the one
+ *            stolen from last, and take the top subtask of the first
+ *            that has one.
+ * input:     the calling thread's deque (NULL if none), where to put the
+ *            subtask.
+ * output:    1 if a subtask was stolen, 0 if there were none.
+ */
+static int
+steal(struct fj_deque* own, struct fj_task* task)
+{
+    int count = __atomic_load_n(&num_deques, __ATOMIC_ACQUIRE);
+    int i;
+
+    for (i = 0; i < count; i++) {
+	struct fj_deque* deque = &deques[(steal_start + i) % count];
+
+	if (deque != own && pop_top(deque, task)) {
+	    steal_start = (steal_start + i) % count;
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+/* run a subtask, and count it done in its group. */
+static void
+run_task(struct fj_task* task)
+{
+    task->func(task->arg);
+    __atomic_fetch_sub(&task->group->pending, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * function help(): the handler of a helper request.
+ * algorithm: steal subtasks and run them, until there are none left.
+ * input:     none (the argument is unused).
+ * output:    none.
+ */
+static void
+help(void* data)
+{
+    struct fj_task task;
+
+    while (steal(my_deque, &task))
+	run_task(&task);
+    __atomic_fetch_sub(&num_helpers, 1, __ATOMIC_RELAXED);
+}
+
+/* discard function of a helper request - a helper dropped, expired or */
+/* cancelled before running is no longer queued, either.                */
+static void
+discard_helper(void* data)
+{
+    __atomic_fetch_sub(&num_helpers, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * function queue_helper(): queue a helper request.
+ * algorithm: unless 'max_helpers' are queued or running, count one more
+ *            and queue it. it is counted out when it is done, refused,
+ *            or discarded unhandled - e.g. dropped by admission control
+ *            - so the count never leaks, and helping never stops.
+ * input:     none.
+ * output:    none.
+ */
+static void
+queue_helper(void)
+{
+    int helpers = __atomic_load_n(&num_helpers, __ATOMIC_RELAXED);
+
+    while (helpers < max_helpers) {
+	if (__atomic_compare_exchange_n(&num_helpers, &helpers, helpers + 1, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	    if (add_request_with_discard(helper_requests, -1, 0, help, NULL,
+					 discard_helper, 0) != REQUEST_QUEUED)
+		__atomic_fetch_sub(&num_helpers, 1, __ATOMIC_RELAXED);
+	    return;
+	}
+    }
+}
+
+/*
+ * function fj_init(): let idle handler threads help.
+ * input:     requests queue of the handler threads, most helper requests
+ *            queued or running at once.
+ * output:    none.
+ */
+void
+fj_init(struct requests_queue* requests, int helpers)
+{
+    helper_requests = requests;
+    max_helpers = requests ? helpers : 0;
+}
+
+/*
+ * function fj_group_init(): initialize a group of subtasks.
+ * input:     pointer to group.
+ * output:    none.
+ */
+void
+fj_group_init(struct fj_group* group)
+{
+    /* sanity check */
+    assert(group);
+
+    group->pending = 0;
+}
+
+/*
+ * function fj_spawn(): spawn a subtask.
+ * algorithm: count it in its group, and push it on the calling thread's
+ *            deque - or, if that is full, run it right away. then ask an
+ *            idle handler thread to help, if helpers are wanted.
+ * input:     pointer to group, function running the subtask and its
+ *            argument.
+ * output:    none.
+ */
+void
+fj_spawn(struct fj_group* group, void (*func)(void*), void* arg)
+{
+    struct fj_task task;
+
+    /* sanity check */
+    assert(group && func);
+
+    task.func = func;
+    task.arg = arg;
+    task.group = group;
+    __atomic_fetch_add(&group->pending, 1, __ATOMIC_RELAXED);
+    if (!push_bottom(get_deque(), &task)) {
+	run_task(&task);
+	return;
+    }
+    if (max_helpers > 0)
+	queue_helper();
+}
+
+/*
+ * function fj_sync(): wait for a group's subtasks.
+ * algorithm: while some are not done, run a subtask off the calling
+ *            thread's deque, or steal one. if there is none - the last
+ *            ones are running on other threads - spin a little, then
+ *            yield the CPU, and look again.
+ * input:     pointer to group.
+ * output:    none.
+ */
+void
+fj_sync(struct fj_group* group)
+{
+    struct fj_deque* deque;
+    struct fj_task task;
+    int spins = 0;
+
+    /* sanity check */
+    assert(group);
+
+    deque = get_deque();
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+	if (pop_bottom(deque, &task) || steal(deque, &task)) {
+	    run_task(&task);
+	    spins = 0;
+	}
+	else if (spins++ < FJ_SPINS) {
+	    cpu_relax();
+	}
+	else {
+	    sched_yield();
+	    spins = 0;
+	}
+    }
+}
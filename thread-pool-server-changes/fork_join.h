@@ -0,0 +1,90 @@
+#ifndef FORK_JOIN_H
+# define FORK_JOIN_H
+
+#include <pthread.h>     /* pthread functions and data structures     */
+
+#include "cache_line.h"      /* CACHE_ALIGNED                         */
+#include "requests_queue.h"  /* requests queue routines/structs       */
+
+/*
+ * fork-join subtasks, for handlers splitting a request into parallel
+ * parts. a handler spawns subtasks into a group, and then syncs on the
+ * group - waits until all of them are done:
+ *
+ *     struct fj_group group;
+ *
+ *     fj_group_init(&group);
+ *     fj_spawn(&group, sum_half, &left);
+ *     fj_spawn(&group, sum_half, &right);
+ *     fj_sync(&group);
+ *
+ * subtasks may spawn subtasks of their own, in groups of their own. a
+ * spawned subtask goes on the spawning thread's local queue (a deque) -
+ * no lock is shared with other threads, unless they steal from it. a
+ * thread waiting in fj_sync() never sleeps: it runs its own subtasks
+ * (the last spawned first, while its data is still in the cache), and
+ * when it has none, steals subtasks from the other threads' queues (the
+ * first spawned - the biggest parts). so a join never blocks a handler
+ * thread, and a pool of any size - even one thread - can't deadlock.
+ *
+ * idle handler threads join in through the requests queue: while there
+ * are subtasks to steal, spawning queues 'helper' requests (up to the
+ * number given to fj_init() - usually the pool's size), and a handler
+ * taking one steals subtasks until there are none left. no threads are
+ * created.
+ */
+
+/* number of subtasks a thread's queue may hold. spawning into a full */
+/* queue runs the subtask right away.                                 */
+#define FJ_DEQUE_SIZE 256
+
+/* most threads that may spawn subtasks at once. */
+#define FJ_MAX_THREADS 64
+
+/* a group of subtasks, synced on together. */
+struct fj_group {
+    int pending;		/* subtasks spawned and not yet done.    */
+};
+
+/* a spawned subtask. */
+struct fj_task {
+    void (*func)(void*);	/* function running it.                  */
+    void* arg;			/* argument to pass to 'func'.           */
+    struct fj_group* group;	/* group it was spawned into.            */
+};
+
+/* a thread's queue of subtasks. the thread adds and takes subtasks at */
+/* its bottom, others steal from its top.                              */
+struct fj_deque {
+    pthread_mutex_t mutex;	/* protects the deque.                   */
+    int top;			/* index of the first subtask.           */
+    int bottom;			/* index after the last subtask.         */
+    int owned;			/* is a thread using it?                 */
+    struct fj_task tasks[FJ_DEQUE_SIZE]; /* the subtasks (a ring).       */
+} CACHE_ALIGNED;
+
+/*
+ * let idle handler threads help: queue helper requests on 'requests',
+ * up to 'max_helpers' at once. without it, a thread syncing runs all
+ * its subtasks itself, with whatever help threads syncing elsewhere
+ * give it.
+ */
+extern void
+fj_init(struct requests_queue* requests, int max_helpers);
+
+/* initialize a group of subtasks. */
+extern void
+fj_group_init(struct fj_group* group);
+
+/* spawn a subtask, running func(arg), into a group. */
+extern void
+fj_spawn(struct fj_group* group, void (*func)(void*), void* arg);
+
+/*
+ * wait until all the subtasks spawned into a group are done - running
+ * subtasks (of this group, or any other) meanwhile.
+ */
+extern void
+fj_sync(struct fj_group* group);
+
+#endif /* FORK_JOIN_H */
@@ -0,0 +1,345 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc(), atoi(), atol(), exit()          */
+#include <string.h>      /* memcpy()                                  */
+#include <fcntl.h>       /* open()                                    */
+#include <time.h>        /* clock_gettime()                           */
+#include <unistd.h>      /* sysconf()                                 */
+#include <pthread.h>     /* pthread functions and data structures     */
+
+#include "cache_line.h"             /* CACHE_ALIGNED                         */
+#include "requests_queue.h"         /* requests queue routines/structs       */
+#include "handler_threads_pool.h"   /* handler thread list functions/structs */
+#include "logger.h"                 /* asynchronous logger                   */
+#include "fork_join.h"              /* fork-join subtasks                    */
+
+/*
+ * fork-join benchmark: a request handled by the thread-pool-server's
+ * handler threads splits itself, recursively, into subtasks - a
+ * parallel sum of an array, and a parallel quicksort - with fj_spawn()
+ * and fj_sync(). for pools of 1, 2, 4... handler threads it reports the
+ * time each took, and the speedup over a plain serial run. the pool
+ * never grows: the threads syncing run subtasks meanwhile, and idle
+ * threads help through the requests queue. a pool of one thread - which
+ * would deadlock if a join blocked its thread - runs them all itself.
+ */
+
+/* default most handler threads, and numbers of elements summed and */
+/* sorted.                                                          */
+#define MAX_THREADS 8
+#define SUM_SIZE (16L * 1024 * 1024)
+#define SORT_SIZE (4L * 1024 * 1024)
+
+/* sizes below which the work is not split further. */
+#define SUM_CUTOFF (64 * 1024)
+#define SORT_CUTOFF (16 * 1024)
+
+/* the server's mutex (recursive, as a handler thread might lock it */
+/* twice), condition variable, and flag - as in main.c.             */
+pthread_mutex_t request_mutex CACHE_ALIGNED =
+					PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+pthread_cond_t  got_request CACHE_ALIGNED = PTHREAD_COND_INITIALIZER;
+int done_creating_requests CACHE_ALIGNED = 0;
+
+/* signalled by a root request when it is done. */
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  done_cond = PTHREAD_COND_INITIALIZER;
+static int root_done = 0;
+
+/* a part of an array to sum. */
+struct sum_job {
+    const int* a;		/* first element.                        */
+    long n;			/* number of elements.                   */
+    long long sum;		/* their sum, once done.                 */
+};
+
+/* a part of an array to sort. */
+struct sort_job {
+    int* a;			/* first element.                        */
+    long n;			/* number of elements.                   */
+};
+
+/* a root request - the job, and the function splitting it. */
+struct root_job {
+    void (*func)(void*);
+    void* arg;
+};
+
+/* get the current time, in seconds. */
+static double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* sum an array, serially. */
+static long long
+serial_sum(const int* a, long n)
+{
+    long long sum = 0;
+    long i;
+
+    for (i = 0; i < n; i++)
+	sum += a[i];
+
+    return sum;
+}
+
+/* sum an array - spawn its left half, sum its right half, and sync. */
+static void
+parallel_sum(void* data)
+{
+    struct sum_job* job = (struct sum_job*)data;
+    struct sum_job left, right;
+    struct fj_group group;
+
+    if (job->n <= SUM_CUTOFF) {
+	job->sum = serial_sum(job->a, job->n);
+	return;
+    }
+    left.a = job->a;
+    left.n = job->n / 2;
+    right.a = job->a + left.n;
+    right.n = job->n - left.n;
+
+    fj_group_init(&group);
+    fj_spawn(&group, parallel_sum, &left);
+    parallel_sum(&right);
+    fj_sync(&group);
+
+    job->sum = left.sum + right.sum;
+}
+
+/* swap two elements of an array. */
+static void
+swap(int* a, long i, long j)
+{
+    int t = a[i];
+
+    a[i] = a[j];
+    a[j] = t;
+}
+
+/* partition an array (of at least 2 elements) around the median of its */
+/* first, middle and last elements (Hoare's scheme). the median is put  */
+/* in the middle - as the pivot is not the last element, both parts get */
+/* some. returns the size of the left part.                             */
+static long
+partition(int* a, long n)
+{
+    long mid = (n - 1) / 2;
+    long i = -1, j = n;
+    int pivot;
+
+    if (a[mid] < a[0])
+	swap(a, 0, mid);
+    if (a[n - 1] < a[0])
+	swap(a, 0, n - 1);
+    if (a[n - 1] < a[mid])
+	swap(a, mid, n - 1);
+    pivot = a[mid];
+
+    while (1) {
+	do i++; while (a[i] < pivot);
+	do j--; while (a[j] > pivot);
+	if (i >= j)
+	    return j + 1;
+	swap(a, i, j);
+    }
+}
+
+/* sort an array, serially. */
+static void
+serial_sort(int* a, long n)
+{
+    while (n > 1) {
+	long left = partition(a, n);
+
+	/* recurse into the smaller part - the stack stays shallow. */
+	if (left < n - left) {
+	    serial_sort(a, left);
+	    a += left;
+	    n -= left;
+	}
+	else {
+	    serial_sort(a + left, n - left);
+	    n = left;
+	}
+    }
+}
+
+/* sort an array - partition it, spawn sorting its left part, sort its */
+/* right part, and sync.                                               */
+static void
+parallel_sort(void* data)
+{
+    struct sort_job* job = (struct sort_job*)data;
+    struct sort_job left, right;
+    struct fj_group group;
+
+    if (job->n <= SORT_CUTOFF) {
+	serial_sort(job->a, job->n);
+	return;
+    }
+    left.a = job->a;
+    left.n = partition(job->a, job->n);
+    right.a = job->a + left.n;
+    right.n = job->n - left.n;
+
+    fj_group_init(&group);
+    fj_spawn(&group, parallel_sort, &left);
+    parallel_sort(&right);
+    fj_sync(&group);
+}
+
+/* handler of a root request - run its job, and tell main it's done. */
+static void
+run_root(void* data)
+{
+    struct root_job* root = (struct root_job*)data;
+
+    root->func(root->arg);
+
+    pthread_mutex_lock(&done_mutex);
+    root_done = 1;
+    pthread_cond_signal(&done_cond);
+    pthread_mutex_unlock(&done_mutex);
+}
+
+/* queue a root request on the pool, and wait for it. returns the time */
+/* it took, in seconds.                                                 */
+static double
+time_root(struct requests_queue* requests, void (*func)(void*), void* arg)
+{
+    struct root_job root;
+    double start = now_sec();
+
+    root.func = func;
+    root.arg = arg;
+    root_done = 0;
+    add_request_func(requests, -1, run_root, &root, 0);
+
+    pthread_mutex_lock(&done_mutex);
+    while (!root_done)
+	pthread_cond_wait(&done_cond, &done_mutex);
+    pthread_mutex_unlock(&done_mutex);
+
+    return now_sec() - start;
+}
+
+/* check an array is sorted. */
+static int
+is_sorted(const int* a, long n)
+{
+    long i;
+
+    for (i = 1; i < n; i++) {
+	if (a[i - 1] > a[i])
+	    return 0;
+    }
+
+    return 1;
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : MAX_THREADS;
+    long sum_size = argc > 2 ? atol(argv[2]) : SUM_SIZE;
+    long sort_size = argc > 3 ? atol(argv[3]) : SORT_SIZE;
+    struct requests_queue* requests;
+    struct handler_threads_pool* handler_threads;
+    struct sum_job sum_job;
+    struct sort_job sort_job;
+    int* sum_array;
+    int* sort_input;
+    int* sort_array;
+    long long expected_sum;
+    double serial_sum_time, serial_sort_time, sum_time, sort_time;
+    unsigned int seed = 1;
+    int num_threads;
+    int pool_size;
+    long i;
+
+    if (max_threads < 1 || sum_size < 1 || sort_size < 1) {
+	fprintf(stderr, "usage: %s [max_threads] [sum_size] [sort_size]\n",
+		argv[0]);
+	exit(1);
+    }
+
+    sum_array = (int*)malloc(sum_size * sizeof(int));
+    sort_input = (int*)malloc(sort_size * sizeof(int));
+    sort_array = (int*)malloc(sort_size * sizeof(int));
+    if (!sum_array || !sort_input || !sort_array) {
+	fprintf(stderr, "main: out of memory. exiting\n");
+	exit(1);
+    }
+    for (i = 0; i < sum_size; i++)
+	sum_array[i] = (int)(i % 1000) - 500;
+    for (i = 0; i < sort_size; i++) {
+	seed = seed * 1103515245 + 12345;
+	sort_input[i] = (int)(seed >> 1);
+    }
+
+    /* serial runs, for reference. */
+    serial_sum_time = now_sec();
+    expected_sum = serial_sum(sum_array, sum_size);
+    serial_sum_time = now_sec() - serial_sum_time;
+    memcpy(sort_array, sort_input, sort_size * sizeof(int));
+    serial_sort_time = now_sec();
+    serial_sort(sort_array, sort_size);
+    serial_sort_time = now_sec() - serial_sort_time;
+
+    printf("%ld CPUs, sum of %ld ints, sort of %ld ints\n",
+	   sysconf(_SC_NPROCESSORS_ONLN), sum_size, sort_size);
+    printf("%7s %5s %10s %8s %10s %8s\n", "threads", "pool", "sum", "speedup",
+	   "sort", "speedup");
+    printf("%7s %5s %9.2fms %8s %9.2fms %8s\n", "serial", "-",
+	   serial_sum_time * 1e3, "-", serial_sort_time * 1e3, "-");
+
+    log_init(open("/dev/null", O_WRONLY));
+    for (num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+	/* start a server with a pool of 'num_threads' handler threads. */
+	requests = init_requests_queue(&request_mutex, &got_request);
+	handler_threads =
+	    init_handler_threads_pool(&request_mutex, &got_request, requests);
+	for (i = 0; i < num_threads; i++)
+	    add_handler_thread(handler_threads);
+	fj_init(requests, num_threads);
+
+	sum_job.a = sum_array;
+	sum_job.n = sum_size;
+	sum_time = time_root(requests, parallel_sum, &sum_job);
+
+	memcpy(sort_array, sort_input, sort_size * sizeof(int));
+	sort_job.a = sort_array;
+	sort_job.n = sort_size;
+	sort_time = time_root(requests, parallel_sort, &sort_job);
+
+	pool_size = get_handler_threads_number(handler_threads);
+	printf("%7d %5d %9.2fms %7.2fx %9.2fms %7.2fx\n", num_threads,
+	       pool_size, sum_time * 1e3, serial_sum_time / sum_time,
+	       sort_time * 1e3, serial_sort_time / sort_time);
+	if (sum_job.sum != expected_sum || !is_sorted(sort_array, sort_size) ||
+	    pool_size != num_threads) {
+	    printf("wrong sum, unsorted array, or the pool grew!\n");
+	    return 1;
+	}
+
+	/* stop the server. */
+	fj_init(NULL, 0);
+	pthread_mutex_lock(&request_mutex);
+	done_creating_requests = 1;
+	pthread_cond_broadcast(&got_request);
+	pthread_mutex_unlock(&request_mutex);
+	delete_handler_threads_pool(handler_threads);
+	delete_requests_queue(requests);
+	done_creating_requests = 0;
+    }
+    log_shutdown();
+
+    return 0;
+}
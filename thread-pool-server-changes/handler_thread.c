@@ -5,6 +5,8 @@
 
 #include "requests_queue.h"   /* requests queue routines/structs      */
 #include "handler_thread.h"   /* handler thread functions/structs     */
+#include "trace.h"            /* event tracing macros                 */
+#include "logger.h"           /* asynchronous logger                  */
 
 extern int done_creating_requests;   /* are we done creating new requests? */
 
@@ -24,8 +26,9 @@ cleanup_free_mutex(void* a_mutex)
 
 /*
  * function handle_request(): handle a single given request.
- * algorithm: prints a message stating that the given thread handled
- *            the given request.
+ * algorithm: if the request carries a handling function, call it.
+ *            otherwise, prints a message stating that the given thread
+ *            handled the given request.
  * input:     request pointer, id of calling thread.
  * output:    none.
  */
@@ -34,10 +37,14 @@ handle_request(struct request* a_request, int thread_id)
 {
     if (a_request) {
 	int i;
+
+	if (a_request->func) {
+	    a_request->func(a_request->arg);
+	    return;
+	}
 	/*
-	printf("Thread '%d' handled request '%d'\n",
-	       thread_id, a_request->number);
-	fflush(stdout);
+	log_printf("Thread '%d' handled request '%d'\n",
+		   thread_id, a_request->number);
 	*/
 	for (i = 0; i<100000; i++)
 	    ;
@@ -65,8 +72,7 @@ handle_requests_loop(void* thread_params)
     data = (struct handler_thread_params*)thread_params;
     assert(data);
 
-    printf("Starting thread '%d'\n", data->thread_id);
-    fflush(stdout);
+    log_printf("Starting thread '%d'\n", data->thread_id);
 
     /* set my cancel state to 'enabled', and cancel type to 'defered'. */
     pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
@@ -98,10 +104,15 @@ handle_requests_loop(void* thread_params)
     		/* unlock mutex - so other threads would be able to handle */
 		/* other reqeusts waiting in the queue paralelly.          */
     		rc = pthread_mutex_unlock(data->request_mutex);
+		TRACE_EVENT(TRACE_HANDLE_START, a_request->number);
 		handle_request(a_request, data->thread_id);
+		TRACE_EVENT(TRACE_HANDLE_END, a_request->number);
 		free(a_request);
     		/* and lock the mutex again. */
     		rc = pthread_mutex_lock(data->request_mutex);
+		/* a deleted thread stops here too, not only when it waits */
+		/* for a request - the cleanup handler frees the mutex.    */
+		pthread_testcancel();
 	    }
 	}
 	else {
@@ -110,8 +121,7 @@ handle_requests_loop(void* thread_params)
 	    /* if no new requests are going to be generated, exit.  */
 	    if (done_creating_requests) {
                 pthread_mutex_unlock(data->request_mutex);
-		printf("thread '%d' exiting\n", data->thread_id);
-		fflush(stdout);
+		log_printf("thread '%d' exiting\n", data->thread_id);
 		pthread_exit(NULL);
 	    }
 	    /* wait for a request to arrive. note the mutex will be */
@@ -121,7 +131,9 @@ handle_requests_loop(void* thread_params)
     	    printf("thread '%d' before pthread_cond_wait\n", data->thread_id);
     	    fflush(stdout);
 #endif /* DEBUG */
+	    TRACE_EVENT(TRACE_COND_WAIT, data->thread_id);
 	    rc = pthread_cond_wait(data->got_request, data->request_mutex);
+	    TRACE_EVENT(TRACE_COND_WAKE, data->thread_id);
 	    /* and after we return from pthread_cond_wait, the mutex  */
 	    /* is locked again, so we don't need to lock it ourselves */
 #ifdef DEBUG
@@ -4,6 +4,16 @@
 #include <assert.h>      /* assert()                                  */
 
 #include "handler_threads_pool.h" /* handler threads pool functions/structs */
+#include "trace.h"                /* event tracing macros                   */
+
+/* a request waiting on the pool's timers to be queued. */
+struct delayed_request {
+    struct timer timer;		      /* must be first - see discard.   */
+    struct requests_queue* requests;  /* queue to add the request to.   */
+    void (*func)(void*);	      /* function handling the request. */
+    void* arg;			      /* argument to pass to 'func'.    */
+    void (*discard)(void*);	      /* frees 'arg' unhandled, or NULL. */
+};
 
 /*
  * create a handler threads pool. associate it with the given mutex
@@ -29,6 +39,7 @@ init_handler_threads_pool(pthread_mutex_t* p_mutex,
     pool->p_mutex = p_mutex;
     pool->p_cond_var = p_cond_var;
     pool->requests = requests;
+    pool->timers = init_timer_service(POOL_TIMER_TICK_MS);
 
     return pool;
 }
@@ -82,6 +93,8 @@ add_handler_thread(struct handler_threads_pool* pool)
 
     /* increase total number of threads by one. */
     pool->num_threads++;
+
+    TRACE_EVENT(TRACE_THREAD_ADD, a_thread->thr_id);
 }
 
 /* remove the first thread from the threads pool (do NOT cancel the thread) */
@@ -103,7 +116,11 @@ remove_first_handler_thread(struct handler_threads_pool* pool)
     return a_thread;
 }
 
-/* delete the first thread from the threads pool (and cancel the thread) */
+/*
+ * delete the first thread from the threads pool (and cancel the thread).
+ * wait for the thread to stop - once out of the pool, nobody else would,
+ * and it might still use the requests queue after it is deleted.
+ */
 void
 delete_handler_thread(struct handler_threads_pool* pool)
 {
@@ -114,11 +131,78 @@ delete_handler_thread(struct handler_threads_pool* pool)
 
     a_thread = remove_first_handler_thread(pool);
     if (a_thread) {
+	TRACE_EVENT(TRACE_THREAD_DELETE, a_thread->thr_id);
 	pthread_cancel(a_thread->thread);
+	pthread_join(a_thread->thread, NULL);
         free(a_thread);
     }
 }
 
+/*
+ * function queue_delayed_request(): timer function of a delayed request.
+ * algorithm: adds the request to the requests queue, with its discard
+ *            function. delayed requests carry no request number, so they
+ *            get -1. if the queue is overloaded, the request is lost like
+ *            any other refused one - but no caller is left to free its
+ *            argument, so it is discarded here.
+ * input:     pointer to the delayed request.
+ * output:    none.
+ */
+static void
+queue_delayed_request(void* data)
+{
+    struct delayed_request* delayed = (struct delayed_request*)data;
+
+    if (add_request_with_discard(delayed->requests, -1, 0, delayed->func,
+				 delayed->arg, delayed->discard, 0)
+	!= REQUEST_QUEUED && delayed->discard)
+	delayed->discard(delayed->arg);
+    free(delayed);
+}
+
+/* free a delayed request that never became due, and its argument. */
+static void
+discard_delayed_request(struct timer* a_timer)
+{
+    struct delayed_request* delayed = (struct delayed_request*)a_timer;
+
+    if (delayed->discard)
+	delayed->discard(delayed->arg);
+    free(delayed);
+}
+
+/*
+ * function submit_after(): queue a request after a delay.
+ * algorithm: sets a timer on the pool's timer service, which adds the
+ *            request to the queue when it fires.
+ * input:     pointer to pool, delay in milliseconds, handling function
+ *            and its argument, function freeing the argument if the
+ *            request is never handled (or NULL).
+ * output:    none.
+ */
+void
+submit_after(struct handler_threads_pool* pool, unsigned int delay_ms,
+	     void (*func)(void*), void* arg, void (*discard)(void*))
+{
+    struct delayed_request* delayed;
+
+    /* sanity check */
+    assert(pool && func);
+
+    delayed = (struct delayed_request*)malloc(sizeof(struct delayed_request));
+    if (!delayed) {
+	fprintf(stderr, "submit_after: out of memory. exiting\n");
+	exit(1);
+    }
+    delayed->requests = pool->requests;
+    delayed->func = func;
+    delayed->arg = arg;
+    delayed->discard = discard;
+    delayed->timer.pending = 0;
+    timer_service_add(pool->timers, &delayed->timer, delay_ms,
+		      queue_delayed_request, (void*)delayed);
+}
+
 /* get the number of handler threads currently in the threads pool */
 int
 get_handler_threads_number(struct handler_threads_pool* pool)
@@ -142,6 +226,10 @@ delete_handler_threads_pool(struct handler_threads_pool* pool)
     /* sanity check */
     assert(pool);
 
+    /* stop the timers first, so no more delayed requests are queued. */
+    delete_timer_service(pool->timers, discard_delayed_request);
+    pool->timers = NULL;
+
     /* use pthread_join() to wait for all threads to terminate. */
     while (pool->num_threads > 0) {
 	a_thread = remove_first_handler_thread(pool);
@@ -6,6 +6,10 @@
 
 #include "requests_queue.h"     /* requests queue routines/structs       */
 #include "handler_thread.h"     /* handler thread functions/structs      */
+#include "timer_wheel.h"        /* timing wheel functions/structs        */
+
+/* length of a tick of the pool's timers, in milliseconds. */
+#define POOL_TIMER_TICK_MS 1
 
 /* format of a single thread structure. */
 struct handler_thread {
@@ -23,6 +27,7 @@ struct handler_threads_pool {
     pthread_mutex_t* p_mutex;	        /* pool's mutex.                    */
     pthread_cond_t*  p_cond_var;        /* pool's condition variable.       */
     struct requests_queue* requests;    /* requests queue                   */
+    struct timer_service* timers;       /* timers of delayed requests.      */
 };
 
 /*
@@ -42,6 +47,16 @@ add_handler_thread(struct handler_threads_pool* pool);
 extern void
 delete_handler_thread(struct handler_threads_pool* pool);
 
+/*
+ * queue a request handled by calling func(arg), 'delay_ms' milliseconds
+ * from now. if it is never handled - the pool is deleted before that,
+ * or the queue refuses or discards it - discard(arg) is called instead,
+ * unless 'discard' is NULL.
+ */
+extern void
+submit_after(struct handler_threads_pool* pool, unsigned int delay_ms,
+	     void (*func)(void*), void* arg, void (*discard)(void*));
+
 /* get the number of handler threads currently in the threads pool */
 extern int
 get_handler_threads_number(struct handler_threads_pool* pool);
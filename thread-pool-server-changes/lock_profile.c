@@ -0,0 +1,566 @@
+#ifdef LOCK_PROFILE
+
+#include <stdio.h>       /* standard I/O routines                     */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdlib.h>      /* calloc(), qsort(), atexit()               */
+#include <string.h>      /* strcmp()                                  */
+#include <errno.h>       /* EBUSY                                     */
+#include <time.h>        /* clock_gettime()                           */
+
+#include "lock_profile.h" /* lock contention profiling wrappers       */
+
+/* here, the mutex functions are the real ones. */
+#undef pthread_mutex_lock
+#undef pthread_mutex_trylock
+#undef pthread_mutex_unlock
+#undef pthread_cond_wait
+#undef pthread_cond_timedwait
+
+/* statistics of a call site, in one thread. */
+struct lock_site {
+    const char* file;		/* site's file, NULL if slot unused.   */
+    int line;			/* site's line.                        */
+    pthread_mutex_t* mutex;	/* mutex last locked there.            */
+    unsigned long acquired;	/* times the mutex was acquired.       */
+    unsigned long contended;	/* of them, times it was taken.        */
+    unsigned long busy;		/* trylocks failing - it was taken.    */
+    unsigned long long waited;	/* total time waiting, nanoseconds.    */
+    unsigned long long max_wait; /* longest wait, nanoseconds.         */
+    unsigned long long held;	/* total time held, nanoseconds.       */
+    unsigned long long max_hold; /* longest hold, nanoseconds.         */
+    unsigned long holds;	/* holds that ended (were timed).      */
+    unsigned long wait_hist[LOCK_PROFILE_BUCKETS]; /* wait times.     */
+    unsigned long hold_hist[LOCK_PROFILE_BUCKETS]; /* hold times.     */
+};
+
+/* a mutex a thread holds. */
+struct lock_held {
+    pthread_mutex_t* mutex;	/* the mutex.                          */
+    struct lock_site* site;	/* site that acquired it.              */
+    unsigned long long since;	/* time it was acquired, nanoseconds.  */
+    int depth;			/* times locked (recursive mutexes).   */
+};
+
+/* a thread's profile. only the thread itself writes it. */
+struct lock_profile {
+    struct lock_site sites[LOCK_PROFILE_MAX_SITES]; /* its call sites.  */
+    struct lock_held held[LOCK_PROFILE_MAX_HELD];   /* mutexes it holds. */
+    int num_held;		/* number of mutexes it holds.         */
+    unsigned long lost;		/* events not recorded - too many      */
+				/* sites, or mutexes held at once.     */
+    struct lock_profile* next;	/* next profile in the global list.    */
+};
+
+/* list of all profiles ever created - they outlive their threads, to */
+/* be reported at exit.                                               */
+static struct lock_profile* lock_profiles = NULL;
+static pthread_mutex_t lock_profiles_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t lock_profile_once = PTHREAD_ONCE_INIT;
+
+/* the calling thread's own profile. */
+static __thread struct lock_profile* my_profile = NULL;
+
+/* get the current time, in nanoseconds, from a monotonic clock. */
+static unsigned long long
+now_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* add to a counter of the calling thread's profile. the report may read */
+/* it at the same time, so the store is atomic (and costs the same).    */
+#define PROFILE_ADD(counter, value) \
+	__atomic_store_n(&(counter), (counter) + (value), __ATOMIC_RELAXED)
+
+/* read a counter of any thread's profile. */
+#define PROFILE_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/* report at exit. */
+static void
+lock_profile_report_at_exit(void)
+{
+    lock_profile_report(stderr, LOCK_PROFILE_TOP_SITES);
+}
+
+/* run once, by the first thread to lock a mutex. */
+static void
+lock_profile_init(void)
+{
+    atexit(lock_profile_report_at_exit);
+}
+
+/*
+ * function get_profile(): get the calling thread's profile.
+ * algorithm: on the thread's first call, allocate its profile, and link
+ *            it on the global list.
+ * input:     none.
+ * output:    pointer to the profile.
+ */
+static struct lock_profile*
+get_profile(void)
+{
+    struct lock_profile* profile = my_profile;
+
+    if (profile)
+	return profile;
+
+    pthread_once(&lock_profile_once, lock_profile_init);
+    profile = (struct lock_profile*)calloc(1, sizeof(struct lock_profile));
+    if (!profile) {
+	fprintf(stderr, "get_profile: out of memory. exiting\n");
+	exit(1);
+    }
+    pthread_mutex_lock(&lock_profiles_mutex);
+    profile->next = lock_profiles;
+    lock_profiles = profile;
+    pthread_mutex_unlock(&lock_profiles_mutex);
+    my_profile = profile;
+
+    return profile;
+}
+
+/*
+ * function find_site(): get the statistics of a call site.
+ * algorithm: open addressing, by the file name's address (the same for
+ *            all sites of a source file) and line. a site is added on
+ *            its first use - the report may be reading the table, so
+ *            its file is set last, atomically.
+ * input:     thread's profile, site's file and line.
+ * output:    the site's statistics, NULL if the table is full.
+ */
+static struct lock_site*
+find_site(struct lock_profile* profile, const char* file, int line)
+{
+    unsigned long hash = ((unsigned long)file >> 3) * 31 + line;
+    int i;
+
+    for (i = 0; i < LOCK_PROFILE_MAX_SITES; i++) {
+	struct lock_site* site =
+	    &profile->sites[(hash + i) & (LOCK_PROFILE_MAX_SITES - 1)];
+
+	if (site->file == file && site->line == line)
+	    return site;
+	if (!site->file) {
+	    site->line = line;
+	    __atomic_store_n(&site->file, file, __ATOMIC_RELEASE);
+	    return site;
+	}
+    }
+
+    return NULL;
+}
+
+/* get the histogram bucket of a time, in nanoseconds. */
+static int
+time_bucket(unsigned long long nsec)
+{
+    int bucket = nsec ? 64 - __builtin_clzll(nsec) : 0;
+
+    return bucket < LOCK_PROFILE_BUCKETS ? bucket : LOCK_PROFILE_BUCKETS - 1;
+}
+
+/* record an acquisition of a mutex at a site, after waiting 'wait' */
+/* nanoseconds for it, if it was contended.                          */
+static void
+record_acquired(struct lock_site* site, pthread_mutex_t* mutex,
+		int contended, unsigned long long wait)
+{
+    __atomic_store_n(&site->mutex, mutex, __ATOMIC_RELAXED);
+    PROFILE_ADD(site->acquired, 1);
+    PROFILE_ADD(site->wait_hist[time_bucket(wait)], 1);
+    if (contended) {
+	PROFILE_ADD(site->contended, 1);
+	PROFILE_ADD(site->waited, wait);
+	if (wait > site->max_wait)
+	    __atomic_store_n(&site->max_wait, wait, __ATOMIC_RELAXED);
+    }
+}
+
+/* record the end of a hold of a mutex, at the time 'now'. */
+static void
+record_released(struct lock_held* held, unsigned long long now)
+{
+    struct lock_site* site = held->site;
+    unsigned long long hold = now - held->since;
+
+    if (!site)
+	return;
+    PROFILE_ADD(site->holds, 1);
+    PROFILE_ADD(site->held, hold);
+    PROFILE_ADD(site->hold_hist[time_bucket(hold)], 1);
+    if (hold > site->max_hold)
+	__atomic_store_n(&site->max_hold, hold, __ATOMIC_RELAXED);
+}
+
+/* find a mutex among the ones the thread holds. NULL if not held. */
+static struct lock_held*
+find_held(struct lock_profile* profile, pthread_mutex_t* mutex)
+{
+    int i;
+
+    for (i = profile->num_held - 1; i >= 0; i--) {
+	if (profile->held[i].mutex == mutex)
+	    return &profile->held[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * function acquired(): note the thread acquired a mutex at a site.
+ * algorithm: a mutex it holds already (a recursive one) is held deeper.
+ *            otherwise, it starts being held now.
+ * input:     thread's profile, the mutex, site's file and line, was the
+ *            mutex contended, time waited, time it was acquired.
+ * output:    none.
+ */
+static void
+acquired(struct lock_profile* profile, pthread_mutex_t* mutex,
+	 const char* file, int line, int contended,
+	 unsigned long long wait, unsigned long long now)
+{
+    struct lock_site* site = find_site(profile, file, line);
+    struct lock_held* held = find_held(profile, mutex);
+
+    if (site)
+	record_acquired(site, mutex, contended, wait);
+    else
+	PROFILE_ADD(profile->lost, 1);
+
+    if (held) {
+	held->depth++;
+	return;
+    }
+    if (profile->num_held == LOCK_PROFILE_MAX_HELD) {
+	PROFILE_ADD(profile->lost, 1);
+	return;
+    }
+    held = &profile->held[profile->num_held++];
+    held->mutex = mutex;
+    held->site = site;
+    held->since = now;
+    held->depth = 1;
+}
+
+/*
+ * function lock_profile_mutex_lock(): lock a mutex, and profile it.
+ * algorithm: try locking it. if that fails, the mutex is contended -
+ *            lock it, timing the wait. a mutex the thread holds already
+ *            (a recursive one) can't be contended.
+ * input:     the mutex, call site's file and line.
+ * output:    what pthread_mutex_lock() returned.
+ */
+int
+lock_profile_mutex_lock(pthread_mutex_t* mutex, const char* file, int line)
+{
+    struct lock_profile* profile = get_profile();
+    unsigned long long start, now;
+    int rc = pthread_mutex_trylock(mutex);
+
+    if (rc == EBUSY) {
+	start = now_nsec();
+	rc = pthread_mutex_lock(mutex);
+	now = now_nsec();
+	if (rc == 0)
+	    acquired(profile, mutex, file, line, 1, now - start, now);
+    }
+    else if (rc == 0) {
+	acquired(profile, mutex, file, line, 0, 0, now_nsec());
+    }
+
+    return rc;
+}
+
+/* try locking a mutex, and profile it. a failure acquires nothing, so */
+/* it is counted apart, as busy.                                        */
+int
+lock_profile_mutex_trylock(pthread_mutex_t* mutex, const char* file,
+			   int line)
+{
+    struct lock_profile* profile = get_profile();
+    int rc = pthread_mutex_trylock(mutex);
+    struct lock_site* site;
+
+    if (rc == 0) {
+	acquired(profile, mutex, file, line, 0, 0, now_nsec());
+    }
+    else if (rc == EBUSY) {
+	site = find_site(profile, file, line);
+	if (site) {
+	    __atomic_store_n(&site->mutex, mutex, __ATOMIC_RELAXED);
+	    PROFILE_ADD(site->busy, 1);
+	}
+    }
+
+    return rc;
+}
+
+/*
+ * function lock_profile_mutex_unlock(): unlock a mutex, and profile it.
+ * algorithm: if this is the last unlock of a mutex the thread holds,
+ *            record how long it was held, and forget it.
+ * input:     the mutex, call site's file and line.
+ * output:    what pthread_mutex_unlock() returned.
+ */
+int
+lock_profile_mutex_unlock(pthread_mutex_t* mutex, const char* file,
+			  int line)
+{
+    struct lock_profile* profile = get_profile();
+    struct lock_held* held = find_held(profile, mutex);
+
+    if (held && --held->depth == 0) {
+	record_released(held, now_nsec());
+	*held = profile->held[--profile->num_held];
+    }
+
+    return pthread_mutex_unlock(mutex);
+}
+
+/* cleanup handler of a cancelled condition wait - the mutex is locked */
+/* again, and will be unlocked by the thread's own cleanup handlers.   */
+static void
+cond_wait_cancelled(void* data)
+{
+    struct lock_profile* profile = get_profile();
+    struct lock_held* held = find_held(profile,
+				       (pthread_mutex_t*)data);
+
+    if (held)
+	held->since = now_nsec();
+}
+
+/*
+ * function cond_wait(): wait on a condition variable, and profile the
+ *                       mutex.
+ * algorithm: waiting releases the mutex, so its hold ends. once the
+ *            wait returns, it is held again - acquired at the wait's
+ *            site. the time waiting for the condition is not counted as
+ *            waiting for the mutex: the two can't be told apart.
+ * input:     the condition variable, the mutex, time to wait until (or
+ *            NULL for no limit), call site's file and line.
+ * output:    what pthread_cond_(timed)wait() returned.
+ */
+static int
+cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+	  const struct timespec* abstime, const char* file, int line)
+{
+    struct lock_profile* profile = get_profile();
+    struct lock_held* held = find_held(profile, mutex);
+    struct lock_site* site;
+    int rc;
+
+    if (held)
+	record_released(held, now_nsec());
+
+    pthread_cleanup_push(cond_wait_cancelled, (void*)mutex);
+    if (abstime)
+	rc = pthread_cond_timedwait(cond, mutex, abstime);
+    else
+	rc = pthread_cond_wait(cond, mutex);
+    pthread_cleanup_pop(0);
+
+    held = find_held(profile, mutex);
+    if (held) {
+	site = find_site(profile, file, line);
+	if (site)
+	    record_acquired(site, mutex, 0, 0);
+	held->site = site;
+	held->since = now_nsec();
+    }
+
+    return rc;
+}
+
+int
+lock_profile_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+		       const char* file, int line)
+{
+    return cond_wait(cond, mutex, NULL, file, line);
+}
+
+int
+lock_profile_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+			    const struct timespec* abstime,
+			    const char* file, int line)
+{
+    return cond_wait(cond, mutex, abstime, file, line);
+}
+
+/* add a site's statistics (as read now) to a sum of the same site. */
+static void
+add_site(struct lock_site* sum, struct lock_site* site)
+{
+    unsigned long long value;
+    int i;
+
+    sum->mutex = PROFILE_READ(site->mutex);
+    sum->acquired += PROFILE_READ(site->acquired);
+    sum->contended += PROFILE_READ(site->contended);
+    sum->busy += PROFILE_READ(site->busy);
+    sum->waited += PROFILE_READ(site->waited);
+    sum->held += PROFILE_READ(site->held);
+    sum->holds += PROFILE_READ(site->holds);
+    value = PROFILE_READ(site->max_wait);
+    if (value > sum->max_wait)
+	sum->max_wait = value;
+    value = PROFILE_READ(site->max_hold);
+    if (value > sum->max_hold)
+	sum->max_hold = value;
+    for (i = 0; i < LOCK_PROFILE_BUCKETS; i++) {
+	sum->wait_hist[i] += PROFILE_READ(site->wait_hist[i]);
+	sum->hold_hist[i] += PROFILE_READ(site->hold_hist[i]);
+    }
+}
+
+/* order sites by time waiting, then by contention, longest first. */
+static int
+compare_sites(const void* a, const void* b)
+{
+    const struct lock_site* site_a = (const struct lock_site*)a;
+    const struct lock_site* site_b = (const struct lock_site*)b;
+
+    if (site_a->waited != site_b->waited)
+	return site_a->waited < site_b->waited ? 1 : -1;
+    if (site_a->contended != site_b->contended)
+	return site_a->contended < site_b->contended ? 1 : -1;
+    return site_a->acquired < site_b->acquired ? 1 :
+	   site_a->acquired > site_b->acquired ? -1 : 0;
+}
+
+/* get the upper bound of the given percentile of a histogram - but no */
+/* more than the longest time recorded, which may be well below the    */
+/* bound of its bucket (or above it, in the last bucket).              */
+static unsigned long long
+percentile(const unsigned long* hist, double fraction,
+	   unsigned long long max)
+{
+    unsigned long long bound;
+    unsigned long total = 0, sum = 0;
+    int i;
+
+    for (i = 0; i < LOCK_PROFILE_BUCKETS; i++)
+	total += hist[i];
+    for (i = 0; i < LOCK_PROFILE_BUCKETS - 1; i++) {
+	sum += hist[i];
+	if (sum >= fraction * total)
+	    break;
+    }
+
+    bound = i ? 1ULL << i : 0;
+
+    return bound < max ? bound : max;
+}
+
+/* format a time, in nanoseconds, in the unit that suits it. a time */
+/* of something that never happened is formatted as '-'.            */
+static char*
+format_time(char* buf, size_t size, unsigned long long nsec, int happened)
+{
+    if (!happened)
+	snprintf(buf, size, "-");
+    else if (nsec < 1000)
+	snprintf(buf, size, "%lluns", nsec);
+    else if (nsec < 1000000)
+	snprintf(buf, size, "%.1fus", nsec / 1e3);
+    else if (nsec < 1000000000)
+	snprintf(buf, size, "%.1fms", nsec / 1e6);
+    else
+	snprintf(buf, size, "%.2fs", nsec / 1e9);
+
+    return buf;
+}
+
+/*
+ * function lock_profile_report(): report the most contended sites.
+ * algorithm: sum the statistics of each site over all threads, sort
+ *            the sites by the time they waited, and print the top ones:
+ *            acquisitions, and the percent contended; failed trylocks;
+ *            total, p99 and longest wait; average, p99 and longest
+ *            hold. percentiles are the upper bounds of the histograms'
+ *            buckets, capped at the longest time.
+ * input:     file to write to, number of sites to report.
+ * output:    none.
+ */
+void
+lock_profile_report(FILE* out, int top)
+{
+    struct lock_profile* profile;
+    struct lock_site* sums = NULL;
+    int num_sums = 0, max_sums = 0;
+    unsigned long lost = 0;
+    char buf[6][16];
+    int i, j;
+
+    pthread_mutex_lock(&lock_profiles_mutex);
+    for (profile = lock_profiles; profile; profile = profile->next) {
+	lost += PROFILE_READ(profile->lost);
+	for (i = 0; i < LOCK_PROFILE_MAX_SITES; i++) {
+	    struct lock_site* site = &profile->sites[i];
+	    const char* file = __atomic_load_n(&site->file, __ATOMIC_ACQUIRE);
+
+	    if (!file)
+		continue;
+	    for (j = 0; j < num_sums; j++) {
+		if (sums[j].line == site->line &&
+		    strcmp(sums[j].file, file) == 0)
+		    break;
+	    }
+	    if (j == num_sums) {
+		if (num_sums == max_sums) {
+		    max_sums = max_sums ? max_sums * 2 : LOCK_PROFILE_MAX_SITES;
+		    sums = (struct lock_site*)
+			   realloc(sums, max_sums * sizeof(struct lock_site));
+		    if (!sums) {
+			fprintf(stderr, "lock_profile_report: out of memory. "
+				"exiting\n");
+			exit(1);
+		    }
+		}
+		memset(&sums[j], 0, sizeof(struct lock_site));
+		sums[j].file = file;
+		sums[j].line = site->line;
+		num_sums++;
+	    }
+	    add_site(&sums[j], site);
+	}
+    }
+    pthread_mutex_unlock(&lock_profiles_mutex);
+
+    qsort(sums, num_sums, sizeof(struct lock_site), compare_sites);
+    fprintf(out, "lock profile: top %d of %d lock sites, by time waiting\n",
+	    top < num_sums ? top : num_sums, num_sums);
+    fprintf(out, "%-26s %-14s %9s %6s %7s %8s %8s %8s %8s %8s %8s\n",
+	    "site", "mutex", "acquired", "cont%", "busy", "waited", "wait p99",
+	    "wait max", "held avg", "held p99", "held max");
+    for (i = 0; i < num_sums && i < top; i++) {
+	struct lock_site* sum = &sums[i];
+	char site_name[64];
+
+	snprintf(site_name, sizeof(site_name), "%s:%d", sum->file, sum->line);
+	fprintf(out, "%-26s %-14p %9lu %5.1f%% %7lu %8s %8s %8s %8s %8s %8s\n",
+		site_name, (void*)sum->mutex, sum->acquired,
+		sum->acquired ? 100.0 * sum->contended / sum->acquired : 0.0,
+		sum->busy,
+		format_time(buf[0], sizeof(buf[0]), sum->waited, 1),
+		format_time(buf[1], sizeof(buf[1]),
+			    percentile(sum->wait_hist, 0.99, sum->max_wait),
+			    1),
+		format_time(buf[2], sizeof(buf[2]), sum->max_wait, 1),
+		format_time(buf[3], sizeof(buf[3]),
+			    sum->holds ? sum->held / sum->holds : 0, sum->holds),
+		format_time(buf[4], sizeof(buf[4]),
+			    percentile(sum->hold_hist, 0.99, sum->max_hold),
+			    sum->holds),
+		format_time(buf[5], sizeof(buf[5]), sum->max_hold, sum->holds));
+    }
+    if (lost)
+	fprintf(out, "lock profile: %lu events not recorded - raise "
+		"LOCK_PROFILE_MAX_SITES or LOCK_PROFILE_MAX_HELD\n", lost);
+    free(sums);
+}
+
+#endif /* LOCK_PROFILE */
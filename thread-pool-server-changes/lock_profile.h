@@ -0,0 +1,87 @@
+#ifndef LOCK_PROFILE_H
+# define LOCK_PROFILE_H
+
+/*
+ * lock contention profiling. compile with -DLOCK_PROFILE, and include
+ * this file before any use of the mutex functions - most simply, with
+ * gcc's '-include lock_profile.h' (as 'make LOCK_PROFILE=1' does), so no
+ * source file needs to change. pthread_mutex_lock() and friends then go
+ * through wrappers that record, per call site (__FILE__:__LINE__) and
+ * per thread, without any shared lock:
+ *
+ * - acquisitions, and how many were contended (the mutex was taken).
+ * - failed pthread_mutex_trylock() calls (the mutex was busy).
+ * - a histogram of the time waiting for the mutex.
+ * - a histogram of the time it was held - from the site locking it,
+ *   until it was unlocked (or waited on, in pthread_cond_wait()).
+ *
+ * at exit, the sites of all threads are summed up, and the ones that
+ * waited longest are reported on stderr. recursive locking is followed:
+ * a mutex is held from its outermost lock to its last unlock. without
+ * LOCK_PROFILE, this file defines nothing, and profiling costs nothing.
+ */
+
+#ifdef LOCK_PROFILE
+
+#include <stdio.h>       /* FILE                                      */
+#include <time.h>        /* struct timespec                           */
+#include <pthread.h>     /* pthread functions and data structures     */
+
+/* most call sites recorded per thread. must be a power of 2. */
+#define LOCK_PROFILE_MAX_SITES 128
+
+/* most mutexes a thread may hold at once, and still be profiled. */
+#define LOCK_PROFILE_MAX_HELD 16
+
+/* buckets of the histograms. bucket 'i' counts times of less than */
+/* 2^i nanoseconds (and at least 2^(i-1)) - the last, all longer.  */
+#define LOCK_PROFILE_BUCKETS 36
+
+/* number of sites the report at exit shows. */
+#define LOCK_PROFILE_TOP_SITES 10
+
+/* the wrappers - the same as the pthread functions, plus a call site. */
+extern int
+lock_profile_mutex_lock(pthread_mutex_t* mutex, const char* file, int line);
+
+extern int
+lock_profile_mutex_trylock(pthread_mutex_t* mutex, const char* file,
+			   int line);
+
+extern int
+lock_profile_mutex_unlock(pthread_mutex_t* mutex, const char* file,
+			  int line);
+
+extern int
+lock_profile_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+		       const char* file, int line);
+
+extern int
+lock_profile_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+			    const struct timespec* abstime,
+			    const char* file, int line);
+
+/*
+ * write a report of the 'top' sites that waited longest for their
+ * mutexes, over all threads, to 'out'. called at exit with stderr. may be
+ * called while other threads are still locking - their latest counts
+ * may then be missed.
+ */
+extern void
+lock_profile_report(FILE* out, int top);
+
+#define pthread_mutex_lock(mutex) \
+	lock_profile_mutex_lock((mutex), __FILE__, __LINE__)
+#define pthread_mutex_trylock(mutex) \
+	lock_profile_mutex_trylock((mutex), __FILE__, __LINE__)
+#define pthread_mutex_unlock(mutex) \
+	lock_profile_mutex_unlock((mutex), __FILE__, __LINE__)
+#define pthread_cond_wait(cond, mutex) \
+	lock_profile_cond_wait((cond), (mutex), __FILE__, __LINE__)
+#define pthread_cond_timedwait(cond, mutex, abstime) \
+	lock_profile_cond_timedwait((cond), (mutex), (abstime), \
+				    __FILE__, __LINE__)
+
+#endif /* LOCK_PROFILE */
+
+#endif /* LOCK_PROFILE_H */
@@ -0,0 +1,246 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdlib.h>      /* exit()                                    */
+#include <stdarg.h>      /* va_list and friends                       */
+#include <string.h>      /* memcpy()                                  */
+#include <stdint.h>      /* fixed-size integer types                  */
+#include <time.h>        /* nanosleep()                               */
+#include <unistd.h>      /* write()                                   */
+#include <errno.h>       /* errno and error codes                     */
+#include <sys/uio.h>     /* writev() and struct iovec                 */
+
+#include "logger.h"      /* asynchronous logger functions             */
+#include "cache_line.h"  /* CACHE_ALIGNED                             */
+
+/* maximal number of messages written with a single writev() call. */
+#define LOG_BATCH_SIZE 64
+
+/* time the writer sleeps when it finds the queue empty, in nanoseconds. */
+#define LOG_IDLE_SLEEP 1000000
+
+/* a single slot of the queue. 'seq' tells who owns the slot: it equals  */
+/* the slot's position when free, and position+1 when holding a message. */
+struct log_cell {
+    uint64_t seq;			/* slot's sequence number.     */
+    int len;				/* length of message in text.  */
+    char text[LOG_RECORD_SIZE];		/* the message itself.         */
+} CACHE_ALIGNED;
+
+/* the logger's state. producers only touch 'tail' and the cells, */
+/* the writer only 'head' and the cells - each on its own cache    */
+/* line(s), and so is each cell, so they don't slow each other.    */
+static struct log_cell log_queue[LOG_QUEUE_SIZE] CACHE_ALIGNED;
+static uint64_t log_tail CACHE_ALIGNED = 0; /* next position to fill.  */
+static uint64_t log_head CACHE_ALIGNED = 0; /* next position to write. */
+static unsigned long log_num_dropped = 0; /* messages lost to overload. */
+static int log_done = 0;		/* asks the writer to exit.    */
+static int log_fd = -1;			/* where messages are written. */
+static pthread_t log_writer;		/* the writer thread.          */
+
+/* each thread's private formatting buffer. */
+static __thread char log_buffer[LOG_RECORD_SIZE];
+
+/*
+ * function log_write_all(): write a batch of buffers, retrying on short
+ *                           writes.
+ * input:     array of buffers, number of buffers.
+ * output:    none. on error, the rest of the batch is discarded.
+ */
+static void
+log_write_all(struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+	ssize_t n = writev(log_fd, iov, iovcnt);
+
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return;
+	}
+	/* skip the buffers fully written, and trim a partial one. */
+	while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char*)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+}
+
+/*
+ * function log_flush_batch(): write out up to LOG_BATCH_SIZE messages.
+ * algorithm: collect consecutive ready cells into an iovec array, write
+ *            them with one writev(), then hand the cells back to the
+ *            producers.
+ * input:     none.
+ * output:    number of messages written.
+ */
+static int
+log_flush_batch(void)
+{
+    struct iovec iov[LOG_BATCH_SIZE];
+    int count = 0;
+    int i;
+
+    while (count < LOG_BATCH_SIZE) {
+	uint64_t pos = log_head + count;
+	struct log_cell* cell = &log_queue[pos & (LOG_QUEUE_SIZE - 1)];
+
+	if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+	    break;
+	iov[count].iov_base = cell->text;
+	iov[count].iov_len = cell->len;
+	count++;
+    }
+
+    if (count == 0)
+	return 0;
+
+    log_write_all(iov, count);
+
+    /* free the written cells for the next round of positions. */
+    for (i = 0; i < count; i++) {
+	uint64_t pos = log_head + i;
+	struct log_cell* cell = &log_queue[pos & (LOG_QUEUE_SIZE - 1)];
+
+	__atomic_store_n(&cell->seq, pos + LOG_QUEUE_SIZE, __ATOMIC_RELEASE);
+    }
+    log_head += count;
+
+    return count;
+}
+
+/*
+ * function log_writer_loop(): the writer thread's main loop.
+ * algorithm: write batches while there are messages, sleep a little
+ *            when the queue is empty. on shutdown, drain the queue.
+ * input:     none.
+ * output:    none.
+ */
+static void*
+log_writer_loop(void* data)
+{
+    struct timespec delay;
+
+    delay.tv_sec = 0;
+    delay.tv_nsec = LOG_IDLE_SLEEP;
+
+    while (1) {
+	if (log_flush_batch() > 0)
+	    continue;
+	if (__atomic_load_n(&log_done, __ATOMIC_ACQUIRE)) {
+	    /* producers are gone - write whatever was left behind. */
+	    while (log_flush_batch() > 0)
+		;
+	    break;
+	}
+	nanosleep(&delay, NULL);
+    }
+
+    return NULL;
+}
+
+/*
+ * function log_init(): start the logger.
+ * input:     file descriptor to write messages to.
+ * output:    none.
+ */
+void
+log_init(int fd)
+{
+    uint64_t i;
+
+    for (i = 0; i < LOG_QUEUE_SIZE; i++)
+	log_queue[i].seq = i;
+    log_tail = log_head = 0;
+    log_num_dropped = 0;
+    log_done = 0;
+    log_fd = fd;
+
+    if (pthread_create(&log_writer, NULL, log_writer_loop, NULL) != 0) {
+	fprintf(stderr, "log_init: cannot create writer thread. exiting\n");
+	exit(1);
+    }
+}
+
+/*
+ * function log_printf(): queue a message for writing.
+ * algorithm: format the message into the thread's own buffer, then claim
+ *            a queue slot by advancing 'tail' with a CAS (several threads
+ *            may do this at once), copy the message in, and publish it
+ *            through the slot's sequence number. if the slot at 'tail'
+ *            was not yet written out, the queue is full - drop.
+ * input:     printf-style format and arguments.
+ * output:    none.
+ */
+void
+log_printf(const char* format, ...)
+{
+    va_list ap;
+    int len;
+    uint64_t pos;
+    struct log_cell* cell;
+
+    va_start(ap, format);
+    len = vsnprintf(log_buffer, LOG_RECORD_SIZE, format, ap);
+    va_end(ap);
+    if (len < 0)
+	return;
+    if (len >= LOG_RECORD_SIZE) {
+	/* truncated message - it still ends its line, so the next */
+	/* message does not run onto it.                           */
+	len = LOG_RECORD_SIZE - 1;
+	log_buffer[len - 1] = '\n';
+    }
+
+    pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    while (1) {
+	int64_t dif;
+
+	cell = &log_queue[pos & (LOG_QUEUE_SIZE - 1)];
+	dif = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+	if (dif == 0) {
+	    /* slot is free - try to claim it. on failure 'pos' is reloaded. */
+	    if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	}
+	else if (dif < 0) {
+	    /* queue is full - never wait for the writer. */
+	    __atomic_fetch_add(&log_num_dropped, 1, __ATOMIC_RELAXED);
+	    return;
+	}
+	else {
+	    /* another thread claimed this slot - move on. */
+	    pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	}
+    }
+
+    memcpy(cell->text, log_buffer, len);
+    cell->len = len;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* get the number of messages dropped so far since the queue was full. */
+unsigned long
+log_dropped(void)
+{
+    return __atomic_load_n(&log_num_dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * function log_shutdown(): stop the logger.
+ * algorithm: ask the writer to drain the queue and exit, and wait for it.
+ *            no thread may call log_printf() after this.
+ * input:     none.
+ * output:    none.
+ */
+void
+log_shutdown(void)
+{
+    __atomic_store_n(&log_done, 1, __ATOMIC_RELEASE);
+    pthread_join(log_writer, NULL);
+}
@@ -0,0 +1,36 @@
+#ifndef LOGGER_H
+# define LOGGER_H
+
+/*
+ * asynchronous logger. a thread calling log_printf() formats its message
+ * into its own buffer, and pushes it on a lock-free queue. a background
+ * writer thread collects queued messages and writes them in batches with
+ * writev(). log_printf() never blocks - if the queue is full, the message
+ * is dropped and counted.
+ */
+
+/* maximal length of a single log message, including the newline. a */
+/* longer one is cut short, and still ends with a newline.          */
+#define LOG_RECORD_SIZE 240
+
+/* number of messages the queue can hold. must be a power of 2. */
+#define LOG_QUEUE_SIZE 1024
+
+/* start the writer thread, writing to the given file descriptor. */
+extern void
+log_init(int fd);
+
+/* format a message (printf style), and queue it for writing. */
+extern void
+log_printf(const char* format, ...)
+	__attribute__ ((format (printf, 1, 2)));
+
+/* get the number of messages dropped so far since the queue was full. */
+extern unsigned long
+log_dropped(void);
+
+/* write out all queued messages, and stop the writer thread. */
+extern void
+log_shutdown(void);
+
+#endif /* LOGGER_H */
@@ -1,12 +1,16 @@
 #include <stdio.h>             /* standard I/O routines                      */
 #include <pthread.h>           /* pthread functions and data structures      */
 #include <stdlib.h>            /* rand() and srand() functions               */
-#include <unistd.h>            /* sleep()                                    */
+#include <unistd.h>            /* sleep(), STDOUT_FILENO                     */
 #include <assert.h>            /* assert()                                   */
+#include <signal.h>            /* signal()                                   */
 
 #include "requests_queue.h"         /* requests queue routines/structs       */
 #include "handler_thread.h"         /* handler thread functions/structs      */
 #include "handler_threads_pool.h"   /* handler thread list functions/structs */
+#include "trace.h"                  /* event tracing macros and functions    */
+#include "logger.h"                 /* asynchronous logger                   */
+#include "cache_line.h"             /* CACHE_ALIGNED                         */
 
 /* number of initial threads used to service requests, and max number */
 /* of handler threads to create during "high pressure" times.         */
@@ -17,16 +21,61 @@
 #define HIGH_REQUESTS_WATERMARK 15
 #define LOW_REQUESTS_WATERMARK 3
 
+/* admission control: acceptable time for a request to wait on the queue, */
+/* and the interval over which it may stay above that, in milliseconds.   */
+#define QUEUE_TARGET_DELAY_MS 5
+#define QUEUE_INTERVAL_MS 100
+
+/* requests are tagged by the (simulated) client sending them. one */
+/* client disconnects half way, and its pending requests are cancelled. */
+#define NUM_CLIENTS 10
+#define DISCONNECTING_CLIENT 3
+
 /* global mutex for our program. assignment initializes it. */
 /* note that we use a RECURSIVE mutex, since a handler      */
 /* thread might try to lock it twice consecutively.         */
-pthread_mutex_t request_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+/* each of these globals gets a cache line of its own - the */
+/* mutex is written on every lock, the condition variable on */
+/* every wait and signal, and the flag is read by handlers   */
+/* that should not lose their copy of it on every one.       */
+pthread_mutex_t request_mutex CACHE_ALIGNED =
+					PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 /* global condition variable for our program. assignment initializes it. */
-pthread_cond_t  got_request   = PTHREAD_COND_INITIALIZER;
+pthread_cond_t  got_request CACHE_ALIGNED = PTHREAD_COND_INITIALIZER;
 
 /* are we done creating new requests? */
-int done_creating_requests = 0;
+int done_creating_requests CACHE_ALIGNED = 0;
+
+#ifdef TRACE
+/* name of the trace file. taken from $TRACE_FILE, if set. */
+#define DEFAULT_TRACE_FILE "trace.json"
+
+/* set by SIGUSR1, to ask for a trace dump while running. */
+volatile sig_atomic_t trace_dump_requested = 0;
+
+/*
+ * function request_trace_dump(): SIGUSR1 handler.
+ * algorithm: only raises a flag - the dump itself is done by the main
+ *            loop, since stdio is not async-signal-safe.
+ * input:     signal number.
+ * output:    none.
+ */
+static void
+request_trace_dump(int sig)
+{
+    trace_dump_requested = 1;
+}
+
+/* get the name of the file to dump the trace into. */
+static const char*
+trace_file_name(void)
+{
+    const char* name = getenv("TRACE_FILE");
+
+    return name ? name : DEFAULT_TRACE_FILE;
+}
+#endif /* TRACE */
 
 /* like any C program, program's execution begins in main */
 int
@@ -38,9 +87,18 @@ main(int argc, char* argv[])
     struct handler_threads_pool* handler_threads = NULL;
 					       /* list of handler threads */
 
+#ifdef TRACE
+    signal(SIGUSR1, request_trace_dump);
+#endif /* TRACE */
+
+    /* start the logger - handler threads must not block on stdout. */
+    log_init(STDOUT_FILENO);
+
     /* create the requests queue */
     requests = init_requests_queue(&request_mutex, &got_request);
     assert(requests);
+    set_requests_queue_codel(requests, QUEUE_TARGET_DELAY_MS,
+			     QUEUE_INTERVAL_MS);
 
     /* create the handler threads list */
     handler_threads =
@@ -57,7 +115,15 @@ main(int argc, char* argv[])
 	int num_requests; // number of requests waiting to be handled.
 	int num_threads;  // number of active handler threads.
 
-	add_request(requests, i);
+	if (add_request_tagged(requests, i, i % NUM_CLIENTS,
+			       NULL, NULL, 0) == REQUEST_OVERLOADED) {
+	    log_printf("main: request '%d' refused - queue overloaded\n", i);
+	}
+	if (i == 300) {
+	    log_printf("main: client '%d' disconnected, %d requests cancelled\n",
+		       DISCONNECTING_CLIENT,
+		       cancel_requests_by_tag(requests, DISCONNECTING_CLIENT));
+	}
 
 	num_requests = get_requests_number(requests);
 	num_threads = get_handler_threads_number(handler_threads);
@@ -67,13 +133,13 @@ main(int argc, char* argv[])
 	/* a handler thread.          					  */
 	if (num_requests > HIGH_REQUESTS_WATERMARK &&
 	    num_threads < MAX_NUM_HANDLER_THREADS) {
-		printf("main: adding thread: '%d' requests, '%d' threads\n",
+		log_printf("main: adding thread: '%d' requests, '%d' threads\n",
 		       num_requests, num_threads);
 		add_handler_thread(handler_threads);
 	}
 	if (num_requests < LOW_REQUESTS_WATERMARK &&
 		 num_threads > NUM_HANDLER_THREADS) {
-	    printf("main: deleting thread: '%d' requests, '%d' threads\n",
+	    log_printf("main: deleting thread: '%d' requests, '%d' threads\n",
 		   num_requests, num_threads);
 	    delete_handler_thread(handler_threads);
 	}
@@ -85,6 +151,14 @@ main(int argc, char* argv[])
 	    delay.tv_nsec = 1;
 	    nanosleep(&delay, NULL);
 	}
+
+#ifdef TRACE
+	/* dump the trace collected so far, if asked to. */
+	if (trace_dump_requested) {
+	    trace_dump_requested = 0;
+	    trace_dump(trace_file_name());
+	}
+#endif /* TRACE */
     }
     /* modify the flag to tell the handler threads no   */
     /* new requests will be generated.                  */
@@ -99,7 +173,34 @@ main(int argc, char* argv[])
 
     /* cleanup */
     delete_handler_threads_pool(handler_threads);
+
+    /* report how much load the queue had to shed. */
+    {
+	struct requests_queue_stats stats;
+
+	get_requests_queue_stats(requests, &stats);
+	log_printf("main: %lu requests handled, %lu refused, %lu dropped, "
+		   "%lu cancelled\n",
+		   stats.num_handed, stats.num_rejected, stats.num_dropped,
+		   stats.num_cancelled);
+	if (stats.num_handed + stats.num_dropped > 0)
+	    log_printf("main: sojourn time min %.3fms, avg %.3fms, max %.3fms\n",
+		       stats.min_sojourn / 1e6,
+		       stats.total_sojourn / 1e6 /
+		           (stats.num_handed + stats.num_dropped),
+		       stats.max_sojourn / 1e6);
+    }
     delete_requests_queue(requests);
+
+    /* flush all pending log messages before using stdio again. */
+    log_shutdown();
+    if (log_dropped() > 0)
+	fprintf(stderr, "main: %lu log messages dropped\n", log_dropped());
+
+#ifdef TRACE
+    if (trace_dump(trace_file_name()) == 0)
+	printf("trace written to '%s'\n", trace_file_name());
+#endif /* TRACE */
     
     printf("Glory,  we are done.\n");
 
@@ -0,0 +1,168 @@
+#include <limits.h>      /* INT_MAX                                   */
+#include <sched.h>       /* sched_yield()                             */
+#include <unistd.h>      /* syscall(), sysconf()                      */
+#include <sys/syscall.h> /* SYS_futex                                 */
+#include <linux/futex.h> /* FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE    */
+
+#include "queue_lock.h"  /* ticket and MCS locks                      */
+
+/* tell the CPU we are spinning - so it saves power, and leaves the */
+/* core to its other hyper-thread.                                  */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __asm__ __volatile__ ("pause" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+/* rounds a waiter spins before parking - QUEUE_LOCK_SPINS, or none at */
+/* all on a single CPU, where the holder can't run while we spin.      */
+static int
+spin_limit(void)
+{
+    static int limit = -1;
+    int value = __atomic_load_n(&limit, __ATOMIC_RELAXED);
+
+    if (value < 0) {
+	value = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_LOCK_SPINS : 0;
+	__atomic_store_n(&limit, value, __ATOMIC_RELAXED);
+    }
+
+    return value;
+}
+
+/* park until '*word' is no longer 'value' (or for no reason at all). */
+static void
+futex_wait(unsigned int* word, unsigned int value)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+/* wake up to 'count' threads parked on 'word'. */
+static void
+futex_wake(unsigned int* word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/*
+ * function ticket_lock(): lock a ticket lock.
+ * algorithm: take a ticket, and spin until it is served. after
+ *            QUEUE_LOCK_SPINS rounds, count ourselves as parked - so
+ *            unlock knows to wake us - and park on 'serving', if it
+ *            still doesn't serve our ticket. on a single CPU, park
+ *            right away.
+ * input:     the lock.
+ * output:    none.
+ */
+void
+ticket_lock(struct ticket_lock* lock)
+{
+    unsigned int ticket = __atomic_fetch_add(&lock->next, 1,
+					     __ATOMIC_RELAXED);
+    unsigned int serving;
+    int max_spins = spin_limit();
+    int spins = 0;
+
+    while ((serving = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE))
+	   != ticket) {
+	if (spins++ < max_spins) {
+	    cpu_relax();
+	    continue;
+	}
+	__atomic_fetch_add(&lock->parked, 1, __ATOMIC_SEQ_CST);
+	serving = __atomic_load_n(&lock->serving, __ATOMIC_SEQ_CST);
+	if (serving != ticket)
+	    futex_wait(&lock->serving, serving);
+	__atomic_fetch_sub(&lock->parked, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * function ticket_unlock(): unlock a ticket lock.
+ * algorithm: serve the next ticket. if any waiter is parked, wake them
+ *            all - they park on the same word, and only the one whose
+ *            ticket is served keeps going.
+ * input:     the lock.
+ * output:    none.
+ */
+void
+ticket_unlock(struct ticket_lock* lock)
+{
+    __atomic_fetch_add(&lock->serving, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lock->parked, __ATOMIC_SEQ_CST))
+	futex_wake(&lock->serving, INT_MAX);
+}
+
+/*
+ * function mcs_lock(): lock an MCS lock.
+ * algorithm: make our node the queue's tail. if there was none before
+ *            it, the lock is ours. otherwise, link our node after the
+ *            previous tail, and spin on our node until the lock is
+ *            handed to us. after QUEUE_LOCK_SPINS rounds (none, on a
+ *            single CPU), mark the node parked - so unlock knows to
+ *            wake us - and park on it.
+ * input:     the lock, the calling thread's node.
+ * output:    none.
+ */
+void
+mcs_lock(struct mcs_lock* lock, struct mcs_node* node)
+{
+    struct mcs_node* prev;
+    unsigned int state = MCS_WAITING;
+    int max_spins;
+    int spins = 0;
+
+    node->next = NULL;
+    node->state = MCS_WAITING;
+    prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    if (!prev)
+	return;
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+    max_spins = spin_limit();
+    while (__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) != MCS_GRANTED) {
+	if (spins++ < max_spins) {
+	    cpu_relax();
+	    continue;
+	}
+	if (__atomic_compare_exchange_n(&node->state, &state, MCS_PARKED, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) ||
+	    state == MCS_PARKED)
+	    futex_wait(&node->state, MCS_PARKED);
+	state = MCS_WAITING;
+    }
+}
+
+/*
+ * function mcs_unlock(): unlock an MCS lock.
+ * algorithm: if no node follows ours, and ours is still the tail, the
+ *            lock is free. if a node follows - or is just being linked,
+ *            so wait for it - hand the lock to it, and wake its thread
+ *            if it parked.
+ * input:     the lock, the node the calling thread locked it with.
+ * output:    none.
+ */
+void
+mcs_unlock(struct mcs_lock* lock, struct mcs_node* node)
+{
+    struct mcs_node* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    struct mcs_node* expected = node;
+    int max_spins = spin_limit();
+    int spins = 0;
+
+    if (!next) {
+	if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	    return;
+	/* a waiter swapped the tail, but did not link its node yet. */
+	while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+	    if (spins++ < max_spins)
+		cpu_relax();
+	    else
+		sched_yield();
+	}
+    }
+    if (__atomic_exchange_n(&next->state, MCS_GRANTED, __ATOMIC_RELEASE) ==
+	MCS_PARKED)
+	futex_wake(&next->state, 1);
+}
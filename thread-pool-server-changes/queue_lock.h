@@ -0,0 +1,71 @@
+#ifndef QUEUE_LOCK_H
+# define QUEUE_LOCK_H
+
+#include "cache_line.h"  /* CACHE_ALIGNED                             */
+
+/*
+ * fair (first come, first served) spin locks, for short critical
+ * sections hammered by many threads - like the requests queue's.
+ *
+ * - ticket lock: a thread takes the next ticket, and waits until it is
+ *   served. all the waiters watch the same word, so each hand-off
+ *   moves its cache line to all of them.
+ * - MCS lock: a thread adds a node of its own to the lock's queue of
+ *   waiters, and waits on its node - on a cache line of its own. the
+ *   holder hands the lock to the next node, touching only its line.
+ *
+ * a waiter spins for QUEUE_LOCK_SPINS rounds (on more than one CPU),
+ * and then parks in the kernel (with a futex) until the lock is handed
+ * to it - so a holder preempted, or a long wait, costs no CPU. unlike
+ * a pthread mutex, these locks are not recursive, and can't be used
+ * with condition variables.
+ */
+
+/* rounds a waiter spins before parking. */
+#define QUEUE_LOCK_SPINS 1000
+
+/* a ticket lock. initialize with QUEUE_TICKET_LOCK_INITIALIZER. */
+struct ticket_lock {
+    unsigned int next CACHE_ALIGNED;	/* next ticket to take.          */
+    unsigned int serving CACHE_ALIGNED;	/* ticket allowed to hold it.    */
+    unsigned int parked;		/* waiters parked on 'serving'.  */
+};
+
+#define QUEUE_TICKET_LOCK_INITIALIZER { 0, 0, 0 }
+
+/* states of an MCS node. */
+enum mcs_state {
+    MCS_WAITING,		/* waiting for the lock, spinning.       */
+    MCS_PARKED,			/* waiting for the lock, in the kernel.  */
+    MCS_GRANTED			/* the lock was handed to it.            */
+};
+
+/* a waiter's node in an MCS lock's queue. each thread locking passes */
+/* a node of its own - usually on its stack - to both lock and unlock. */
+struct mcs_node {
+    struct mcs_node* next;	/* next waiter, NULL if none (yet).      */
+    unsigned int state;		/* one of 'enum mcs_state'.              */
+} CACHE_ALIGNED;
+
+/* an MCS lock. initialize with QUEUE_MCS_LOCK_INITIALIZER. */
+struct mcs_lock {
+    struct mcs_node* tail CACHE_ALIGNED; /* last waiter, NULL if free. */
+};
+
+#define QUEUE_MCS_LOCK_INITIALIZER { NULL }
+
+/* lock, and unlock, a ticket lock. */
+extern void
+ticket_lock(struct ticket_lock* lock);
+
+extern void
+ticket_unlock(struct ticket_lock* lock);
+
+/* lock, and unlock, an MCS lock, with the calling thread's node. */
+extern void
+mcs_lock(struct mcs_lock* lock, struct mcs_node* node);
+
+extern void
+mcs_unlock(struct mcs_lock* lock, struct mcs_node* node);
+
+#endif /* QUEUE_LOCK_H */
@@ -0,0 +1,259 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* posix_memalign(), atoi(), atof(), exit()  */
+#include <string.h>      /* memset()                                  */
+#include <math.h>        /* sqrt()                                    */
+#include <time.h>        /* clock_gettime()                           */
+#include <unistd.h>      /* usleep(), sysconf()                       */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <sched.h>       /* sched_yield()                             */
+
+#include "cache_line.h"  /* CACHE_LINE_SIZE, CACHE_ALIGNED            */
+#include "queue_lock.h"  /* ticket and MCS locks                      */
+
+/*
+ * queue locks benchmark: threads hammer a queue like the requests
+ * queue - each one, in turn, adds a node at its tail, or takes the node
+ * at its head - under a pthread mutex, a ticket lock and an MCS lock.
+ * between operations, a thread does some work of its own (handling the
+ * request). for 2, 4, 8... threads, it reports the operations per
+ * second, and how evenly the threads got the lock: the ratio between
+ * the most and the fewest operations a thread made, and their
+ * coefficient of variation (0% is perfectly fair).
+ */
+
+/* default most threads, seconds per run, and work between operations. */
+#define MAX_THREADS 64
+#define RUN_SECONDS 0.2
+#define WORK_ROUNDS 100
+
+/* the locks compared. */
+enum lock_kind {
+    LOCK_MUTEX,			/* pthread mutex.                        */
+    LOCK_TICKET,		/* ticket lock.                          */
+    LOCK_MCS,			/* MCS lock.                             */
+    NUM_LOCK_KINDS
+};
+
+static const char* lock_names[NUM_LOCK_KINDS] = { "mutex", "ticket", "mcs" };
+
+/* a node of the queue. */
+struct node {
+    struct node* next;
+};
+
+/* the queue, protected by the lock measured. */
+struct queue {
+    struct node* head;		/* first node, NULL if empty.            */
+    struct node* tail;		/* last node.                            */
+    int num_nodes;		/* number of nodes in the queue.         */
+};
+
+/* the locks, and the queue - each on cache lines of its own. */
+static pthread_mutex_t the_mutex CACHE_ALIGNED = PTHREAD_MUTEX_INITIALIZER;
+static struct ticket_lock the_ticket_lock = QUEUE_TICKET_LOCK_INITIALIZER;
+static struct mcs_lock the_mcs_lock = QUEUE_MCS_LOCK_INITIALIZER;
+static struct queue the_queue CACHE_ALIGNED;
+
+/* the lock measured, work between operations, and the run's flags. */
+static enum lock_kind lock_kind;
+static int work_rounds = WORK_ROUNDS;
+static int start_threads CACHE_ALIGNED = 0;
+static int stop_threads = 0;
+
+/* a thread's share of a run. */
+struct worker {
+    pthread_t thread;		/* the thread.                           */
+    struct node* node;		/* the node it holds between operations. */
+    struct node own_node;	/* the node it started with.             */
+    unsigned long ops;		/* operations it made.                   */
+} CACHE_ALIGNED;
+
+/* get the current time, in seconds. */
+static double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* add a node at the queue's tail, or take the one at its head - with */
+/* the lock held.                                                      */
+static void
+queue_op(struct worker* me)
+{
+    if (me->node) {
+	me->node->next = NULL;
+	if (the_queue.tail)
+	    the_queue.tail->next = me->node;
+	else
+	    the_queue.head = me->node;
+	the_queue.tail = me->node;
+	the_queue.num_nodes++;
+	me->node = NULL;
+    }
+    else if (the_queue.head) {
+	me->node = the_queue.head;
+	the_queue.head = me->node->next;
+	if (!the_queue.head)
+	    the_queue.tail = NULL;
+	the_queue.num_nodes--;
+    }
+}
+
+/* function of the threads - operate on the queue, under the lock */
+/* measured, and do some work between operations.                 */
+static void*
+do_ops(void* data)
+{
+    struct worker* me = (struct worker*)data;
+    struct mcs_node mcs_node;
+    volatile int sink = 0;
+    int i;
+
+    while (!__atomic_load_n(&start_threads, __ATOMIC_ACQUIRE))
+	sched_yield();
+
+    while (!__atomic_load_n(&stop_threads, __ATOMIC_RELAXED)) {
+	switch (lock_kind) {
+	    case LOCK_MUTEX:
+		pthread_mutex_lock(&the_mutex);
+		queue_op(me);
+		pthread_mutex_unlock(&the_mutex);
+		break;
+	    case LOCK_TICKET:
+		ticket_lock(&the_ticket_lock);
+		queue_op(me);
+		ticket_unlock(&the_ticket_lock);
+		break;
+	    case LOCK_MCS:
+		mcs_lock(&the_mcs_lock, &mcs_node);
+		queue_op(me);
+		mcs_unlock(&the_mcs_lock, &mcs_node);
+		break;
+	    default:
+		break;
+	}
+	me->ops++;
+	for (i = 0; i < work_rounds; i++)
+	    sink += i;
+    }
+
+    return NULL;
+}
+
+/* format the max/min ratio of the threads' operations into 'buf' - */
+/* "inf" if a thread made no progress while others did, "-" if none */
+/* did.                                                              */
+static const char*
+format_ratio(char* buf, size_t size, double max, double min)
+{
+    if (max == 0)
+	snprintf(buf, size, "-");
+    else if (min == 0)
+	snprintf(buf, size, "inf");
+    else
+	snprintf(buf, size, "%.2f", max / min);
+
+    return buf;
+}
+
+/*
+ * function run_lock(): run the threads with one lock, and report.
+ * algorithm: start the threads together, stop them after the given
+ *            time, and check the queue holds all the nodes the threads
+ *            don't - a lock that let two threads in would lose some.
+ * input:     lock, number of threads, seconds to run.
+ * output:    none. exits if nodes were lost.
+ */
+static void
+run_lock(enum lock_kind kind, int num_threads, double seconds)
+{
+    struct worker* workers;
+    double total = 0, sum_squares = 0, min = 0, max = 0;
+    double start, elapsed, mean, variance, cv = 0;
+    char ratio[16];
+    int held = 0;
+    int i;
+
+    if (posix_memalign((void**)&workers, CACHE_LINE_SIZE,
+		       num_threads * sizeof(struct worker)) != 0) {
+	fprintf(stderr, "run_lock: out of memory. exiting\n");
+	exit(1);
+    }
+    memset(workers, 0, num_threads * sizeof(struct worker));
+    memset(&the_queue, 0, sizeof(the_queue));
+    lock_kind = kind;
+    start_threads = 0;
+    stop_threads = 0;
+    for (i = 0; i < num_threads; i++) {
+	workers[i].node = &workers[i].own_node;
+	pthread_create(&workers[i].thread, NULL, do_ops, (void*)&workers[i]);
+    }
+
+    start = now_sec();
+    __atomic_store_n(&start_threads, 1, __ATOMIC_RELEASE);
+    usleep((useconds_t)(seconds * 1e6));
+    __atomic_store_n(&stop_threads, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < num_threads; i++)
+	pthread_join(workers[i].thread, NULL);
+    elapsed = now_sec() - start;
+
+    for (i = 0; i < num_threads; i++) {
+	double ops = workers[i].ops;
+
+	held += workers[i].node != NULL;
+	total += ops;
+	sum_squares += ops * ops;
+	if (i == 0 || ops < min)
+	    min = ops;
+	if (i == 0 || ops > max)
+	    max = ops;
+    }
+    if (held + the_queue.num_nodes != num_threads) {
+	fprintf(stderr, "run_lock: %s lost nodes. exiting\n",
+		lock_names[kind]);
+	exit(1);
+    }
+    mean = total / num_threads;
+    if (mean > 0) {
+	/* rounding may take an all but zero variance below zero. */
+	variance = sum_squares / num_threads - mean * mean;
+	cv = sqrt(variance > 0 ? variance : 0) / mean;
+    }
+
+    printf("%7d %-7s %12.0f %10s %7.1f%%\n", num_threads, lock_names[kind],
+	   total / elapsed, format_ratio(ratio, sizeof(ratio), max, min),
+	   cv * 100);
+    free(workers);
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : MAX_THREADS;
+    double seconds = argc > 2 ? atof(argv[2]) : RUN_SECONDS;
+    int num_threads;
+    int kind;
+
+    if (argc > 3)
+	work_rounds = atoi(argv[3]);
+    if (max_threads < 2 || seconds <= 0 || work_rounds < 0) {
+	fprintf(stderr, "usage: %s [max_threads] [seconds] [work_rounds]\n",
+		argv[0]);
+	exit(1);
+    }
+
+    printf("%ld CPUs, %.2f sec per run, %d work rounds between operations\n",
+	   sysconf(_SC_NPROCESSORS_ONLN), seconds, work_rounds);
+    printf("%7s %-7s %12s %10s %8s\n", "threads", "lock", "ops/sec",
+	   "max/min", "cv");
+    for (num_threads = 2; num_threads <= max_threads; num_threads *= 2) {
+	for (kind = 0; kind < NUM_LOCK_KINDS; kind++)
+	    run_lock(kind, num_threads, seconds);
+    }
+
+    return 0;
+}
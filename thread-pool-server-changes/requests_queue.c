@@ -1,8 +1,111 @@
 #include <stdlib.h>      /* malloc() and free()                       */
+#include <string.h>      /* memset()                                  */
 #include <assert.h>      /* assert()                                  */
+#include <math.h>        /* sqrt()                                    */
+#include <time.h>        /* clock_gettime()                           */
+#include <unistd.h>      /* read(), write(), close()                  */
+#include <sys/eventfd.h> /* eventfd()                                 */
 
 #include "requests_queue.h"      /* requests queue functions and structs */
+#include "trace.h"               /* event tracing macros                 */
 
+/* get the current time, in nanoseconds, from a monotonic clock. */
+static unsigned long long
+now_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* get the bucket of the pending requests map, holding the given number. */
+#define REQUEST_MAP_BUCKET(num) ((unsigned int)(num) % REQUEST_MAP_BUCKETS)
+
+/* get the mutex protecting the given bucket. */
+#define REQUEST_MAP_STRIPE(map, bucket) \
+	(&(map)->stripes[((bucket) / REQUEST_MAP_LINE_BUCKETS) % \
+			 REQUEST_MAP_STRIPES].mutex)
+
+/*
+ * function request_map_insert(): add a request to the pending map.
+ * input:     pointer to map, pointer to request.
+ * output:    none.
+ */
+static void
+request_map_insert(struct request_map* map, struct request* a_request)
+{
+    unsigned int bucket;
+
+    a_request->map_next = NULL;
+    a_request->map_pprev = NULL;
+    if (a_request->number < 0)	/* not indexed - can't be cancelled. */
+	return;
+
+    bucket = REQUEST_MAP_BUCKET(a_request->number);
+    pthread_mutex_lock(REQUEST_MAP_STRIPE(map, bucket));
+    a_request->map_next = map->buckets[bucket];
+    if (a_request->map_next)
+	a_request->map_next->map_pprev = &a_request->map_next;
+    a_request->map_pprev = &map->buckets[bucket];
+    map->buckets[bucket] = a_request;
+    pthread_mutex_unlock(REQUEST_MAP_STRIPE(map, bucket));
+}
+
+/* unlink a request from its bucket. the bucket's stripe must be locked. */
+static void
+request_map_unlink(struct request* a_request)
+{
+    if (!a_request->map_pprev)	/* already unlinked. */
+	return;
+    *a_request->map_pprev = a_request->map_next;
+    if (a_request->map_next)
+	a_request->map_next->map_pprev = a_request->map_pprev;
+    a_request->map_next = NULL;
+    a_request->map_pprev = NULL;
+}
+
+/*
+ * function request_map_remove(): remove a dequeued request from the map.
+ * algorithm: under the bucket's stripe lock, unlink the request (if a
+ *            cancellation did not do it already) and read its tombstone.
+ *            since cancel_request() uses the same lock, a request is
+ *            either cancelled before this point, or not at all.
+ * input:     pointer to map, pointer to request.
+ * output:    1 if the request was cancelled, 0 otherwise.
+ */
+static int
+request_map_remove(struct request_map* map, struct request* a_request)
+{
+    unsigned int bucket;
+    int cancelled;
+
+    if (a_request->number < 0)
+	return 0;
+
+    bucket = REQUEST_MAP_BUCKET(a_request->number);
+    pthread_mutex_lock(REQUEST_MAP_STRIPE(map, bucket));
+    request_map_unlink(a_request);
+    cancelled = a_request->cancelled;
+    pthread_mutex_unlock(REQUEST_MAP_STRIPE(map, bucket));
+
+    return cancelled;
+}
+
+/*
+ * function discard_request(): free a request that is not handled.
+ * algorithm: call its discard function, if it has one, on its argument,
+ *            and free it.
+ * input:     pointer to request.
+ * output:    none.
+ */
+static void
+discard_request(struct request* a_request)
+{
+    if (a_request->discard)
+	a_request->discard(a_request->arg);
+    free(a_request);
+}
 
 /*
  * function init_requests_queue(): create a requests queue.
@@ -14,9 +117,13 @@
 struct requests_queue*
 init_requests_queue(pthread_mutex_t* p_mutex, pthread_cond_t*  p_cond_var)
 {
-    struct requests_queue* queue =
-		(struct requests_queue*)malloc(sizeof(struct requests_queue));
-    if (!queue) {
+    struct requests_queue* queue;
+    int i;
+
+    /* the queue's fields are laid out on cache lines - so it must start */
+    /* on one, too.                                                      */
+    if (posix_memalign((void**)&queue, CACHE_LINE_SIZE,
+		       sizeof(struct requests_queue)) != 0) {
 	fprintf(stderr, "out of memory. exiting\n");
 	exit(1);
     }
@@ -26,22 +133,163 @@ init_requests_queue(pthread_mutex_t* p_mutex, pthread_cond_t*  p_cond_var)
     queue->num_requests = 0;
     queue->p_mutex = p_mutex;
     queue->p_cond_var = p_cond_var;
+    queue->event_fd = -1;
+    queue->event_pending = 0;
+    memset(&queue->codel, 0, sizeof(queue->codel));
+    memset(&queue->stats, 0, sizeof(queue->stats));
+    memset(queue->pending.buckets, 0, sizeof(queue->pending.buckets));
+    for (i = 0; i < REQUEST_MAP_STRIPES; i++)
+	pthread_mutex_init(&queue->pending.stripes[i].mutex, NULL);
 
     return queue;
 }
 
 /*
- * function add_request(): add a request to the requests list
- * algorithm: creates a request structure, adds to the list, and
- *            increases number of pending requests by one.
- * input:     pointer to queue, request number.
+ * function set_requests_queue_codel(): configure admission control.
+ * input:     pointer to queue, target sojourn time and interval, in
+ *            milliseconds. a target of 0 disables admission control.
  * output:    none.
  */
 void
+set_requests_queue_codel(struct requests_queue* queue,
+			 unsigned int target_ms,
+			 unsigned int interval_ms)
+{
+    /* sanity check - amke sure queue is not NULL */
+    assert(queue);
+
+    pthread_mutex_lock(queue->p_mutex);
+    memset(&queue->codel, 0, sizeof(queue->codel));
+    queue->codel.target = target_ms * 1000000ULL;
+    queue->codel.interval = interval_ms * 1000000ULL;
+    pthread_mutex_unlock(queue->p_mutex);
+}
+
+/*
+ * function enable_requests_queue_eventfd(): signal an eventfd on new
+ *                                           requests.
+ * algorithm: create a non-blocking eventfd, and have add_request_tagged()
+ *            signal it. if requests are queued already, signal it now.
+ * input:     pointer to queue.
+ * output:    the eventfd, or -1 on error (errno is set).
+ */
+int
+enable_requests_queue_eventfd(struct requests_queue* queue)
+{
+    int fd;
+
+    /* sanity check - amke sure queue is not NULL */
+    assert(queue);
+
+    pthread_mutex_lock(queue->p_mutex);
+    if (queue->event_fd < 0) {
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+	    pthread_mutex_unlock(queue->p_mutex);
+	    return -1;
+	}
+	queue->event_fd = fd;
+	queue->event_pending = queue->num_requests > 0;
+	if (queue->event_pending) {
+	    eventfd_write(fd, 1);
+	    queue->stats.num_events++;
+	}
+    }
+    fd = queue->event_fd;
+    pthread_mutex_unlock(queue->p_mutex);
+
+    return fd;
+}
+
+/*
+ * function ack_requests_queue_event(): acknowledge the eventfd.
+ * algorithm: reset the eventfd's counter, and then mark it no longer
+ *            signalled, so the next request added signals it again. a
+ *            request added in between signals it once more - a spurious
+ *            wakeup, but never a lost one.
+ * input:     pointer to queue.
+ * output:    none.
+ */
+void
+ack_requests_queue_event(struct requests_queue* queue)
+{
+    eventfd_t count;
+
+    /* sanity check - amke sure queue is not NULL */
+    assert(queue);
+
+    if (queue->event_fd < 0)
+	return;
+    eventfd_read(queue->event_fd, &count);
+
+    pthread_mutex_lock(queue->p_mutex);
+    queue->event_pending = 0;
+    pthread_mutex_unlock(queue->p_mutex);
+}
+
+/*
+ * function add_request(): add a request to the requests list
+ * algorithm: adds a request handled the default way, without timeout.
+ * input:     pointer to queue, request number.
+ * output:    REQUEST_QUEUED, or REQUEST_OVERLOADED.
+ */
+int
 add_request(struct requests_queue* queue, int request_num)
+{
+    return add_request_func(queue, request_num, NULL, NULL, 0);
+}
+
+/*
+ * function add_request_func(): add a request handled by a function.
+ * algorithm: adds an untagged request.
+ * input:     pointer to queue, request number, handling function and
+ *            its argument, timeout in milliseconds (0 for none).
+ * output:    REQUEST_QUEUED, or REQUEST_OVERLOADED.
+ */
+int
+add_request_func(struct requests_queue* queue, int request_num,
+		 void (*func)(void*), void* arg, unsigned int timeout_ms)
+{
+    return add_request_tagged(queue, request_num, 0, func, arg, timeout_ms);
+}
+
+/*
+ * function add_request_tagged(): add a tagged request.
+ * algorithm: adds a request without a discard function.
+ * input:     pointer to queue, request number, tag, handling function
+ *            and its argument, timeout in milliseconds (0 for none).
+ * output:    REQUEST_QUEUED, or REQUEST_OVERLOADED.
+ */
+int
+add_request_tagged(struct requests_queue* queue, int request_num, int tag,
+		   void (*func)(void*), void* arg, unsigned int timeout_ms)
+{
+    return add_request_with_discard(queue, request_num, tag, func, arg, NULL,
+				    timeout_ms);
+}
+
+/*
+ * function add_request_with_discard(): add a request to the requests list
+ * algorithm: creates a request structure, adds to the list, and
+ *            increases number of pending requests by one. while the
+ *            queue is overloaded, the request is refused instead.
+ *            the request is also indexed by its number in the pending
+ *            requests map, so it may be cancelled. the condition
+ *            variable is signalled, and the eventfd too - unless it is
+ *            signalled already, and not yet acknowledged.
+ * input:     pointer to queue, request number, tag, handling function
+ *            and its argument, function discarding the argument (or
+ *            NULL), timeout in milliseconds (0 for none).
+ * output:    REQUEST_QUEUED, or REQUEST_OVERLOADED.
+ */
+int
+add_request_with_discard(struct requests_queue* queue, int request_num,
+			 int tag, void (*func)(void*), void* arg,
+			 void (*discard)(void*), unsigned int timeout_ms)
 {
     int rc;	                    /* return code of pthreads functions.  */
     struct request* a_request;      /* pointer to newly added request.     */
+    int event_fd = -1;		    /* eventfd to signal, if any.          */
 
     /* sanity check - amke sure queue is not NULL */
     assert(queue);
@@ -53,11 +301,27 @@ add_request(struct requests_queue* queue, int request_num)
 	exit(1);
     }
     a_request->number = request_num;
+    a_request->func = func;
+    a_request->arg = arg;
+    a_request->discard = discard;
+    a_request->enqueue_time = now_nsec();
+    a_request->deadline = timeout_ms ?
+	a_request->enqueue_time + timeout_ms * 1000000ULL : 0;
+    a_request->tag = tag;
+    a_request->cancelled = 0;
     a_request->next = NULL;
 
     /* lock the mutex, to assure exclusive access to the list */
     rc = pthread_mutex_lock(queue->p_mutex);
 
+    /* refuse new work while we are shedding load. */
+    if (queue->codel.dropping) {
+	queue->stats.num_rejected++;
+	rc = pthread_mutex_unlock(queue->p_mutex);
+	free(a_request);
+	return REQUEST_OVERLOADED;
+    }
+
     /* add new request to the end of the list, updating list */
     /* pointers as required */
     if (queue->num_requests == 0) { /* special case - list is empty */
@@ -69,9 +333,22 @@ add_request(struct requests_queue* queue, int request_num)
 	queue->last_request = a_request;
     }
 
+    /* index it while still holding the mutex - once it is unlocked, */
+    /* a handler might dequeue the request.                          */
+    request_map_insert(&queue->pending, a_request);
+
     /* increase total number of pending requests by one. */
     queue->num_requests++;
 
+    TRACE_EVENT(TRACE_ENQUEUE, request_num);
+
+    /* a burst of requests signals the eventfd once - until acknowledged. */
+    if (queue->event_fd >= 0 && !queue->event_pending) {
+	queue->event_pending = 1;
+	queue->stats.num_events++;
+	event_fd = queue->event_fd;
+    }
+
 #ifdef DEBUG
     printf("add_request: added request with id '%d'\n", a_request->number);
     fflush(stdout);
@@ -82,13 +359,123 @@ add_request(struct requests_queue* queue, int request_num)
 
     /* signal the condition variable - there's a new request to handle */
     rc = pthread_cond_signal(queue->p_cond_var);
+    if (event_fd >= 0)
+	eventfd_write(event_fd, 1);
+
+    return REQUEST_QUEUED;
+}
+
+/*
+ * function codel_control_law(): time of the next drop.
+ * algorithm: drops are spaced interval/sqrt(count) apart, so the drop
+ *            rate grows slowly for as long as the overload persists.
+ * input:     pointer to queue, time of the previous drop.
+ * output:    time of the next drop.
+ */
+static unsigned long long
+codel_control_law(struct requests_queue* queue, unsigned long long t)
+{
+    return t + (unsigned long long)(queue->codel.interval /
+				    sqrt((double)queue->codel.count));
+}
+
+/*
+ * function codel_dequeue(): remove the first request from the list.
+ * algorithm: unlinks the head request, updates sojourn statistics, and
+ *            checks whether the sojourn time has stayed above target for
+ *            a whole interval. cancelled requests are discarded and
+ *            skipped.
+ *            the queue's mutex must be held.
+ * input:     pointer to queue, current time, pointer to 'ok to drop' flag.
+ * output:    the removed request, or NULL if the list is empty.
+ */
+static struct request*
+codel_dequeue(struct requests_queue* queue, unsigned long long now,
+	      int* ok_to_drop)
+{
+    struct codel_state* codel = &queue->codel;
+    struct requests_queue_stats* stats = &queue->stats;
+    struct request* a_request;
+    unsigned long long sojourn;
+
+    *ok_to_drop = 0;
+    while (1) {
+	if (queue->num_requests == 0) {
+	    codel->first_above_time = 0;
+	    return NULL;
+	}
+
+	a_request = queue->requests;
+	queue->requests = a_request->next;
+	if (queue->requests == NULL) { /* this was last request on the list */
+	    queue->last_request = NULL;
+	}
+	/* decrease the total number of pending requests */
+	queue->num_requests--;
+
+	if (!request_map_remove(&queue->pending, a_request))
+	    break;
+	/* a cancelled request - it never reaches a handler. */
+#ifdef DEBUG
+	printf("get_request: skipped cancelled request with id '%d'\n",
+	       a_request->number);
+	fflush(stdout);
+#endif /* DEBUG */
+	stats->num_cancelled++;
+	discard_request(a_request);
+    }
+
+    sojourn = now > a_request->enqueue_time ? now - a_request->enqueue_time : 0;
+    if (stats->num_handed + stats->num_dropped == 0 ||
+	sojourn < stats->min_sojourn)
+	stats->min_sojourn = sojourn;
+    if (sojourn > stats->max_sojourn)
+	stats->max_sojourn = sojourn;
+    stats->total_sojourn += sojourn;
+
+    if (codel->target == 0)
+	return a_request;
+
+    /* a request that found the queue (almost) empty shows no standing */
+    /* queue, whatever its sojourn time was.                           */
+    if (sojourn < codel->target || queue->num_requests == 0) {
+	codel->first_above_time = 0;
+    }
+    else if (codel->first_above_time == 0) {
+	codel->first_above_time = now + codel->interval;
+    }
+    else if (now >= codel->first_above_time) {
+	*ok_to_drop = 1;
+    }
+
+    return a_request;
+}
+
+/*
+ * function drop_request(): discard a request dropped by admission control.
+ * input:     pointer to queue, request to drop.
+ * output:    none.
+ */
+static void
+drop_request(struct requests_queue* queue, struct request* a_request)
+{
+#ifdef DEBUG
+    printf("drop_request: dropped request with id '%d'\n", a_request->number);
+    fflush(stdout);
+#endif /* DEBUG */
+    queue->stats.num_dropped++;
+    discard_request(a_request);
 }
 
 /*
  * function get_request(): gets the first pending request from the requests list
  *                         removing it from the list.
- * algorithm: creates a request structure, adds to the list, and
- *            increases number of pending requests by one.
+ * algorithm: removes the first request from the list. if admission
+ *            control is on, and requests have been waiting too long for
+ *            a whole interval, enter overload state and drop requests at
+ *            the head (the CoDel algorithm), until the sojourn time falls
+ *            back below target. requests whose timeout passed are
+ *            discarded as well.
  * input:     pointer to requests queue.
  * output:    pointer to the removed request, or NULL if none.
  * memory:    the returned request need to be freed by the caller.
@@ -98,24 +485,66 @@ get_request(struct requests_queue* queue)
 {
     int rc;	                    /* return code of pthreads functions.  */
     struct request* a_request;      /* pointer to request.                 */
+    struct codel_state* codel;      /* queue's admission control state.    */
+    unsigned long long now;	    /* current time.                       */
+    int ok_to_drop;		    /* is sojourn time above target?       */
 
     /* sanity check - amke sure queue is not NULL */
     assert(queue);
 
+    codel = &queue->codel;
+    now = now_nsec();
+
     /* lock the mutex, to assure exclusive access to the list */
     rc = pthread_mutex_lock(queue->p_mutex);
 
-    if (queue->num_requests > 0) {
-	a_request = queue->requests;
-	queue->requests = a_request->next;
-	if (queue->requests == NULL) { /* this was last request on the list */
-	    queue->last_request = NULL;
+    a_request = codel_dequeue(queue, now, &ok_to_drop);
+    if (codel->dropping) {
+	if (!ok_to_drop) {
+	    /* sojourn time is below target - leave overload state. */
+	    codel->dropping = 0;
+	}
+	while (codel->dropping && now >= codel->drop_next) {
+	    drop_request(queue, a_request);
+	    codel->count++;
+	    a_request = codel_dequeue(queue, now, &ok_to_drop);
+	    if (!ok_to_drop)
+		codel->dropping = 0;
+	    else
+		codel->drop_next = codel_control_law(queue, codel->drop_next);
 	}
-	/* decrease the total number of pending requests */
-	queue->num_requests--;
     }
-    else { /* requests list is empty */
-	a_request = NULL;
+    else if (ok_to_drop) {
+	/* enter overload state, and drop the head request. */
+	drop_request(queue, a_request);
+	a_request = codel_dequeue(queue, now, &ok_to_drop);
+	codel->dropping = 1;
+	/* if we left overload state just recently, resume the drop */
+	/* rate from where it was, rather than starting over. the   */
+	/* next drop may still be due later than now - the times    */
+	/* are unsigned, so compare them without subtracting.       */
+	if (codel->count > 2 && now < codel->drop_next + 8 * codel->interval)
+	    codel->count -= 2;
+	else
+	    codel->count = 1;
+	codel->drop_next = codel_control_law(queue, now);
+    }
+
+    /* skip requests whose timeout passed while they were queued. */
+    while (a_request && a_request->deadline && now >= a_request->deadline) {
+#ifdef DEBUG
+	printf("get_request: request with id '%d' expired\n",
+	       a_request->number);
+	fflush(stdout);
+#endif /* DEBUG */
+	queue->stats.num_expired++;
+	discard_request(a_request);
+	a_request = codel_dequeue(queue, now, &ok_to_drop);
+    }
+
+    if (a_request) {
+	queue->stats.num_handed++;
+	TRACE_EVENT(TRACE_DEQUEUE, a_request->number);
     }
 
     /* unlock mutex */
@@ -125,6 +554,129 @@ get_request(struct requests_queue* queue)
     return a_request;
 }
 
+/*
+ * function cancel_request(): cancel a pending request by its number.
+ * algorithm: look the request up in the pending map, mark it cancelled
+ *            and unlink it from the map. it stays on the queue, and is
+ *            discarded when it reaches the head. this takes only the
+ *            bucket's stripe lock, not the queue's mutex.
+ * input:     pointer to requests queue, request number.
+ * output:    1 if a request was cancelled, 0 if none was pending.
+ */
+int
+cancel_request(struct requests_queue* queue, int request_num)
+{
+    struct request_map* map;
+    struct request* a_request;
+    unsigned int bucket;
+
+    /* sanity check */
+    assert(queue);
+
+    if (request_num < 0)
+	return 0;
+
+    map = &queue->pending;
+    bucket = REQUEST_MAP_BUCKET(request_num);
+    pthread_mutex_lock(REQUEST_MAP_STRIPE(map, bucket));
+    for (a_request = map->buckets[bucket]; a_request;
+	 a_request = a_request->map_next) {
+	if (a_request->number == request_num) {
+	    a_request->cancelled = 1;
+	    request_map_unlink(a_request);
+	    break;
+	}
+    }
+    pthread_mutex_unlock(REQUEST_MAP_STRIPE(map, bucket));
+
+    return a_request != NULL;
+}
+
+/*
+ * function cancel_requests_matching(): cancel all matching requests.
+ * algorithm: walk the pending map one stripe at a time, cancelling each
+ *            request that 'match' accepts. 'match' is called with the
+ *            stripe locked, so it must not call back into the queue.
+ * input:     pointer to requests queue, match function and its data.
+ * output:    number of requests cancelled.
+ */
+int
+cancel_requests_matching(struct requests_queue* queue,
+			 int (*match)(struct request*, void*), void* data)
+{
+    struct request_map* map;
+    int num_cancelled = 0;
+    int stripe;
+    unsigned int line;		/* a cache line of buckets.              */
+    unsigned int bucket;
+
+    /* sanity check */
+    assert(queue && match);
+
+    map = &queue->pending;
+    for (stripe = 0; stripe < REQUEST_MAP_STRIPES; stripe++) {
+	pthread_mutex_lock(&map->stripes[stripe].mutex);
+	for (line = stripe;
+	     line < REQUEST_MAP_BUCKETS / REQUEST_MAP_LINE_BUCKETS;
+	     line += REQUEST_MAP_STRIPES) {
+	    for (bucket = line * REQUEST_MAP_LINE_BUCKETS;
+		 bucket < (line + 1) * REQUEST_MAP_LINE_BUCKETS; bucket++) {
+		struct request* a_request = map->buckets[bucket];
+
+		while (a_request) {
+		    struct request* next = a_request->map_next;
+
+		    if (match(a_request, data)) {
+			a_request->cancelled = 1;
+			request_map_unlink(a_request);
+			num_cancelled++;
+		    }
+		    a_request = next;
+		}
+	    }
+	}
+	pthread_mutex_unlock(&map->stripes[stripe].mutex);
+    }
+
+    return num_cancelled;
+}
+
+/* match function of cancel_requests_by_tag(). */
+static int
+request_has_tag(struct request* a_request, void* data)
+{
+    return a_request->tag == *(int*)data;
+}
+
+/*
+ * function cancel_requests_by_tag(): cancel all requests with a tag.
+ * input:     pointer to requests queue, tag.
+ * output:    number of requests cancelled.
+ */
+int
+cancel_requests_by_tag(struct requests_queue* queue, int tag)
+{
+    return cancel_requests_matching(queue, request_has_tag, (void*)&tag);
+}
+
+/*
+ * function get_requests_queue_stats(): get the queue's statistics.
+ * input:     pointer to requests queue, structure to fill in.
+ * output:    none.
+ */
+void
+get_requests_queue_stats(struct requests_queue* queue,
+			 struct requests_queue_stats* stats)
+{
+    /* sanity check */
+    assert(queue && stats);
+
+    pthread_mutex_lock(queue->p_mutex);
+    *stats = queue->stats;
+    stats->overloaded = queue->codel.dropping;
+    pthread_mutex_unlock(queue->p_mutex);
+}
+
 /*
  * function get_requests_number(): get the number of requests in the list.
  * input:     pointer to requests queue.
@@ -160,15 +712,21 @@ void
 delete_requests_queue(struct requests_queue* queue)
 {
     struct request* a_request;      /* pointer to a request.               */
+    int i;			    /* loop counter.                       */
 
     /* sanity check - amke sure queue is not NULL */
     assert(queue);
 
-    /* first free any requests that might be on the queue */
+    /* first discard any requests that might be on the queue */
     while (queue->num_requests > 0) {
 	a_request = get_request(queue);
-	free(a_request);
+	if (a_request)
+	    discard_request(a_request);
     }
+    for (i = 0; i < REQUEST_MAP_STRIPES; i++)
+	pthread_mutex_destroy(&queue->pending.stripes[i].mutex);
+    if (queue->event_fd >= 0)
+	close(queue->event_fd);
 
     /* finally, free the queue's struct itself */
     free(queue);
@@ -4,19 +4,119 @@
 #include <stdio.h>       /* standard I/O routines                     */
 #include <pthread.h>     /* pthread functions and data structures     */
 
+#include "cache_line.h"  /* CACHE_ALIGNED                             */
+
+/* return codes of add_request() */
+#define REQUEST_QUEUED     0	/* request was added to the queue.       */
+#define REQUEST_OVERLOADED 1	/* queue is overloaded - request refused. */
+
 /* format of a single request. */
 struct request {
     int number;		    /* number of the request                  */
+    void (*func)(void*);    /* function handling it, NULL for default. */
+    void* arg;		    /* argument to pass to 'func'.            */
+    void (*discard)(void*); /* called with 'arg' if the request is    */
+			    /* discarded unhandled, NULL if none.     */
+    unsigned long long enqueue_time;
+			    /* time request was queued, nanoseconds.  */
+    unsigned long long deadline;
+			    /* time it expires if not yet handled,    */
+			    /* in nanoseconds. 0 means never.         */
+    int tag;		    /* user tag, e.g. the client's id.        */
+    int cancelled;	    /* tombstone - set by cancel_request().   */
     struct request* next;   /* pointer to next request, NULL if none. */
+    struct request* map_next;   /* next request in same map bucket.   */
+    struct request** map_pprev; /* pointer to the pointer to us.      */
+};
+
+/*
+ * size of the map of pending requests, indexed by request number.
+ * buckets are protected by REQUEST_MAP_STRIPES mutexes, so cancelling a
+ * request does not contend on the queue's mutex, nor (mostly) with
+ * other cancellations. the buckets sharing a cache line share a stripe
+ * too - bucket 'i' is protected by stripe
+ * '(i / REQUEST_MAP_LINE_BUCKETS) % REQUEST_MAP_STRIPES' - so threads
+ * holding different stripes never write the same cache line.
+ */
+#define REQUEST_MAP_BUCKETS 4096
+#define REQUEST_MAP_STRIPES 64
+#define REQUEST_MAP_LINE_BUCKETS (CACHE_LINE_SIZE / sizeof(struct request*))
+
+/* a stripe's mutex, on a cache line of its own. */
+struct request_map_stripe {
+    pthread_mutex_t mutex;
+} CACHE_ALIGNED;
+
+/* structure for the map of pending requests. */
+struct request_map {
+    struct request* buckets[REQUEST_MAP_BUCKETS] CACHE_ALIGNED;
+						   /* chains of requests. */
+    struct request_map_stripe stripes[REQUEST_MAP_STRIPES];
+						   /* buckets' mutexes.   */
+};
+
+/*
+ * state of the queue's admission control. this follows the CoDel
+ * algorithm: if the time requests spend on the queue (their 'sojourn
+ * time') stays above 'target' for a whole 'interval', the queue is
+ * overloaded. it then drops requests at its head, at an increasing
+ * rate, and refuses new requests, until the sojourn time falls below
+ * 'target' again. a 'target' of 0 disables admission control.
+ */
+struct codel_state {
+    unsigned long long target;	         /* acceptable sojourn time (ns). */
+    unsigned long long interval;         /* sliding window length (ns).   */
+    unsigned long long first_above_time; /* when sojourn time will have   */
+					 /* been above target an interval. */
+    unsigned long long drop_next;	 /* time of next head drop.       */
+    unsigned int count;		         /* drops since overload started. */
+    int dropping;		         /* are we in overload state?     */
+};
+
+/* statistics of a requests queue. */
+struct requests_queue_stats {
+    unsigned long num_handed;	         /* requests given to handlers.   */
+    unsigned long num_rejected;	         /* requests refused on add.      */
+    unsigned long num_dropped;	         /* requests dropped at the head. */
+    unsigned long num_expired;	         /* requests that timed out.      */
+    unsigned long num_cancelled;         /* requests cancelled by users.  */
+    unsigned long long min_sojourn;      /* minimal sojourn time (ns).    */
+    unsigned long long max_sojourn;      /* maximal sojourn time (ns).    */
+    unsigned long long total_sojourn;    /* sum of sojourn times (ns).    */
+    unsigned long num_events;	         /* times the eventfd was        */
+					 /* signalled.                    */
+    int overloaded;		         /* currently dropping requests?  */
 };
 
-/* structure for a requests queue */
+/*
+ * structure for a requests queue. the fields that never change come
+ * first, and are only read. the list's head and tail, its length, and
+ * the admission control state and statistics are all written under the
+ * queue's mutex - by one thread at a time - so they share cache lines,
+ * which start after the read-only ones. the pending map is written
+ * under its own stripes' mutexes, so it starts on a cache line too.
+ *
+ * the queue may also signal an eventfd when requests are added, so a
+ * thread can wait for requests, sockets and timers in a single
+ * poll/epoll call. wakeups are coalesced: once signalled, the eventfd is
+ * not signalled again until a consumer acknowledges it - so a burst of
+ * requests costs one wakeup (and one write() system call), not one per
+ * request.
+ */
 struct requests_queue {
-    struct request* requests;       /* head of linked list of requests. */
-    struct request* last_request;   /* pointer to last request.         */
-    int num_requests;		    /* number of requests in queue.     */
     pthread_mutex_t* p_mutex;	    /* queue's mutex.                   */
     pthread_cond_t*  p_cond_var;    /* queue's condition variable.      */
+    int event_fd;		    /* eventfd signalled on new         */
+				    /* requests, -1 if none.            */
+    struct request* requests CACHE_ALIGNED;
+				    /* head of linked list of requests. */
+    struct request* last_request;   /* pointer to last request.         */
+    int num_requests;		    /* number of requests in queue.     */
+    int event_pending;		    /* eventfd signalled, and not yet   */
+				    /* acknowledged?                    */
+    struct codel_state codel;	    /* admission control state.         */
+    struct requests_queue_stats stats; /* queue's statistics.           */
+    struct request_map pending;	    /* pending requests, by number.     */
 };
 
 /*
@@ -26,14 +126,95 @@ struct requests_queue {
 extern struct requests_queue*
 init_requests_queue(pthread_mutex_t* p_mutex, pthread_cond_t*  p_cond_var);
 
-/* add a request to the requests list */
+/*
+ * enable admission control on the queue, with the given target sojourn
+ * time and interval, in milliseconds. a target of 0 disables it.
+ */
+extern void
+set_requests_queue_codel(struct requests_queue* queue,
+			 unsigned int target_ms,
+			 unsigned int interval_ms);
+
+/*
+ * make the queue signal an eventfd when requests are added, and return
+ * it - to wait on with poll/epoll (it becomes readable). the queue owns
+ * it, and closes it when deleted. returns -1 on error (errno is set).
+ */
+extern int
+enable_requests_queue_eventfd(struct requests_queue* queue);
+
+/*
+ * acknowledge the queue's eventfd was signalled, re-arming it. a
+ * consumer woken by it must call this first, and then take requests
+ * with get_request() until it returns NULL - requests added after this
+ * call signal the eventfd again.
+ */
 extern void
+ack_requests_queue_event(struct requests_queue* queue);
+
+/*
+ * add a request to the requests list. returns REQUEST_QUEUED, or
+ * REQUEST_OVERLOADED if the queue refused it.
+ */
+extern int
 add_request(struct requests_queue* queue, int request_num);
 
+/*
+ * add a request, handled by calling func(arg). if 'timeout_ms' is not 0,
+ * the request is discarded if no handler took it within that time.
+ * returns REQUEST_QUEUED, or REQUEST_OVERLOADED if the queue refused it.
+ */
+extern int
+add_request_func(struct requests_queue* queue, int request_num,
+		 void (*func)(void*), void* arg, unsigned int timeout_ms);
+
+/* like add_request_func(), with a tag to select requests for cancelling. */
+extern int
+add_request_tagged(struct requests_queue* queue, int request_num, int tag,
+		   void (*func)(void*), void* arg, unsigned int timeout_ms);
+
+/*
+ * like add_request_tagged(), calling discard(arg) if the queue discards
+ * the request once queued - dropped by admission control, expired,
+ * cancelled, or left on the queue when it is deleted - so 'arg' is not
+ * leaked. 'discard' is called with the queue's mutex held, so it must
+ * not call back into the queue. a refused request is not queued: its
+ * 'arg' stays the caller's, and 'discard' is not called.
+ */
+extern int
+add_request_with_discard(struct requests_queue* queue, int request_num,
+			 int tag, void (*func)(void*), void* arg,
+			 void (*discard)(void*), unsigned int timeout_ms);
+
+/*
+ * cancel a pending request with the given number (requests with negative
+ * numbers can't be cancelled). returns 1 if cancelled, 0 if no such
+ * request is pending - it might already be handled.
+ */
+extern int
+cancel_request(struct requests_queue* queue, int request_num);
+
+/*
+ * cancel all pending requests for which 'match' returns non-zero. 'data'
+ * is passed on to 'match'. returns the number of requests cancelled.
+ */
+extern int
+cancel_requests_matching(struct requests_queue* queue,
+			 int (*match)(struct request*, void*), void* data);
+
+/* cancel all pending requests with the given tag. returns their number. */
+extern int
+cancel_requests_by_tag(struct requests_queue* queue, int tag);
+
 /* get the first pending request from the requests list */
 extern struct request*
 get_request(struct requests_queue* queue);
 
+/* get a copy of the queue's statistics */
+extern void
+get_requests_queue_stats(struct requests_queue* queue,
+			 struct requests_queue_stats* stats);
+
 /* get the number of requests in the list */
 extern int
 get_requests_number(struct requests_queue* queue);
@@ -0,0 +1,334 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc(), qsort(), atoi(), exit()         */
+#include <string.h>      /* memset()                                  */
+#include <errno.h>       /* errno                                     */
+#include <fcntl.h>       /* open()                                    */
+#include <time.h>        /* clock_gettime()                           */
+#include <unistd.h>      /* fork(), getpid(), _exit()                 */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <sched.h>       /* sched_yield()                             */
+#include <sys/mman.h>    /* mmap()                                    */
+#include <sys/wait.h>    /* waitpid()                                 */
+
+#include "cache_line.h"             /* CACHE_ALIGNED                         */
+#include "requests_queue.h"         /* requests queue routines/structs       */
+#include "handler_threads_pool.h"   /* handler thread list functions/structs */
+#include "logger.h"                 /* asynchronous logger                   */
+#include "shm_requests_queue.h"     /* shared memory queue                   */
+
+/*
+ * shared memory queue benchmark: producer processes queue requests on
+ * a shared memory queue, and a thread-pool-server - a requests queue, a
+ * pool of handler threads, and a thread forwarding the requests from
+ * the shared memory queue - handles them. it reports the requests
+ * handled per second, and their latency: the time from being queued by
+ * a producer, to a handler starting on them. a producer finding the
+ * queue full yields the CPU, and tries again.
+ *
+ * before the producers start, one more producer dies holding the
+ * queue's mutex, half way through adding a request. the benchmark
+ * checks the queue was repaired, and every request the producers
+ * queued was handled - once.
+ */
+
+/* default number of producers, requests each queues, and handler */
+/* threads.                                                       */
+#define NUM_PRODUCERS 4
+#define NUM_REQUESTS 100000
+#define NUM_HANDLER_THREADS 3
+
+/* most producers the benchmark runs. */
+#define MAX_PRODUCERS 64
+
+/* the server's mutex (recursive, as a handler thread might lock it */
+/* twice), condition variable, and flag - as in main.c.             */
+pthread_mutex_t request_mutex CACHE_ALIGNED =
+					PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+pthread_cond_t  got_request CACHE_ALIGNED = PTHREAD_COND_INITIALIZER;
+int done_creating_requests CACHE_ALIGNED = 0;
+
+/* a request's data - who queued it. */
+struct bench_data {
+    int producer;		/* index of the producer.                */
+    int seq;			/* its sequence number at the producer.  */
+};
+
+/* a producer's results. */
+struct producer_result {
+    unsigned long queued;	/* requests it queued.                   */
+    unsigned long full;		/* times it found the queue full.        */
+} CACHE_ALIGNED;
+
+/* state shared with the producers (mapped before forking). */
+struct bench_state {
+    int start CACHE_ALIGNED;	/* set when the producers should start.  */
+    struct producer_result results[MAX_PRODUCERS];
+};
+
+static struct bench_state* bench;
+
+/* the benchmark's settings, and the queue's name. */
+static int num_producers = NUM_PRODUCERS;
+static int num_requests = NUM_REQUESTS;
+static int num_threads = NUM_HANDLER_THREADS;
+static char queue_name[64];
+
+/* latencies of the handled requests, in nanoseconds, and the number */
+/* of requests handled with the wrong data.                           */
+static unsigned long long* latencies;
+static unsigned long num_handled CACHE_ALIGNED = 0;
+static unsigned long num_bad = 0;
+
+/* get the current time, in nanoseconds, from a monotonic clock. */
+static unsigned long long
+now_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* handle a forwarded request - record its latency, and check its data. */
+static void
+handle_shm_request(void* arg)
+{
+    struct shm_request* a_request = (struct shm_request*)arg;
+    struct bench_data* data = (struct bench_data*)a_request->data;
+    unsigned long long now = now_nsec();
+    unsigned long i = __atomic_fetch_add(&num_handled, 1, __ATOMIC_RELAXED);
+
+    if (i < (unsigned long)num_producers * num_requests)
+	latencies[i] = now > a_request->enqueue_time ?
+		       now - a_request->enqueue_time : 0;
+    if (data->producer < 0 || data->producer >= num_producers ||
+	a_request->tag != data->producer ||
+	a_request->number != data->producer * num_requests + data->seq)
+	__atomic_fetch_add(&num_bad, 1, __ATOMIC_RELAXED);
+    free(a_request);
+}
+
+/* function of the forwarding thread. */
+static void*
+forward_requests(void* data)
+{
+    struct requests_queue* requests = (struct requests_queue*)data;
+    struct shm_requests_queue* queue = attach_shm_requests_queue(queue_name);
+
+    if (!queue) {
+	perror("attach_shm_requests_queue");
+	exit(1);
+    }
+    if (forward_shm_requests(queue, requests, handle_shm_request) > 0) {
+	fprintf(stderr, "forward_requests: requests refused. exiting\n");
+	exit(1);
+    }
+    delete_shm_requests_queue(queue);
+
+    return NULL;
+}
+
+/* the body of a producer process - attach to the queue by its name, and */
+/* queue its requests.                                                   */
+static void
+run_producer(int index)
+{
+    struct producer_result* result = &bench->results[index];
+    struct shm_requests_queue* queue = attach_shm_requests_queue(queue_name);
+    struct bench_data data;
+    int rc;
+
+    if (!queue) {
+	perror("attach_shm_requests_queue");
+	_exit(1);
+    }
+    while (!__atomic_load_n(&bench->start, __ATOMIC_ACQUIRE))
+	sched_yield();
+
+    data.producer = index;
+    for (data.seq = 0; data.seq < num_requests; data.seq++) {
+	while ((rc = shm_add_request(queue, index * num_requests + data.seq,
+				     index, &data, sizeof(data)))
+	       == REQUEST_OVERLOADED) {
+	    result->full++;
+	    sched_yield();
+	}
+	if (rc != REQUEST_QUEUED) {
+	    perror("shm_add_request");
+	    _exit(1);
+	}
+	result->queued++;
+    }
+    delete_shm_requests_queue(queue);
+    _exit(0);
+}
+
+/*
+ * function crash_producer(): have a producer die half way through
+ *                            adding a request.
+ * algorithm: fork a process that locks the queue's mutex, takes a slot
+ *            off the free list, fills part of a request, and exits.
+ * input:     none.
+ * output:    none.
+ */
+static void
+crash_producer(void)
+{
+    pid_t pid = fork();
+
+    if (pid < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (pid == 0) {
+	struct shm_requests_queue* queue = attach_shm_requests_queue(queue_name);
+	struct shm_queue_header* header;
+	struct shm_slot* slot;
+
+	if (!queue)
+	    _exit(1);
+	header = queue->header;
+	pthread_mutex_lock(&header->mutex);
+	slot = (struct shm_slot*)((char*)header + header->free_list);
+	header->free_list = slot->next;
+	slot->request.number = -1;
+	slot->seq = header->next_seq++;
+	_exit(1);	/* die, holding the mutex, with the slot lost. */
+    }
+    waitpid(pid, NULL, 0);
+}
+
+/* compare latencies, for sorting. */
+static int
+compare_latencies(const void* a, const void* b)
+{
+    unsigned long long latency_a = *(const unsigned long long*)a;
+    unsigned long long latency_b = *(const unsigned long long*)b;
+
+    return latency_a < latency_b ? -1 : latency_a > latency_b;
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    struct shm_requests_queue* queue;
+    struct requests_queue* requests;
+    struct handler_threads_pool* handler_threads;
+    pthread_t forwarder;
+    unsigned long total, queued = 0, full = 0, repairs;
+    unsigned long long start, elapsed, sum = 0;
+    int failed = 0;
+    int status;
+    int i;
+
+    if (argc > 1)
+	num_producers = atoi(argv[1]);
+    if (argc > 2)
+	num_requests = atoi(argv[2]);
+    if (argc > 3)
+	num_threads = atoi(argv[3]);
+    if (num_producers < 1 || num_producers > MAX_PRODUCERS ||
+	num_requests < 1 || num_threads < 1) {
+	fprintf(stderr, "usage: %s [producers] [requests] [threads]\n",
+		argv[0]);
+	exit(1);
+    }
+    total = (unsigned long)num_producers * num_requests;
+
+    snprintf(queue_name, sizeof(queue_name), "/shm_queue_bench.%d",
+	     (int)getpid());
+    queue = create_shm_requests_queue(queue_name, SHM_QUEUE_CAPACITY);
+    if (!queue) {
+	perror("create_shm_requests_queue");
+	exit(1);
+    }
+
+    /* a producer dies holding the mutex - the next lock repairs. */
+    crash_producer();
+
+    /* fork the producers - before this process has threads. */
+    bench = (struct bench_state*)mmap(NULL, sizeof(struct bench_state),
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (bench == MAP_FAILED) {
+	perror("mmap");
+	exit(1);
+    }
+    for (i = 0; i < num_producers; i++) {
+	pid_t pid = fork();
+
+	if (pid < 0) {
+	    perror("fork");
+	    exit(1);
+	}
+	if (pid == 0)
+	    run_producer(i);
+    }
+
+    /* start the server: its queue, handler threads, and forwarder. */
+    latencies = (unsigned long long*)malloc(total * sizeof(unsigned long long));
+    if (!latencies) {
+	fprintf(stderr, "main: out of memory. exiting\n");
+	exit(1);
+    }
+    log_init(open("/dev/null", O_WRONLY));
+    requests = init_requests_queue(&request_mutex, &got_request);
+    handler_threads =
+	init_handler_threads_pool(&request_mutex, &got_request, requests);
+    for (i = 0; i < num_threads; i++)
+	add_handler_thread(handler_threads);
+    pthread_create(&forwarder, NULL, forward_requests, (void*)requests);
+
+    start = now_nsec();
+    __atomic_store_n(&bench->start, 1, __ATOMIC_RELEASE);
+    while (wait(&status) > 0) {
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    failed = 1;
+    }
+
+    /* no more requests - drain the queues, and stop the server. */
+    close_shm_requests_queue(queue);
+    pthread_join(forwarder, NULL);
+    pthread_mutex_lock(&request_mutex);
+    done_creating_requests = 1;
+    pthread_cond_broadcast(&got_request);
+    pthread_mutex_unlock(&request_mutex);
+    delete_handler_threads_pool(handler_threads);
+    elapsed = now_nsec() - start;
+    delete_requests_queue(requests);
+    log_shutdown();
+
+    for (i = 0; i < num_producers; i++) {
+	queued += bench->results[i].queued;
+	full += bench->results[i].full;
+    }
+    printf("%d producers, %d requests each, %d handler threads\n",
+	   num_producers, num_requests, num_threads);
+    printf("%lu requests handled in %.3f sec: %.0f requests/sec, "
+	   "queue found full %lu times\n", num_handled, elapsed / 1e9,
+	   num_handled / (elapsed / 1e9), full);
+    if (num_handled > 0 && num_handled <= total) {
+	qsort(latencies, num_handled, sizeof(unsigned long long),
+	      compare_latencies);
+	for (i = 0; (unsigned long)i < num_handled; i++)
+	    sum += latencies[i];
+	printf("latency: avg %.1f us, p50 %.1f us, p99 %.1f us, "
+	       "max %.1f us\n", sum / 1e3 / num_handled,
+	       latencies[num_handled / 2] / 1e3,
+	       latencies[num_handled * 99 / 100] / 1e3,
+	       latencies[num_handled - 1] / 1e3);
+    }
+    repairs = queue->header->num_repairs;
+    printf("queue repaired %lu times after a producer died\n", repairs);
+    delete_shm_requests_queue(queue);
+
+    if (failed || queued != total || num_handled != total || num_bad > 0 ||
+	repairs != 1) {
+	printf("requests lost, or handled wrong: %lu queued, %lu handled, "
+	       "%lu bad!\n", queued, num_handled, num_bad);
+	return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,534 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc(), free(), qsort()                 */
+#include <string.h>      /* memset(), memcpy(), memcmp(), strdup()    */
+#include <errno.h>       /* errno and error codes                     */
+#include <fcntl.h>       /* O_CREAT, O_EXCL, O_RDWR                   */
+#include <limits.h>      /* INT_MAX                                   */
+#include <time.h>        /* clock_gettime()                           */
+#include <unistd.h>      /* ftruncate(), close(), getpid(), syscall() */
+#include <assert.h>      /* assert()                                  */
+#include <sys/mman.h>    /* shm_open(), mmap(), munmap()              */
+#include <sys/stat.h>    /* fstat()                                   */
+#include <sys/syscall.h> /* SYS_futex                                 */
+#include <linux/futex.h> /* FUTEX_WAIT, FUTEX_WAKE                    */
+
+#include "shm_requests_queue.h"  /* shared memory queue functions/structs */
+
+/* magic string at the start of an initialized segment, and its layout */
+/* version.                                                            */
+#define SHM_QUEUE_MAGIC "SHMREQQ"
+#define SHM_QUEUE_VERSION 1
+
+/* get the slot at the given offset of a segment. */
+#define SHM_SLOT(header, offset) \
+	((struct shm_slot*)((char*)(header) + (offset)))
+
+/* get the offset of the i'th slot of a segment. */
+#define SHM_SLOT_OFFSET(header, i) \
+	((header)->slots_offset + (unsigned long)(i) * sizeof(struct shm_slot))
+
+/* get the current time, in nanoseconds, from a monotonic clock. */
+static unsigned long long
+now_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* park until '*word' is no longer 'value', or SHM_QUEUE_WAIT_MS pass. */
+/* the futex is not private - the word is shared between processes.   */
+static void
+futex_wait(unsigned int* word, unsigned int value)
+{
+    struct timespec timeout;
+
+    timeout.tv_sec = SHM_QUEUE_WAIT_MS / 1000;
+    timeout.tv_nsec = (SHM_QUEUE_WAIT_MS % 1000) * 1000000L;
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+/* wake up to 'count' processes (or threads) parked on 'word'. */
+static void
+futex_wake(unsigned int* word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/* a queued slot, and the order it was queued in - for sorting. */
+struct queued_slot {
+    unsigned long long seq;
+    unsigned long offset;
+};
+
+/* compare queued slots by their order. */
+static int
+compare_queued_slots(const void* a, const void* b)
+{
+    const struct queued_slot* slot_a = (const struct queued_slot*)a;
+    const struct queued_slot* slot_b = (const struct queued_slot*)b;
+
+    return slot_a->seq < slot_b->seq ? -1 : slot_a->seq > slot_b->seq;
+}
+
+/*
+ * function repair_queue(): repair a queue after a process died holding
+ *                          its mutex.
+ * algorithm: the dead process may have left the lists half changed -
+ *            but a slot's state is right: it is set to QUEUED once its
+ *            request is complete, and back to FREE once the request is
+ *            taken. so rebuild the lists from the states: link the
+ *            queued slots in the order they were queued, and put all the
+ *            others on the free list. then wake all the consumers - the
+ *            dead process might have been about to wake one.
+ * input:     the segment, with its mutex locked.
+ * output:    none.
+ */
+static void
+repair_queue(struct shm_queue_header* header)
+{
+    struct queued_slot* queued;
+    unsigned long offset;
+    int num_queued = 0;
+    int i;
+
+    queued = (struct queued_slot*)malloc(header->capacity *
+					 sizeof(struct queued_slot));
+    if (!queued) {
+	fprintf(stderr, "repair_queue: out of memory. exiting\n");
+	exit(1);
+    }
+    header->free_list = 0;
+    for (i = header->capacity - 1; i >= 0; i--) {
+	struct shm_slot* slot;
+
+	offset = SHM_SLOT_OFFSET(header, i);
+	slot = SHM_SLOT(header, offset);
+	if (slot->state == SHM_SLOT_QUEUED) {
+	    queued[num_queued].seq = slot->seq;
+	    queued[num_queued].offset = offset;
+	    num_queued++;
+	}
+	else {
+	    slot->next = header->free_list;
+	    header->free_list = offset;
+	}
+    }
+    qsort(queued, num_queued, sizeof(struct queued_slot),
+	  compare_queued_slots);
+
+    header->head = 0;
+    header->tail = 0;
+    for (i = 0; i < num_queued; i++) {
+	SHM_SLOT(header, queued[i].offset)->next = 0;
+	if (header->tail)
+	    SHM_SLOT(header, header->tail)->next = queued[i].offset;
+	else
+	    header->head = queued[i].offset;
+	header->tail = queued[i].offset;
+    }
+    header->num_requests = num_queued;
+    if (num_queued > 0 && queued[num_queued - 1].seq >= header->next_seq)
+	header->next_seq = queued[num_queued - 1].seq + 1;
+    header->num_repairs++;
+    free(queued);
+
+    __atomic_fetch_add(&header->wake_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&header->wake_seq, INT_MAX);
+}
+
+/*
+ * function lock_queue(): lock a queue's mutex.
+ * algorithm: if its previous owner died holding it, repair the queue,
+ *            and mark the mutex consistent again.
+ * input:     the segment.
+ * output:    none.
+ */
+static void
+lock_queue(struct shm_queue_header* header)
+{
+    if (pthread_mutex_lock(&header->mutex) == EOWNERDEAD) {
+	repair_queue(header);
+	pthread_mutex_consistent(&header->mutex);
+    }
+}
+
+/* map a segment, of the given size, and make a handle of it. returns */
+/* NULL on error (errno is set).                                       */
+static struct shm_requests_queue*
+map_queue(int fd, size_t size)
+{
+    struct shm_requests_queue* queue;
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED)
+	return NULL;
+    queue = (struct shm_requests_queue*)malloc(sizeof(struct shm_requests_queue));
+    if (!queue) {
+	fprintf(stderr, "map_queue: out of memory. exiting\n");
+	exit(1);
+    }
+    queue->header = (struct shm_queue_header*)addr;
+    queue->size = size;
+    queue->name = NULL;
+
+    return queue;
+}
+
+/*
+ * function create_shm_requests_queue(): create a shared memory queue.
+ * algorithm: create the segment (failing if it exists), size it, put
+ *            all the slots on the free list, and initialize the mutex as
+ *            process shared and robust. the magic string is written
+ *            last - attaching fails until it is there.
+ * input:     segment's name, number of slots.
+ * output:    the queue, or NULL on error (errno is set).
+ */
+struct shm_requests_queue*
+create_shm_requests_queue(const char* name, int capacity)
+{
+    struct shm_requests_queue* queue;
+    struct shm_queue_header* header;
+    pthread_mutexattr_t attr;
+    size_t slots_offset = (sizeof(struct shm_queue_header) + CACHE_LINE_SIZE - 1)
+			  / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    size_t size;
+    int fd;
+    int i;
+
+    if (capacity <= 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    size = slots_offset + (size_t)capacity * sizeof(struct shm_slot);
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+	return NULL;
+    if (ftruncate(fd, size) < 0 || !(queue = map_queue(fd, size))) {
+	int error = errno;
+
+	close(fd);
+	shm_unlink(name);
+	errno = error;
+	return NULL;
+    }
+    close(fd);
+
+    header = queue->header;
+    header->version = SHM_QUEUE_VERSION;
+    header->slot_size = sizeof(struct shm_slot);
+    header->capacity = capacity;
+    header->slots_offset = slots_offset;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    /* the segment starts zeroed - so the lists are empty, and the */
+    /* slots free. link them on the free list.                     */
+    for (i = capacity - 1; i >= 0; i--) {
+	unsigned long offset = SHM_SLOT_OFFSET(header, i);
+
+	SHM_SLOT(header, offset)->next = header->free_list;
+	header->free_list = offset;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, SHM_QUEUE_MAGIC, sizeof(SHM_QUEUE_MAGIC));
+
+    queue->name = strdup(name);
+    if (!queue->name) {
+	fprintf(stderr, "create_shm_requests_queue: out of memory. exiting\n");
+	exit(1);
+    }
+
+    return queue;
+}
+
+/*
+ * function attach_shm_requests_queue(): attach to a shared memory queue.
+ * algorithm: map the segment, and check it is an initialized queue, of
+ *            the layout we use.
+ * input:     segment's name.
+ * output:    the queue, or NULL on error (errno is set).
+ */
+struct shm_requests_queue*
+attach_shm_requests_queue(const char* name)
+{
+    struct shm_requests_queue* queue;
+    struct shm_queue_header* header;
+    struct stat st;
+    int fd = shm_open(name, O_RDWR, 0);
+
+    if (fd < 0)
+	return NULL;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(struct shm_queue_header)) {
+	close(fd);
+	errno = EAGAIN;		/* not sized yet. */
+	return NULL;
+    }
+    queue = map_queue(fd, st.st_size);
+    close(fd);
+    if (!queue)
+	return NULL;
+
+    header = queue->header;
+    if (memcmp(header->magic, SHM_QUEUE_MAGIC, sizeof(SHM_QUEUE_MAGIC)) != 0) {
+	errno = EAGAIN;		/* not initialized yet. */
+    }
+    else {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (header->version == SHM_QUEUE_VERSION &&
+	    header->slot_size == sizeof(struct shm_slot) &&
+	    header->capacity > 0 &&
+	    header->slots_offset >= sizeof(struct shm_queue_header) &&
+	    header->slots_offset + (size_t)header->capacity *
+		sizeof(struct shm_slot) <= queue->size)
+	    return queue;
+	errno = EINVAL;
+    }
+    munmap(queue->header, queue->size);
+    free(queue);
+
+    return NULL;
+}
+
+/*
+ * function shm_add_request(): add a request to a shared memory queue.
+ * algorithm: take a slot off the free list, and fill in the request.
+ *            only then mark it queued - should we die before that, a
+ *            repair frees the slot - and link it at the queue's tail.
+ *            if a consumer is waiting, wake it, once the mutex is
+ *            unlocked - a burst of requests added while no consumer
+ *            waits wakes nobody.
+ * input:     pointer to queue, request number, tag, request's data and
+ *            its size.
+ * output:    REQUEST_QUEUED, REQUEST_OVERLOADED, or -1 (errno is set).
+ */
+int
+shm_add_request(struct shm_requests_queue* queue, int request_num, int tag,
+		const void* data, size_t size)
+{
+    struct shm_queue_header* header;
+    struct shm_slot* slot;
+    unsigned long offset;
+    int wake;
+
+    /* sanity check */
+    assert(queue);
+
+    if (size > SHM_REQUEST_DATA_SIZE) {
+	errno = EMSGSIZE;
+	return -1;
+    }
+    header = queue->header;
+
+    lock_queue(header);
+    if (header->closed) {
+	pthread_mutex_unlock(&header->mutex);
+	errno = EPIPE;
+	return -1;
+    }
+    if (!header->free_list) {
+	header->num_refused++;
+	pthread_mutex_unlock(&header->mutex);
+	return REQUEST_OVERLOADED;
+    }
+
+    offset = header->free_list;
+    slot = SHM_SLOT(header, offset);
+    slot->request.number = request_num;
+    slot->request.tag = tag;
+    slot->request.producer = getpid();
+    slot->request.enqueue_time = now_nsec();
+    memset(slot->request.data, 0, SHM_REQUEST_DATA_SIZE);
+    if (size > 0)
+	memcpy(slot->request.data, data, size);
+    slot->seq = header->next_seq++;
+    __atomic_store_n(&slot->state, SHM_SLOT_QUEUED, __ATOMIC_RELEASE);
+
+    header->free_list = slot->next;
+    slot->next = 0;
+    if (header->tail)
+	SHM_SLOT(header, header->tail)->next = offset;
+    else
+	header->head = offset;
+    header->tail = offset;
+    header->num_requests++;
+    header->num_added++;
+
+    wake = header->num_waiters > 0;
+    if (wake)
+	__atomic_fetch_add(&header->wake_seq, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&header->mutex);
+
+    if (wake)
+	futex_wake(&header->wake_seq, 1);
+
+    return REQUEST_QUEUED;
+}
+
+/*
+ * function shm_get_request(): take the first request off the queue.
+ * algorithm: while the queue is empty (and open), count ourselves as
+ *            waiting, unlock the mutex, and park on the futex word -
+ *            unless a producer changed it since we read it, under the
+ *            mutex. once there is a request, copy it out, and free its
+ *            slot.
+ * input:     pointer to queue, where to copy the request to, should we
+ *            wait for one.
+ * output:    1 if a request was taken, 0 if none.
+ */
+int
+shm_get_request(struct shm_requests_queue* queue,
+		struct shm_request* a_request, int wait)
+{
+    struct shm_queue_header* header;
+    struct shm_slot* slot;
+    unsigned long offset;
+
+    /* sanity check */
+    assert(queue && a_request);
+
+    header = queue->header;
+    lock_queue(header);
+    while (!header->head) {
+	unsigned int wake_seq;
+
+	if (!wait || header->closed) {
+	    pthread_mutex_unlock(&header->mutex);
+	    return 0;
+	}
+	wake_seq = header->wake_seq;
+	header->num_waiters++;
+	pthread_mutex_unlock(&header->mutex);
+
+	futex_wait(&header->wake_seq, wake_seq);
+
+	lock_queue(header);
+	header->num_waiters--;
+    }
+
+    offset = header->head;
+    slot = SHM_SLOT(header, offset);
+    *a_request = slot->request;
+    header->head = slot->next;
+    if (!header->head)
+	header->tail = 0;
+    header->num_requests--;
+    __atomic_store_n(&slot->state, SHM_SLOT_FREE, __ATOMIC_RELEASE);
+    slot->next = header->free_list;
+    header->free_list = offset;
+    pthread_mutex_unlock(&header->mutex);
+
+    return 1;
+}
+
+/*
+ * function forward_shm_requests(): move requests to a requests queue.
+ * algorithm: take requests off the shared memory queue, waiting for
+ *            them, and add a copy of each to 'requests', to be handled
+ *            by 'func' - or freed by the queue, if it discards it. stop
+ *            once the queue is closed and empty.
+ * input:     pointer to queue, requests queue, handling function.
+ * output:    number of requests 'requests' refused.
+ */
+unsigned long
+forward_shm_requests(struct shm_requests_queue* queue,
+		     struct requests_queue* requests, void (*func)(void*))
+{
+    struct shm_request* a_request;
+    unsigned long num_refused = 0;
+
+    /* sanity check */
+    assert(queue && requests && func);
+
+    while (1) {
+	a_request = (struct shm_request*)malloc(sizeof(struct shm_request));
+	if (!a_request) {
+	    fprintf(stderr, "forward_shm_requests: out of memory. exiting\n");
+	    exit(1);
+	}
+	if (!shm_get_request(queue, a_request, 1)) {
+	    free(a_request);
+	    break;
+	}
+	if (add_request_with_discard(requests, a_request->number,
+				     a_request->tag, func, a_request, free,
+				     0) == REQUEST_OVERLOADED) {
+	    num_refused++;
+	    free(a_request);
+	}
+    }
+
+    return num_refused;
+}
+
+/*
+ * function close_shm_requests_queue(): close a shared memory queue.
+ * algorithm: mark it closed, so adding fails, and wake all consumers -
+ *            they take the requests left, and then find it closed.
+ * input:     pointer to queue.
+ * output:    none.
+ */
+void
+close_shm_requests_queue(struct shm_requests_queue* queue)
+{
+    struct shm_queue_header* header;
+
+    /* sanity check */
+    assert(queue);
+
+    header = queue->header;
+    lock_queue(header);
+    header->closed = 1;
+    __atomic_fetch_add(&header->wake_seq, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&header->mutex);
+
+    futex_wake(&header->wake_seq, INT_MAX);
+}
+
+/*
+ * function get_shm_requests_number(): get the number of requests in
+ *                                     the queue.
+ * input:     pointer to queue.
+ * output:    number of pending requests on the queue.
+ */
+int
+get_shm_requests_number(struct shm_requests_queue* queue)
+{
+    int num_requests;
+
+    /* sanity check */
+    assert(queue);
+
+    lock_queue(queue->header);
+    num_requests = queue->header->num_requests;
+    pthread_mutex_unlock(&queue->header->mutex);
+
+    return num_requests;
+}
+
+/*
+ * function delete_shm_requests_queue(): detach from a queue.
+ * algorithm: unmap the segment, and remove its name if we created it.
+ * input:     pointer to queue.
+ * output:    none.
+ */
+void
+delete_shm_requests_queue(struct shm_requests_queue* queue)
+{
+    /* sanity check */
+    assert(queue);
+
+    munmap(queue->header, queue->size);
+    if (queue->name) {
+	shm_unlink(queue->name);
+	free(queue->name);
+    }
+    free(queue);
+}
@@ -0,0 +1,166 @@
+#ifndef SHM_REQUESTS_QUEUE_H
+# define SHM_REQUESTS_QUEUE_H
+
+#include <stddef.h>      /* size_t                                    */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <sys/types.h>   /* pid_t                                     */
+
+#include "cache_line.h"      /* CACHE_ALIGNED                         */
+#include "requests_queue.h"  /* REQUEST_QUEUED, REQUEST_OVERLOADED    */
+
+/*
+ * a requests queue in a POSIX shared memory segment, so other processes
+ * can queue requests for the server's handler threads without going
+ * through sockets. the server creates the segment, and runs
+ * forward_shm_requests() (in a thread of its own) to move the requests
+ * to its requests queue. producer processes attach to the segment by
+ * its name, and add requests to it.
+ *
+ * the segment is mapped at different addresses in each process, so it
+ * holds no pointers: requests are copied into a fixed array of slots,
+ * linked by their offsets from the segment's start. the queue is guarded
+ * by a process shared, robust mutex. a producer may die at any point -
+ * even holding the mutex, half way through adding a request. the next
+ * process to lock the mutex is told so, and repairs the queue: the
+ * lists are rebuilt from the slots' states, and a slot's state is set
+ * only once its request is complete - so a half added request is
+ * dropped, and nothing else is lost. consumers wait for requests on a
+ * futex word in the segment, rather than on a process shared condition
+ * variable, whose internal state a producer dying while signalling it
+ * could leave locked.
+ */
+
+/* default number of slots of a queue. */
+#define SHM_QUEUE_CAPACITY 4096
+
+/* bytes of data a request may carry. */
+#define SHM_REQUEST_DATA_SIZE 32
+
+/* longest a consumer waits before checking the queue again, even if */
+/* not woken - a producer might have died before waking it.          */
+#define SHM_QUEUE_WAIT_MS 100
+
+/* a request, as passed between processes - plain data, no pointers. */
+struct shm_request {
+    int number;			/* number of the request.                */
+    int tag;			/* user tag, e.g. the client's id.       */
+    pid_t producer;		/* process that queued it.               */
+    unsigned long long enqueue_time;
+				/* time it was queued (CLOCK_MONOTONIC - */
+				/* the same in all processes), in ns.    */
+    char data[SHM_REQUEST_DATA_SIZE]; /* request's data.                */
+};
+
+/* states of a slot. */
+enum shm_slot_state {
+    SHM_SLOT_FREE,		/* on the free list (or being filled).   */
+    SHM_SLOT_QUEUED		/* holds a queued request.               */
+};
+
+/* a slot of the queue. */
+struct shm_slot {
+    unsigned long next;		/* offset of the next slot on its list,  */
+				/* 0 if none.                            */
+    unsigned long long seq;	/* order the request was queued in.      */
+    int state;			/* one of 'enum shm_slot_state'.         */
+    struct shm_request request;	/* the request.                          */
+};
+
+/*
+ * the start of the segment. the fields that never change come first.
+ * the rest are written under the mutex - by one process at a time - so
+ * they share cache lines, which start after the read-only ones. the
+ * slots follow, from 'slots_offset'.
+ */
+struct shm_queue_header {
+    char magic[8];		/* SHM_QUEUE_MAGIC, once initialized.    */
+    unsigned int version;	/* layout version.                       */
+    unsigned int slot_size;	/* sizeof(struct shm_slot) - the         */
+				/* processes must agree on the layout.   */
+    int capacity;		/* number of slots.                      */
+    unsigned long slots_offset;	/* offset of the first slot.             */
+    pthread_mutex_t mutex CACHE_ALIGNED;
+				/* queue's mutex. process shared, robust. */
+    unsigned long head;		/* offset of the first queued slot.      */
+    unsigned long tail;		/* offset of the last queued slot.       */
+    unsigned long free_list;	/* offset of the first free slot.        */
+    unsigned long long next_seq; /* order of the next request queued.    */
+    int num_requests;		/* number of requests in queue.          */
+    int num_waiters;		/* consumers waiting for a request.      */
+    int closed;			/* no more requests may be added.        */
+    unsigned int wake_seq;	/* futex word consumers wait on.         */
+    unsigned long num_added;	/* requests added.                       */
+    unsigned long num_refused;	/* requests refused - the queue was full. */
+    unsigned long num_repairs;	/* repairs after a process died.         */
+};
+
+/* a process's handle of a shared memory queue. */
+struct shm_requests_queue {
+    struct shm_queue_header* header; /* the mapped segment.              */
+    size_t size;		/* size of the mapping.                  */
+    char* name;			/* segment's name - set if we created it. */
+};
+
+/*
+ * create a shared memory queue, with the given name (e.g. "/requests")
+ * and number of slots. returns NULL on error (errno is set - EEXIST if
+ * a segment with that name exists).
+ */
+extern struct shm_requests_queue*
+create_shm_requests_queue(const char* name, int capacity);
+
+/*
+ * attach to a shared memory queue created by another process. returns
+ * NULL on error (errno is set - EAGAIN if it is still being created,
+ * EINVAL if it is not a queue we can use).
+ */
+extern struct shm_requests_queue*
+attach_shm_requests_queue(const char* name);
+
+/*
+ * add a request, with 'size' bytes of data (at most
+ * SHM_REQUEST_DATA_SIZE). returns REQUEST_QUEUED, REQUEST_OVERLOADED if
+ * the queue is full, or -1 if it was closed (errno is EPIPE).
+ */
+extern int
+shm_add_request(struct shm_requests_queue* queue, int request_num, int tag,
+		const void* data, size_t size);
+
+/*
+ * take the first request off the queue, copying it to 'a_request'. if
+ * 'wait' is set, wait for one while the queue is empty. returns 1 if a
+ * request was taken, 0 if the queue is empty (and closed, if waiting).
+ */
+extern int
+shm_get_request(struct shm_requests_queue* queue,
+		struct shm_request* a_request, int wait);
+
+/*
+ * move requests from the shared memory queue to 'requests', until the
+ * queue is closed and empty. each is added with
+ * add_request_with_discard(), handled by 'func', with a (malloc'ed)
+ * copy of the shm_request as its argument - 'func' should free it.
+ * returns the number of requests 'requests' refused (they are freed).
+ * a request 'requests' discards later - dropped, expired or cancelled -
+ * is freed by the queue, and counted in its statistics.
+ */
+extern unsigned long
+forward_shm_requests(struct shm_requests_queue* queue,
+		     struct requests_queue* requests, void (*func)(void*));
+
+/* close the queue - no more requests may be added - and wake consumers. */
+extern void
+close_shm_requests_queue(struct shm_requests_queue* queue);
+
+/* get the number of requests in the queue */
+extern int
+get_shm_requests_number(struct shm_requests_queue* queue);
+
+/*
+ * detach from the queue. if we created it, its name is removed too -
+ * processes attached to it may keep using it.
+ */
+extern void
+delete_shm_requests_queue(struct shm_requests_queue* queue);
+
+#endif /* SHM_REQUESTS_QUEUE_H */
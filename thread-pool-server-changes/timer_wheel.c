@@ -0,0 +1,387 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <string.h>      /* memset()                                  */
+#include <assert.h>      /* assert()                                  */
+#include <time.h>        /* clock_gettime()                           */
+
+#include "timer_wheel.h" /* timing wheel functions and structs        */
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/*
+ * function timer_wheel_init(): initialize a timing wheel.
+ * input:     pointer to wheel, current tick.
+ * output:    none.
+ */
+void
+timer_wheel_init(struct timer_wheel* wheel, unsigned long long now)
+{
+    assert(wheel);
+
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->now = now;
+    wheel->num_timers = 0;
+}
+
+/*
+ * function timer_wheel_link(): place a timer in its slot.
+ * algorithm: the distance to the timer's tick selects the wheel - the
+ *            first wheel whose range covers it. the timer's tick, shifted
+ *            to that wheel's resolution, selects the slot.
+ * input:     pointer to wheel, pointer to timer.
+ * output:    none.
+ */
+static void
+timer_wheel_link(struct timer_wheel* wheel, struct timer* a_timer)
+{
+    unsigned long long delta;
+    struct timer** slot;
+    int level;
+
+    /* a timer already due fires on the next tick. */
+    if (a_timer->expires <= wheel->now)
+	a_timer->expires = wheel->now + 1;
+    delta = a_timer->expires - wheel->now;
+
+    /* timers beyond the last wheel's range are clamped to its end. */
+    if (delta >= 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+	delta = (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+	a_timer->expires = wheel->now + delta;
+    }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+	if (delta < 1ULL << (TIMER_WHEEL_BITS * (level + 1)))
+	    break;
+    }
+    slot = &wheel->slots[level][(a_timer->expires >> (TIMER_WHEEL_BITS * level))
+				& TIMER_WHEEL_MASK];
+
+    /* push the timer at the head of the slot's list. */
+    a_timer->next = *slot;
+    if (a_timer->next)
+	a_timer->next->pprev = &a_timer->next;
+    a_timer->pprev = slot;
+    *slot = a_timer;
+}
+
+/*
+ * function timer_wheel_add(): add a timer to the wheel.
+ * input:     pointer to wheel, pointer to timer, tick at which it is due,
+ *            function to run and its argument.
+ * output:    none.
+ */
+void
+timer_wheel_add(struct timer_wheel* wheel, struct timer* a_timer,
+		unsigned long long expires, void (*func)(void*), void* arg)
+{
+    assert(wheel && a_timer && !a_timer->pending);
+
+    a_timer->expires = expires;
+    a_timer->func = func;
+    a_timer->arg = arg;
+    a_timer->pending = 1;
+    timer_wheel_link(wheel, a_timer);
+    wheel->num_timers++;
+}
+
+/*
+ * function timer_wheel_cancel(): remove a timer from the wheel.
+ * algorithm: unlink the timer through its 'pprev' pointer - no need to
+ *            know which slot it is in.
+ * input:     pointer to wheel, pointer to timer.
+ * output:    1 if the timer was pending, 0 otherwise.
+ */
+int
+timer_wheel_cancel(struct timer_wheel* wheel, struct timer* a_timer)
+{
+    assert(wheel && a_timer);
+
+    if (!a_timer->pending)
+	return 0;
+
+    *a_timer->pprev = a_timer->next;
+    if (a_timer->next)
+	a_timer->next->pprev = a_timer->pprev;
+    a_timer->next = NULL;
+    a_timer->pprev = NULL;
+    a_timer->pending = 0;
+    wheel->num_timers--;
+
+    return 1;
+}
+
+/*
+ * function timer_wheel_cascade(): move a coarse slot's timers down.
+ * algorithm: re-links every timer of the given slot. since the wheel's
+ *            time moved on, each of them now lands on a finer wheel.
+ * input:     pointer to wheel, level and index of slot.
+ * output:    the index of the slot, so the caller knows if the next
+ *            wheel completed a round as well.
+ */
+static int
+timer_wheel_cascade(struct timer_wheel* wheel, int level, int index)
+{
+    struct timer* a_timer = wheel->slots[level][index];
+
+    wheel->slots[level][index] = NULL;
+    while (a_timer) {
+	struct timer* next = a_timer->next;
+
+	timer_wheel_link(wheel, a_timer);
+	a_timer = next;
+    }
+
+    return index;
+}
+
+/*
+ * function timer_wheel_advance(): advance the wheel's time.
+ * algorithm: for each tick up to 'now' - when the first wheel starts a
+ *            new round, cascade the matching slot of the next wheel (and
+ *            so on, up the levels). then collect the timers of the first
+ *            wheel's slot for this tick, which are all due.
+ * input:     pointer to wheel, tick to advance to.
+ * output:    list of due timers, linked by 'next'. NULL if none.
+ */
+struct timer*
+timer_wheel_advance(struct timer_wheel* wheel, unsigned long long now)
+{
+    struct timer* expired = NULL;
+
+    assert(wheel);
+
+    while (wheel->now < now) {
+	int index;
+	struct timer* a_timer;
+
+	/* nothing pending - just jump ahead. */
+	if (wheel->num_timers == 0) {
+	    wheel->now = now;
+	    break;
+	}
+
+	wheel->now++;
+	index = wheel->now & TIMER_WHEEL_MASK;
+	if (index == 0) {
+	    int level;
+
+	    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		int slot = (wheel->now >> (TIMER_WHEEL_BITS * level))
+			   & TIMER_WHEEL_MASK;
+
+		if (timer_wheel_cascade(wheel, level, slot) != 0)
+		    break;
+	    }
+	}
+
+	a_timer = wheel->slots[0][index];
+	wheel->slots[0][index] = NULL;
+	while (a_timer) {
+	    struct timer* next = a_timer->next;
+
+	    a_timer->pending = 0;
+	    a_timer->pprev = NULL;
+	    a_timer->next = expired;
+	    expired = a_timer;
+	    wheel->num_timers--;
+	    a_timer = next;
+	}
+    }
+
+    return expired;
+}
+
+/* get the current time, in ticks of the given length. */
+static unsigned long long
+current_tick(unsigned int tick_ms)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000)
+	   / tick_ms;
+}
+
+/*
+ * function timer_service_loop(): the timer thread's main loop.
+ * algorithm: while timers are pending, wake up every tick, advance the
+ *            wheel and run the due timers, with the mutex unlocked (so
+ *            they may add new timers). with no pending timers, sleep
+ *            until one is added.
+ * input:     pointer to timer service.
+ * output:    none.
+ */
+static void*
+timer_service_loop(void* data)
+{
+    struct timer_service* service = (struct timer_service*)data;
+    struct timespec wake_time;
+    unsigned long long tick;
+
+    pthread_mutex_lock(&service->mutex);
+    while (!service->done) {
+	struct timer* expired;
+
+	if (service->wheel.num_timers == 0) {
+	    pthread_cond_wait(&service->cond_var, &service->mutex);
+	    continue;
+	}
+
+	tick = current_tick(service->tick_ms);
+	expired = timer_wheel_advance(&service->wheel, tick);
+	if (expired) {
+	    pthread_mutex_unlock(&service->mutex);
+	    while (expired) {
+		/* the function may free the timer - get 'next' first. */
+		struct timer* next = expired->next;
+
+		expired->next = NULL;
+		expired->func(expired->arg);
+		expired = next;
+	    }
+	    pthread_mutex_lock(&service->mutex);
+	    continue;
+	}
+
+	/* sleep till the start of the next tick. */
+	tick = (tick + 1) * service->tick_ms;
+	wake_time.tv_sec = tick / 1000;
+	wake_time.tv_nsec = (tick % 1000) * 1000000;
+	pthread_cond_timedwait(&service->cond_var, &service->mutex,
+			       &wake_time);
+    }
+    pthread_mutex_unlock(&service->mutex);
+
+    return NULL;
+}
+
+/*
+ * function init_timer_service(): create a timer service.
+ * algorithm: initialize a wheel at the current tick, and spawn the thread
+ *            advancing it. the condition variable uses the monotonic
+ *            clock, like the ticks do.
+ * input:     length of a tick, in milliseconds.
+ * output:    pointer to the new timer service.
+ */
+struct timer_service*
+init_timer_service(unsigned int tick_ms)
+{
+    struct timer_service* service;
+    pthread_condattr_t cond_attr;
+
+    assert(tick_ms > 0);
+
+    service = (struct timer_service*)malloc(sizeof(struct timer_service));
+    if (!service) {
+	fprintf(stderr, "init_timer_service: out of memory. exiting\n");
+	exit(1);
+    }
+    service->tick_ms = tick_ms;
+    service->done = 0;
+    timer_wheel_init(&service->wheel, current_tick(tick_ms));
+    pthread_mutex_init(&service->mutex, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&service->cond_var, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    if (pthread_create(&service->thread, NULL, timer_service_loop,
+		       (void*)service) != 0) {
+	fprintf(stderr, "init_timer_service: cannot create thread. exiting\n");
+	exit(1);
+    }
+
+    return service;
+}
+
+/*
+ * function timer_service_add(): add a timer to the service.
+ * algorithm: round the delay up to whole ticks, and add the timer to the
+ *            wheel. if the wheel was empty, wake the sleeping thread. the
+ *            timer must not be pending - it is only read under the
+ *            mutex, as the service's thread may be firing it.
+ * input:     pointer to service, pointer to timer, delay in milliseconds,
+ *            function to run and its argument.
+ * output:    none.
+ */
+void
+timer_service_add(struct timer_service* service, struct timer* a_timer,
+		  unsigned int delay_ms, void (*func)(void*), void* arg)
+{
+    unsigned long long expires;
+    int was_idle;
+
+    assert(service && a_timer);
+
+    expires = current_tick(service->tick_ms) +
+	      (delay_ms + service->tick_ms - 1) / service->tick_ms;
+
+    pthread_mutex_lock(&service->mutex);
+    was_idle = (service->wheel.num_timers == 0);
+    timer_wheel_add(&service->wheel, a_timer, expires, func, arg);
+    pthread_mutex_unlock(&service->mutex);
+
+    if (was_idle)
+	pthread_cond_signal(&service->cond_var);
+}
+
+/*
+ * function timer_service_cancel(): cancel a timer of the service.
+ * input:     pointer to service, pointer to timer.
+ * output:    1 if the timer was cancelled, 0 if it already fired.
+ */
+int
+timer_service_cancel(struct timer_service* service, struct timer* a_timer)
+{
+    int cancelled;
+
+    assert(service && a_timer);
+
+    pthread_mutex_lock(&service->mutex);
+    cancelled = timer_wheel_cancel(&service->wheel, a_timer);
+    pthread_mutex_unlock(&service->mutex);
+
+    return cancelled;
+}
+
+/*
+ * function delete_timer_service(): stop and free a timer service.
+ * algorithm: tell the thread to exit and join it, then hand every timer
+ *            still on the wheel to 'discard'.
+ * input:     pointer to service, discard function (may be NULL).
+ * output:    none.
+ */
+void
+delete_timer_service(struct timer_service* service,
+		     void (*discard)(struct timer*))
+{
+    int level, index;
+
+    assert(service);
+
+    pthread_mutex_lock(&service->mutex);
+    service->done = 1;
+    pthread_cond_signal(&service->cond_var);
+    pthread_mutex_unlock(&service->mutex);
+    pthread_join(service->thread, NULL);
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+	for (index = 0; index < TIMER_WHEEL_SLOTS; index++) {
+	    struct timer* a_timer = service->wheel.slots[level][index];
+
+	    while (a_timer) {
+		struct timer* next = a_timer->next;
+
+		timer_wheel_cancel(&service->wheel, a_timer);
+		if (discard)
+		    discard(a_timer);
+		a_timer = next;
+	    }
+	}
+    }
+
+    pthread_cond_destroy(&service->cond_var);
+    pthread_mutex_destroy(&service->mutex);
+    free(service);
+}
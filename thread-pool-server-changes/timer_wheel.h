@@ -0,0 +1,92 @@
+#ifndef TIMER_WHEEL_H
+# define TIMER_WHEEL_H
+
+#include <pthread.h>     /* pthread functions and data structures     */
+
+/*
+ * hierarchical timing wheel. time is counted in 'ticks'. there are
+ * TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SLOTS slots each. a timer due
+ * within TIMER_WHEEL_SLOTS ticks sits in the slot of its exact tick on
+ * the first wheel. timers due later sit on a coarser wheel, and are moved
+ * ('cascaded') down one wheel each time the finer wheel completes a
+ * round. adding and cancelling a timer are O(1).
+ */
+#define TIMER_WHEEL_BITS   8
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/*
+ * format of a single timer. its memory is owned by the caller. a timer
+ * added must not be pending: a new one must be zeroed first, and one
+ * added before must have fired, or been cancelled.
+ */
+struct timer {
+    struct timer* next;		     /* next timer in slot, NULL if none. */
+    struct timer** pprev;	     /* pointer to the pointer to us.     */
+    unsigned long long expires;	     /* tick at which the timer is due.   */
+    void (*func)(void*);	     /* function to run when it is due.   */
+    void* arg;			     /* argument to pass to 'func'.       */
+    int pending;		     /* is the timer on the wheel?        */
+};
+
+/* structure for a timing wheel. */
+struct timer_wheel {
+    unsigned long long now;	     /* last tick processed.              */
+    unsigned long num_timers;	     /* number of pending timers.         */
+    struct timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+/* initialize a timing wheel, whose current time is the given tick. */
+extern void
+timer_wheel_init(struct timer_wheel* wheel, unsigned long long now);
+
+/* add a timer to fire at the given tick, running func(arg). */
+extern void
+timer_wheel_add(struct timer_wheel* wheel, struct timer* a_timer,
+		unsigned long long expires, void (*func)(void*), void* arg);
+
+/* remove a pending timer. returns 1 if removed, 0 if it wasn't pending. */
+extern int
+timer_wheel_cancel(struct timer_wheel* wheel, struct timer* a_timer);
+
+/*
+ * advance the wheel up to the given tick. the timers that became due are
+ * removed from the wheel, and returned as a list linked by 'next'. the
+ * caller runs them.
+ */
+extern struct timer*
+timer_wheel_advance(struct timer_wheel* wheel, unsigned long long now);
+
+/* structure for a timer service - a wheel driven by its own thread. */
+struct timer_service {
+    struct timer_wheel wheel;	     /* the wheel of pending timers.      */
+    unsigned int tick_ms;	     /* length of a tick, in milliseconds. */
+    int done;			     /* asks the thread to exit.          */
+    pthread_mutex_t mutex;	     /* protects the wheel.               */
+    pthread_cond_t  cond_var;	     /* wakes the thread when idle.       */
+    pthread_t thread;		     /* the thread advancing the wheel.   */
+};
+
+/* create a timer service with the given tick, and start its thread. */
+extern struct timer_service*
+init_timer_service(unsigned int tick_ms);
+
+/* run func(arg) on the service's thread, 'delay_ms' from now. */
+extern void
+timer_service_add(struct timer_service* service, struct timer* a_timer,
+		  unsigned int delay_ms, void (*func)(void*), void* arg);
+
+/* cancel a timer. returns 1 if cancelled, 0 if it already fired. */
+extern int
+timer_service_cancel(struct timer_service* service, struct timer* a_timer);
+
+/*
+ * stop the service's thread and free the service. timers still pending
+ * never fire. instead, if 'discard' is not NULL, it is called for each
+ * of them, so whoever added them can free them.
+ */
+extern void
+delete_timer_service(struct timer_service* service,
+		     void (*discard)(struct timer*));
+
+#endif /* TIMER_WHEEL_H */
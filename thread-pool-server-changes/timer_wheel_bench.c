@@ -0,0 +1,120 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc(), atol()                          */
+#include <time.h>        /* clock_gettime()                           */
+
+#include "timer_wheel.h" /* timing wheel functions and structs        */
+
+/* default number of active timers, and of churn operations. */
+#define NUM_TIMERS 1000000
+#define NUM_CHURN_OPS 10000000
+
+/* timers are set to expire up to this many ticks ahead. */
+#define MAX_DELAY_TICKS (1 << 20)
+
+/* every that many churn operations, the wheel advances by one tick. */
+#define OPS_PER_TICK 16
+
+/* the wheel, and the state of the random numbers generator. */
+static struct timer_wheel wheel;
+static unsigned long long rand_state = 88172645463325252ULL;
+
+/* number of timers fired so far. */
+static unsigned long num_fired = 0;
+
+/* a fast xorshift random numbers generator. */
+static unsigned long long
+next_rand(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+/* get the current time, in seconds. */
+static double
+now_sec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* timer function - re-arm the timer, keeping the number active constant. */
+static void
+rearm_timer(void* data)
+{
+    struct timer* a_timer = (struct timer*)data;
+
+    num_fired++;
+    timer_wheel_add(&wheel, a_timer,
+		    wheel.now + 1 + next_rand() % MAX_DELAY_TICKS,
+		    rearm_timer, a_timer);
+}
+
+/* like any C program, program's execution begins in main */
+int
+main(int argc, char* argv[])
+{
+    long num_timers = argc > 1 ? atol(argv[1]) : NUM_TIMERS;
+    long num_ops = argc > 2 ? atol(argv[2]) : NUM_CHURN_OPS;
+    struct timer* timers;
+    double start, elapsed;
+    unsigned long num_cancelled = 0;
+    long i;
+
+    if (num_timers <= 0 || num_ops < 0) {
+	fprintf(stderr, "usage: %s [num_timers] [num_churn_ops]\n", argv[0]);
+	exit(1);
+    }
+    timers = (struct timer*)calloc(num_timers, sizeof(struct timer));
+    if (!timers) {
+	fprintf(stderr, "out of memory. exiting\n");
+	exit(1);
+    }
+    timer_wheel_init(&wheel, 0);
+
+    /* phase 1 - fill the wheel. */
+    start = now_sec();
+    for (i = 0; i < num_timers; i++) {
+	timer_wheel_add(&wheel, &timers[i],
+			1 + next_rand() % MAX_DELAY_TICKS,
+			rearm_timer, &timers[i]);
+    }
+    elapsed = now_sec() - start;
+    printf("insert:  %ld timers in %.3f sec, %.1f ns/insert\n",
+	   num_timers, elapsed, elapsed * 1e9 / num_timers);
+
+    /* phase 2 - churn: cancel a random timer and set it again, while */
+    /* time moves on and due timers fire (and re-arm themselves).      */
+    start = now_sec();
+    for (i = 0; i < num_ops; i++) {
+	struct timer* a_timer = &timers[next_rand() % num_timers];
+
+	num_cancelled += timer_wheel_cancel(&wheel, a_timer);
+	timer_wheel_add(&wheel, a_timer,
+			wheel.now + 1 + next_rand() % MAX_DELAY_TICKS,
+			rearm_timer, a_timer);
+
+	if (i % OPS_PER_TICK == 0) {
+	    struct timer* expired = timer_wheel_advance(&wheel, wheel.now + 1);
+
+	    while (expired) {
+		struct timer* next = expired->next;
+
+		expired->func(expired->arg);
+		expired = next;
+	    }
+	}
+    }
+    elapsed = now_sec() - start;
+    printf("churn:   %ld cancel+add in %.3f sec, %.1f ns/op "
+	   "(%lu cancelled, %lu fired, %lu active)\n",
+	   num_ops, elapsed, num_ops ? elapsed * 1e9 / num_ops : 0.0,
+	   num_cancelled, num_fired, wheel.num_timers);
+
+    free(timers);
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+#ifdef TRACE
+
+#include <stdio.h>       /* standard I/O routines                     */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <stdint.h>      /* fixed-size integer types                  */
+#include <time.h>        /* clock_gettime()                           */
+#include <unistd.h>      /* syscall()                                 */
+#include <sys/syscall.h> /* SYS_gettid                                */
+
+#include "trace.h"       /* event tracing macros and functions        */
+
+/* format of a single recorded event - kept small on purpose. */
+struct trace_record {
+    uint64_t timestamp;		/* time of event, in nanoseconds.  */
+    int32_t  arg;		/* event's argument (request, id). */
+    uint32_t type;		/* one of 'enum trace_event_type'. */
+};
+
+/* a single thread's ring buffer of events. */
+struct trace_ring {
+    uint64_t head;		   /* number of events ever recorded.   */
+    int tid;			   /* kernel thread id of the owner.    */
+    struct trace_ring* next;	   /* next ring in the global list.     */
+    struct trace_record events[TRACE_RING_SIZE];
+};
+
+/* names of the events, as shown in the trace viewer. */
+static const char* trace_event_names[TRACE_NUM_EVENT_TYPES] = {
+    "enqueue", "dequeue", "handle_request", "handle_request",
+    "cond_wait", "cond_wake", "thread_add", "thread_delete"
+};
+
+/* list of all rings ever created. only touched when a thread */
+/* records its first event, and when dumping.                 */
+static struct trace_ring* trace_rings = NULL;
+static pthread_mutex_t trace_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the calling thread's own ring. */
+static __thread struct trace_ring* my_ring = NULL;
+
+/*
+ * function trace_ring_create(): create a ring for the calling thread.
+ * algorithm: allocates the ring, and links it on the global list, so
+ *            it survives the thread and can be dumped later.
+ * input:     none.
+ * output:    pointer to the new ring.
+ */
+static struct trace_ring*
+trace_ring_create(void)
+{
+    struct trace_ring* ring =
+		(struct trace_ring*)malloc(sizeof(struct trace_ring));
+
+    if (!ring) {
+	fprintf(stderr, "trace_ring_create: out of memory. exiting\n");
+	exit(1);
+    }
+    ring->head = 0;
+    ring->tid = (int)syscall(SYS_gettid);
+
+    pthread_mutex_lock(&trace_rings_mutex);
+    ring->next = trace_rings;
+    trace_rings = ring;
+    pthread_mutex_unlock(&trace_rings_mutex);
+
+    return ring;
+}
+
+/*
+ * function trace_event(): record one event in the calling thread's ring.
+ * algorithm: write the record into the next slot, overwriting the oldest
+ *            event once the ring is full, then publish it by advancing
+ *            the ring's head. only the owner thread writes its ring, so
+ *            no lock or atomic read-modify-write is needed.
+ * input:     event type, event argument.
+ * output:    none.
+ */
+void
+trace_event(enum trace_event_type type, int arg)
+{
+    struct trace_ring* ring = my_ring;
+    struct trace_record* rec;
+    struct timespec now;
+    uint64_t head;
+
+    if (!ring)
+	ring = my_ring = trace_ring_create();
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    head = ring->head;
+    rec = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    rec->timestamp = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    rec->arg = arg;
+    rec->type = type;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * function trace_dump_ring(): write the events of one ring as JSON.
+ * algorithm: copies the window of valid events, then re-reads the head
+ *            and drops events that the owner overwrote during the copy,
+ *            or may be overwriting - the one in the slot of the next.
+ * input:     ring, output file, pointer to 'first event' flag.
+ * output:    none.
+ */
+static void
+trace_dump_ring(struct trace_ring* ring, FILE* f, int* first)
+{
+    static struct trace_record copy[TRACE_RING_SIZE];
+    uint64_t head, start, valid, i;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (i = start; i < head; i++)
+	copy[i - start] = ring->events[i & (TRACE_RING_SIZE - 1)];
+
+    /* events below 'valid' may have been overwritten while copying - */
+    /* including the slot of the event the owner may be writing now.   */
+    valid = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    valid = valid + 1 > TRACE_RING_SIZE ? valid + 1 - TRACE_RING_SIZE : 0;
+    if (valid < start)
+	valid = start;
+
+    for (i = valid; i < head; i++) {
+	struct trace_record* rec = &copy[i - start];
+	const char* phase;
+
+	switch (rec->type) {
+	    case TRACE_HANDLE_START: phase = "B"; break;
+	    case TRACE_HANDLE_END:   phase = "E"; break;
+	    default:                 phase = "i"; break;
+	}
+	fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+		   "\"pid\":1,\"tid\":%d,%s\"args\":{\"arg\":%d}}",
+		*first ? "" : ",",
+		trace_event_names[rec->type], phase,
+		rec->timestamp / 1000.0, ring->tid,
+		phase[0] == 'i' ? "\"s\":\"t\"," : "",
+		rec->arg);
+	*first = 0;
+    }
+}
+
+/*
+ * function trace_dump(): write all recorded events to a file.
+ * algorithm: walks the list of rings, dumping each one.
+ * input:     name of output file.
+ * output:    0 on success, -1 on error.
+ */
+int
+trace_dump(const char* file_name)
+{
+    struct trace_ring* ring;
+    FILE* f;
+    int first = 1;
+    int rc = 0;
+
+    f = fopen(file_name, "w");
+    if (!f) {
+	perror("trace_dump: fopen");
+	return -1;
+    }
+
+    /* the mutex also serializes concurrent dumps, that share the */
+    /* static copy buffer.                                        */
+    pthread_mutex_lock(&trace_rings_mutex);
+    fprintf(f, "{\"traceEvents\":[");
+    for (ring = trace_rings; ring; ring = ring->next)
+	trace_dump_ring(ring, f, &first);
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    pthread_mutex_unlock(&trace_rings_mutex);
+
+    if (ferror(f))
+	rc = -1;
+    if (fclose(f) != 0)
+	rc = -1;
+
+    return rc;
+}
+
+#endif /* TRACE */
@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+# define TRACE_H
+
+/*
+ * low-overhead event tracing. each thread records compact binary events
+ * into its own ring buffer, without taking any lock. the rings are dumped
+ * as Chrome trace-event JSON (load it in chrome://tracing or perfetto).
+ * compile with -DTRACE to enable. without it, TRACE_EVENT() expands to
+ * nothing, and tracing costs nothing.
+ */
+
+/* types of traced events */
+enum trace_event_type {
+    TRACE_ENQUEUE,		/* request added to the queue.      */
+    TRACE_DEQUEUE,		/* request taken off the queue.     */
+    TRACE_HANDLE_START,		/* handler started a request.       */
+    TRACE_HANDLE_END,		/* handler finished a request.      */
+    TRACE_COND_WAIT,		/* thread blocks on the cond var.   */
+    TRACE_COND_WAKE,		/* thread returned from cond wait.  */
+    TRACE_THREAD_ADD,		/* handler thread added to pool.    */
+    TRACE_THREAD_DELETE,	/* handler thread removed from pool. */
+    TRACE_NUM_EVENT_TYPES
+};
+
+#ifdef TRACE
+
+/* number of events kept per thread. must be a power of 2. */
+#define TRACE_RING_SIZE 16384
+
+/* record an event of the given type, with one integer argument. */
+#define TRACE_EVENT(type, arg) trace_event((type), (arg))
+
+/* record one event in the calling thread's ring buffer. */
+extern void
+trace_event(enum trace_event_type type, int arg);
+
+/*
+ * write all recorded events, from all threads, to the given file
+ * in Chrome trace-event JSON format. may be called while other
+ * threads are still recording. returns 0 on success, -1 on error.
+ */
+extern int
+trace_dump(const char* file_name);
+
+#else /* TRACE */
+
+#define TRACE_EVENT(type, arg) do { } while (0)
+
+#endif /* TRACE */
+
+#endif /* TRACE_H */